@@ -2,93 +2,927 @@
 #define BTREE_H
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
 #include <cstdint>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <set>
 #include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree_frozen.h"
+#include "btree_mapped.h"
+#include "hash_index.h"
+#include "key_search.h"
+#include "node_allocator.h"
+
+// How a leaf stores a value. Small trivially copyable values are stored inline in the
+// leaf so reading them does not need another cache miss. Anything else is stored
+// behind a pointer, which keeps the leaf entries trivially copyable so nodes can still
+// be shifted and split with memmove/memcpy.
+template<typename Value,
+    bool INLINE = std::is_trivially_copyable<Value>::value && sizeof(Value) <= 16>
+struct ValueStorage {
+  typedef Value Slot;
+  enum { NEEDS_DESTROY = 0 };
+
+  static Slot Make(const Value& value) { return value; }
+  static Value& Get(Slot& slot) { return slot; }
+  static const Value& Get(const Slot& slot) { return slot; }
+  static void Destroy(Slot* slot) {}
+};
+
+template<typename Value>
+struct ValueStorage<Value, false> {
+  typedef Value* Slot;
+  enum { NEEDS_DESTROY = 1 };
+
+  static Slot Make(const Value& value) { return new Value(value); }
+  static Value& Get(Slot& slot) { return *slot; }
+  static const Value& Get(const Slot& slot) { return *slot; }
+  static void Destroy(Slot* slot) { delete *slot; }
+};
+
+// Define BTREE_COUNTERS as 1 to have every BTree count the events in BTreeCounters.
+// Otherwise the counting compiles away.
+#ifndef BTREE_COUNTERS
+#define BTREE_COUNTERS 0
+#endif
+
+// Default for how often a BTree validates itself after it changes, see the
+// VALIDATE_EVERY argument of BTree: after every 1000th change in debug builds and
+// never otherwise. Each check walks the whole tree, so checking every change would
+// make a run of n changes take O(n^2) time.
+#ifndef BTREE_VALIDATE_EVERY
+#ifdef NDEBUG
+#define BTREE_VALIDATE_EVERY 0
+#else
+#define BTREE_VALIDATE_EVERY 1000
+#endif
+#endif
+
+// Events counted by a BTree when BTREE_COUNTERS is 1. See BTree::counters().
+struct BTreeCounters {
+  // Nodes split by inserts.
+  int64_t splits;
+  // Nodes merged into a sibling, or dropped once empty, by removes.
+  int64_t merges;
+  // Values moved into a node that got too small from one of its siblings.
+  int64_t borrows;
+  // Separators rewritten because the largest key of a child changed, one per level.
+  int64_t separator_updates;
+  // Walks from the root to a leaf. Every lookup and every modification takes one.
+  int64_t descents;
+  // Nodes searched on those walks and keys compared in them. A search compares the
+  // keys up to the first that is not smaller than the search key. The vector kernels
+  // compare whole blocks, but are counted the same way.
+  int64_t node_searches;
+  int64_t key_comparisons;
+
+  BTreeCounters()
+    : splits(0), merges(0), borrows(0), separator_updates(0), descents(0),
+      node_searches(0), key_comparisons(0) {}
+};
+
+// Shape of a BTree, from BTree::Stats().
+struct BTreeStats {
+  enum { FILL_BUCKETS = 10 };
+
+  // The nodes at one depth of the tree.
+  struct Level {
+    int64_t num_nodes;
+    int64_t num_values;
+    // Fraction of the capacity of the nodes in use.
+    double fill;
+    // fill_histogram[i] is the number of nodes with a fill in [i / 10, (i + 1) / 10).
+    // Full nodes are in the last bucket.
+    int64_t fill_histogram[FILL_BUCKETS];
+  };
+
+  int64_t size;
+  // Number of levels. A tree that is a single leaf has height 1.
+  int height;
+  int64_t num_leaves;
+  int64_t num_internal_nodes;
+  // Bytes of the nodes in the tree, of the values stored outside of the leaves and of
+  // the hash index, if there is one.
+  // Free memory in the node allocator and nodes kept for snapshots are not included.
+  int64_t bytes_used;
+  // levels[0] is the root and levels[height - 1] the leaves.
+  std::vector<Level> levels;
+  // All zero unless BTREE_COUNTERS is 1.
+  BTreeCounters counters;
+
+  std::string ToString() const {
+    std::stringstream ss;
+    ss << "size: " << size << "  height: " << height << "  leaves: " << num_leaves
+       << "  internal nodes: " << num_internal_nodes << "  bytes: " << bytes_used
+       << "\n";
+    for (size_t i = 0; i < levels.size(); ++i) {
+      const Level& level = levels[i];
+      ss << "level " << i << ": " << level.num_nodes << " nodes, "
+         << static_cast<int>(level.fill * 100 + 0.5) << "% full, histogram";
+      for (int j = 0; j < FILL_BUCKETS; ++j) ss << " " << level.fill_histogram[j];
+      ss << "\n";
+    }
+    if (BTREE_COUNTERS) {
+      ss << "splits: " << counters.splits << "  merges: " << counters.merges
+         << "  borrows: " << counters.borrows << "  separator updates: "
+         << counters.separator_updates << "  descents: " << counters.descents
+         << "  nodes searched: " << counters.node_searches << "  keys compared: "
+         << counters.key_comparisons << "\n";
+    }
+    return ss.str();
+  }
+};
 
 // Implementation of a B+ tree. This is different from v1:
 //  - Min key is not maintained
+//  - Keys and values are stored in separate arrays in each node so that searching a
+//    node only touches keys and can use the vectorized kernels in key_search.h.
+//  - Nodes come from a NodeAllocator, by default a NodePool owned by the tree.
+//  - The key type, value type and ordering are template arguments. The fanout is
+//    derived from NODE_BYTES, so leaves and internal nodes can have different
+//    capacities. Keys must be trivially copyable.
+//  - Nodes have no parent pointers and only leaves are linked to their siblings.
+//    Insert and Remove record the path from the root while descending and walk back
+//    up it to split, merge and update separators. Moving children between internal
+//    nodes only copies the pointers, and internal nodes spend all their bytes on
+//    fanout.
+//  - Snapshot() returns an immutable view of the tree that shares its nodes. Writes
+//    copy the nodes they change while a snapshot still shares them.
+//  - Stats() describes the shape of the tree, and with BTREE_COUNTERS the tree counts
+//    splits, merges and the work of its searches.
+//  - SearchPolicy picks how nodes are searched, see key_search.h. The default uses
+//    the vector kernels for integer keys. Binary or interpolation search does fewer
+//    comparisons in large nodes.
+//  - Validate() checks the whole tree in one pass. The tree runs it after every
+//    VALIDATE_EVERY-th change: 0 never does, 1 checks every change, which makes each
+//    one take time linear in the size of the tree, and larger values sample. A failed
+//    check prints the problem and aborts, in any build.
+//  - With SUBTREE_COUNTS, internal nodes also keep the number of values under each
+//    child. CountRange(), Rank() and Select() then take O(log n) time instead of
+//    walking the leaves, and internal nodes hold fewer children.
+//  - With HASH_INDEX, a hash table from every key to its leaf sits in front of the
+//    tree, see hash_index.h. Find() and Update() probe it instead of descending and
+//    only search that one leaf, and so do Upsert() and FindOrInsert() of keys that
+//    exist. Every write that moves keys into another leaf points them to it, which
+//    makes splits and merges cost a probe per key moved and RemoveRange() take time
+//    in the number of keys removed. The table needs std::hash<Key> and an == that
+//    agrees with Compare, and takes two to four slots of a key and a pointer per key.
+//  - ParallelBulkLoad() and Merge() fill the leaves on several threads. The tree is
+//    not otherwise thread-safe, and nothing else may use it during these calls.
+template<typename Key = int64_t, typename Value = void*,
+    typename Compare = std::less<Key>, size_t NODE_BYTES = 256,
+    template<typename, typename> class SearchPolicy = KeySearch,
+    int VALIDATE_EVERY = BTREE_VALIDATE_EVERY, bool SUBTREE_COUNTS = false,
+    bool HASH_INDEX = false>
 class BTree {
+ private:
+  typedef SearchPolicy<Key, Compare> Search;
+  typedef ValueStorage<Value> Storage;
+  typedef typename Storage::Slot ValueSlot;
+
+  // Fields shared by leaf and internal nodes.
+  struct Node {
+    int32_t num_values;
+    // Generation the node was created in. Snapshots taken in this generation or later
+    // can share the node. See Snapshot().
+    uint32_t gen : 31;
+    uint32_t is_leaf_ : 1;
+
+    bool is_leaf() const { return is_leaf_; }
+    bool is_internal() const { return !is_leaf_; }
+    explicit Node(bool is_leaf) : num_values(0), gen(0), is_leaf_(is_leaf) {}
+  };
+
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys must be trivially copyable");
+
+ public:
+  // Maximum number of values in a leaf and in an internal node.
+  enum {
+    // Leaves also hold the prev/next links.
+    LEAF_ORDER = (NODE_BYTES - sizeof(Node) - 2 * sizeof(Node*)) /
+        (sizeof(Key) + sizeof(ValueSlot)),
+    // Internal nodes also hold the subtree counts, if they are kept.
+    INTERNAL_ORDER = (NODE_BYTES - sizeof(Node)) /
+        (sizeof(Key) + sizeof(Node*) + (SUBTREE_COUNTS ? sizeof(int64_t) : 0)),
+  };
+  // Every internal node but the root keeps at least two values, so the height stays
+  // within MAX_HEIGHT.
+  static_assert(LEAF_ORDER >= 4 && INTERNAL_ORDER >= 4, "NODE_BYTES is too small");
+  static_assert(VALIDATE_EVERY >= 0, "VALIDATE_EVERY must not be negative");
+
+ private:
+  struct LeafNode;
+  struct InternalNode;
+
+  enum {
+    // Bound on the height of the tree. Every internal node but the root has at least
+    // two children, so this is never reached.
+    MAX_HEIGHT = 64,
+  };
+
  public:
-  BTree() : size_(0) {
-    root_ = new Node(true, NULL);
-    root_->prev = root_->next = NULL;
-    root_->num_values = 0;
+  // Nodes are allocated from 'allocator', which must outlive the tree. If it is NULL,
+  // the tree allocates its nodes from its own NodePool.
+  explicit BTree(NodeAllocator* allocator = NULL, const Compare& comp = Compare())
+    : size_(0), allocator_(allocator), owned_pool_(NULL),
+      min_leaf_values_(LEAF_ORDER / 2), min_internal_values_(INTERNAL_ORDER / 2),
+      num_changes_(0), gen_(0), max_snapshot_gen_(-1), comp_(comp) {
+    if (allocator_ == NULL) allocator_ = owned_pool_ = new NodePool();
+    root_ = NewNode<LeafNode>();
+  }
+
+  // Builds the tree from the sorted (key, value) pairs in [begin, end). See BulkLoad().
+  template<typename ForwardIt>
+  BTree(ForwardIt begin, ForwardIt end, double fill_factor = 1.0,
+      NodeAllocator* allocator = NULL, const Compare& comp = Compare())
+    : size_(0), allocator_(allocator), owned_pool_(NULL),
+      min_leaf_values_(LEAF_ORDER / 2), min_internal_values_(INTERNAL_ORDER / 2),
+      num_changes_(0), gen_(0), max_snapshot_gen_(-1), comp_(comp) {
+    if (allocator_ == NULL) allocator_ = owned_pool_ = new NodePool();
+    root_ = NewNode<LeafNode>();
+    BulkLoad(begin, end, fill_factor);
   }
 
+  // All snapshots must be destroyed before the tree.
   ~BTree() {
-    Delete(root_);
+    assert(snapshot_gens_.empty());
+    if (owned_pool_ != NULL) {
+      // Every node came from the pool. Dropping it releases them all.
+      DestroyAllValues();
+      delete owned_pool_;
+    } else {
+      Delete(root_);
+    }
   }
 
+  // Cursor over the values of the tree in key order. It walks the leaf level through
+  // the prev/next links and never allocates. Any modification to the tree invalidates
+  // all iterators.
   class Iterator {
    public:
-    bool AtEnd() { return parent_ == NULL; }
+    // An iterator at the end.
+    Iterator() : node_(NULL), idx_(0) {}
+
+    bool AtEnd() const { return node_ == NULL; }
+
+    const Key& key() const {
+      assert(!AtEnd());
+      return node_->keys[idx_];
+    }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return Storage::Get(node_->values[idx_]);
+    }
+
+    // Moves to the next larger key. The iterator is at the end after the largest key.
+    void Next() {
+      assert(!AtEnd());
+      ++idx_;
+      SkipForward();
+    }
+
+    // Moves to the next smaller key. The iterator is at the end after the smallest key.
+    void Prev() {
+      assert(!AtEnd());
+      while (idx_ == 0) {
+        node_ = node_->prev;
+        if (node_ == NULL) return;
+        idx_ = node_->num_values;
+      }
+      --idx_;
+    }
 
    private:
     friend class BTree;
-    Iterator(const BTree* parent = NULL, void* value = NULL)
-      : parent_(parent), value_(value ) {
+    Iterator(const LeafNode* node, int idx) : node_(node), idx_(idx) {
+      if (node_ != NULL) SkipForward();
+    }
+
+    // If idx_ is past the values in node_, moves to the first value of the next
+    // non-empty leaf.
+    void SkipForward() {
+      while (idx_ >= node_->num_values) {
+        node_ = node_->next;
+        idx_ = 0;
+        if (node_ == NULL) return;
+      }
     }
 
-    const BTree* parent_;
-    void* value_;
+    const LeafNode* node_;
+    int idx_;
   };
 
-  Iterator Find(int64_t key) const {
+  // Read-only view of the tree at the time Snapshot() was called. The view shares the
+  // tree's nodes. Writes to the tree copy a node before changing it while a snapshot
+  // shares it, and snapshots never change nodes, so reading a snapshot needs no
+  // synchronization with writers of the tree, even from another thread. Taking and
+  // destroying snapshots are writes to the tree. A snapshot must be destroyed before
+  // its tree.
+  class SnapshotView {
+   public:
+    // Cursor over a snapshot in key order. Leaf sibling links are only kept up to date
+    // for the tree, so this keeps the path from the root instead.
+    class Iterator {
+     public:
+      // An iterator at the end.
+      Iterator() : leaf_(NULL), idx_(0), depth_(0) {}
+
+      bool AtEnd() const { return leaf_ == NULL; }
+
+      const Key& key() const {
+        assert(!AtEnd());
+        return leaf_->keys[idx_];
+      }
+
+      const Value& value() const {
+        assert(!AtEnd());
+        return Storage::Get(leaf_->values[idx_]);
+      }
+
+      // Moves to the next larger key. The iterator is at the end after the largest key.
+      void Next() {
+        assert(!AtEnd());
+        ++idx_;
+        SkipForward();
+      }
+
+     private:
+      friend class SnapshotView;
+
+      // If idx_ is past the values in leaf_, moves to the first value of the next
+      // leaf: up to the lowest node with a child to the right, then down to the
+      // leftmost leaf of that child.
+      void SkipForward() {
+        if (idx_ < leaf_->num_values) return;
+        int d = depth_ - 1;
+        while (d >= 0 && child_idx_[d] == nodes_[d]->num_values - 1) --d;
+        if (d < 0) {
+          leaf_ = NULL;
+          return;
+        }
+        ++child_idx_[d];
+        const Node* node = nodes_[d]->values[child_idx_[d]];
+        for (++d; d < depth_; ++d) {
+          nodes_[d] = AsInternal(node);
+          child_idx_[d] = 0;
+          node = nodes_[d]->values[0];
+        }
+        leaf_ = AsLeaf(node);
+        idx_ = 0;
+      }
+
+      const InternalNode* nodes_[MAX_HEIGHT];
+      int child_idx_[MAX_HEIGHT];
+      const LeafNode* leaf_;
+      int idx_;
+      int depth_;
+    };
+
+    SnapshotView(SnapshotView&& other)
+      : tree_(other.tree_), root_(other.root_), gen_(other.gen_), size_(other.size_) {
+      other.tree_ = NULL;
+    }
+
+    ~SnapshotView() {
+      if (tree_ != NULL) tree_->ReleaseSnapshot(gen_);
+    }
+
+    Iterator Find(const Key& key) const {
+      Iterator it = LowerBound(key);
+      if (!it.AtEnd() && tree_->comp_(key, it.key())) return Iterator();
+      return it;
+    }
+
+    // Returns an iterator to the first key that is >= key.
+    Iterator LowerBound(const Key& key) const {
+      Iterator it;
+      const Node* node = root_;
+      while (node->is_internal()) {
+        const InternalNode* internal = AsInternal(node);
+        int i = tree_->ChildIndex(internal, key, false, false);
+        if (i == -1) return Iterator();
+        it.nodes_[it.depth_] = internal;
+        it.child_idx_[it.depth_++] = i;
+        node = internal->values[i];
+      }
+      it.leaf_ = AsLeaf(node);
+      it.idx_ = tree_->SearchNode(it.leaf_, key, false);
+      if (it.idx_ == it.leaf_->num_values) return Iterator();
+      return it;
+    }
+
+    // Returns an iterator to the smallest key.
+    Iterator Begin() const {
+      Iterator it;
+      const Node* node = root_;
+      while (node->is_internal()) {
+        it.nodes_[it.depth_] = AsInternal(node);
+        it.child_idx_[it.depth_++] = 0;
+        node = AsInternal(node)->values[0];
+      }
+      if (node->num_values == 0) return Iterator();
+      it.leaf_ = AsLeaf(node);
+      return it;
+    }
+
+    Iterator End() const { return Iterator(); }
+
+    int64_t size() const { return size_; }
+
+    void CollectAllKeys(std::vector<Key>* keys) const {
+      keys->clear();
+      for (Iterator it = Begin(); !it.AtEnd(); it.Next()) keys->push_back(it.key());
+    }
+
+   private:
+    friend class BTree;
+    SnapshotView(BTree* tree, const Node* root, uint32_t gen, int64_t size)
+      : tree_(tree), root_(root), gen_(gen), size_(size) {}
+    SnapshotView(const SnapshotView&) = delete;
+    SnapshotView& operator=(const SnapshotView&) = delete;
+
+    BTree* tree_;
+    const Node* root_;
+    uint32_t gen_;
+    int64_t size_;
+  };
+
+  Iterator Find(const Key& key) const {
     //printf("BTREE: Finding %ld\n", key);
-    Node* leaf_node = FindLeafNode(root_, key, false);
+    LeafNode* leaf_node = HASH_INDEX ? index_.Find(key) : FindLeafNode(root_, key, false);
     if (leaf_node == NULL) return End();
-    assert(leaf_node->is_leaf());
     int idx = IndexOfKey(leaf_node, key);
     if (idx == -1) return End();
-    return Iterator(this, leaf_node->values[idx].value);
+    return Iterator(leaf_node, idx);
+  }
+
+  // Returns an iterator to the first key that is >= key.
+  Iterator LowerBound(const Key& key) const {
+    LeafNode* leaf_node = FindLeafNode(root_, key, false);
+    if (leaf_node == NULL) return End();
+    return Iterator(leaf_node, SearchNode(leaf_node, key));
+  }
+
+  // Returns an iterator to the first key that is > key.
+  Iterator UpperBound(const Key& key) const {
+    Iterator it = LowerBound(key);
+    if (!it.AtEnd() && !comp_(key, it.key())) it.Next();
+    return it;
+  }
+
+  // Returns an iterator to the smallest key.
+  Iterator Begin() const {
+    Node* node = root_;
+    while (node->is_internal()) node = GetChildNode(AsInternal(node), 0);
+    return Iterator(AsLeaf(node), 0);
+  }
+
+  // Returns an iterator to the largest key.
+  Iterator Last() const {
+    Node* node = root_;
+    while (node->is_internal()) {
+      node = GetChildNode(AsInternal(node), node->num_values - 1);
+    }
+    if (node->num_values == 0) return End();
+    return Iterator(AsLeaf(node), node->num_values - 1);
   }
 
-  bool Update(int64_t key, void* value) {
+  bool Update(const Key& key, const Value& value) {
     //printf("BTREE: Update %ld\n", key);
-    Node* leaf_node = FindLeafNode(root_, key, false);
+    if (HASH_INDEX) {
+      LeafNode* leaf_node = index_.Find(key);
+      if (leaf_node == NULL) return false;
+      if (!IsShared(leaf_node)) {
+        Storage::Get(leaf_node->values[IndexOfKey(leaf_node, key)]) = value;
+        return true;
+      }
+      // A snapshot shares the leaf. Copy the path to it below.
+    }
+    Path path;
+    LeafNode* leaf_node = FindLeafNode(root_, key, false, &path);
     if (leaf_node == NULL) return false;
-    assert(leaf_node->is_leaf());
     int idx = IndexOfKey(leaf_node, key);
     if (idx == -1) return false;
-    leaf_node->values[idx].value = value;
+    leaf_node = UnsharePath(&path, leaf_node);
+    Storage::Get(leaf_node->values[idx]) = value;
     return true;
   }
 
-  Iterator Insert(int64_t key, void* value) {
+  Iterator Insert(const Key& key, const Value& value) {
     //printf("BTREE: Inserting %ld\n", key);
-    Node* leaf_node = FindLeafNode(root_, key, true);
-    if (leaf_node == NULL) return End();
-    assert(leaf_node->is_leaf());
-    if (!InsertInNode<true>(leaf_node, key, value)) return End();
-    VerifyTreeIntegrity();
-    ++size_;
-    return Iterator(this, value);
+    int idx;
+    bool inserted;
+    LeafNode* leaf_node = FindOrInsertLeaf(key, value, &idx, &inserted);
+    if (!inserted) return End();
+    return Iterator(leaf_node, idx);
   }
 
-  Iterator Upsert(int64_t key, void* value) {
+  Iterator Upsert(const Key& key, const Value& value) {
     //printf("BTREE: Upsert %ld\n", key);
-    Node* leaf_node = FindLeafNode(root_, key, true);
-    if (leaf_node == NULL) return End();
-    assert(leaf_node->is_leaf());
-    int idx = IndexOfKey(leaf_node, key);
-    if (idx == -1) {
-      if (!InsertInNode<true>(leaf_node, key, value)) return End();
-      ++size_;
-    } else {
-      leaf_node->values[idx].value = value;
-    }
-    return Iterator(this, value);
+    int idx;
+    bool inserted;
+    LeafNode* leaf_node = FindOrInsertLeaf(key, value, &idx, &inserted);
+    if (!inserted) Storage::Get(leaf_node->values[idx]) = value;
+    return Iterator(leaf_node, idx);
+  }
+
+  // Returns the value of key, inserting (key, value) first if key is missing, like
+  // std::map::try_emplace. The value can be read or updated in place through the
+  // returned pointer until the tree is next modified. If inserted is not NULL, it is
+  // set to whether the key was inserted.
+  Value* FindOrInsert(const Key& key, const Value& value, bool* inserted = NULL) {
+    int idx;
+    bool was_inserted;
+    LeafNode* leaf_node = FindOrInsertLeaf(key, value, &idx, &was_inserted);
+    if (inserted != NULL) *inserted = was_inserted;
+    return &Storage::Get(leaf_node->values[idx]);
   }
 
-  bool Remove(int64_t key) {
+  bool Remove(const Key& key) {
     //printf("BTREE: Removing %ld\n", key);
-    Node* leaf_node = FindLeafNode(root_, key, false);
+    Path path;
+    LeafNode* leaf_node = FindLeafNode(root_, key, false, &path);
     if (leaf_node == NULL) return false;
-    assert(leaf_node->is_leaf());
-    if (!RemoveKeyFromNode(leaf_node, key)) return false;
-    VerifyTreeIntegrity();
+    int idx = IndexOfKey(leaf_node, key);
+    if (idx == -1) return false;
+    leaf_node = UnsharePath(&path, leaf_node);
+    index_.Erase(key);
+    DestroyValue(leaf_node, idx);
+    RemoveAt(leaf_node, idx, &path, path.depth);
     --size_;
+    VerifyTreeIntegrity();
+    return true;
+  }
+
+  // Removes the keys in [lo, hi) and returns how many there were. The children between
+  // the paths to lo and hi are dropped whole, so this takes time in the number of nodes
+  // removed rather than keys, unless the values are stored outside the leaves. Only the
+  // nodes on those two paths are rebalanced.
+  int64_t RemoveRange(const Key& lo, const Key& hi) {
+    if (!comp_(lo, hi)) return 0;
+    Count(&counters_.descents);
+    if (IsShared(root_)) {
+      if (root_->is_leaf()) {
+        root_ = CopyNode(AsLeaf(root_));
+      } else {
+        root_ = CopyNode(AsInternal(root_));
+      }
+    }
+    int64_t removed = RemoveRangeInNode(root_, lo, hi);
+    size_ -= removed;
+    // The root can be left with a single child, or none.
+    while (root_->is_internal() && root_->num_values < 2) {
+      Node* root = root_;
+      root_ = root->num_values == 0 ?
+          NewNode<LeafNode>() : GetChildNode(AsInternal(root), 0);
+      FreeNode(root);
+    }
+    VerifyTreeIntegrity();
+    return removed;
+  }
+
+  // Returns the number of keys in [lo, hi). With SUBTREE_COUNTS this adds up the counts
+  // beside the paths to lo and hi in O(log n). Otherwise it walks the leaves in the
+  // range.
+  int64_t CountRange(const Key& lo, const Key& hi) const {
+    if (!comp_(lo, hi)) return 0;
+    if (SUBTREE_COUNTS) return CountLess(hi) - CountLess(lo);
+    const LeafNode* leaf = FindLeafNode(root_, lo, false);
+    if (leaf == NULL) return 0;
+    return CountLessFrom(leaf, hi) - SearchNode(leaf, lo);
+  }
+
+  // Returns the number of keys smaller than key. With SUBTREE_COUNTS this takes
+  // O(log n), otherwise it walks the leaves before key.
+  int64_t Rank(const Key& key) const {
+    if (SUBTREE_COUNTS) return CountLess(key);
+    return CountLessFrom(LeftmostLeaf(root_), key);
+  }
+
+  // Returns an iterator to the key of rank k, the k-th smallest counting from 0, or
+  // End() if there are not that many keys. With SUBTREE_COUNTS this descends by the
+  // counts in O(log n), otherwise it walks the leaves before the key.
+  Iterator Select(int64_t k) const {
+    if (k < 0 || k >= size_) return End();
+    if (!SUBTREE_COUNTS) {
+      const LeafNode* leaf = LeftmostLeaf(root_);
+      for (; k >= leaf->num_values; leaf = leaf->next) k -= leaf->num_values;
+      return Iterator(leaf, k);
+    }
+    Count(&counters_.descents);
+    const Node* node = root_;
+    while (node->is_internal()) {
+      const InternalNode* internal = AsInternal(node);
+      int i = 0;
+      for (; k >= internal->counts[i]; ++i) k -= internal->counts[i];
+      node = GetChildNode(internal, i);
+    }
+    return Iterator(AsLeaf(node), k);
+  }
+
+  // Looks up keys[0, n) and stores the result of Find(keys[i]) in out[i]. The keys go
+  // down the tree in groups, one level at a time, and every child is prefetched before
+  // it is searched. The cache misses of a group overlap instead of each lookup waiting
+  // for its own misses in turn, which trades a little latency for throughput on trees
+  // that do not fit in the cache.
+  void FindBatch(const Key* keys, size_t n, Iterator* out) const {
+    if (HASH_INDEX) {
+      // The probes do not depend on each other, so they overlap anyway.
+      for (size_t i = 0; i < n; ++i) out[i] = Find(keys[i]);
+      return;
+    }
+    LeafNode* leaves[BATCH_GROUP_SIZE];
+    for (size_t start = 0; start < n; start += BATCH_GROUP_SIZE) {
+      int group = n - start < BATCH_GROUP_SIZE ? n - start : BATCH_GROUP_SIZE;
+      FindLeafNodes(keys + start, group, false, leaves);
+      for (int i = 0; i < group; ++i) {
+        int idx = leaves[i] == NULL ? -1 : IndexOfKey(leaves[i], keys[start + i]);
+        out[start + i] = idx == -1 ? End() : Iterator(leaves[i], idx);
+      }
+    }
+  }
+
+  // Inserts (keys[i], values[i]) for every i in [0, n), with the same result as calling
+  // Insert() for each in order, and descends the tree like FindBatch(). Returns the
+  // number of keys inserted. If inserted is not NULL, inserted[i] is set to whether
+  // keys[i] was inserted.
+  size_t InsertBatch(const Key* keys, const Value* values, size_t n,
+      bool* inserted = NULL) {
+    return ModifyBatch(keys, values, n, false, inserted);
+  }
+
+  // Same as calling Upsert() for each pair in order. Returns the number of keys that
+  // were not in the tree before.
+  size_t UpsertBatch(const Key* keys, const Value* values, size_t n) {
+    return ModifyBatch(keys, values, n, true, NULL);
+  }
+
+  // Replaces the contents of the tree with the (key, value) pairs in [begin, end).
+  // The pairs must be sorted by key with no duplicates. The tree is built bottom up in
+  // one pass over the input: each level keeps the node it is filling and a full node
+  // is handed to the level above, so only one node per level is open at a time.
+  // Nodes are filled to fill_factor of their capacity (but never below the minimum
+  // fill), leaving room for later inserts without splits.
+  template<typename ForwardIt>
+  void BulkLoad(ForwardIt begin, ForwardIt end, double fill_factor = 1.0) {
+    Delete(root_);
+    size_ = std::distance(begin, end);
+    index_.Clear();
+    index_.Reserve(size_);
+
+    std::vector<BulkLevel> levels;
+    PlanBulkLevels(size_, fill_factor, &levels);
+
+    if (size_ == 0) {
+      root_ = NewNode<LeafNode>();
+      return;
+    }
+
+#ifndef NDEBUG
+    const Key* last_key = NULL;
+#endif
+    for (ForwardIt it = begin; it != end; ++it) {
+      assert(last_key == NULL || comp_(*last_key, it->first));
+      LeafNode* leaf = BulkNextNode<LeafNode>(&levels[0]);
+#ifndef NDEBUG
+      last_key = &leaf->keys[leaf->num_values];
+#endif
+      AssignInNode(leaf, leaf->num_values, it->first, Storage::Make(it->second));
+      ++leaf->num_values;
+      BulkFinishNode(&levels, 0);
+    }
+    root_ = levels.back().prev;
+    VerifyTreeIntegrity();
+  }
+
+  // Replaces the contents of the tree with the (key, value) pairs, like BulkLoad(), on
+  // num_threads threads, or one per core if num_threads is 0. The pairs need not be
+  // sorted: they are sorted in place with a parallel merge sort unless they already
+  // are. Of pairs with equal keys the last one wins, as if they were upserted in order.
+  // The threads fill the leaves; the levels above, about one node per LEAF_ORDER
+  // values, are built on the calling thread.
+  void ParallelBulkLoad(std::vector<std::pair<Key, Value>>* pairs, int num_threads,
+      double fill_factor = 1.0) {
+    num_threads = NumThreads(num_threads);
+    SortPairs(pairs, num_threads);
+    Delete(root_);
+    const std::pair<Key, Value>* sorted = pairs->data();
+    BuildInParallel(pairs->size(), num_threads, fill_factor,
+        [sorted](LeafNode* leaf, int idx, int64_t i) {
+          leaf->keys[idx] = sorted[i].first;
+          leaf->values[idx] = Storage::Make(sorted[i].second);
+        });
+  }
+
+  // Sets how far nodes can empty out before Remove() rebalances them: a node other
+  // than the root borrows from or merges with a sibling once it has fewer than
+  // min_fill of its capacity. The default of 0.5 keeps every node at least half full.
+  // Lower values let nodes underflow, so deletes and inserts that churn the same key
+  // range stop merging and splitting the same nodes over and over. At 0, leaves are
+  // only removed once they are empty. Raising the bound repacks the tree with
+  // Compact() so every node meets it.
+  void SetMinFill(double min_fill) {
+    assert(min_fill >= 0 && min_fill <= 0.5);
+    int min_leaf_values = MinValuesForFill(LEAF_ORDER, min_fill, 1);
+    int min_internal_values = MinValuesForFill(INTERNAL_ORDER, min_fill, 2);
+    bool raised = min_leaf_values > min_leaf_values_ ||
+        min_internal_values > min_internal_values_;
+    min_leaf_values_ = min_leaf_values;
+    min_internal_values_ = min_internal_values;
+    if (raised) Compact();
+  }
+
+  // Repacks the tree in one pass over the leaves, filling nodes to fill_factor of
+  // their capacity like BulkLoad(). This reclaims the space of nodes left sparse by
+  // removals, especially with a low SetMinFill(). Values move to the new leaves
+  // without being copied, unless a snapshot still shares their leaf.
+  void Compact(double fill_factor = 1.0) {
+    if (root_->is_leaf()) return;
+    std::vector<BulkLevel> levels;
+    PlanBulkLevels(size_, fill_factor, &levels);
+    Node* node = root_;
+    while (node->is_internal()) node = GetChildNode(AsInternal(node), 0);
+    // The internal nodes are dropped first, while the leaves they point to can still
+    // be told apart from internal nodes.
+    DeleteInternalNodes(root_);
+    LeafNode* leaf = AsLeaf(node);
+    while (leaf != NULL) {
+      bool shared = IsShared(leaf);
+      for (int i = 0; i < leaf->num_values; ++i) {
+        LeafNode* dst = BulkNextNode<LeafNode>(&levels[0]);
+        ValueSlot value = shared && Storage::NEEDS_DESTROY ?
+            Storage::Make(Storage::Get(leaf->values[i])) : leaf->values[i];
+        AssignInNode(dst, dst->num_values, leaf->keys[i], value);
+        ++dst->num_values;
+        BulkFinishNode(&levels, 0);
+      }
+      LeafNode* next = leaf->next;
+      if (shared) {
+        RetireNode(leaf);
+      } else {
+        FreeNode(leaf);
+      }
+      leaf = next;
+    }
+    root_ = levels.back().prev;
+    VerifyTreeIntegrity();
+  }
+
+  // Moves every value of other into this tree and leaves other empty. Of equal keys the
+  // value from other wins. The leaves of both trees are merged in one pass, cut into
+  // key ranges that num_threads threads merge in parallel (one per core if 0), and the
+  // tree is rebuilt from the result like ParallelBulkLoad(). This takes time linear in
+  // the size of both trees, with no descent per key, and moves the values instead of
+  // copying them. The key ranges of the trees may overlap or not. other must not have
+  // snapshots, and its allocator must outlive the call.
+  void Merge(BTree&& other, int num_threads = 0) {
+    assert(other.snapshot_gens_.empty());
+    if (&other == this || other.size_ == 0) return;
+    num_threads = NumThreads(num_threads);
+    std::vector<LeafNode*> ours, theirs;
+    CollectLeaves(&ours);
+    other.CollectLeaves(&theirs);
+
+    // Range t is [splits[t], splits[t + 1]) in both trees. The splits are the first
+    // keys of evenly spaced leaves of the larger tree.
+    const std::vector<LeafNode*>& larger = ours.size() > theirs.size() ? ours : theirs;
+    std::vector<LeafPosition> our_splits(num_threads + 1), their_splits(num_threads + 1);
+    our_splits[0] = their_splits[0] = LeafPosition(0, 0);
+    our_splits[num_threads] = LeafPosition(ours.size(), 0);
+    their_splits[num_threads] = LeafPosition(theirs.size(), 0);
+    for (int t = 1; t < num_threads; ++t) {
+      const Key& split = larger[larger.size() * t / num_threads]->keys[0];
+      our_splits[t] = FindInLeaves(ours, split);
+      their_splits[t] = FindInLeaves(theirs, split);
+    }
+
+    // Each range is merged twice: once to count its values, which places the ranges
+    // in the output, and once to move them there.
+    std::vector<int64_t> offsets(num_threads + 1, 0);
+    std::vector<std::pair<Key, ValueSlot>> merged;
+    for (int pass = 0; pass < 2; ++pass) {
+      ParallelFor(num_threads, num_threads, [&](int64_t begin, int64_t end) {
+        for (int64_t t = begin; t < end; ++t) {
+          int64_t n = MergeLeaves(ours, our_splits[t], our_splits[t + 1], theirs,
+              their_splits[t], their_splits[t + 1],
+              pass == 0 ? NULL : merged.data() + offsets[t]);
+          if (pass == 0) offsets[t + 1] = n;
+        }
+      });
+      if (pass == 0) {
+        for (int t = 0; t < num_threads; ++t) offsets[t + 1] += offsets[t];
+        merged.resize(offsets[num_threads]);
+      }
+    }
+
+    // The values moved out, so the old nodes are freed without them. Leaves that
+    // snapshots of this tree share are retired and keep theirs.
+    FreeNodes(root_);
+    other.FreeNodes(other.root_);
+    other.root_ = other.template NewNode<LeafNode>();
+    other.size_ = 0;
+    other.index_.Clear();
+    other.VerifyTreeIntegrity();
+
+    const std::pair<Key, ValueSlot>* entries = merged.data();
+    BuildInParallel(merged.size(), num_threads, 1.0,
+        [entries](LeafNode* leaf, int idx, int64_t i) {
+          leaf->keys[idx] = entries[i].first;
+          leaf->values[idx] = entries[i].second;
+        });
+  }
+
+  // Returns a view of the current contents of the tree, in O(1). Nodes the view
+  // shares are copied by the next write that changes them, so the first writes after
+  // a snapshot copy the nodes on their path and the tree uses more memory until the
+  // snapshot is destroyed. See SnapshotView.
+  SnapshotView Snapshot() {
+    assert(gen_ < MAX_GEN);
+    uint32_t gen = gen_++;
+    snapshot_gens_.insert(gen);
+    max_snapshot_gen_ = gen;
+    return SnapshotView(this, root_, gen, size_);
+  }
+
+  // Returns a read-only copy of the tree packed into arrays without pointers, which
+  // serves lookups and scans faster and in less space. Later changes to the tree do
+  // not affect it. See FrozenBTree.
+  FrozenBTree<Key, Value, Compare, NODE_BYTES, SearchPolicy> Freeze() const {
+    return FrozenBTree<Key, Value, Compare, NODE_BYTES, SearchPolicy>(Begin(), size_,
+        comp_);
+  }
+
+  // Writes the tree to path in the format of MappedBTree, which serves lookups and
+  // scans straight from the file: MappedBTree<Key, Value, Compare>::OpenMapped(path).
+  // Values must be trivially copyable. Returns false if the file cannot be written.
+  bool Save(const std::string& path) const {
+    return MappedBTree<Key, Value, Compare>::Save(path, Begin());
+  }
+
+  // Walks the tree to describe its shape. Takes time linear in the number of nodes.
+  BTreeStats Stats() const {
+    BTreeStats stats;
+    stats.size = size_;
+    stats.height = 0;
+    stats.num_leaves = 0;
+    stats.num_internal_nodes = 0;
+    stats.bytes_used = Storage::NEEDS_DESTROY ? size_ * sizeof(Value) : 0;
+    stats.bytes_used += index_.bytes();
+    CollectStats(root_, 0, &stats);
+    for (int i = 0; i < stats.height; ++i) {
+      BTreeStats::Level* level = &stats.levels[i];
+      int capacity = i == stats.height - 1 ? LEAF_ORDER : INTERNAL_ORDER;
+      level->fill = static_cast<double>(level->num_values) /
+          (level->num_nodes * capacity);
+    }
+    stats.counters = counters_;
+    return stats;
+  }
+
+  // Events since the tree was created or ResetCounters(). All zero unless
+  // BTREE_COUNTERS is 1. Lookups update the counters too, so with BTREE_COUNTERS
+  // concurrent readers race on them.
+  const BTreeCounters& counters() const { return counters_; }
+  void ResetCounters() { counters_ = BTreeCounters(); }
+
+  // Checks the structure of the tree in one pass over its nodes:
+  //  - keys increase within every node and from each leaf to the next
+  //  - every separator is the largest key of its child
+  //  - every node but the root holds between its minimum (see SetMinFill()) and its
+  //    capacity of values, and an internal root at least two
+  //  - all leaves are at the same depth and linked in key order in both directions
+  //  - size() is the number of values in the leaves, and every subtree count the
+  //    number of values under its child
+  //  - no node that snapshots share is below one they do not share
+  //  - with HASH_INDEX, the hash index holds exactly the keys of the tree, each with
+  //    its leaf
+  // Returns false at the first problem and describes it in error if that is not NULL.
+  // Unlike assertions, this works in any build.
+  bool Validate(std::string* error = NULL) const {
+    ValidateState state = { -1, NULL, NULL, 0 };
+    if (!ValidateNode(root_, 0, &state, error)) return false;
+    if (state.last_leaf->next != NULL) {
+      return ValidateError(error, "the last leaf has a next leaf");
+    }
+    if (state.num_values != size_) {
+      return ValidateError(error, "size() is " + std::to_string(size_) +
+          " but the leaves hold " + std::to_string(state.num_values) + " values");
+    }
+    if (static_cast<int64_t>(index_.size()) != (HASH_INDEX ? size_ : 0)) {
+      return ValidateError(error, "the hash index holds " +
+          std::to_string(index_.size()) + " keys but the tree " + std::to_string(size_));
+    }
     return true;
   }
 
@@ -101,208 +935,815 @@ class BTree {
     PrintNode(root_, 0);
   }
 
-  void CollectAllKeys(std::vector<int64_t>* keys, bool backwards = false) const {
+  void CollectAllKeys(std::vector<Key>* keys, bool backwards = false) const {
     keys->clear();
     Node* node = root_;
     // Get the left most/right most child.
     while (node->is_internal()) {
       if (backwards) {
-        node = GetChildNode(node, node->num_values - 1);
+        node = GetChildNode(AsInternal(node), node->num_values - 1);
       } else {
-        node = GetChildNode(node, 0);
+        node = GetChildNode(AsInternal(node), 0);
       }
     }
-    while (node != NULL) {
-      for (int i = 0; i < node->num_values; ++i) {
-        int idx = backwards ? (node->num_values - i - 1) : i;
-        keys->push_back(node->values[idx].key);
+    const LeafNode* leaf = AsLeaf(node);
+    while (leaf != NULL) {
+      for (int i = 0; i < leaf->num_values; ++i) {
+        int idx = backwards ? (leaf->num_values - i - 1) : i;
+        keys->push_back(leaf->keys[idx]);
       }
       if (backwards) {
-        node = node->prev;
+        leaf = leaf->prev;
       } else {
-        node = node->next;
+        leaf = leaf->next;
       }
     }
   }
 
  private:
-  struct Node;
+  // Key arrays are padded so the search kernels can read whole blocks.
+  enum {
+    PADDED_LEAF_ORDER = (LEAF_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+    PADDED_INTERNAL_ORDER = (INTERNAL_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+  };
 
-  struct Link {
-    int64_t key;
-    union {
-      // For leaf nodes.
-      void* value;
+  // The leaf level is a doubly linked list through prev/next.
+  struct LeafNode : public Node {
+    typedef ValueSlot ValueType;
+    enum { CAPACITY = LEAF_ORDER };
 
-      // For internal nodes.
-      Node* node;
-    };
+    LeafNode* prev;
+    LeafNode* next;
+    Key keys[PADDED_LEAF_ORDER];
+    ValueSlot values[LEAF_ORDER];
+
+    LeafNode() : Node(true), prev(NULL), next(NULL) {}
   };
 
-  struct Node {
-    Node* parent;
-    bool is_leaf_;
-    int32_t num_values;
-    Link values[ORDER];
+  struct InternalNode : public Node {
+    typedef Node* ValueType;
+    enum { CAPACITY = INTERNAL_ORDER };
 
-    // Only used for leaf nodes
-    Node* prev;
-    Node* next;
+    // keys[i] is the largest key in the subtree of values[i].
+    Key keys[PADDED_INTERNAL_ORDER];
+    Node* values[INTERNAL_ORDER];
+    // With SUBTREE_COUNTS, counts[i] is the number of values in the subtree of
+    // values[i]. Otherwise the array is empty.
+    int64_t counts[SUBTREE_COUNTS ? INTERNAL_ORDER : 0];
 
-    bool is_leaf() const { return is_leaf_; }
-    bool is_internal() const { return !is_leaf_; }
-    Node(bool is_leaf, Node* parent) : parent(parent), is_leaf_(is_leaf) {}
+    InternalNode() : Node(false) {}
   };
 
-  void MoveValues(Node* node, int dst_idx, int src_idx, int n) const {
-    if (n == 0) return;
-    memmove(&node->values[dst_idx], &node->values[src_idx], n * sizeof(Link));
+  // The internal nodes from the root down to a leaf and the index of the child taken
+  // in each. nodes[0] is the root and depth is the number of internal nodes, so a
+  // node at depth d > 0 is nodes[d - 1]->values[idx[d - 1]].
+  struct Path {
+    InternalNode* nodes[MAX_HEIGHT];
+    int idx[MAX_HEIGHT];
+    int depth;
+
+    void Push(InternalNode* node, int i) {
+      assert(depth < MAX_HEIGHT);
+      nodes[depth] = node;
+      idx[depth] = i;
+      ++depth;
+    }
+  };
+
+  static LeafNode* AsLeaf(Node* node) {
+    assert(node == NULL || node->is_leaf());
+    return static_cast<LeafNode*>(node);
   }
 
-  void CopyValues(Node* dst, int dst_idx, Node* src, int src_idx, int n) const {
-    assert(dst != src);
-    assert(dst->parent == src->parent);
-    memcpy(&dst->values[dst_idx], &src->values[src_idx], n * sizeof(Link));
-    if (dst->is_internal()) {
-      // Moving values between internal nodes. Need to update the parent pointer for
-      // all the nodes from src that were moved.
+  static const LeafNode* AsLeaf(const Node* node) {
+    assert(node == NULL || node->is_leaf());
+    return static_cast<const LeafNode*>(node);
+  }
+
+  static InternalNode* AsInternal(Node* node) {
+    assert(node == NULL || node->is_internal());
+    return static_cast<InternalNode*>(node);
+  }
+
+  static const InternalNode* AsInternal(const Node* node) {
+    assert(node == NULL || node->is_internal());
+    return static_cast<const InternalNode*>(node);
+  }
+
+  enum {
+    // Number of keys that go down the tree together in the batch operations.
+    BATCH_GROUP_SIZE = 16,
+    // How much of a node the batch operations prefetch: the header and the start of
+    // the key array. The search kernels stream through the rest.
+    PREFETCH_BYTES = NODE_BYTES < 256 ? NODE_BYTES : 256,
+  };
+
+  static void PrefetchNode(const Node* node) {
+    const char* ptr = reinterpret_cast<const char*>(node);
+    for (size_t i = 0; i < PREFETCH_BYTES; i += NodeAllocator::CACHE_LINE_SIZE) {
+      __builtin_prefetch(ptr + i);
+    }
+  }
+
+  // Same as FindLeafNode() for each of keys[0, n), n <= BATCH_GROUP_SIZE. All the keys
+  // advance one level at a time and every child is prefetched as soon as it is known.
+  // Leaves are all on the same level, so the keys reach them together. If paths is not
+  // NULL, the path to leaves[i] is recorded in paths[i].
+  void FindLeafNodes(const Key* keys, int n, bool insert, LeafNode** leaves,
+      Path* paths = NULL) const {
+    Node* nodes[BATCH_GROUP_SIZE];
+    for (int i = 0; i < n; ++i) nodes[i] = root_;
+    Count(&counters_.descents, n);
+    if (paths != NULL) {
+      for (int i = 0; i < n; ++i) paths[i].depth = 0;
+    }
+    bool internal = root_->is_internal();
+    while (internal) {
+      internal = false;
+      for (int i = 0; i < n; ++i) {
+        if (nodes[i] == NULL) continue;
+        InternalNode* node = AsInternal(nodes[i]);
+        int idx = ChildIndex(node, keys[i], insert);
+        if (idx == -1) {
+          nodes[i] = NULL;
+          continue;
+        }
+        if (paths != NULL) paths[i].Push(node, idx);
+        nodes[i] = GetChildNode(node, idx);
+        PrefetchNode(nodes[i]);
+      }
       for (int i = 0; i < n; ++i) {
-        dst->values[i + dst_idx].node->parent = dst;
+        if (nodes[i] == NULL) continue;
+        internal = nodes[i]->is_internal();
+        break;
       }
     }
+    for (int i = 0; i < n; ++i) leaves[i] = AsLeaf(nodes[i]);
+  }
+
+  size_t ModifyBatch(const Key* keys, const Value* values, size_t n, bool upsert,
+      bool* inserted) {
+    size_t num_inserted = 0;
+    LeafNode* leaves[BATCH_GROUP_SIZE];
+    Path paths[BATCH_GROUP_SIZE];
+    for (size_t start = 0; start < n; start += BATCH_GROUP_SIZE) {
+      int group = n - start < BATCH_GROUP_SIZE ? n - start : BATCH_GROUP_SIZE;
+      FindLeafNodes(keys + start, group, true, leaves, paths);
+      // A split moves keys to a new leaf and changes internal nodes, and so does
+      // copying nodes a snapshot shares. After either, the leaves and paths found for
+      // the rest of the group may be wrong. Those are looked up again, from a warm
+      // cache.
+      bool changed = false;
+      for (int i = 0; i < group; ++i) {
+        const Key& key = keys[start + i];
+        Path* path = &paths[i];
+        LeafNode* leaf = changed ? FindLeafNode(root_, key, true, path) : leaves[i];
+        int idx = SearchNode(leaf, key);
+        bool exists = idx < leaf->num_values && !comp_(key, leaf->keys[idx]);
+        if (!exists || upsert) {
+          LeafNode* writable = UnsharePath(path, leaf);
+          if (writable != leaf) changed = true;
+          leaf = writable;
+        }
+        if (!exists) {
+          if (leaf->num_values == LeafNode::CAPACITY) changed = true;
+          InsertAt(leaf, idx, key, Storage::Make(values[start + i]), path, path->depth);
+          ++size_;
+          ++num_inserted;
+        } else if (upsert) {
+          Storage::Get(leaf->values[idx]) = values[start + i];
+        }
+        if (inserted != NULL) inserted[start + i] = !exists;
+      }
+    }
+    VerifyTreeIntegrity();
+    return num_inserted;
+  }
+
+  // State for one level of the tree during BulkLoad().
+  struct BulkLevel {
+    // Spreads num_entries as evenly as possible over nodes filled to about
+    // fill_factor. Every node gets min_values values and the first num_larger get one
+    // more.
+    BulkLevel(int64_t num_entries, int order, double fill_factor)
+      : node(NULL), prev(NULL), nodes_done(0) {
+      int target = static_cast<int>(fill_factor * order + 0.5);
+      if (target > order) target = order;
+      if (target < order / 2) target = order / 2;
+      num_nodes = num_entries / target;
+      int64_t min_nodes = (num_entries + order - 1) / order;
+      if (num_nodes < min_nodes) num_nodes = min_nodes;
+      if (num_nodes == 0) num_nodes = 1;
+      min_values = num_entries / num_nodes;
+      num_larger = num_entries % num_nodes;
+    }
+
+    int64_t num_nodes;
+    int min_values;
+    int64_t num_larger;
+
+    // Node currently being filled. NULL if the next value starts a new node.
+    Node* node;
+    // Last node that was filled.
+    Node* prev;
+    int64_t nodes_done;
+  };
+
+  // Plans the number of nodes on every level for num_values values, from the leaves
+  // up to the root.
+  static void PlanBulkLevels(int64_t num_values, double fill_factor,
+      std::vector<BulkLevel>* levels) {
+    int64_t num_entries = num_values;
+    do {
+      int order = levels->empty() ? LEAF_ORDER : INTERNAL_ORDER;
+      levels->push_back(BulkLevel(num_entries, order, fill_factor));
+      num_entries = levels->back().num_nodes;
+    } while (num_entries > 1);
+  }
+
+  // Returns the node being filled on 'level', starting a new one if needed.
+  template<typename NodeType>
+  NodeType* BulkNextNode(BulkLevel* level) {
+    if (level->node == NULL) {
+      assert(level->nodes_done < level->num_nodes);
+      level->node = NewNode<NodeType>();
+      if (level->prev != NULL) {
+        ConnectSiblingNode(static_cast<NodeType*>(level->prev),
+            static_cast<NodeType*>(level->node));
+      }
+    }
+    return static_cast<NodeType*>(level->node);
+  }
+
+  // Called after a value was appended to the node being filled on levels[level].
+  // Once the node has all its values, it is linked into the level above.
+  void BulkFinishNode(std::vector<BulkLevel>* levels, int level) {
+    BulkLevel* l = &(*levels)[level];
+    Node* node = l->node;
+    int size = l->min_values + (l->nodes_done < l->num_larger ? 1 : 0);
+    if (node->num_values < size) return;
+    l->node = NULL;
+    l->prev = node;
+    ++l->nodes_done;
+    if (level + 1 == static_cast<int>(levels->size())) return;
+
+    InternalNode* parent = BulkNextNode<InternalNode>(&(*levels)[level + 1]);
+    AssignInNode(parent, parent->num_values, LargestKey(node), node);
+    if (SUBTREE_COUNTS) parent->counts[parent->num_values] = SubtreeSize(node);
+    ++parent->num_values;
+    BulkFinishNode(levels, level + 1);
+  }
+
+  // Returns num_threads, or the number of cores if it is 0.
+  static int NumThreads(int num_threads) {
+    if (num_threads > 0) return num_threads;
+    int cores = std::thread::hardware_concurrency();
+    return cores > 0 ? cores : 1;
+  }
+
+  // Calls fn(begin, end) for num_threads even ranges of [0, n), each on its own
+  // thread. The last range runs on the calling thread.
+  template<typename Fn>
+  static void ParallelFor(int num_threads, int64_t n, const Fn& fn) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t + 1 < num_threads; ++t) {
+      threads.push_back(std::thread(fn, n * t / num_threads, n * (t + 1) / num_threads));
+    }
+    fn(n * (num_threads - 1) / num_threads, n);
+    for (std::thread& thread : threads) thread.join();
+  }
+
+  // Sorts pairs by key, keeping the order of equal keys, then drops all but the last
+  // of each run of equal keys. Each thread sorts a slice and the slices are merged in
+  // pairs, halving the number of threads in each round.
+  void SortPairs(std::vector<std::pair<Key, Value>>* pairs, int num_threads) const {
+    typedef typename std::vector<std::pair<Key, Value>>::iterator PairIt;
+    auto less = [this](const std::pair<Key, Value>& a, const std::pair<Key, Value>& b) {
+      return comp_(a.first, b.first);
+    };
+    PairIt begin = pairs->begin();
+    int64_t n = pairs->size();
+    if (!std::is_sorted(begin, pairs->end(), less)) {
+      ParallelFor(num_threads, num_threads, [&](int64_t t, int64_t end) {
+        for (; t < end; ++t) {
+          std::stable_sort(begin + n * t / num_threads, begin + n * (t + 1) / num_threads,
+              less);
+        }
+      });
+      for (int width = 1; width < num_threads; width *= 2) {
+        int num_merges = (num_threads + 2 * width - 1) / (2 * width);
+        ParallelFor(num_merges, num_merges, [&](int64_t m, int64_t end) {
+          for (; m < end; ++m) {
+            int64_t first = 2 * width * m;
+            int64_t middle = std::min<int64_t>(first + width, num_threads);
+            int64_t last = std::min<int64_t>(first + 2 * width, num_threads);
+            std::inplace_merge(begin + n * first / num_threads,
+                begin + n * middle / num_threads, begin + n * last / num_threads, less);
+          }
+        });
+      }
+    }
+    int64_t kept = 0;
+    for (int64_t i = 0; i < n; ++i) {
+      if (kept > 0 && !comp_((*pairs)[kept - 1].first, (*pairs)[i].first)) --kept;
+      if (kept != i) (*pairs)[kept] = std::move((*pairs)[i]);
+      ++kept;
+    }
+    pairs->resize(kept);
+  }
+
+  // Replaces the contents of the tree, whose nodes must have been freed, with n values
+  // in key order. set(leaf, idx, i) stores value i at idx in leaf. The leaves are
+  // planned like BulkLoad() and allocated on this thread, filled by num_threads
+  // threads, then linked and given parents on this thread.
+  template<typename SetValue>
+  void BuildInParallel(int64_t n, int num_threads, double fill_factor,
+      const SetValue& set) {
+    size_ = n;
+    index_.Clear();
+    index_.Reserve(size_);
+    std::vector<BulkLevel> levels;
+    PlanBulkLevels(size_, fill_factor, &levels);
+    if (size_ == 0) {
+      root_ = NewNode<LeafNode>();
+      return;
+    }
+
+    BulkLevel* bottom = &levels[0];
+    std::vector<LeafNode*> leaves(bottom->num_nodes);
+    for (LeafNode*& leaf : leaves) leaf = NewNode<LeafNode>();
+    ParallelFor(num_threads, leaves.size(), [&](int64_t begin, int64_t end) {
+      for (int64_t l = begin; l < end; ++l) {
+        LeafNode* leaf = leaves[l];
+        int64_t first = l * bottom->min_values + std::min(l, bottom->num_larger);
+        leaf->num_values = bottom->min_values + (l < bottom->num_larger ? 1 : 0);
+        for (int idx = 0; idx < leaf->num_values; ++idx) set(leaf, idx, first + idx);
+      }
+    });
+    for (LeafNode* leaf : leaves) {
+      if (bottom->prev != NULL) ConnectSiblingNode(AsLeaf(bottom->prev), leaf);
+      IndexKeys(leaf, 0, leaf->num_values);
+      bottom->node = leaf;
+      BulkFinishNode(&levels, 0);
+    }
+    root_ = levels.back().prev;
+    VerifyTreeIntegrity();
+  }
+
+  // Position of a value in a list of leaves: index idx in leaves[leaf]. The end of the
+  // list is (leaves.size(), 0).
+  struct LeafPosition {
+    LeafPosition() : leaf(0), idx(0) {}
+    LeafPosition(int64_t leaf, int idx) : leaf(leaf), idx(idx) {}
+
+    bool operator<(const LeafPosition& other) const {
+      return leaf < other.leaf || (leaf == other.leaf && idx < other.idx);
+    }
+
+    int64_t leaf;
+    int idx;
+  };
+
+  // Frees node and the nodes under it without their values, retiring the ones that
+  // snapshots share.
+  void FreeNodes(Node* node) {
+    LeafNode* leaf = LeftmostLeaf(node);
+    DeleteInternalNodes(node);
+    while (leaf != NULL) {
+      LeafNode* next = leaf->next;
+      if (IsShared(leaf)) {
+        RetireNode(leaf);
+      } else {
+        FreeNode(leaf);
+      }
+      leaf = next;
+    }
+  }
+
+  // Appends the non-empty leaves of the tree to leaves, in key order.
+  void CollectLeaves(std::vector<LeafNode*>* leaves) const {
+    for (LeafNode* leaf = LeftmostLeaf(root_); leaf != NULL; leaf = leaf->next) {
+      if (leaf->num_values > 0) leaves->push_back(leaf);
+    }
+  }
+
+  // Returns the position of the first key in leaves that is >= key.
+  LeafPosition FindInLeaves(const std::vector<LeafNode*>& leaves, const Key& key) const {
+    int64_t lo = 0;
+    int64_t hi = leaves.size();
+    while (lo < hi) {
+      int64_t mid = lo + (hi - lo) / 2;
+      if (comp_(LargestKey(leaves[mid]), key)) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    if (lo == static_cast<int64_t>(leaves.size())) return LeafPosition(lo, 0);
+    return LeafPosition(lo, SearchNode(leaves[lo], key, false));
+  }
+
+  static void Advance(const std::vector<LeafNode*>& leaves, LeafPosition* pos) {
+    if (++pos->idx == leaves[pos->leaf]->num_values) {
+      ++pos->leaf;
+      pos->idx = 0;
+    }
+  }
+
+  // Merges the values of ours in [a, a_end) and of theirs, another tree's leaves, in
+  // [b, b_end) into out in key order, and returns how many there are. Of equal keys
+  // the value from theirs is kept and ours is destroyed. Values of ours that snapshots
+  // share are copied if they are not stored inline, and never destroyed. With out NULL
+  // this only counts. Runs on several threads at once, so it leaves the counters
+  // alone.
+  int64_t MergeLeaves(const std::vector<LeafNode*>& ours, LeafPosition a,
+      LeafPosition a_end, const std::vector<LeafNode*>& theirs, LeafPosition b,
+      LeafPosition b_end, std::pair<Key, ValueSlot>* out) {
+    int64_t n = 0;
+    while (a < a_end || b < b_end) {
+      LeafNode* our_leaf = a < a_end ? ours[a.leaf] : NULL;
+      LeafNode* their_leaf = b < b_end ? theirs[b.leaf] : NULL;
+      bool take_ours = our_leaf != NULL;
+      bool take_theirs = their_leaf != NULL;
+      if (take_ours && take_theirs) {
+        const Key& our_key = our_leaf->keys[a.idx];
+        const Key& their_key = their_leaf->keys[b.idx];
+        if (comp_(our_key, their_key)) {
+          take_theirs = false;
+        } else if (comp_(their_key, our_key)) {
+          take_ours = false;
+        }
+      }
+      if (out != NULL) {
+        bool shared = take_ours && IsShared(our_leaf);
+        if (take_theirs) {
+          out[n] = std::make_pair(their_leaf->keys[b.idx], their_leaf->values[b.idx]);
+          if (take_ours && !shared) Storage::Destroy(&our_leaf->values[a.idx]);
+        } else {
+          ValueSlot& value = our_leaf->values[a.idx];
+          out[n] = std::make_pair(our_leaf->keys[a.idx], shared && Storage::NEEDS_DESTROY ?
+              Storage::Make(Storage::Get(value)) : value);
+        }
+      }
+      ++n;
+      if (take_ours) Advance(ours, &a);
+      if (take_theirs) Advance(theirs, &b);
+    }
+    return n;
+  }
+
+  template<typename NodeType>
+  NodeType* NewNode() {
+    NodeType* node = new (allocator_->Allocate(sizeof(NodeType))) NodeType();
+    node->gen = gen_;
+    return node;
+  }
+
+  void FreeNode(Node* node) {
+    allocator_->Free(node, node->is_leaf() ? sizeof(LeafNode) : sizeof(InternalNode));
+  }
+
+  template<typename NodeType>
+  void MoveValues(NodeType* node, int dst_idx, int src_idx, int n) const {
+    if (n == 0) return;
+    memmove(&node->keys[dst_idx], &node->keys[src_idx], n * sizeof(Key));
+    memmove(&node->values[dst_idx], &node->values[src_idx],
+        n * sizeof(typename NodeType::ValueType));
+    MoveCounts(node, dst_idx, node, src_idx, n);
+  }
+
+  template<typename NodeType>
+  void CopyValues(NodeType* dst, int dst_idx, NodeType* src, int src_idx, int n) {
+    assert(dst != src);
+    memcpy(&dst->keys[dst_idx], &src->keys[src_idx], n * sizeof(Key));
+    memcpy(&dst->values[dst_idx], &src->values[src_idx],
+        n * sizeof(typename NodeType::ValueType));
+    MoveCounts(dst, dst_idx, src, src_idx, n);
+    IndexKeys(dst, dst_idx, n);
   }
 
   // Moves src[src_idx] into dst[dst_idx];
-  void MoveNode(Node* dst, int dst_idx, Node* src, int src_idx) const {
+  template<typename NodeType>
+  void MoveNode(NodeType* dst, int dst_idx, NodeType* src, int src_idx) {
+    dst->keys[dst_idx] = src->keys[src_idx];
     dst->values[dst_idx] = src->values[src_idx];
-    if (dst->is_internal()) dst->values[dst_idx].node->parent = dst;
+    MoveCounts(dst, dst_idx, src, src_idx, 1);
+    IndexKeys(dst, dst_idx, 1);
     ++dst->num_values;
     --src->num_values;
-    assert(dst->num_values <= ORDER);
+    assert(dst->num_values <= NodeType::CAPACITY);
     assert(src->num_values >= 1);
   }
 
+  // The values of internal nodes take their subtree counts with them.
+  void MoveCounts(LeafNode* dst, int dst_idx, const LeafNode* src, int src_idx,
+      int n) const {}
+  void MoveCounts(InternalNode* dst, int dst_idx, const InternalNode* src, int src_idx,
+      int n) const {
+    if (SUBTREE_COUNTS) {
+      memmove(&dst->counts[dst_idx], &src->counts[src_idx], n * sizeof(int64_t));
+    }
+  }
+
+  // Points the keys at [idx, idx + n) of node, which just moved there, to node in the
+  // hash index. Keys only land in a leaf through CopyValues(), MoveNode(),
+  // AssignInNode() and CopyNode(), and moves within a leaf leave the index alone.
+  void IndexKeys(LeafNode* node, int idx, int n) {
+    if (!HASH_INDEX) return;
+    for (int i = idx; i < idx + n; ++i) index_.Set(node->keys[i], node);
+  }
+  void IndexKeys(InternalNode* node, int idx, int n) {}
+
+  // Drops the keys at [begin, end) of node from the hash index.
+  void UnindexKeys(const LeafNode* node, int begin, int end) {
+    if (!HASH_INDEX) return;
+    for (int i = begin; i < end; ++i) index_.Erase(node->keys[i]);
+  }
+
+  // Returns the number of values under node from the counts of its children. Only
+  // leaves can be counted without SUBTREE_COUNTS.
+  static int64_t SubtreeSize(const Node* node) {
+    if (node->is_leaf()) return node->num_values;
+    assert(SUBTREE_COUNTS);
+    int64_t n = 0;
+    for (int i = 0; i < node->num_values; ++i) n += AsInternal(node)->counts[i];
+    return n;
+  }
+
+  // Number of values under the value at idx of node.
+  static int64_t EntrySize(const LeafNode* node, int idx) { return 1; }
+  static int64_t EntrySize(const InternalNode* node, int idx) {
+    return SUBTREE_COUNTS ? node->counts[idx] : 0;
+  }
+
+  // Adds n to the counts of the children taken by path down to the node at depth.
+  static void AddToCounts(const Path* path, int depth, int64_t n) {
+    if (!SUBTREE_COUNTS) return;
+    for (int d = 0; d < depth; ++d) path->nodes[d]->counts[path->idx[d]] += n;
+  }
+
+  static void SetCount(InternalNode* node, int idx, int64_t n) {
+    if (SUBTREE_COUNTS) node->counts[idx] = n;
+  }
+
+  // Moves n values from the count of child src of parent to child dst.
+  static void TransferCount(InternalNode* parent, int src, int dst, int64_t n) {
+    if (!SUBTREE_COUNTS) return;
+    parent->counts[src] -= n;
+    parent->counts[dst] += n;
+  }
+
+  // Child src of parent was merged into child dst, which takes over its count.
+  static void MergeCount(InternalNode* parent, int src, int dst) {
+    if (SUBTREE_COUNTS) parent->counts[dst] += parent->counts[src];
+  }
+
+  // Sets the separator and the count of child idx of parent from the child itself.
+  void ResetChildEntry(InternalNode* parent, int idx) const {
+    const Node* child = GetChildNode(parent, idx);
+    parent->keys[idx] = LargestKey(child);
+    if (SUBTREE_COUNTS) parent->counts[idx] = SubtreeSize(child);
+  }
+
   // Returns the largest key in the subtree from node.
-  int64_t LargestKey(const Node* node) const {
+  const Key& LargestKey(const Node* node) const {
     assert(node->num_values > 0);
-    return node->values[node->num_values - 1].key;
+    if (node->is_leaf()) return AsLeaf(node)->keys[node->num_values - 1];
+    return AsInternal(node)->keys[node->num_values - 1];
   }
 
-  // Returns the child node for parent. Parent must be an internal node.
-  Node* GetChildNode(const Node* parent, int idx) const {
-    assert(parent->is_internal());
+  // Returns the child node for parent.
+  Node* GetChildNode(const InternalNode* parent, int idx) const {
     assert(idx < parent->num_values);
-    return parent->values[idx].node;
+    return parent->values[idx];
+  }
+
+  // Shared by Insert(), Upsert() and FindOrInsert(). Descends to the leaf for key and
+  // scans it once: the position found is where the key is, or where it is inserted if
+  // it is missing. Returns the leaf and index of the key afterwards.
+  LeafNode* FindOrInsertLeaf(const Key& key, const Value& value, int* idx,
+      bool* inserted) {
+    if (HASH_INDEX) {
+      // The caller may write the value, so this only skips the descent if no snapshot
+      // shares the leaf.
+      LeafNode* leaf_node = index_.Find(key);
+      if (leaf_node != NULL && !IsShared(leaf_node)) {
+        *idx = IndexOfKey(leaf_node, key);
+        *inserted = false;
+        return leaf_node;
+      }
+    }
+    Path path;
+    LeafNode* leaf_node = FindLeafNode(root_, key, true, &path);
+    // The caller may write the value through the result even if the key exists.
+    leaf_node = UnsharePath(&path, leaf_node);
+    *idx = SearchNode(leaf_node, key);
+    *inserted = *idx == leaf_node->num_values || comp_(key, leaf_node->keys[*idx]);
+    if (*inserted) {
+      InsertAt(leaf_node, *idx, key, Storage::Make(value), &path, path.depth,
+          &leaf_node, idx);
+      ++size_;
+      VerifyTreeIntegrity();
+    }
+    return leaf_node;
+  }
+
+  // Returns the index of the first key in node that is >= key. Snapshots search with
+  // count false: they can be read while the tree changes, and its counters with it.
+  template<typename NodeType>
+  int SearchNode(const NodeType* node, const Key& key, bool count = true) const {
+    int i = Search::LowerBound(node->keys, node->num_values, key, comp_);
+    if (count) {
+      Count(&counters_.node_searches);
+      Count(&counters_.key_comparisons, i < node->num_values ? i + 1 : i);
+    }
+    return i;
+  }
+
+  // Adds n to a counter if BTREE_COUNTERS is 1.
+  static void Count(int64_t* counter, int64_t n = 1) {
+    if (BTREE_COUNTERS) *counter += n;
   }
 
   // Returns the index in node->values that contains key. Returns -1 if the key does
   // not exist.
-  int IndexOfKey(const Node* node, int64_t key) const {
-    for (int i = 0; i < node->num_values; ++i) {
-      if (node->values[i].key == key) return i;
-      if (node->values[i].key > key) return -1;
-    }
-    return -1;
-  }
-
-  // Updates the separator key in node->parent
-  void UpdateParentSeparator(Node* node, int64_t old_key, int64_t new_key) const {
-    Node* parent = node->parent;
-    assert(parent != NULL);
-    while (parent != NULL) {
-      int separtor_idx = IndexOfKey(parent, old_key);
-      assert(separtor_idx != -1);
-      assert(GetChildNode(parent, separtor_idx) == node);
-      parent->values[separtor_idx].key = new_key;
-      if (separtor_idx == parent->num_values - 1) {
-        // Just updated the max value in parent. We need to propagate up.
-        node = parent;
-        parent = parent->parent;
-      } else {
-        break;
-      }
+  template<typename NodeType>
+  int IndexOfKey(const NodeType* node, const Key& key) const {
+    int i = SearchNode(node, key);
+    if (i == node->num_values || comp_(key, node->keys[i])) return -1;
+    return i;
+  }
+
+  // The largest key in the node at depth in path changed to key. Updates the node's
+  // separator in its parent and, while that is the parent's largest key, further up.
+  void UpdateSeparators(const Path* path, int depth, const Key& key) const {
+    for (int d = depth - 1; d >= 0; --d) {
+      InternalNode* parent = path->nodes[d];
+      parent->keys[path->idx[d]] = key;
+      Count(&counters_.separator_updates);
+      if (path->idx[d] != parent->num_values - 1) break;
     }
   }
 
   // node->values[idx] = {key, value}
-  void AssignInNode(Node* node, int idx, int64_t key, void* value) const {
-    node->values[idx].key = key;
-    node->values[idx].value = value;
+  template<typename NodeType>
+  void AssignInNode(NodeType* node, int idx, const Key& key,
+      const typename NodeType::ValueType& value) {
+    node->keys[idx] = key;
+    node->values[idx] = value;
+    IndexKeys(node, idx, 1);
   }
 
-  // Finds the child in node which can contain key. If insert, then this never returns
-  // NULL and returns the leaf node to insert into. If not insert, returns NULL if this
-  // key cannot be in any of the children.
-  // node must be an internal node.
-  Node* FindInInternalNode(Node* node, int64_t key, bool insert) const {
-    assert(node->is_internal());
+  // Returns the index of the child in node which can contain key. If insert, then this
+  // never returns -1 and returns the child to insert into. If not insert, returns -1 if
+  // this key cannot be in any of the children. count is passed to SearchNode().
+  int ChildIndex(const InternalNode* node, const Key& key, bool insert,
+      bool count = true) const {
     assert(node->num_values > 0);
-    for (int i = 0; i < node->num_values; ++i) {
-      if (key <= node->values[i].key) return GetChildNode(node, i);
-    }
-    return (insert ? GetChildNode(node, node->num_values - 1) : NULL);
+    int i = SearchNode(node, key, count);
+    if (i < node->num_values) return i;
+    return (insert ? node->num_values - 1 : -1);
   }
 
   // Finds the leaf node in the subtree from node which can contain the key. Returns NULL
-  // if the key does not exist and insert is false.
-  Node* FindLeafNode(Node* node, int64_t key, bool insert) const {
+  // if the key does not exist and insert is false. If path is not NULL, the internal
+  // nodes on the way are recorded in it.
+  LeafNode* FindLeafNode(Node* node, const Key& key, bool insert,
+      Path* path = NULL) const {
+    Count(&counters_.descents);
+    if (path != NULL) path->depth = 0;
     while (node->is_internal()) {
-      node = FindInInternalNode(node, key, insert);
-      if (node == NULL) return NULL;
+      InternalNode* internal = AsInternal(node);
+      int i = ChildIndex(internal, key, insert);
+      if (i == -1) return NULL;
+      if (path != NULL) path->Push(internal, i);
+      node = GetChildNode(internal, i);
     }
-    return node;
+    return AsLeaf(node);
+  }
+
+  // Returns the number of keys smaller than key, adding up the subtree counts of the
+  // children left of the path to key.
+  int64_t CountLess(const Key& key) const {
+    assert(SUBTREE_COUNTS);
+    Count(&counters_.descents);
+    int64_t n = 0;
+    const Node* node = root_;
+    while (node->is_internal()) {
+      const InternalNode* internal = AsInternal(node);
+      int i = SearchNode(internal, key);
+      for (int j = 0; j < i; ++j) n += internal->counts[j];
+      if (i == internal->num_values) return n;
+      node = GetChildNode(internal, i);
+    }
+    return n + SearchNode(AsLeaf(node), key);
+  }
+
+  // Returns the number of keys smaller than key in leaf and the leaves after it.
+  int64_t CountLessFrom(const LeafNode* leaf, const Key& key) const {
+    int64_t n = 0;
+    // Only a leaf that is the root can be empty.
+    while (leaf->next != NULL && comp_(leaf->keys[leaf->num_values - 1], key)) {
+      n += leaf->num_values;
+      leaf = leaf->next;
+    }
+    return n + SearchNode(leaf, key);
+  }
+
+  static LeafNode* LeftmostLeaf(Node* node) {
+    while (node->is_internal()) node = AsInternal(node)->values[0];
+    return AsLeaf(node);
+  }
+
+  static LeafNode* RightmostLeaf(Node* node) {
+    while (node->is_internal()) node = AsInternal(node)->values[node->num_values - 1];
+    return AsLeaf(node);
   }
 
   // Inserts right_sibling to the right of node, maintaining the doubly-linked list.
-  void ConnectSiblingNode(Node* node, Node* right_sibling) const {
+  // Only leaves are linked.
+  void ConnectSiblingNode(LeafNode* node, LeafNode* right_sibling) const {
     right_sibling->next = node->next;
     right_sibling->prev = node;
     if (node->next != NULL) node->next->prev = right_sibling;
     node->next = right_sibling;
   }
+  void ConnectSiblingNode(InternalNode* node, InternalNode* right_sibling) const {}
 
   // Removes node from the doubly linked list.
-  void RemoveNode(Node* node) {
-    node->prev->next = node->next;
+  void RemoveNode(LeafNode* node) {
+    if (node->prev != NULL) node->prev->next = node->next;
     if (node->next != NULL) node->next->prev = node->prev;
   }
+  void RemoveNode(InternalNode* node) {}
 
-  // Splits 'node' to insert a value at *value_idx. Returns the node that the value
-  // should be inserted into and adjusts value_idx.
+  // Splits 'node', which is at depth in path, to insert key at *value_idx. Returns the
+  // node that the value should be inserted into and adjusts value_idx.
   // For example if the current node contains 7 elements and is full.
   //  1 2 4 5 6 8 9
-  // If we are inserting 3 (value_idx == 3), this would return the left node after the
-  // split with value_idx == 3. If we are inserting 7 (value_idx == 5), this would
+  // If we are inserting 3 (value_idx == 2), this would return the left node after the
+  // split with value_idx == 2. If we are inserting 7 (value_idx == 5), this would
   // return the right node with value_idx = 1
-  Node* SplitNodeForInsert(Node* node, int* value_idx) {
+  template<typename NodeType>
+  NodeType* SplitNodeForInsert(NodeType* node, int* value_idx, const Key& key,
+      const Path* path, int depth) {
     // Values from [0, split_idx] stay in node.
-    // Values from [split_idx +1, ORDER] go to the new node.
-    int split_idx = ORDER / 2;
-    // Take into account where the new value will be inserted into to get a more even
-    // split.
-    if (*value_idx < split_idx) --split_idx;
+    // Values from [split_idx +1, CAPACITY) go to the new node.
+    int split_idx = NodeType::CAPACITY / 2 - 1;
+    // With an odd capacity there is a value to spare. Take into account where the new
+    // value will be inserted into to get a more even split.
+    if (NodeType::CAPACITY % 2 == 1 && *value_idx > split_idx) ++split_idx;
 
     // Make the new node, copy the bottom half of the values and shrink the original node.
-    Node* new_node = new Node(node->is_leaf(), node->parent);
-    new_node->num_values = ORDER - split_idx - 1;
+    Count(&counters_.splits);
+    NodeType* new_node = NewNode<NodeType>();
+    new_node->num_values = NodeType::CAPACITY - split_idx - 1;
     node->num_values = split_idx + 1;
     CopyValues(new_node, 0, node, split_idx + 1, new_node->num_values);
     ConnectSiblingNode(node, new_node);
+    // Separator of new_node, including key if it goes after all the other values.
+    Key separator = *value_idx == NodeType::CAPACITY ? key : LargestKey(new_node);
+
+    // The count of node in its parent already includes the value being inserted, see
+    // InsertAt(), and so does size_ + 1 for the root. The half the value does not go
+    // into is counted as it is and the other half gets the rest.
+    int64_t node_count = 0;
+    int64_t new_node_count = 0;
+    if (SUBTREE_COUNTS) {
+      int64_t total = depth == 0 ?
+          size_ + 1 : path->nodes[depth - 1]->counts[path->idx[depth - 1]];
+      if (*value_idx > split_idx) {
+        node_count = SubtreeSize(node);
+        new_node_count = total - node_count;
+      } else {
+        new_node_count = SubtreeSize(new_node);
+        node_count = total - new_node_count;
+      }
+    }
 
     // Update the parent chain.
-    if (node->parent == NULL) {
+    if (depth == 0) {
       // Need a new root.
-      Node* root = new Node(false, NULL);
-      root->prev = root->next = NULL;
-      AssignInNode(root, 0, LargestKey(node), node);
-      AssignInNode(root, 1, LargestKey(new_node), new_node);
+      InternalNode* root = NewNode<InternalNode>();
+      AssignInNode(root, 0, LargestKey(node), static_cast<Node*>(node));
+      AssignInNode(root, 1, separator, static_cast<Node*>(new_node));
+      SetCount(root, 0, node_count);
+      SetCount(root, 1, new_node_count);
       root->num_values = 2;
-      node->parent = new_node->parent = root;
       root_ = root;
     } else {
-      int64_t old_separator = LargestKey(new_node);
-      UpdateParentSeparator(node, old_separator, LargestKey(node));
-      InsertInNode<false>(node->parent, old_separator, new_node);
+      // node keeps its entry in the parent with its new largest key and new_node is
+      // inserted after it.
+      InternalNode* parent = path->nodes[depth - 1];
+      int idx = path->idx[depth - 1];
+      assert(GetChildNode(parent, idx) == node);
+      parent->keys[idx] = LargestKey(node);
+      SetCount(parent, idx, node_count);
+      InternalNode* inserted_node;
+      int inserted_idx;
+      InsertAt(parent, idx + 1, separator, static_cast<Node*>(new_node), path, depth - 1,
+          &inserted_node, &inserted_idx);
+      SetCount(inserted_node, inserted_idx, new_node_count);
     }
 
     if (*value_idx > split_idx) {
@@ -313,137 +1754,155 @@ class BTree {
     return node;
   }
 
-  // Inserts (key, value) into node, splitting as necessary. Returns true if the
-  // insert is successful or false if the key already exists in which case the value
-  // is not inserted.
-  template<bool IS_VALUE>
-  bool InsertInNode(Node* node, int64_t key, void* value) {
-    int i = 0;
-    for (; i < node->num_values; ++i) {
-      if (node->values[i].key < key) continue;
-      if (node->values[i].key == key) return false;
-      break;
-    }
-
-    // Node is full. Split it before inserting.
-    if (node->num_values == ORDER) {
-      node = SplitNodeForInsert(node, &i);
-      assert(node->num_values < ORDER);
-      if (node->is_internal()) reinterpret_cast<Node*>(value)->parent = node;
-    }
-
-    if (i == node->num_values && node->parent != NULL) {
+  // Inserts (key, value) at index i of node, splitting as necessary. i must be the
+  // position of key in node and node must be at depth in path. If inserted_node and
+  // inserted_idx are not NULL, they are set to where the value ended up. A value
+  // inserted into a leaf is counted on the path before any split, and the count of a
+  // child inserted into an internal node is left for the caller to set.
+  template<typename NodeType>
+  void InsertAt(NodeType* node, int i, const Key& key,
+      const typename NodeType::ValueType& value, const Path* path, int depth,
+      NodeType** inserted_node = NULL, int* inserted_idx = NULL) {
+    if (node->is_leaf()) AddToCounts(path, depth, 1);
+    if (node->num_values == NodeType::CAPACITY) {
+      // Node is full. Split it before inserting. This also sets the separators.
+      node = SplitNodeForInsert(node, &i, key, path, depth);
+      assert(node->num_values < NodeType::CAPACITY);
+    } else if (i == node->num_values) {
       // Propagate max up to the root.
-      UpdateParentSeparator(node, LargestKey(node), key);
+      UpdateSeparators(path, depth, key);
     }
 
     MoveValues(node, i + 1, i, node->num_values - i);
     AssignInNode(node, i, key, value);
     ++node->num_values;
-    return true;
+    if (inserted_node != NULL) *inserted_node = node;
+    if (inserted_idx != NULL) *inserted_idx = i;
   }
 
-  // Removes key from the node. If the key does not exist, returns false and
-  // nothing is removed.
-  bool RemoveKeyFromNode(Node* node, int64_t key) {
-    int key_idx = IndexOfKey(node, key);
-    if (key_idx == -1) return false;
+  // Releases the value at idx before it is removed from the tree.
+  void DestroyValue(LeafNode* node, int idx) {
+    Storage::Destroy(&node->values[idx]);
+  }
+  void DestroyValue(InternalNode* node, int idx) {}
 
-    MoveValues(node, key_idx, key_idx + 1, node->num_values - key_idx - 1);
+  // Removes the value at index i of node, which is at depth in path, and rebalances.
+  // A leaf value must have been destroyed already.
+  template<typename NodeType>
+  void RemoveAt(NodeType* node, int i, const Path* path, int depth) {
+    if (node->is_leaf()) AddToCounts(path, depth, -1);
+    MoveValues(node, i, i + 1, node->num_values - i - 1);
     --node->num_values;
 
-    // Propagate min and separators up to the root.
-    if (node->parent != NULL) {
-      // Propagate separators up the root.
-      if (key_idx == node->num_values) {
-        int64_t new_key = LargestKey(node);
-        Node* parent = node->parent;
-        while (parent != NULL) {
-          int separator_idx = IndexOfKey(parent, key);
-          if (separator_idx == -1) break;
-          parent->values[separator_idx].key = new_key;
-          if (separator_idx != parent->num_values - 1) break;
-          parent = parent->parent;
-        }
+    if (depth == 0) {
+      if (node->is_internal() && node->num_values == 1) {
+        // In this case, we've collapsed to the root which now only has 1 child. Replace
+        // the root with its child and delete the root.
+        root_ = GetChildNode(AsInternal(node), 0);
+        FreeNode(node);
       }
+      return;
+    }
+
+    // Propagate separators up the root. An empty leaf has no largest key, but it is
+    // dropped by the rebalance below.
+    if (i == node->num_values && node->num_values > 0) {
+      UpdateSeparators(path, depth, LargestKey(node));
     }
 
     // Need to rebalance.
-    if (node != root_ && node->num_values < ORDER / 2) RebalanceNode(node);
+    if (node->num_values < MinValues(node)) RebalanceNode(node, path, depth);
+  }
 
-    if (node == root_ && node->is_internal() && node->num_values == 1) {
-      // In this case, we've collapsed to the root which now only has 1 child. Replace the
-      // root with its child and delete the root.
-      root_ = GetChildNode(node, 0);
-      root_->parent = NULL;
-      delete node;
-    }
+  // Number of values below which a node other than the root is rebalanced. See
+  // SetMinFill(). It is at most half the capacity, so a node that is too small always
+  // fits in a sibling that is not large enough to give it a value.
+  int MinValues(const LeafNode* node) const { return min_leaf_values_; }
+  int MinValues(const InternalNode* node) const { return min_internal_values_; }
+  int MinValues(const Node* node) const {
+    return node->is_leaf() ? min_leaf_values_ : min_internal_values_;
+  }
 
-    return true;
+  // Returns min_fill of order, between floor and order / 2.
+  static int MinValuesForFill(int order, double min_fill, int floor) {
+    int min_values = static_cast<int>(min_fill * order);
+    if (min_values > order / 2) min_values = order / 2;
+    if (min_values < floor) min_values = floor;
+    return min_values;
   }
 
-  // Rebalances node because it is too small. This can either pull a value from one of
-  // its siblings in which case no nodes are deleted. If there are too few values, it
-  // is combined with its sibling and a node is deleted.
-  void RebalanceNode(Node* node) {
-    assert(node->num_values < ORDER / 2);
-    if (node->prev != NULL && node->prev->parent == node->parent) {
-      int64_t old_separator_key = LargestKey(node->prev);
-      if (node->prev->num_values > ORDER / 2) {
+  // Rebalances node, which is at depth in path, because it is too small. This can
+  // either pull a value from one of its siblings in which case no nodes are deleted. If
+  // there are too few values, it is combined with its sibling and a node is deleted.
+  template<typename NodeType>
+  void RebalanceNode(NodeType* node, const Path* path, int depth) {
+    const int min_values = MinValues(node);
+    assert(node->num_values < min_values);
+    InternalNode* parent = path->nodes[depth - 1];
+    int idx = path->idx[depth - 1];
+    assert(GetChildNode(parent, idx) == node);
+    if (node->num_values == 0) {
+      // Only leaves empty out, when SetMinFill() lets them. Drop the leaf and its entry
+      // in the parent, which leaves the siblings alone.
+      Count(&counters_.merges);
+      RemoveNode(node);
+      FreeNode(node);
+      RemoveAt(parent, idx, path, depth - 1);
+    } else if (idx > 0) {
+      NodeType* prev = static_cast<NodeType*>(UnshareChild(parent, idx - 1));
+      if (prev->num_values > min_values) {
         // Rebalance by stealing from my prev sibling. Move node's values over one and
-        // take the prev node's last value. Update the parent separators.
+        // take the prev node's last value. Update the parent separator.
+        Count(&counters_.borrows);
         MoveValues(node, 1, 0, node->num_values);
-        MoveNode(node, 0, node->prev, node->prev->num_values - 1);
-        UpdateParentSeparator(node->prev, old_separator_key, LargestKey(node->prev));
+        MoveNode(node, 0, prev, prev->num_values - 1);
+        TransferCount(parent, idx - 1, idx, EntrySize(node, 0));
+        parent->keys[idx - 1] = LargestKey(prev);
       } else {
         // Move node into node->prev.
-        CopyValues(node->prev, node->prev->num_values, node, 0, node->num_values);
-        node->prev->num_values += node->num_values;
-        assert(node->prev->num_values <= ORDER);
-
-        // Fix up the side links and delete the removed node.
-        // Update parent link to point to new node.
-        int separtor_idx = IndexOfKey(node->parent, LargestKey(node));
-        assert(separtor_idx != -1);
-        assert(GetChildNode(node->parent, separtor_idx) == node);
-        node->parent->values[separtor_idx].node = node->prev;
+        Count(&counters_.merges);
+        CopyValues(prev, prev->num_values, node, 0, node->num_values);
+        prev->num_values += node->num_values;
+        assert(prev->num_values <= NodeType::CAPACITY);
 
-        // Fix up the separators in the parent which can call this recursively.
-        RemoveKeyFromNode(node->parent, old_separator_key);
-
-        // Finally fix up the side links and delete the node.
+        // prev takes over node's entry in the parent, whose separator is the largest
+        // key of both. Fix up the side links and delete the node.
+        parent->values[idx] = prev;
+        MergeCount(parent, idx - 1, idx);
         RemoveNode(node);
-        delete node;
+        FreeNode(node);
+
+        // Remove prev's old entry, which can rebalance the parent recursively.
+        RemoveAt(parent, idx - 1, path, depth - 1);
       }
-    } else if (node->next != NULL && node->next->parent == node->parent) {
-      int64_t old_separator_key = LargestKey(node);
-      if (node->next->num_values > ORDER / 2) {
+    } else if (idx + 1 < parent->num_values) {
+      NodeType* next = static_cast<NodeType*>(UnshareChild(parent, idx + 1));
+      if (next->num_values > min_values) {
         // Rebalance by stealing from node's next sibling. Take next's first value and
-        // shift next's values over one. Update parent separators.
-        MoveNode(node, node->num_values, node->next, 0);
-        MoveValues(node->next, 0, 1, node->next->num_values);
-        UpdateParentSeparator(node, old_separator_key, LargestKey(node));
+        // shift next's values over one. Update the parent separator.
+        Count(&counters_.borrows);
+        MoveNode(node, node->num_values, next, 0);
+        MoveValues(next, 0, 1, next->num_values);
+        TransferCount(parent, idx + 1, idx, EntrySize(node, node->num_values - 1));
+        parent->keys[idx] = LargestKey(node);
       } else {
         // Move node->next into node.
-        CopyValues(node, node->num_values, node->next, 0, node->next->num_values);
-        node->num_values += node->next->num_values;
-        assert(node->num_values <= ORDER);
+        Count(&counters_.merges);
+        CopyValues(node, node->num_values, next, 0, next->num_values);
+        node->num_values += next->num_values;
+        assert(node->num_values <= NodeType::CAPACITY);
 
-        // Update parent link to point to new node.
-        int separtor_idx = IndexOfKey(node->parent, LargestKey(node->next));
-        assert(separtor_idx != -1);
-        assert(GetChildNode(node->parent, separtor_idx) == node->next);
-        node->parent->values[separtor_idx].node = node;
-
-        // Fix up the separators in the parent which can call this recursively.
-        RemoveKeyFromNode(node->parent, old_separator_key);
-
-        // Finally fix up the side links and delete the node.
+        // node takes over next's entry in the parent. Fix up the side links and delete
+        // next.
         // node <--> node->next <--> [some node]
         // and want to delete node->next. Some node can be NULL.
-        Node* node_to_delete = node->next;
-        RemoveNode(node_to_delete);
-        delete node_to_delete;
+        parent->values[idx + 1] = node;
+        MergeCount(parent, idx, idx + 1);
+        RemoveNode(next);
+        FreeNode(next);
+
+        // Remove node's old entry, which can rebalance the parent recursively.
+        RemoveAt(parent, idx, path, depth - 1);
       }
     } else {
       printf("Invalid BTree!\n");
@@ -452,15 +1911,344 @@ class BTree {
     }
   }
 
-  // Depth first traversal to delete the entire tree. This *cannot* be used to delete a
-  // subtree.
-  void Delete(Node* node) {
+  // Removes the keys in [lo, hi) from the subtree under node, which must not be shared,
+  // and returns how many there were. The children between the ones that can hold lo and
+  // hi are dropped whole and only those two are searched further. They are rebalanced
+  // afterwards, but node itself can be left with too few values, or none, for its
+  // parent to fix.
+  int64_t RemoveRangeInNode(Node* node, const Key& lo, const Key& hi) {
+    if (node->is_leaf()) {
+      LeafNode* leaf = AsLeaf(node);
+      int begin = SearchNode(leaf, lo);
+      int end = SearchNode(leaf, hi);
+      UnindexKeys(leaf, begin, end);
+      for (int i = begin; i < end; ++i) DestroyValue(leaf, i);
+      MoveValues(leaf, begin, end, leaf->num_values - end);
+      leaf->num_values -= end - begin;
+      return end - begin;
+    }
+
+    InternalNode* internal = AsInternal(node);
+    int first = SearchNode(internal, lo);
+    if (first == internal->num_values) return 0;
+    int last = SearchNode(internal, hi);
+    if (last == internal->num_values) --last;
+    int64_t removed = 0;
+    if (last - first > 1) {
+      // Every key under the children in between is in the range. Link the leaves on
+      // either side of them and drop them. The leaves stay at the edges of first and
+      // last whatever the recursion below removes, see RebalanceChildren().
+      LeafNode* left = RightmostLeaf(GetChildNode(internal, first));
+      LeafNode* right = LeftmostLeaf(GetChildNode(internal, last));
+      if (HASH_INDEX) {
+        for (LeafNode* leaf = left->next; leaf != right; leaf = leaf->next) {
+          UnindexKeys(leaf, 0, leaf->num_values);
+        }
+      }
+      left->next = right;
+      right->prev = left;
+      for (int i = first + 1; i < last; ++i) removed += Delete(GetChildNode(internal, i));
+      MoveValues(internal, first + 1, last, internal->num_values - last);
+      internal->num_values -= last - first - 1;
+      last = first + 1;
+    }
+    for (int i = first; i <= last; ++i) {
+      removed += RemoveRangeInNode(UnshareChild(internal, i), lo, hi);
+    }
+    RebalanceChildren(internal, first, last);
+    return removed;
+  }
+
+  // Children first to last of parent lost values to RemoveRangeInNode(). Drops the ones
+  // left empty, which unlinks empty leaves, refills the ones left too small and updates
+  // the separators and counts of the rest.
+  void RebalanceChildren(InternalNode* parent, int first, int last) {
+    for (int i = last; i >= first; --i) {
+      Node* child = GetChildNode(parent, i);
+      if (child->num_values > 0) {
+        ResetChildEntry(parent, i);
+        continue;
+      }
+      Count(&counters_.merges);
+      if (child->is_leaf()) RemoveNode(AsLeaf(child));
+      FreeNode(child);
+      MoveValues(parent, i, i + 1, parent->num_values - i - 1);
+      --parent->num_values;
+      --last;
+    }
+    // The right one goes first and merges into or borrows from the left one, which stays
+    // at first unless the merged node has to merge further left. It is refilled then.
+    for (int i = last; i >= first; --i) {
+      if (i >= parent->num_values) continue;
+      Node* child = GetChildNode(parent, i);
+      if (child->num_values < MinValues(child)) RefillChild(parent, i);
+    }
+  }
+
+  // Brings child idx of parent up to its minimum. See RefillNode().
+  void RefillChild(InternalNode* parent, int idx) {
+    if (GetChildNode(parent, idx)->is_leaf()) {
+      RefillNode<LeafNode>(parent, idx);
+    } else {
+      RefillNode<InternalNode>(parent, idx);
+    }
+  }
+
+  // Brings child idx of parent, which is too small, up to its minimum by merging it
+  // with its siblings or moving their values over. Unlike RebalanceNode(), the child can
+  // be any number of values short, and parent is left for the caller to fix. If parent
+  // has no other children, the child stays too small.
+  //
+  // A child of a node that was too small can be too small too, if it was the only child
+  // then and could not be refilled. It has siblings now, and is refilled in turn.
+  // Merging it can leave the node too small again, so this repeats until neither is.
+  template<typename NodeType>
+  void RefillNode(InternalNode* parent, int idx) {
+    NodeType* node = static_cast<NodeType*>(GetChildNode(parent, idx));
+    const int min_values = MinValues(node);
+    do {
+      RefillFromSiblings(parent, &node, &idx, min_values);
+    } while (node->is_internal() && RefillChildren(AsInternal(node)));
+    ResetChildEntry(parent, idx);
+  }
+
+  // Merges *node, child *idx of parent, with its siblings or moves their values over
+  // until it has min_values or is the only child, and updates node and idx.
+  template<typename NodeType>
+  void RefillFromSiblings(InternalNode* parent, NodeType** node_ptr, int* idx_ptr,
+      int min_values) {
+    NodeType* node = *node_ptr;
+    int idx = *idx_ptr;
+    while (node->num_values < min_values && parent->num_values > 1) {
+      int sibling_idx = idx > 0 ? idx - 1 : idx + 1;
+      NodeType* sibling = static_cast<NodeType*>(UnshareChild(parent, sibling_idx));
+      if (node->num_values + sibling->num_values <= NodeType::CAPACITY) {
+        // Merge the right one of the two into the left one, which takes over the
+        // right one's entry in parent.
+        Count(&counters_.merges);
+        int left_idx = idx < sibling_idx ? idx : sibling_idx;
+        NodeType* left = idx < sibling_idx ? node : sibling;
+        NodeType* right = idx < sibling_idx ? sibling : node;
+        CopyValues(left, left->num_values, right, 0, right->num_values);
+        left->num_values += right->num_values;
+        parent->values[left_idx + 1] = left;
+        MergeCount(parent, left_idx, left_idx + 1);
+        RemoveNode(right);
+        FreeNode(right);
+        MoveValues(parent, left_idx, left_idx + 1, parent->num_values - left_idx - 1);
+        --parent->num_values;
+        node = left;
+        idx = left_idx;
+      } else {
+        // The two do not fit in one node, so the sibling keeps more than
+        // CAPACITY - min_values >= min_values after giving up the values.
+        int n = min_values - node->num_values;
+        Count(&counters_.borrows, n);
+        if (sibling_idx < idx) {
+          MoveValues(node, n, 0, node->num_values);
+          CopyValues(node, 0, sibling, sibling->num_values - n, n);
+        } else {
+          CopyValues(node, node->num_values, sibling, 0, n);
+          MoveValues(sibling, 0, n, sibling->num_values - n);
+        }
+        node->num_values += n;
+        sibling->num_values -= n;
+        ResetChildEntry(parent, sibling_idx);
+      }
+    }
+    *node_ptr = node;
+    *idx_ptr = idx;
+  }
+
+  // Refills the children of node that are too small. Returns whether there were any.
+  bool RefillChildren(InternalNode* node) {
+    bool refilled = false;
+    for (int i = 0; i < node->num_values && node->num_values > 1; ++i) {
+      Node* child = GetChildNode(node, i);
+      if (child->num_values >= MinValues(child)) continue;
+      RefillChild(node, i);
+      refilled = true;
+      // Merges shift the children, so start over.
+      i = -1;
+    }
+    return refilled;
+  }
+
+  // Whether a snapshot may share node, in which case the tree must not change it.
+  // Snapshots share exactly the nodes created in their generation or before that are
+  // still in the tree.
+  bool IsShared(const Node* node) const {
+    return static_cast<int64_t>(node->gen) <= max_snapshot_gen_;
+  }
+
+  // Makes the nodes on path and leaf safe to change, replacing any that a snapshot
+  // shares with a copy. Returns the leaf to change and updates path to the copies.
+  // Once a node is shared all the nodes below it are too, so the copies are always a
+  // suffix of the path.
+  LeafNode* UnsharePath(Path* path, LeafNode* leaf) {
+    if (max_snapshot_gen_ < 0 || !IsShared(leaf)) return leaf;
+    if (path->depth == 0) {
+      root_ = CopyNode(leaf);
+      return AsLeaf(root_);
+    }
+    if (IsShared(root_)) root_ = CopyNode(AsInternal(root_));
+    path->nodes[0] = AsInternal(root_);
+    for (int d = 1; d < path->depth; ++d) {
+      path->nodes[d] = AsInternal(UnshareChild(path->nodes[d - 1], path->idx[d - 1]));
+    }
+    return AsLeaf(UnshareChild(path->nodes[path->depth - 1], path->idx[path->depth - 1]));
+  }
+
+  // Returns child idx of parent, first replacing it with a copy if a snapshot shares
+  // it. parent must not be shared.
+  Node* UnshareChild(InternalNode* parent, int idx) {
+    assert(!IsShared(parent));
+    Node* child = GetChildNode(parent, idx);
+    if (!IsShared(child)) return child;
+    if (child->is_leaf()) {
+      child = CopyNode(AsLeaf(child));
+    } else {
+      child = CopyNode(AsInternal(child));
+    }
+    parent->values[idx] = child;
+    return child;
+  }
+
+  // Copies a node shared by snapshots for the tree to change, and retires the
+  // original. The copy of a leaf owns copies of the values that are not stored inline
+  // and takes the original's place in the leaf list. The snapshots never follow the
+  // sibling links, so the neighbors are relinked even if they are shared.
+  LeafNode* CopyNode(LeafNode* node) {
+    LeafNode* copy = NewNode<LeafNode>();
+    copy->num_values = node->num_values;
+    memcpy(copy->keys, node->keys, node->num_values * sizeof(Key));
+    for (int i = 0; i < node->num_values; ++i) {
+      copy->values[i] = Storage::NEEDS_DESTROY ?
+          Storage::Make(Storage::Get(node->values[i])) : node->values[i];
+    }
+    IndexKeys(copy, 0, copy->num_values);
+    copy->prev = node->prev;
+    copy->next = node->next;
+    if (copy->prev != NULL) copy->prev->next = copy;
+    if (copy->next != NULL) copy->next->prev = copy;
+    RetireNode(node);
+    return copy;
+  }
+
+  InternalNode* CopyNode(InternalNode* node) {
+    InternalNode* copy = NewNode<InternalNode>();
+    copy->num_values = node->num_values;
+    CopyValues(copy, 0, node, 0, node->num_values);
+    RetireNode(node);
+    return copy;
+  }
+
+  // Takes node, which snapshots share, out of the tree. It is freed once the last
+  // snapshot that can see it is destroyed: one taken in the generation node was
+  // created in or later, and before now. The node still owns its values.
+  void RetireNode(Node* node) {
+    assert(IsShared(node));
+    RetiredNode retired = { node, gen_ };
+    retired_.push_back(retired);
+  }
+
+  void ReleaseSnapshot(uint32_t gen) {
+    snapshot_gens_.erase(snapshot_gens_.find(gen));
+    max_snapshot_gen_ =
+        snapshot_gens_.empty() ? -1 : static_cast<int64_t>(*snapshot_gens_.rbegin());
+    size_t kept = 0;
+    for (size_t i = 0; i < retired_.size(); ++i) {
+      const RetiredNode& retired = retired_[i];
+      std::multiset<uint32_t>::const_iterator it =
+          snapshot_gens_.lower_bound(retired.node->gen);
+      if (it != snapshot_gens_.end() && *it < retired.retired_gen) {
+        retired_[kept++] = retired;
+      } else {
+        FreeNodeAndValues(retired.node);
+      }
+    }
+    retired_.resize(kept);
+  }
+
+  // Frees a node that is no longer in the tree or in any snapshot.
+  void FreeNodeAndValues(Node* node) {
+    if (node->is_leaf()) {
+      for (int i = 0; i < node->num_values; ++i) {
+        DestroyValue(AsLeaf(node), i);
+      }
+    }
+    FreeNode(node);
+  }
+
+  // Releases every value in the tree by walking the leaf level.
+  void DestroyAllValues() {
+    if (!Storage::NEEDS_DESTROY) return;
+    Node* node = root_;
+    while (node->is_internal()) node = GetChildNode(AsInternal(node), 0);
+    for (LeafNode* leaf = AsLeaf(node); leaf != NULL; leaf = leaf->next) {
+      for (int i = 0; i < leaf->num_values; ++i) {
+        DestroyValue(leaf, i);
+      }
+    }
+  }
+
+  // Depth first traversal to delete the subtree under node. Returns the number of
+  // values it held. Leaves outside the subtree are not unlinked from it, so deleting
+  // less than the entire tree is up to the caller to relink. Nodes that snapshots share
+  // are retired instead.
+  int64_t Delete(Node* node) {
+    int64_t num_values = node->is_leaf() ? node->num_values : 0;
     if (node->is_internal()) {
       for (int i = 0; i < node->num_values; ++i) {
-        Delete(GetChildNode(node, i));
+        num_values += Delete(GetChildNode(AsInternal(node), i));
       }
     }
-    delete node;
+    if (IsShared(node)) {
+      RetireNode(node);
+    } else {
+      FreeNodeAndValues(node);
+    }
+    return num_values;
+  }
+
+  // Deletes the internal nodes of the tree under node but not the leaves, retiring the
+  // ones that snapshots share.
+  void DeleteInternalNodes(Node* node) {
+    if (node->is_leaf()) return;
+    for (int i = 0; i < node->num_values; ++i) {
+      DeleteInternalNodes(GetChildNode(AsInternal(node), i));
+    }
+    if (IsShared(node)) {
+      RetireNode(node);
+    } else {
+      FreeNode(node);
+    }
+  }
+
+  // Adds node, at depth, and the nodes under it to stats.
+  void CollectStats(const Node* node, int depth, BTreeStats* stats) const {
+    if (depth == stats->height) {
+      BTreeStats::Level level = {};
+      stats->levels.push_back(level);
+      ++stats->height;
+    }
+    BTreeStats::Level* level = &stats->levels[depth];
+    int capacity = node->is_leaf() ? LEAF_ORDER : INTERNAL_ORDER;
+    ++level->num_nodes;
+    level->num_values += node->num_values;
+    int bucket = node->num_values * BTreeStats::FILL_BUCKETS / capacity;
+    if (bucket == BTreeStats::FILL_BUCKETS) --bucket;
+    ++level->fill_histogram[bucket];
+    if (node->is_leaf()) {
+      ++stats->num_leaves;
+      stats->bytes_used += sizeof(LeafNode);
+      return;
+    }
+    ++stats->num_internal_nodes;
+    stats->bytes_used += sizeof(InternalNode);
+    for (int i = 0; i < node->num_values; ++i) {
+      CollectStats(GetChildNode(AsInternal(node), i), depth + 1, stats);
+    }
   }
 
   void PrintNode(const Node* node, int level = -1) const {
@@ -471,52 +2259,118 @@ class BTree {
     ss << (node->is_leaf() ? "<" : "[");
     for (int i = 0; i < node->num_values; ++i) {
       if (i != 0) ss << " ";
-      ss << node->values[i].key;
+      if (node->is_leaf()) {
+        ss << AsLeaf(node)->keys[i];
+      } else {
+        ss << AsInternal(node)->keys[i];
+      }
     }
     ss << (node->is_leaf() ? ">" : "]");
     printf("%s\n", ss.str().c_str());
     if (level != -1 && node->is_internal()) {
       for (int i = 0; i < node->num_values; ++i) {
-        PrintNode(GetChildNode(node, i), level + 1);
+        PrintNode(GetChildNode(AsInternal(node), i), level + 1);
       }
     }
   }
 
+  // Runs Validate() after every VALIDATE_EVERY-th change and aborts if it fails.
   void VerifyTreeIntegrity() {
-#ifndef NDEBUG
-    VerifyTreeIntegrity(root_, NULL);
-    Node* node = root_;
-    while (true) {
-      // Verify doubly linked list
-      Node* l = node;
-      Node* prev = NULL;
-      while (l->next != NULL) {
-        assert(l->prev == prev);
-        if (prev != NULL) assert(prev->next == l);
-        prev = l;
-        l = l->next;
-      }
-      if (node->is_leaf()) break;
-      node = node->values[0].node;
+    if (VALIDATE_EVERY == 0) return;
+    if (VALIDATE_EVERY > 1 && ++num_changes_ % VALIDATE_EVERY != 0) return;
+    std::string error;
+    if (!Validate(&error)) {
+      fprintf(stderr, "Invalid BTree: %s\n", error.c_str());
+      abort();
     }
-#endif
   }
 
-  void VerifyTreeIntegrity(Node* node, Node* parent) {
-    if (node != root_) {
-      assert(node->num_values >= ORDER / 2);
-      assert(node->num_values <= ORDER);
+  // What Validate() has seen so far in its walk of the tree.
+  struct ValidateState {
+    // Depth of the leaves.
+    int leaf_depth;
+    const LeafNode* last_leaf;
+    // Largest key so far.
+    const Key* last_key;
+    int64_t num_values;
+  };
+
+  static bool ValidateError(std::string* error, const std::string& message) {
+    if (error != NULL) *error = message;
+    return false;
+  }
+
+  // Fails validation because of problem with node, at depth.
+  bool ValidateError(std::string* error, const Node* node, int depth,
+      const std::string& problem) const {
+    std::string name = node->is_leaf() ? "leaf" : "internal node";
+    name += " at depth " + std::to_string(depth);
+    if (node == root_) name += " (the root)";
+    return ValidateError(error, name + " " + problem);
+  }
+
+  // Validates node, at depth, and the subtree under it. Leaves are visited in key
+  // order, which is where the leaf links and the keys across leaves are checked.
+  bool ValidateNode(const Node* node, int depth, ValidateState* state,
+      std::string* error) const {
+    int order = node->is_leaf() ? LEAF_ORDER : INTERNAL_ORDER;
+    int min_values = node->is_leaf() ? min_leaf_values_ : min_internal_values_;
+    if (node == root_) min_values = node->is_leaf() ? 0 : 2;
+    if (node->num_values < min_values || node->num_values > order) {
+      return ValidateError(error, node, depth, "holds " +
+          std::to_string(node->num_values) + " values, outside [" +
+          std::to_string(min_values) + ", " + std::to_string(order) + "]");
     }
-    if (node->is_internal()) {
-      for (int i = 0; i < node->num_values; ++i) {
-        Node* child = node->values[i].node;
-        if (child->parent != node) {
-          PrintNode(child);
+
+    if (node->is_leaf()) {
+      const LeafNode* leaf = AsLeaf(node);
+      if (state->leaf_depth == -1) state->leaf_depth = depth;
+      if (depth != state->leaf_depth) {
+        return ValidateError(error, node, depth, "is not at the depth of the first leaf");
+      }
+      if (leaf->prev != state->last_leaf) {
+        return ValidateError(error, node, depth, "does not link back to the leaf before");
+      }
+      if (state->last_leaf != NULL && state->last_leaf->next != leaf) {
+        return ValidateError(error, node, depth, "is not the next of the leaf before");
+      }
+      for (int i = 0; i < leaf->num_values; ++i) {
+        if (state->last_key != NULL && !comp_(*state->last_key, leaf->keys[i])) {
+          return ValidateError(error, node, depth,
+              "has key " + std::to_string(i) + " out of order");
+        }
+        state->last_key = &leaf->keys[i];
+        if (HASH_INDEX && index_.Find(leaf->keys[i]) != leaf) {
+          return ValidateError(error, node, depth,
+              "has key " + std::to_string(i) + " that the hash index does not lead to");
         }
-        assert(child->parent == node);
-        VerifyTreeIntegrity(node->values[i].node, node);
       }
+      state->last_leaf = leaf;
+      state->num_values += leaf->num_values;
+      return true;
     }
+
+    const InternalNode* internal = AsInternal(node);
+    for (int i = 0; i < internal->num_values; ++i) {
+      const Node* child = GetChildNode(internal, i);
+      if (IsShared(internal) && !IsShared(child)) {
+        return ValidateError(error, node, depth, "is shared by snapshots but child " +
+            std::to_string(i) + " is not");
+      }
+      int64_t num_values = state->num_values;
+      if (!ValidateNode(child, depth + 1, state, error)) return false;
+      if (SUBTREE_COUNTS && internal->counts[i] != state->num_values - num_values) {
+        return ValidateError(error, node, depth, "has count " + std::to_string(i) +
+            " that is not the number of values under its child");
+      }
+      // Keys within the child are in order, so this also orders the separators.
+      const Key& largest = LargestKey(child);
+      if (comp_(internal->keys[i], largest) || comp_(largest, internal->keys[i])) {
+        return ValidateError(error, node, depth, "has separator " + std::to_string(i) +
+            " that is not the largest key of its child");
+      }
+    }
+    return true;
   }
 
   // Number of values in tree.
@@ -524,6 +2378,42 @@ class BTree {
 
   // Root of the tree. Never NULL.
   Node* root_;
+
+  // Where nodes are allocated from. Either supplied by the caller or owned_pool_.
+  NodeAllocator* allocator_;
+  NodePool* owned_pool_;
+
+  // Nodes other than the root with fewer values are rebalanced. See SetMinFill().
+  int min_leaf_values_;
+  int min_internal_values_;
+
+  // Updated by lookups too. See counters().
+  mutable BTreeCounters counters_;
+
+  // Number of changes, to sample them for VerifyTreeIntegrity().
+  int64_t num_changes_;
+
+  enum { MAX_GEN = (1U << 31) - 1 };
+
+  // A node taken out of the tree while snapshots share it.
+  struct RetiredNode {
+    Node* node;
+    // Generation when it was taken out. Snapshots of this generation do not see it.
+    uint32_t retired_gen;
+  };
+
+  // Generation of new nodes. Every snapshot starts a new one.
+  uint32_t gen_;
+  // Generations of the snapshots that have not been destroyed, and the largest of
+  // them or -1.
+  std::multiset<uint32_t> snapshot_gens_;
+  int64_t max_snapshot_gen_;
+  std::vector<RetiredNode> retired_;
+
+  // Leaf of every key, with HASH_INDEX. Otherwise empty and every call does nothing.
+  HashIndex<Key, LeafNode*, HASH_INDEX> index_;
+
+  Compare comp_;
 };
 
 #endif
@@ -0,0 +1,464 @@
+#ifndef BTREE_COMPRESSED_H
+#define BTREE_COMPRESSED_H
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <sstream>
+#include <vector>
+
+#include "btree.h"
+#include "key_search.h"
+#include "node_allocator.h"
+
+// Layout of the data area of a CompressedBTree leaf: offsets, then values. Outside the
+// class so that its constant expressions can use it.
+template<size_t DATA_BYTES, typename ValueSlot>
+struct CompressedLeafLayout {
+  static constexpr size_t RoundUp(size_t n, size_t multiple) {
+    return (n + multiple - 1) / multiple * multiple;
+  }
+
+  // Values start after the offsets for n keys, aligned for ValueSlot.
+  static constexpr size_t ValuesOffset(int width, int n) {
+    return RoundUp(n * width, alignof(ValueSlot));
+  }
+
+  // Largest n <= max_n such that n offsets of 'width' bytes and n values fit. The
+  // search kernels read offsets in 32 byte blocks, which must stay inside the data.
+  static constexpr int Capacity(int width, int max_n = DATA_BYTES) {
+    return ValuesOffset(width, max_n) + max_n * sizeof(ValueSlot) <= DATA_BYTES &&
+        RoundUp(max_n * width, 32) <= DATA_BYTES ? max_n : Capacity(width, max_n - 1);
+  }
+};
+
+// B+ tree for int64_t keys with compressed leaves, for dense keys such as ids that
+// share their high bits within a leaf.
+//
+// A leaf stores a base key and, for every key, its offset from the base in 1, 2, 4 or 8
+// bytes (frame of reference). The width is picked per leaf, as the smallest that fits
+// the range of keys in it, whenever the leaf is rewritten: on splits, merges and when an
+// insert falls outside the current range. Leaves have a fixed size, so a narrower width
+// means more keys per leaf. Offsets are stored with the sign bit flipped, which makes
+// them signed integers in key order so the leaves are searched with the vector kernels
+// in key_search.h.
+//
+// Leaves are found through an index, a BTree from the fence of each leaf to the leaf.
+// The fence is the smallest key the leaf may hold; the first leaf's fence is the
+// smallest int64_t. Fences only change when leaves are split or merged.
+template<typename Value = void*, size_t LEAF_BYTES = 256>
+class CompressedBTree {
+ private:
+  typedef ValueStorage<Value> Storage;
+  typedef typename Storage::Slot ValueSlot;
+
+  struct Leaf {
+    // Every key in the leaf is >= base.
+    int64_t base;
+    int32_t num_values;
+    // Bytes per offset: 1, 2, 4 or 8.
+    int32_t width;
+    // Offsets, then values.
+    uint8_t data[LEAF_BYTES - 16];
+  };
+
+  typedef BTree<int64_t, Leaf*> Index;
+
+  typedef CompressedLeafLayout<LEAF_BYTES - 16, ValueSlot> Layout;
+
+ public:
+  // Maximum number of values in a leaf for each offset width.
+  enum {
+    LEAF_ORDER_8 = Layout::Capacity(1),
+    LEAF_ORDER_16 = Layout::Capacity(2),
+    LEAF_ORDER_32 = Layout::Capacity(4),
+    LEAF_ORDER_64 = Layout::Capacity(8),
+  };
+  static_assert(sizeof(Leaf) == LEAF_BYTES, "Unexpected leaf layout");
+  static_assert(LEAF_ORDER_64 >= 3, "LEAF_BYTES is too small");
+
+  CompressedBTree() : size_(0), index_(&index_pool_) {
+    Leaf* leaf = NewLeaf();
+    index_.Insert(std::numeric_limits<int64_t>::min(), leaf);
+  }
+
+  ~CompressedBTree() {
+    // Every leaf and index node came from the pools, so only values need freeing.
+    if (!Storage::NEEDS_DESTROY) return;
+    for (typename Index::Iterator it = index_.Begin(); !it.AtEnd(); it.Next()) {
+      Leaf* leaf = it.value();
+      for (int i = 0; i < leaf->num_values; ++i) {
+        Storage::Destroy(&Values(leaf)[i]);
+      }
+    }
+  }
+
+  // Cursor over the values in key order. Any modification to the tree invalidates all
+  // iterators.
+  class Iterator {
+   public:
+    // An iterator at the end.
+    Iterator() : idx_(0) {}
+
+    bool AtEnd() const { return leaf_it_.AtEnd(); }
+
+    int64_t key() const {
+      assert(!AtEnd());
+      return KeyAt(leaf_it_.value(), idx_);
+    }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return Storage::Get(Values(leaf_it_.value())[idx_]);
+    }
+
+    // Moves to the next larger key. The iterator is at the end after the largest key.
+    void Next() {
+      assert(!AtEnd());
+      ++idx_;
+      SkipForward();
+    }
+
+   private:
+    friend class CompressedBTree;
+    Iterator(const typename Index::Iterator& leaf_it, int idx)
+      : leaf_it_(leaf_it), idx_(idx) {
+      SkipForward();
+    }
+
+    // If idx_ is past the values of the leaf, moves to the first value of the next
+    // non-empty leaf.
+    void SkipForward() {
+      while (!leaf_it_.AtEnd() && idx_ >= leaf_it_.value()->num_values) {
+        leaf_it_.Next();
+        idx_ = 0;
+      }
+    }
+
+    typename Index::Iterator leaf_it_;
+    int idx_;
+  };
+
+  Iterator Find(int64_t key) const {
+    typename Index::Iterator leaf_it = FindLeaf(key);
+    int idx = IndexOfKey(leaf_it.value(), key);
+    if (idx == -1) return End();
+    return Iterator(leaf_it, idx);
+  }
+
+  // Returns an iterator to the first key that is >= key.
+  Iterator LowerBound(int64_t key) const {
+    typename Index::Iterator leaf_it = FindLeaf(key);
+    return Iterator(leaf_it, SearchLeaf(leaf_it.value(), key));
+  }
+
+  // Returns an iterator to the smallest key.
+  Iterator Begin() const { return Iterator(index_.Begin(), 0); }
+
+  Iterator End() const { return Iterator(); }
+
+  bool Update(int64_t key, const Value& value) {
+    Leaf* leaf = FindLeaf(key).value();
+    int idx = IndexOfKey(leaf, key);
+    if (idx == -1) return false;
+    Storage::Get(Values(leaf)[idx]) = value;
+    return true;
+  }
+
+  Iterator Insert(int64_t key, const Value& value) {
+    return InsertOrUpsert(key, value, false);
+  }
+
+  Iterator Upsert(int64_t key, const Value& value) {
+    return InsertOrUpsert(key, value, true);
+  }
+
+  bool Remove(int64_t key) {
+    typename Index::Iterator leaf_it = FindLeaf(key);
+    Leaf* leaf = leaf_it.value();
+    int idx = IndexOfKey(leaf, key);
+    if (idx == -1) return false;
+    Storage::Destroy(&Values(leaf)[idx]);
+    MoveEntries(leaf, idx, idx + 1, leaf->num_values - idx - 1);
+    --leaf->num_values;
+    --size_;
+    if (leaf->num_values < Capacity(leaf->width) / 4) MergeWithNeighbor(leaf_it);
+    return true;
+  }
+
+  int64_t size() const { return size_; }
+
+  // Number of leaves.
+  int64_t num_leaves() const { return index_.size(); }
+
+  // Total bytes allocated from the system for leaves and index nodes.
+  int64_t bytes_reserved() const {
+    return leaf_pool_.bytes_reserved() + index_pool_.bytes_reserved();
+  }
+
+  void DebugPrint() const {
+    printf("Printing Tree:\n");
+    for (typename Index::Iterator it = index_.Begin(); !it.AtEnd(); it.Next()) {
+      const Leaf* leaf = it.value();
+      std::stringstream ss;
+      ss << it.key() << " (base " << leaf->base << ", width " << leaf->width << "): <";
+      for (int i = 0; i < leaf->num_values; ++i) {
+        if (i != 0) ss << " ";
+        ss << KeyAt(leaf, i);
+      }
+      ss << ">";
+      printf("%s\n", ss.str().c_str());
+    }
+  }
+
+  void CollectAllKeys(std::vector<int64_t>* keys, bool backwards = false) const {
+    keys->clear();
+    for (Iterator it = Begin(); !it.AtEnd(); it.Next()) {
+      keys->push_back(it.key());
+    }
+    if (backwards) std::reverse(keys->begin(), keys->end());
+  }
+
+ private:
+  enum { MAX_LEAF_ORDER = LEAF_ORDER_8 };
+
+  static int Capacity(int width) {
+    switch (width) {
+      case 1: return LEAF_ORDER_8;
+      case 2: return LEAF_ORDER_16;
+      case 4: return LEAF_ORDER_32;
+      default: return LEAF_ORDER_64;
+    }
+  }
+
+  // Smallest offset width that can store offsets in [0, range].
+  static int WidthFor(uint64_t range) {
+    if (range <= 0xFF) return 1;
+    if (range <= 0xFFFF) return 2;
+    if (range <= 0xFFFFFFFF) return 4;
+    return 8;
+  }
+
+  static ValueSlot* Values(Leaf* leaf) {
+    return reinterpret_cast<ValueSlot*>(
+        leaf->data + Layout::ValuesOffset(leaf->width, Capacity(leaf->width)));
+  }
+
+  static const ValueSlot* Values(const Leaf* leaf) {
+    return reinterpret_cast<const ValueSlot*>(
+        leaf->data + Layout::ValuesOffset(leaf->width, Capacity(leaf->width)));
+  }
+
+  // Offsets are stored as T with the sign bit flipped, so that comparing them as signed
+  // integers orders them like the offsets.
+  template<typename T>
+  static T Encode(uint64_t offset) {
+    return static_cast<T>(offset ^ (uint64_t(1) << (sizeof(T) * 8 - 1)));
+  }
+
+  template<typename T>
+  static uint64_t Decode(T stored) {
+    typedef typename std::make_unsigned<T>::type Unsigned;
+    return static_cast<Unsigned>(stored) ^ (uint64_t(1) << (sizeof(T) * 8 - 1));
+  }
+
+  template<typename T>
+  static int64_t KeyAt(const Leaf* leaf, int idx) {
+    const T* offsets = reinterpret_cast<const T*>(leaf->data);
+    return static_cast<int64_t>(static_cast<uint64_t>(leaf->base) + Decode(offsets[idx]));
+  }
+
+  static int64_t KeyAt(const Leaf* leaf, int idx) {
+    switch (leaf->width) {
+      case 1: return KeyAt<int8_t>(leaf, idx);
+      case 2: return KeyAt<int16_t>(leaf, idx);
+      case 4: return KeyAt<int32_t>(leaf, idx);
+      default: return KeyAt<int64_t>(leaf, idx);
+    }
+  }
+
+  template<typename T>
+  static void SetKey(Leaf* leaf, int idx, int64_t key) {
+    T* offsets = reinterpret_cast<T*>(leaf->data);
+    offsets[idx] = Encode<T>(static_cast<uint64_t>(key) - static_cast<uint64_t>(leaf->base));
+  }
+
+  static void SetKey(Leaf* leaf, int idx, int64_t key) {
+    switch (leaf->width) {
+      case 1: SetKey<int8_t>(leaf, idx, key); break;
+      case 2: SetKey<int16_t>(leaf, idx, key); break;
+      case 4: SetKey<int32_t>(leaf, idx, key); break;
+      default: SetKey<int64_t>(leaf, idx, key); break;
+    }
+  }
+
+  // Returns the index of the first key in leaf that is >= key.
+  static int SearchLeaf(const Leaf* leaf, int64_t key) {
+    int n = leaf->num_values;
+    if (n == 0 || key < leaf->base) return 0;
+    uint64_t offset = static_cast<uint64_t>(key) - static_cast<uint64_t>(leaf->base);
+    if (leaf->width < 8 && offset >> (leaf->width * 8) != 0) return n;
+    switch (leaf->width) {
+      case 1:
+        return KeyLowerBound(reinterpret_cast<const int8_t*>(leaf->data), n,
+            Encode<int8_t>(offset));
+      case 2:
+        return KeyLowerBound(reinterpret_cast<const int16_t*>(leaf->data), n,
+            Encode<int16_t>(offset));
+      case 4:
+        return KeyLowerBound(reinterpret_cast<const int32_t*>(leaf->data), n,
+            Encode<int32_t>(offset));
+      default:
+        return KeyLowerBound(reinterpret_cast<const int64_t*>(leaf->data), n,
+            Encode<int64_t>(offset));
+    }
+  }
+
+  // Returns the index of key in leaf or -1 if it does not exist.
+  static int IndexOfKey(const Leaf* leaf, int64_t key) {
+    int idx = SearchLeaf(leaf, key);
+    if (idx == leaf->num_values || KeyAt(leaf, idx) != key) return -1;
+    return idx;
+  }
+
+  // Returns the position in the index of the leaf that can contain key: the one with
+  // the largest fence <= key.
+  typename Index::Iterator FindLeaf(int64_t key) const {
+    typename Index::Iterator it = index_.UpperBound(key);
+    if (it.AtEnd()) return index_.Last();
+    it.Prev();
+    return it;
+  }
+
+  // Moves n entries of leaf from src_idx to dst_idx.
+  static void MoveEntries(Leaf* leaf, int dst_idx, int src_idx, int n) {
+    if (n <= 0) return;
+    memmove(leaf->data + dst_idx * leaf->width, leaf->data + src_idx * leaf->width,
+        n * leaf->width);
+    ValueSlot* values = Values(leaf);
+    memmove(&values[dst_idx], &values[src_idx], n * sizeof(ValueSlot));
+  }
+
+  // Copies the keys and values of leaf into keys and values.
+  static void DecodeLeaf(const Leaf* leaf, int64_t* keys, ValueSlot* values) {
+    for (int i = 0; i < leaf->num_values; ++i) {
+      keys[i] = KeyAt(leaf, i);
+    }
+    memcpy(values, Values(leaf), leaf->num_values * sizeof(ValueSlot));
+  }
+
+  // Returns true if the sorted keys[0, n) fit in a single leaf.
+  static bool Fits(const int64_t* keys, int n) {
+    if (n == 0) return true;
+    uint64_t range = static_cast<uint64_t>(keys[n - 1]) - static_cast<uint64_t>(keys[0]);
+    return n <= Capacity(WidthFor(range));
+  }
+
+  // Rewrites leaf with the sorted keys[0, n) and their values, picking the base and
+  // width from the keys. They must fit.
+  static void EncodeLeaf(Leaf* leaf, const int64_t* keys, const ValueSlot* values, int n) {
+    assert(Fits(keys, n));
+    leaf->num_values = n;
+    leaf->base = n == 0 ? 0 : keys[0];
+    leaf->width = n == 0 ? 1 :
+        WidthFor(static_cast<uint64_t>(keys[n - 1]) - static_cast<uint64_t>(keys[0]));
+    for (int i = 0; i < n; ++i) {
+      SetKey(leaf, i, keys[i]);
+    }
+    memcpy(Values(leaf), values, n * sizeof(ValueSlot));
+  }
+
+  // Stores the sorted keys[0, n) and their values in leaf. If they do not fit, they are
+  // split in halves recursively and the upper ones go to new leaves after it.
+  void StoreSplit(Leaf* leaf, const int64_t* keys, const ValueSlot* values, int n) {
+    if (Fits(keys, n)) {
+      EncodeLeaf(leaf, keys, values, n);
+      return;
+    }
+    int half = n / 2;
+    StoreSplit(leaf, keys, values, half);
+    Leaf* right = NewLeaf();
+    index_.Insert(keys[half], right);
+    StoreSplit(right, keys + half, values + half, n - half);
+  }
+
+  Iterator InsertOrUpsert(int64_t key, const Value& value, bool upsert) {
+    typename Index::Iterator leaf_it = FindLeaf(key);
+    Leaf* leaf = leaf_it.value();
+    int idx = SearchLeaf(leaf, key);
+    int n = leaf->num_values;
+    if (idx < n && KeyAt(leaf, idx) == key) {
+      if (!upsert) return End();
+      Storage::Get(Values(leaf)[idx]) = value;
+      return Iterator(leaf_it, idx);
+    }
+    ++size_;
+
+    if (n > 0 && key >= leaf->base && n < Capacity(leaf->width) &&
+        WidthFor(static_cast<uint64_t>(key) - static_cast<uint64_t>(leaf->base)) <=
+            leaf->width) {
+      // Fits in the leaf as it is.
+      MoveEntries(leaf, idx + 1, idx, n - idx);
+      SetKey(leaf, idx, key);
+      Values(leaf)[idx] = Storage::Make(value);
+      ++leaf->num_values;
+      return Iterator(leaf_it, idx);
+    }
+
+    // Rewrite the leaf with a new base or width, splitting it if needed.
+    int64_t keys[MAX_LEAF_ORDER + 1];
+    ValueSlot values[MAX_LEAF_ORDER + 1];
+    DecodeLeaf(leaf, keys, values);
+    memmove(&keys[idx + 1], &keys[idx], (n - idx) * sizeof(int64_t));
+    memmove(&values[idx + 1], &values[idx], (n - idx) * sizeof(ValueSlot));
+    keys[idx] = key;
+    values[idx] = Storage::Make(value);
+    StoreSplit(leaf, keys, values, n + 1);
+    return Find(key);
+  }
+
+  // Called when the leaf at leaf_it is less than a quarter full. Merges it with its
+  // right neighbor, or its left neighbor if it is the last leaf, if the keys of both
+  // fit in one leaf.
+  void MergeWithNeighbor(typename Index::Iterator leaf_it) {
+    typename Index::Iterator left_it = leaf_it;
+    typename Index::Iterator right_it = leaf_it;
+    right_it.Next();
+    if (right_it.AtEnd()) {
+      left_it.Prev();
+      if (left_it.AtEnd()) return;
+      right_it = leaf_it;
+    }
+    Leaf* left = left_it.value();
+    Leaf* right = right_it.value();
+    int n = left->num_values + right->num_values;
+    if (n > MAX_LEAF_ORDER) return;
+    int64_t keys[MAX_LEAF_ORDER];
+    ValueSlot values[MAX_LEAF_ORDER];
+    DecodeLeaf(left, keys, values);
+    DecodeLeaf(right, keys + left->num_values, values + left->num_values);
+    if (!Fits(keys, n)) return;
+    EncodeLeaf(left, keys, values, n);
+    index_.Remove(right_it.key());
+    leaf_pool_.Free(right, sizeof(Leaf));
+  }
+
+  Leaf* NewLeaf() {
+    Leaf* leaf = reinterpret_cast<Leaf*>(leaf_pool_.Allocate(sizeof(Leaf)));
+    leaf->base = 0;
+    leaf->num_values = 0;
+    leaf->width = 1;
+    return leaf;
+  }
+
+  // Number of values in tree.
+  int64_t size_;
+
+  NodePool leaf_pool_;
+  NodePool index_pool_;
+  Index index_;
+};
+
+#endif
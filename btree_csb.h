@@ -0,0 +1,823 @@
+#ifndef BTREE_CSB_H
+#define BTREE_CSB_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "btree.h"
+#include "key_search.h"
+#include "node_allocator.h"
+
+// Layouts of the separators in a CsbBTree internal node. A layout stores n sorted keys
+// in an array of slots and finds how many of them are smaller than a key, which is the
+// child to descend into. Slot arrays must be padded to a multiple of PAD keys.
+
+// Keys in sorted order, searched with the kernels in key_search.h.
+template<typename Key, typename Compare>
+struct SortedLayout {
+  typedef KeySearch<Key, Compare> Search;
+  enum { PAD = Search::PAD };
+
+  static void Store(Key* slots, const Key* sorted, int n) {
+    memcpy(slots, sorted, n * sizeof(Key));
+  }
+
+  static void Load(const Key* slots, int n, Key* sorted) {
+    memcpy(sorted, slots, n * sizeof(Key));
+  }
+
+  static int LowerBound(const Key* slots, int n, const Key& key, const Compare& comp) {
+    return Search::LowerBound(slots, n, key, comp);
+  }
+};
+
+// Keys in the order of a breadth first walk of a complete binary search tree over them
+// (Eytzinger order): the key in slot k - 1 has its children in slots 2k - 1 and 2k. A
+// search takes one comparison per level without branches. The first levels share a
+// cache line, and the lines of the levels further down are prefetched while the ones
+// above are compared.
+template<typename Key, typename Compare>
+struct EytzingerLayout {
+  enum { PAD = 1 };
+
+  static void Store(Key* slots, const Key* sorted, int n) {
+    StoreSubtree(slots, sorted, n, 1, 0);
+  }
+
+  static void Load(const Key* slots, int n, Key* sorted) {
+    LoadSubtree(slots, n, 1, sorted, 0);
+  }
+
+  static int LowerBound(const Key* slots, int n, const Key& key, const Compare& comp) {
+    // Go left at keys >= key and right at smaller ones until k falls off the tree.
+    // The n + 1 places where it can, k in [n + 1, 2n + 1], are the gaps between the
+    // keys. In key order the gaps on the deepest level come first, k >= 2^depth, then
+    // the ones a level up.
+    int k = 1;
+    while (k <= n) {
+      // The keys four levels down start at slot 16k - 1.
+      __builtin_prefetch(slots + 16 * k - 1);
+      k = 2 * k + comp(slots[k - 1], key);
+    }
+    int deepest = 1 << (31 - __builtin_clz(2 * n + 1));
+    return k >= deepest ? k - deepest : k + n + 1 - deepest;
+  }
+
+ private:
+  // Fills the subtree from slot k - 1 with sorted[i...] in key order. Returns the index
+  // of the first key left.
+  static int StoreSubtree(Key* slots, const Key* sorted, int n, int k, int i) {
+    if (k > n) return i;
+    i = StoreSubtree(slots, sorted, n, 2 * k, i);
+    slots[k - 1] = sorted[i++];
+    return StoreSubtree(slots, sorted, n, 2 * k + 1, i);
+  }
+
+  static int LoadSubtree(const Key* slots, int n, int k, Key* sorted, int i) {
+    if (k > n) return i;
+    i = LoadSubtree(slots, n, 2 * k, sorted, i);
+    sorted[i++] = slots[k - 1];
+    return LoadSubtree(slots, n, 2 * k + 1, sorted, i);
+  }
+};
+
+// B+ tree with cache sensitive internal nodes (CSB+ tree).
+//
+// The children of an internal node are allocated together, NODE_BYTES apart in one
+// node group, and the node keeps a single pointer to the group instead of a pointer
+// per child. Without the pointers, internal nodes hold about twice as many separators
+// as in BTree, so the tree is lower and a lookup misses the cache on fewer levels.
+// Splits and merges pay for it: adding or dropping a child copies its siblings to a
+// new group, and splitting an internal node splits the group of its children.
+//
+// As in StringBTree, separator i of an internal node is >= every key under child i and
+// < every key under child i + 1, and the last child has no separator. Separators are
+// only set by splits and merges. InternalLayout picks how a node stores them, see
+// SortedLayout and EytzingerLayout above.
+//
+// The leaves of a group are in key order and linked to their neighbors in both
+// directions, across groups too. The links into a group are fixed whenever it moves.
+// Full nodes are split on the way down to insert, so the parent of a leaf always has
+// room for another child. A node that drops below a quarter full is merged with a
+// neighbor if both fit in one node, and shares their values evenly otherwise.
+template<typename Key = int64_t, typename Value = void*,
+    typename Compare = std::less<Key>, size_t NODE_BYTES = 256,
+    template<typename, typename> class InternalLayout = SortedLayout>
+class CsbBTree {
+ private:
+  typedef KeySearch<Key, Compare> Search;
+  typedef InternalLayout<Key, Compare> Layout;
+  typedef ValueStorage<Value> Storage;
+  typedef typename Storage::Slot ValueSlot;
+
+  // Fields shared by leaf and internal nodes.
+  struct Node {
+    // Values of a leaf, separators of an internal node.
+    int32_t num_values;
+    // 0 for leaves. Children are one level below their parent.
+    int32_t level;
+  };
+
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys must be trivially copyable");
+
+ public:
+  // Maximum number of values in a leaf and of children of an internal node. The key
+  // arrays are padded for the searches, which takes up to PAD - 1 keys of room.
+  enum {
+    LEAF_ORDER = (NODE_BYTES - sizeof(Node) - 2 * sizeof(Node*) -
+        (Search::PAD - 1) * sizeof(Key)) / (sizeof(Key) + sizeof(ValueSlot)),
+    INTERNAL_ORDER = (NODE_BYTES - sizeof(Node) - sizeof(uint8_t*) -
+        (Layout::PAD - 1) * sizeof(Key)) / sizeof(Key) + 1,
+  };
+  // Non-root nodes keep a quarter of their capacity, so internal ones at least two
+  // children.
+  static_assert(LEAF_ORDER >= 4 && INTERNAL_ORDER >= 5, "NODE_BYTES is too small");
+
+ private:
+  enum {
+    PADDED_LEAF_ORDER = (LEAF_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+    MAX_KEYS = INTERNAL_ORDER - 1,
+    PADDED_MAX_KEYS = (MAX_KEYS + Layout::PAD - 1) / Layout::PAD * Layout::PAD,
+    MIN_LEAF_VALUES = LEAF_ORDER / 4,
+    MIN_KEYS = MAX_KEYS / 4,
+    MAX_HEIGHT = 64,
+  };
+
+  struct LeafNode : public Node {
+    LeafNode* prev;
+    LeafNode* next;
+    Key keys[PADDED_LEAF_ORDER];
+    ValueSlot values[LEAF_ORDER];
+  };
+
+  struct InternalNode : public Node {
+    // Group of the num_values + 1 children.
+    uint8_t* children;
+    // Separators, in the order of Layout.
+    Key keys[PADDED_MAX_KEYS];
+  };
+
+  static_assert(sizeof(LeafNode) <= NODE_BYTES && sizeof(InternalNode) <= NODE_BYTES,
+      "Nodes overflow");
+  static_assert(NODE_BYTES % alignof(LeafNode) == 0 &&
+      NODE_BYTES % alignof(InternalNode) == 0, "Nodes in a group are misaligned");
+
+ public:
+  explicit CsbBTree(const Compare& comp = Compare()) : size_(0), comp_(comp) {
+    root_ = reinterpret_cast<Node*>(NewGroup(1));
+    LeafNode* root = AsLeaf(root_);
+    root->num_values = 0;
+    root->level = 0;
+    root->prev = NULL;
+    root->next = NULL;
+  }
+
+  ~CsbBTree() {
+    // Every group came from the pool, so only values need freeing.
+    if (!Storage::NEEDS_DESTROY) return;
+    for (LeafNode* leaf = LeftmostLeaf(); leaf != NULL; leaf = leaf->next) {
+      for (int i = 0; i < leaf->num_values; ++i) {
+        Storage::Destroy(&leaf->values[i]);
+      }
+    }
+  }
+
+  // Cursor over the values in key order. Any modification to the tree invalidates all
+  // iterators.
+  class Iterator {
+   public:
+    // An iterator at the end.
+    Iterator() : leaf_(NULL), idx_(0) {}
+
+    bool AtEnd() const { return leaf_ == NULL; }
+
+    const Key& key() const {
+      assert(!AtEnd());
+      return leaf_->keys[idx_];
+    }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return Storage::Get(leaf_->values[idx_]);
+    }
+
+    // Moves to the next larger key. The iterator is at the end after the largest key.
+    void Next() {
+      assert(!AtEnd());
+      ++idx_;
+      SkipForward();
+    }
+
+   private:
+    friend class CsbBTree;
+    Iterator(const LeafNode* leaf, int idx) : leaf_(leaf), idx_(idx) { SkipForward(); }
+
+    // If idx_ is past the values of the leaf, moves to the first value of the next
+    // non-empty leaf.
+    void SkipForward() {
+      while (leaf_ != NULL && idx_ >= leaf_->num_values) {
+        leaf_ = leaf_->next;
+        idx_ = 0;
+      }
+    }
+
+    const LeafNode* leaf_;
+    int idx_;
+  };
+
+  Iterator Find(const Key& key) const {
+    const LeafNode* leaf = FindLeaf(key, NULL);
+    int idx = IndexOfKey(leaf, key);
+    if (idx == -1) return End();
+    return Iterator(leaf, idx);
+  }
+
+  // Returns an iterator to the first key that is >= key.
+  Iterator LowerBound(const Key& key) const {
+    const LeafNode* leaf = FindLeaf(key, NULL);
+    return Iterator(leaf, SearchLeaf(leaf, key));
+  }
+
+  // Returns an iterator to the smallest key.
+  Iterator Begin() const { return Iterator(LeftmostLeaf(), 0); }
+
+  Iterator End() const { return Iterator(); }
+
+  bool Update(const Key& key, const Value& value) {
+    LeafNode* leaf = FindLeaf(key, NULL);
+    int idx = IndexOfKey(leaf, key);
+    if (idx == -1) return false;
+    Storage::Get(leaf->values[idx]) = value;
+    return true;
+  }
+
+  // Inserts key with value if the key is not in the tree. Returns an iterator to the
+  // new value, or End() if the key already exists.
+  Iterator Insert(const Key& key, const Value& value) {
+    return InsertOrUpsert(key, value, false);
+  }
+
+  // Inserts key with value, or replaces the value if the key exists. Returns an
+  // iterator to the value.
+  Iterator Upsert(const Key& key, const Value& value) {
+    return InsertOrUpsert(key, value, true);
+  }
+
+  bool Remove(const Key& key) {
+    Path path;
+    path.depth = 0;
+    LeafNode* leaf = FindLeaf(key, &path);
+    int idx = IndexOfKey(leaf, key);
+    if (idx == -1) return false;
+    Storage::Destroy(&leaf->values[idx]);
+    MoveValues(leaf, idx, idx + 1, leaf->num_values - idx - 1);
+    --leaf->num_values;
+    --size_;
+    // Rebalancing the children of a node moves them, but not the node itself, so the
+    // nodes on the path above stay where they are.
+    for (int d = path.depth - 1; d >= 0; --d) {
+      const Node* child = Child(path.nodes[d], path.idx[d]);
+      if (child->num_values >= MinValues(child)) break;
+      Rebalance(path.nodes[d], path.idx[d]);
+    }
+    // A root with a single child is replaced by it. That child is a group of one.
+    while (root_->level > 0 && root_->num_values == 0) {
+      Node* root = root_;
+      root_ = Child(AsInternal(root), 0);
+      FreeGroup(reinterpret_cast<uint8_t*>(root), 1);
+    }
+    return true;
+  }
+
+  int64_t size() const { return size_; }
+
+  // Number of levels. A tree that is a single leaf has height 1.
+  int height() const { return root_->level + 1; }
+
+  // Total bytes allocated from the system for nodes.
+  int64_t bytes_reserved() const { return pool_.bytes_reserved(); }
+
+  // Checks the structure of the tree:
+  //  - keys increase within every node and from each leaf to the next
+  //  - every key is <= the separator after it and > the one before it
+  //  - every node but the root holds between a quarter of its capacity and its
+  //    capacity, and an internal root at least one separator
+  //  - every child is one level below its parent, and the leaves are linked in key
+  //    order in both directions
+  //  - size() is the number of values in the leaves
+  // Returns false at the first problem and describes it in error if that is not NULL.
+  bool Validate(std::string* error = NULL) const {
+    ValidateState state = { NULL, NULL, 0 };
+    if (!ValidateNode(root_, NULL, NULL, &state, error)) return false;
+    if (state.last_leaf->next != NULL) {
+      return ValidateError(error, "the last leaf has a next leaf");
+    }
+    if (state.num_values != size_) {
+      return ValidateError(error, "size() is " + std::to_string(size_) +
+          " but the leaves hold " + std::to_string(state.num_values) + " values");
+    }
+    return true;
+  }
+
+  void DebugPrint() const {
+    printf("Printing Tree:\n");
+    PrintNode(root_);
+  }
+
+  void CollectAllKeys(std::vector<Key>* keys, bool backwards = false) const {
+    keys->clear();
+    for (Iterator it = Begin(); !it.AtEnd(); it.Next()) {
+      keys->push_back(it.key());
+    }
+    if (backwards) std::reverse(keys->begin(), keys->end());
+  }
+
+ private:
+  // Internal nodes on the way from the root to a leaf, and the child taken in each.
+  struct Path {
+    InternalNode* nodes[MAX_HEIGHT];
+    int idx[MAX_HEIGHT];
+    int depth;
+
+    void Push(InternalNode* node, int i) {
+      assert(depth < MAX_HEIGHT);
+      nodes[depth] = node;
+      idx[depth] = i;
+      ++depth;
+    }
+  };
+
+  struct ValidateState {
+    const LeafNode* last_leaf;
+    // Largest key so far.
+    const Key* last_key;
+    int64_t num_values;
+  };
+
+  static LeafNode* AsLeaf(Node* node) { return static_cast<LeafNode*>(node); }
+  static const LeafNode* AsLeaf(const Node* node) {
+    return static_cast<const LeafNode*>(node);
+  }
+  static InternalNode* AsInternal(Node* node) { return static_cast<InternalNode*>(node); }
+  static const InternalNode* AsInternal(const Node* node) {
+    return static_cast<const InternalNode*>(node);
+  }
+
+  static Node* NodeAt(uint8_t* group, int i) {
+    return reinterpret_cast<Node*>(group + i * NODE_BYTES);
+  }
+  static LeafNode* LeafAt(uint8_t* group, int i) { return AsLeaf(NodeAt(group, i)); }
+
+  static Node* Child(const InternalNode* node, int i) {
+    assert(i <= node->num_values);
+    return NodeAt(node->children, i);
+  }
+
+  static int MinValues(const Node* node) {
+    return node->level == 0 ? MIN_LEAF_VALUES : MIN_KEYS;
+  }
+
+  uint8_t* NewGroup(int n) {
+    return static_cast<uint8_t*>(pool_.Allocate(n * NODE_BYTES));
+  }
+
+  void FreeGroup(uint8_t* group, int n) { pool_.Free(group, n * NODE_BYTES); }
+
+  LeafNode* LeftmostLeaf() const {
+    Node* node = root_;
+    while (node->level > 0) node = Child(AsInternal(node), 0);
+    return AsLeaf(node);
+  }
+
+  // Returns the index of the child of node whose subtree can hold key.
+  int ChildIndex(const InternalNode* node, const Key& key) const {
+    return Layout::LowerBound(node->keys, node->num_values, key, comp_);
+  }
+
+  // Returns the leaf that can hold key. If path is not NULL, the internal nodes on the
+  // way are recorded in it.
+  LeafNode* FindLeaf(const Key& key, Path* path) const {
+    Node* node = root_;
+    while (node->level > 0) {
+      InternalNode* internal = AsInternal(node);
+      int i = ChildIndex(internal, key);
+      if (path != NULL) path->Push(internal, i);
+      node = Child(internal, i);
+    }
+    return AsLeaf(node);
+  }
+
+  // Returns the index of the first key in leaf that is >= key.
+  int SearchLeaf(const LeafNode* leaf, const Key& key) const {
+    return Search::LowerBound(leaf->keys, leaf->num_values, key, comp_);
+  }
+
+  // Returns the index of key in leaf or -1 if it does not exist.
+  int IndexOfKey(const LeafNode* leaf, const Key& key) const {
+    int i = SearchLeaf(leaf, key);
+    if (i == leaf->num_values || comp_(key, leaf->keys[i])) return -1;
+    return i;
+  }
+
+  static void MoveValues(LeafNode* leaf, int dst_idx, int src_idx, int n) {
+    if (n <= 0) return;
+    memmove(&leaf->keys[dst_idx], &leaf->keys[src_idx], n * sizeof(Key));
+    memmove(&leaf->values[dst_idx], &leaf->values[src_idx], n * sizeof(ValueSlot));
+  }
+
+  static void CopyValues(LeafNode* dst, int dst_idx, const LeafNode* src, int src_idx,
+      int n) {
+    memcpy(&dst->keys[dst_idx], &src->keys[src_idx], n * sizeof(Key));
+    memcpy(&dst->values[dst_idx], &src->values[src_idx], n * sizeof(ValueSlot));
+  }
+
+  Iterator InsertOrUpsert(const Key& key, const Value& value, bool upsert) {
+    if (root_->level > 0 && root_->num_values == MAX_KEYS) SplitRoot();
+    InternalNode* parent = NULL;
+    int idx = 0;
+    Node* node = root_;
+    while (node->level > 0) {
+      InternalNode* internal = AsInternal(node);
+      int i = ChildIndex(internal, key);
+      // Full internal nodes are split on the way down, so every parent has room for
+      // the child its own split adds.
+      if (Child(internal, i)->level > 0 && Child(internal, i)->num_values == MAX_KEYS) {
+        SplitChild(internal, i);
+        i = ChildIndex(internal, key);
+      }
+      parent = internal;
+      idx = i;
+      node = Child(internal, i);
+    }
+
+    LeafNode* leaf = AsLeaf(node);
+    int pos = SearchLeaf(leaf, key);
+    if (pos < leaf->num_values && !comp_(key, leaf->keys[pos])) {
+      if (!upsert) return End();
+      Storage::Get(leaf->values[pos]) = value;
+      return Iterator(leaf, pos);
+    }
+    if (leaf->num_values == LEAF_ORDER) {
+      if (parent == NULL) {
+        SplitRoot();
+        parent = AsInternal(root_);
+      } else {
+        SplitChild(parent, idx);
+      }
+      leaf = AsLeaf(Child(parent, ChildIndex(parent, key)));
+      pos = SearchLeaf(leaf, key);
+    }
+    MoveValues(leaf, pos + 1, pos, leaf->num_values - pos);
+    leaf->keys[pos] = key;
+    leaf->values[pos] = Storage::Make(value);
+    ++leaf->num_values;
+    ++size_;
+    return Iterator(leaf, pos);
+  }
+
+  // Adds a level above the root, which is full, and splits the root in two.
+  void SplitRoot() {
+    InternalNode* root = reinterpret_cast<InternalNode*>(NewGroup(1));
+    root->num_values = 0;
+    root->level = root_->level + 1;
+    root->children = reinterpret_cast<uint8_t*>(root_);
+    root_ = root;
+    SplitChild(root, 0);
+  }
+
+  // Splits child i of parent in halves. Parent must have room for another child.
+  void SplitChild(InternalNode* parent, int i) {
+    assert(parent->num_values < MAX_KEYS);
+    OpenChild(parent, i + 1);
+    // The separator for the new child comes last.
+    Node* left = NodeAt(parent->children, i);
+    Node* right = NodeAt(parent->children, i + 1);
+    Key separator;
+    if (left->level == 0) {
+      LeafNode* left_leaf = AsLeaf(left);
+      LeafNode* right_leaf = AsLeaf(right);
+      int keep = left_leaf->num_values / 2;
+      right_leaf->num_values = left_leaf->num_values - keep;
+      CopyValues(right_leaf, 0, left_leaf, keep, right_leaf->num_values);
+      left_leaf->num_values = keep;
+      separator = left_leaf->keys[keep - 1];
+    } else {
+      InternalNode* left_node = AsInternal(left);
+      int n = left_node->num_values;
+      Key keys[MAX_KEYS];
+      Layout::Load(left_node->keys, n, keys);
+      separator = Distribute(left_node, AsInternal(right), keys, n, left_node->children,
+          n + 1, NULL, 0);
+    }
+    InsertSeparator(parent, i, separator);
+  }
+
+  // Child i of parent dropped below its minimum. Merges it with a neighbor if both fit
+  // in one node, and shares their values evenly otherwise.
+  void Rebalance(InternalNode* parent, int i) {
+    // The only child of the root is left for Remove() to make the root.
+    if (parent->num_values == 0) return;
+    int l = i < parent->num_values ? i : i - 1;
+    int r = l + 1;
+    Key separators[MAX_KEYS];
+    Layout::Load(parent->keys, parent->num_values, separators);
+
+    if (parent->level == 1) {
+      LeafNode* left = AsLeaf(Child(parent, l));
+      LeafNode* right = AsLeaf(Child(parent, r));
+      int total = left->num_values + right->num_values;
+      if (total <= LEAF_ORDER) {
+        CopyValues(left, left->num_values, right, 0, right->num_values);
+        left->num_values = total;
+        CloseChild(parent, r);
+        EraseSeparator(parent, l);
+        return;
+      }
+      int keep = total / 2;
+      if (left->num_values > keep) {
+        int n = left->num_values - keep;
+        MoveValues(right, n, 0, right->num_values);
+        CopyValues(right, 0, left, keep, n);
+      } else {
+        int n = keep - left->num_values;
+        CopyValues(left, left->num_values, right, 0, n);
+        MoveValues(right, 0, n, right->num_values - n);
+      }
+      right->num_values = total - keep;
+      left->num_values = keep;
+      SetSeparator(parent, l, left->keys[keep - 1]);
+      return;
+    }
+
+    // The separator between the two goes between their keys.
+    InternalNode* left = AsInternal(Child(parent, l));
+    InternalNode* right = AsInternal(Child(parent, r));
+    int a = left->num_values;
+    int b = right->num_values;
+    int t = a + b + 1;
+    Key keys[2 * MAX_KEYS + 1];
+    Layout::Load(left->keys, a, keys);
+    keys[a] = separators[l];
+    Layout::Load(right->keys, b, keys + a + 1);
+    if (t <= MAX_KEYS) {
+      uint8_t* group = GatherChildren(left->children, a + 1, right->children, b + 1, 0,
+          t + 1);
+      left->children = group;
+      left->num_values = t;
+      Layout::Store(left->keys, keys, t);
+      CloseChild(parent, r);
+      EraseSeparator(parent, l);
+      return;
+    }
+    SetSeparator(parent, l,
+        Distribute(left, right, keys, t, left->children, a + 1, right->children, b + 1));
+  }
+
+  // Spreads the sorted keys[0, t) and the t + 1 children in the groups a, with na of
+  // them, and b over left and right, which get a new group each. Returns the key that
+  // separates left and right, which neither keeps.
+  Key Distribute(InternalNode* left, InternalNode* right, const Key* keys, int t,
+      uint8_t* a, int na, uint8_t* b, int nb) {
+    int m = t / 2;
+    uint8_t* left_group = NewGroup(m + 1);
+    uint8_t* right_group = NewGroup(t - m);
+    CopyChildren(left_group, a, na, b, 0, m + 1);
+    CopyChildren(right_group, a, na, b, m + 1, t - m);
+    if (left->level == 1) {
+      LeafNode* after = b != NULL ? LeafAt(b, nb - 1)->next : LeafAt(a, na - 1)->next;
+      LinkLeaves(LeafAt(a, 0)->prev, after, left_group, m + 1, right_group, t - m);
+    }
+    FreeGroup(a, na);
+    if (b != NULL) FreeGroup(b, nb);
+    left->num_values = m;
+    left->children = left_group;
+    Layout::Store(left->keys, keys, m);
+    right->num_values = t - m - 1;
+    right->level = left->level;
+    right->children = right_group;
+    Layout::Store(right->keys, keys + m + 1, t - m - 1);
+    return keys[m];
+  }
+
+  // Returns a new group with children [from, from + n) of the groups a, with na of
+  // them, and b together, and frees a and b.
+  uint8_t* GatherChildren(uint8_t* a, int na, uint8_t* b, int nb, int from, int n) {
+    uint8_t* group = NewGroup(n);
+    CopyChildren(group, a, na, b, from, n);
+    if (NodeAt(a, 0)->level == 0) {
+      LinkLeaves(LeafAt(a, 0)->prev, LeafAt(b, nb - 1)->next, group, n, NULL, 0);
+    }
+    FreeGroup(a, na);
+    FreeGroup(b, nb);
+    return group;
+  }
+
+  // Copies children [from, from + n) of the groups a, with na of them, and b together
+  // to dst.
+  static void CopyChildren(uint8_t* dst, const uint8_t* a, int na, const uint8_t* b,
+      int from, int n) {
+    for (int i = 0; i < n; ++i) {
+      int c = from + i;
+      const uint8_t* src = c < na ? a + c * NODE_BYTES : b + (c - na) * NODE_BYTES;
+      memcpy(dst + i * NODE_BYTES, src, NODE_BYTES);
+    }
+  }
+
+  // Replaces the children of parent with a copy that has an empty node at idx, on the
+  // level of the others. Leaves the separators to the caller.
+  void OpenChild(InternalNode* parent, int idx) {
+    int n = parent->num_values + 1;
+    uint8_t* old = parent->children;
+    uint8_t* group = NewGroup(n + 1);
+    memcpy(group, old, idx * NODE_BYTES);
+    memcpy(group + (idx + 1) * NODE_BYTES, old + idx * NODE_BYTES,
+        (n - idx) * NODE_BYTES);
+    Node* node = NodeAt(group, idx);
+    node->num_values = 0;
+    node->level = parent->level - 1;
+    if (parent->level == 1) {
+      LinkLeaves(LeafAt(old, 0)->prev, LeafAt(old, n - 1)->next, group, n + 1, NULL, 0);
+    }
+    parent->children = group;
+    FreeGroup(old, n);
+  }
+
+  // Replaces the children of parent with a copy without child idx, whose values must
+  // have moved to a sibling. Leaves the separators to the caller.
+  void CloseChild(InternalNode* parent, int idx) {
+    int n = parent->num_values + 1;
+    assert(n >= 2);
+    uint8_t* old = parent->children;
+    uint8_t* group = NewGroup(n - 1);
+    memcpy(group, old, idx * NODE_BYTES);
+    memcpy(group + idx * NODE_BYTES, old + (idx + 1) * NODE_BYTES,
+        (n - idx - 1) * NODE_BYTES);
+    if (parent->level == 1) {
+      LinkLeaves(LeafAt(old, 0)->prev, LeafAt(old, n - 1)->next, group, n - 1, NULL, 0);
+    }
+    parent->children = group;
+    FreeGroup(old, n);
+  }
+
+  // The leaves between before and after moved to the groups a, with na of them, and
+  // b. Links them in that order, and to before and after.
+  static void LinkLeaves(LeafNode* before, LeafNode* after, uint8_t* a, int na,
+      uint8_t* b, int nb) {
+    LeafNode* last = before;
+    for (int i = 0; i < na + nb; ++i) {
+      LeafNode* leaf = i < na ? LeafAt(a, i) : LeafAt(b, i - na);
+      leaf->prev = last;
+      if (last != NULL) last->next = leaf;
+      last = leaf;
+    }
+    last->next = after;
+    if (after != NULL) after->prev = last;
+  }
+
+  // Separators are rewritten whole, which also suits layouts that do not keep them in
+  // order. They only change when children are split or merged.
+  void InsertSeparator(InternalNode* node, int i, const Key& key) {
+    Key keys[MAX_KEYS];
+    Layout::Load(node->keys, node->num_values, keys);
+    memmove(&keys[i + 1], &keys[i], (node->num_values - i) * sizeof(Key));
+    keys[i] = key;
+    ++node->num_values;
+    Layout::Store(node->keys, keys, node->num_values);
+  }
+
+  void EraseSeparator(InternalNode* node, int i) {
+    Key keys[MAX_KEYS];
+    Layout::Load(node->keys, node->num_values, keys);
+    memmove(&keys[i], &keys[i + 1], (node->num_values - i - 1) * sizeof(Key));
+    --node->num_values;
+    Layout::Store(node->keys, keys, node->num_values);
+  }
+
+  void SetSeparator(InternalNode* node, int i, const Key& key) {
+    Key keys[MAX_KEYS];
+    Layout::Load(node->keys, node->num_values, keys);
+    keys[i] = key;
+    Layout::Store(node->keys, keys, node->num_values);
+  }
+
+  static bool ValidateError(std::string* error, const std::string& message) {
+    if (error != NULL) *error = message;
+    return false;
+  }
+
+  // Fails validation because of problem with node.
+  bool ValidateError(std::string* error, const Node* node, const std::string& problem)
+      const {
+    std::string name = node->level == 0 ? "leaf" : "internal node";
+    name += " at level " + std::to_string(node->level);
+    if (node == root_) name += " (the root)";
+    return ValidateError(error, name + " " + problem);
+  }
+
+  // Validates the subtree under node, whose keys must be > lower and <= upper where
+  // those are not NULL. Leaves are visited in key order.
+  bool ValidateNode(const Node* node, const Key* lower, const Key* upper,
+      ValidateState* state, std::string* error) const {
+    int max_values = node->level == 0 ? static_cast<int>(LEAF_ORDER) : MAX_KEYS;
+    int min_values = node != root_ ? MinValues(node) : node->level == 0 ? 0 : 1;
+    if (node->num_values < min_values || node->num_values > max_values) {
+      return ValidateError(error, node, "holds " + std::to_string(node->num_values) +
+          " values, outside [" + std::to_string(min_values) + ", " +
+          std::to_string(max_values) + "]");
+    }
+
+    if (node->level == 0) {
+      const LeafNode* leaf = AsLeaf(node);
+      if (leaf->prev != state->last_leaf) {
+        return ValidateError(error, node, "does not link back to the leaf before");
+      }
+      if (state->last_leaf != NULL && state->last_leaf->next != leaf) {
+        return ValidateError(error, node, "is not the next of the leaf before");
+      }
+      for (int i = 0; i < leaf->num_values; ++i) {
+        const Key& key = leaf->keys[i];
+        if (state->last_key != NULL && !comp_(*state->last_key, key)) {
+          return ValidateError(error, node, "has key " + std::to_string(i) +
+              " out of order");
+        }
+        if ((lower != NULL && !comp_(*lower, key)) ||
+            (upper != NULL && comp_(*upper, key))) {
+          return ValidateError(error, node, "has key " + std::to_string(i) +
+              " outside its separators");
+        }
+        state->last_key = &key;
+      }
+      state->last_leaf = leaf;
+      state->num_values += leaf->num_values;
+      return true;
+    }
+
+    const InternalNode* internal = AsInternal(node);
+    int n = internal->num_values;
+    Key keys[MAX_KEYS];
+    Layout::Load(internal->keys, n, keys);
+    for (int i = 1; i < n; ++i) {
+      if (!comp_(keys[i - 1], keys[i])) {
+        return ValidateError(error, node, "has separator " + std::to_string(i) +
+            " out of order");
+      }
+    }
+    for (int i = 0; i <= n; ++i) {
+      const Node* child = Child(internal, i);
+      if (child->level != node->level - 1) {
+        return ValidateError(error, node, "has child " + std::to_string(i) +
+            " at level " + std::to_string(child->level));
+      }
+      if (!ValidateNode(child, i == 0 ? lower : &keys[i - 1], i == n ? upper : &keys[i],
+          state, error)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  void PrintNode(const Node* node) const {
+    std::stringstream ss;
+    ss << node->level << ": " << (node->level == 0 ? "<" : "[");
+    if (node->level == 0) {
+      for (int i = 0; i < node->num_values; ++i) {
+        if (i != 0) ss << " ";
+        ss << AsLeaf(node)->keys[i];
+      }
+    } else {
+      Key keys[MAX_KEYS];
+      Layout::Load(AsInternal(node)->keys, node->num_values, keys);
+      for (int i = 0; i < node->num_values; ++i) {
+        if (i != 0) ss << " ";
+        ss << keys[i];
+      }
+    }
+    ss << (node->level == 0 ? ">" : "]");
+    printf("%s\n", ss.str().c_str());
+    if (node->level == 0) return;
+    for (int i = 0; i <= node->num_values; ++i) {
+      PrintNode(Child(AsInternal(node), i));
+    }
+  }
+
+  // Number of values in tree.
+  int64_t size_;
+
+  // Root of the tree, a group of one node. Never NULL.
+  Node* root_;
+
+  // Groups come in as many sizes as internal nodes have children.
+  NodePool pool_;
+
+  Compare comp_;
+};
+
+#endif
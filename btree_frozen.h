@@ -0,0 +1,348 @@
+#ifndef BTREE_FROZEN_H
+#define BTREE_FROZEN_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "key_search.h"
+#include "node_allocator.h"
+
+// Read-only B+ tree packed into arrays, for indexes that are built once and then only
+// searched. See BTree::Freeze().
+//
+// The keys are stored in one sorted array, with the values beside them in another, so
+// a scan reads both in order and every node is full. The array is cut into leaf blocks
+// of B keys, B as many keys as fit in NODE_BYTES. Each level above has one block of B
+// separators per B + 1 blocks below it, and the blocks of all the levels sit in one
+// more array, the root first. Children are found by arithmetic instead of pointers:
+// child j of block i is block i * (B + 1) + j of the level below. Separator j is the
+// largest key under child j, and the last child has none. The tail of the last block
+// of each level is padded with the largest key.
+//
+// Keys must be trivially copyable. The position of a key in the key array is its
+// rank, so Rank(), Select() and CountRange() cost a lookup each.
+template<typename Key = int64_t, typename Value = void*,
+    typename Compare = std::less<Key>, size_t NODE_BYTES = 256,
+    template<typename, typename> class SearchPolicy = KeySearch>
+class FrozenBTree {
+ private:
+  typedef SearchPolicy<Key, Compare> Search;
+
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys must be trivially copyable");
+
+ public:
+  // Keys in a block, rounded down to the padding of the search.
+  enum { BLOCK_KEYS = NODE_BYTES / sizeof(Key) / Search::PAD * Search::PAD };
+  static_assert(BLOCK_KEYS >= 2, "NODE_BYTES is too small");
+
+  // An empty tree.
+  explicit FrozenBTree(const Compare& comp = Compare())
+    : size_(0), keys_(NULL), separators_(NULL), num_separator_blocks_(0), height_(0),
+      comp_(comp) {}
+
+  // Builds the tree from the sorted (key, value) pairs in [begin, end), which must not
+  // have duplicate keys.
+  template<typename ForwardIt>
+  FrozenBTree(ForwardIt begin, ForwardIt end, const Compare& comp = Compare())
+    : FrozenBTree(comp) {
+    Start(std::distance(begin, end));
+    for (int64_t i = 0; begin != end; ++begin, ++i) Set(i, begin->first, begin->second);
+    Finish();
+  }
+
+  // Builds the tree from the first size values from it on. It can be the iterator of
+  // any of the trees: it needs AtEnd(), key(), value() and Next().
+  template<typename TreeIterator>
+  FrozenBTree(TreeIterator it, int64_t size, const Compare& comp = Compare())
+    : FrozenBTree(comp) {
+    Start(size);
+    for (int64_t i = 0; i < size; ++i, it.Next()) {
+      assert(!it.AtEnd());
+      Set(i, it.key(), it.value());
+    }
+    Finish();
+  }
+
+  FrozenBTree(FrozenBTree&& other)
+    : size_(other.size_), keys_(other.keys_), values_(std::move(other.values_)),
+      separators_(other.separators_), num_separator_blocks_(other.num_separator_blocks_),
+      height_(other.height_), comp_(other.comp_) {
+    memcpy(level_begin_, other.level_begin_, sizeof(level_begin_));
+    other.Release();
+  }
+
+  FrozenBTree& operator=(FrozenBTree&& other) {
+    if (this == &other) return *this;
+    Free();
+    size_ = other.size_;
+    keys_ = other.keys_;
+    values_ = std::move(other.values_);
+    separators_ = other.separators_;
+    num_separator_blocks_ = other.num_separator_blocks_;
+    height_ = other.height_;
+    memcpy(level_begin_, other.level_begin_, sizeof(level_begin_));
+    comp_ = other.comp_;
+    other.Release();
+    return *this;
+  }
+
+  FrozenBTree(const FrozenBTree&) = delete;
+  FrozenBTree& operator=(const FrozenBTree&) = delete;
+
+  ~FrozenBTree() { Free(); }
+
+  // Cursor over the values in key order. Moving to the next value is a pointer
+  // increment, so scans run at the speed of the arrays.
+  class Iterator {
+   public:
+    // An iterator at the end.
+    Iterator() : key_(NULL), value_(NULL), end_(NULL) {}
+
+    bool AtEnd() const { return key_ == end_; }
+
+    const Key& key() const {
+      assert(!AtEnd());
+      return *key_;
+    }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return *value_;
+    }
+
+    // Moves to the next larger key. The iterator is at the end after the largest key.
+    void Next() {
+      assert(!AtEnd());
+      ++key_;
+      ++value_;
+    }
+
+   private:
+    friend class FrozenBTree;
+    Iterator(const Key* key, const Value* value, const Key* end)
+      : key_(key), value_(value), end_(end) {}
+
+    const Key* key_;
+    const Value* value_;
+    const Key* end_;
+  };
+
+  Iterator Find(const Key& key) const {
+    int64_t i = IndexOfLowerBound(key);
+    if (i == size_ || comp_(key, keys_[i])) return End();
+    return At(i);
+  }
+
+  // Returns an iterator to the first key that is >= key.
+  Iterator LowerBound(const Key& key) const { return At(IndexOfLowerBound(key)); }
+
+  // Returns an iterator to the first key that is > key.
+  Iterator UpperBound(const Key& key) const {
+    int64_t i = IndexOfLowerBound(key);
+    if (i < size_ && !comp_(key, keys_[i])) ++i;
+    return At(i);
+  }
+
+  // Returns an iterator to the smallest key.
+  Iterator Begin() const { return At(0); }
+
+  Iterator End() const { return At(size_); }
+
+  // Returns the number of keys in [lo, hi).
+  int64_t CountRange(const Key& lo, const Key& hi) const {
+    if (!comp_(lo, hi)) return 0;
+    return IndexOfLowerBound(hi) - IndexOfLowerBound(lo);
+  }
+
+  // Returns the number of keys smaller than key.
+  int64_t Rank(const Key& key) const { return IndexOfLowerBound(key); }
+
+  // Returns an iterator to the key of rank k, the k-th smallest counting from 0, or
+  // End() if there are not that many keys.
+  Iterator Select(int64_t k) const {
+    if (k < 0 || k >= size_) return End();
+    return At(k);
+  }
+
+  int64_t size() const { return size_; }
+
+  // Number of levels. A tree of a single leaf block has height 1.
+  int height() const { return height_ + 1; }
+
+  // Bytes allocated for the keys, values and separators.
+  int64_t bytes() const {
+    return (NumLeafBlocks() + num_separator_blocks_) * BLOCK_KEYS * sizeof(Key) +
+        values_.capacity() * sizeof(Value);
+  }
+
+  // Checks that the keys increase, that the padding repeats the largest key and that
+  // every separator is the largest key under its child, or the largest key of the tree
+  // past the last child. Returns false at the first problem and describes it in error
+  // if that is not NULL.
+  bool Validate(std::string* error = NULL) const {
+    if (static_cast<int64_t>(values_.size()) != size_) {
+      return ValidateError(error, "the tree holds " + std::to_string(size_) +
+          " keys but " + std::to_string(values_.size()) + " values");
+    }
+    int64_t padded_size = NumLeafBlocks() * BLOCK_KEYS;
+    for (int64_t i = 1; i < padded_size; ++i) {
+      if (i < size_ ? !comp_(keys_[i - 1], keys_[i]) :
+          comp_(keys_[i - 1], keys_[i]) || comp_(keys_[i], keys_[i - 1])) {
+        return ValidateError(error, "key " + std::to_string(i) + " is out of order");
+      }
+    }
+    for (int h = 1; h <= height_; ++h) {
+      int64_t end = h == 1 ? num_separator_blocks_ : level_begin_[h - 2];
+      for (int64_t i = 0; i < (end - level_begin_[h - 1]) * BLOCK_KEYS; ++i) {
+        const Key& separator = separators_[level_begin_[h - 1] * BLOCK_KEYS + i];
+        const Key& expected = LargestKeyUnder(h, i / BLOCK_KEYS * (BLOCK_KEYS + 1) +
+            i % BLOCK_KEYS);
+        if (comp_(separator, expected) || comp_(expected, separator)) {
+          return ValidateError(error, "separator " + std::to_string(i) + " of level " +
+              std::to_string(h) + " is not the largest key under its child");
+        }
+      }
+    }
+    return true;
+  }
+
+ private:
+  enum {
+    // Enough levels for 2^63 keys with the smallest blocks.
+    MAX_HEIGHT = 64,
+  };
+
+  // Allocates the leaf blocks for size keys. Set() then fills them in key order and
+  // Finish() packs the levels above.
+  void Start(int64_t size) {
+    size_ = size;
+    if (size_ > 0) keys_ = AllocateKeys(NumLeafBlocks() * BLOCK_KEYS);
+    values_.reserve(size_);
+  }
+
+  void Set(int64_t i, const Key& key, const Value& value) {
+    assert(i == 0 || comp_(keys_[i - 1], key));
+    keys_[i] = key;
+    values_.push_back(value);
+  }
+
+  void Finish() {
+    if (size_ == 0) return;
+    int64_t num_leaf_blocks = NumLeafBlocks();
+    for (int64_t i = size_; i < num_leaf_blocks * BLOCK_KEYS; ++i) {
+      keys_[i] = keys_[size_ - 1];
+    }
+
+    // Sizes of the levels from the bottom, then their places from the top.
+    int64_t num_blocks[MAX_HEIGHT];
+    int64_t blocks_below = num_leaf_blocks;
+    while (blocks_below > 1) {
+      assert(height_ < MAX_HEIGHT);
+      blocks_below = (blocks_below + BLOCK_KEYS) / (BLOCK_KEYS + 1);
+      num_blocks[height_++] = blocks_below;
+    }
+    for (int h = height_; h >= 1; --h) {
+      level_begin_[h - 1] = num_separator_blocks_;
+      num_separator_blocks_ += num_blocks[h - 1];
+    }
+    if (num_separator_blocks_ == 0) return;
+    separators_ = AllocateKeys(num_separator_blocks_ * BLOCK_KEYS);
+    for (int h = 1; h <= height_; ++h) {
+      Key* level = separators_ + level_begin_[h - 1] * BLOCK_KEYS;
+      for (int64_t i = 0; i < num_blocks[h - 1] * BLOCK_KEYS; ++i) {
+        level[i] = LargestKeyUnder(h, i / BLOCK_KEYS * (BLOCK_KEYS + 1) + i % BLOCK_KEYS);
+      }
+    }
+  }
+
+  int64_t NumLeafBlocks() const { return (size_ + BLOCK_KEYS - 1) / BLOCK_KEYS; }
+
+  // Returns the largest key under child c of the level h blocks, which is the largest
+  // key of the tree for the children past the end of the level below.
+  const Key& LargestKeyUnder(int h, int64_t c) const {
+    // Each block of level h - 1 spans span leaf blocks.
+    int64_t span = 1;
+    for (int i = 1; i < h; ++i) span *= BLOCK_KEYS + 1;
+    if (c >= (NumLeafBlocks() + span - 1) / span) return keys_[size_ - 1];
+    int64_t end = (c + 1) * span * BLOCK_KEYS;
+    return keys_[(end < size_ ? end : size_) - 1];
+  }
+
+  // Returns the index of the first key that is >= key, or size() if there is none.
+  int64_t IndexOfLowerBound(const Key& key) const {
+    if (size_ == 0 || comp_(keys_[size_ - 1], key)) return size_;
+    // The padding stops every search at a real child: no key past the largest gets
+    // here.
+    int64_t block = 0;
+    for (int h = height_; h >= 1; --h) {
+      const Key* separators = separators_ + (level_begin_[h - 1] + block) * BLOCK_KEYS;
+      block = block * (BLOCK_KEYS + 1) +
+          Search::LowerBound(separators, BLOCK_KEYS, key, comp_);
+    }
+    const Key* keys = keys_ + block * BLOCK_KEYS;
+    return block * BLOCK_KEYS + Search::LowerBound(keys, BLOCK_KEYS, key, comp_);
+  }
+
+  Iterator At(int64_t i) const {
+    if (i >= size_) return Iterator();
+    return Iterator(keys_ + i, values_.data() + i, keys_ + size_);
+  }
+
+  static Key* AllocateKeys(int64_t n) {
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, NodeAllocator::CACHE_LINE_SIZE, n * sizeof(Key)) != 0) {
+      printf("Out of memory allocating %ld keys.\n", n);
+      abort();
+    }
+    return static_cast<Key*>(ptr);
+  }
+
+  static bool ValidateError(std::string* error, const std::string& message) {
+    if (error != NULL) *error = message;
+    return false;
+  }
+
+  void Free() {
+    free(keys_);
+    free(separators_);
+  }
+
+  // Leaves other empty after its arrays moved out.
+  void Release() {
+    size_ = 0;
+    keys_ = NULL;
+    values_.clear();
+    separators_ = NULL;
+    num_separator_blocks_ = 0;
+    height_ = 0;
+  }
+
+  int64_t size_;
+
+  // The sorted keys, padded to whole blocks.
+  Key* keys_;
+
+  std::vector<Value> values_;
+
+  // The blocks of separators of every level, the root first.
+  Key* separators_;
+  int64_t num_separator_blocks_;
+
+  // Levels of separators above the leaf blocks.
+  int height_;
+
+  // First block of each level, by height above the leaves minus one.
+  int64_t level_begin_[MAX_HEIGHT];
+
+  Compare comp_;
+};
+
+#endif
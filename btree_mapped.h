@@ -0,0 +1,311 @@
+#ifndef BTREE_MAPPED_H
+#define BTREE_MAPPED_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "key_search.h"
+
+// Read-only B+ tree served straight from a memory mapped file.
+//
+// The file is an array of PAGE_SIZE pages and nodes refer to each other by page number
+// rather than by pointer, so the mapping is usable at whatever address it lands.
+// Opening a file maps it and checks its header, nothing more. Pages are read from disk
+// as lookups first touch them.
+//
+// Page 0 is the file header. The leaves follow in key order, each with the page number
+// of the next one, then the internal levels from the bottom up with the root last. Like
+// in BTree, the separators of an internal node are the largest key of each child.
+//
+// Files are written by Save(), usually through BTree::Save(). Keys and values are stored
+// as their bytes, so both must be trivially copyable and a file can only be read on a
+// machine with the same layout. The header records the sizes to catch mismatches. Only
+// the header is checked when opening, so files must come from Save().
+template<typename Key = int64_t, typename Value = void*,
+    typename Compare = std::less<Key>, size_t PAGE_SIZE = 4096>
+class MappedBTree {
+ private:
+  typedef KeySearch<Key, Compare> Search;
+
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Value>::value,
+      "Values must be trivially copyable");
+
+  // Fields shared by leaf and internal pages.
+  struct PageHeader {
+    int32_t is_leaf;
+    int32_t num_values;
+    // Page number of the next leaf or 0 after the last leaf. Unused in internal pages.
+    uint64_t next;
+  };
+
+ public:
+  // Maximum number of values in a leaf and in an internal page. The key arrays are
+  // padded for the search kernels, which takes up to PAD - 1 keys of room.
+  enum {
+    LEAF_ORDER = (PAGE_SIZE - sizeof(PageHeader) - (Search::PAD - 1) * sizeof(Key)) /
+        (sizeof(Key) + sizeof(Value)),
+    INTERNAL_ORDER = (PAGE_SIZE - sizeof(PageHeader) - (Search::PAD - 1) * sizeof(Key)) /
+        (sizeof(Key) + sizeof(uint64_t)),
+  };
+  static_assert(LEAF_ORDER >= 2 && INTERNAL_ORDER >= 2, "PAGE_SIZE is too small");
+
+ private:
+  enum {
+    PADDED_LEAF_ORDER = (LEAF_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+    PADDED_INTERNAL_ORDER = (INTERNAL_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+    FORMAT_VERSION = 1,
+  };
+
+  struct LeafPage : public PageHeader {
+    Key keys[PADDED_LEAF_ORDER];
+    Value values[LEAF_ORDER];
+  };
+
+  struct InternalPage : public PageHeader {
+    // keys[i] is the largest key in the subtree of the page children[i].
+    Key keys[PADDED_INTERNAL_ORDER];
+    uint64_t children[INTERNAL_ORDER];
+  };
+
+  static_assert(sizeof(LeafPage) <= PAGE_SIZE && sizeof(InternalPage) <= PAGE_SIZE,
+      "Pages overflow");
+
+  // Contents of page 0.
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t page_size;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint64_t num_pages;
+    uint64_t root;
+    int64_t size;
+  };
+
+  static const char* Magic() { return "BTREEMAP"; }
+
+ public:
+  // Cursor over the values in key order. It follows the next page numbers of the
+  // leaves.
+  class Iterator {
+   public:
+    // An iterator at the end.
+    Iterator() : tree_(NULL), leaf_(NULL), idx_(0) {}
+
+    bool AtEnd() const { return leaf_ == NULL; }
+
+    const Key& key() const {
+      assert(!AtEnd());
+      return leaf_->keys[idx_];
+    }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return leaf_->values[idx_];
+    }
+
+    // Moves to the next larger key. The iterator is at the end after the largest key.
+    void Next() {
+      assert(!AtEnd());
+      if (++idx_ < leaf_->num_values) return;
+      leaf_ = leaf_->next == 0 ? NULL : tree_->Leaf(leaf_->next);
+      idx_ = 0;
+    }
+
+   private:
+    friend class MappedBTree;
+    Iterator(const MappedBTree* tree, const LeafPage* leaf, int idx)
+      : tree_(tree), leaf_(leaf), idx_(idx) {}
+
+    const MappedBTree* tree_;
+    const LeafPage* leaf_;
+    int idx_;
+  };
+
+  // Writes the pairs that 'it' walks to path. 'it' must return the keys in increasing
+  // order through the interface of BTree::Iterator: AtEnd(), key(), value() and Next().
+  // The file is written front to back in one pass over the pairs. Leaves are filled
+  // completely and only the largest key of every page is kept in memory to build the
+  // levels above. Returns false if the file cannot be written.
+  template<typename PairIterator>
+  static bool Save(const std::string& path, PairIterator it) {
+    FILE* file = fopen(path.c_str(), "wb");
+    if (file == NULL) return false;
+    std::vector<char> page(PAGE_SIZE);
+    // Room for the header, which is written last.
+    memset(page.data(), 0, PAGE_SIZE);
+    bool ok = fwrite(page.data(), PAGE_SIZE, 1, file) == 1;
+    uint64_t num_pages = 1;
+    int64_t size = 0;
+
+    // Largest key and page number of every page on the level last written.
+    std::vector<std::pair<Key, uint64_t>> level;
+    do {
+      memset(page.data(), 0, PAGE_SIZE);
+      LeafPage* leaf = reinterpret_cast<LeafPage*>(page.data());
+      leaf->is_leaf = 1;
+      for (; !it.AtEnd() && leaf->num_values < LEAF_ORDER; it.Next()) {
+        leaf->keys[leaf->num_values] = it.key();
+        leaf->values[leaf->num_values] = it.value();
+        ++leaf->num_values;
+      }
+      size += leaf->num_values;
+      if (!it.AtEnd()) leaf->next = num_pages + 1;
+      // Only the root of an empty tree is an empty leaf.
+      if (leaf->num_values > 0) {
+        level.push_back(std::make_pair(leaf->keys[leaf->num_values - 1], num_pages));
+      }
+      ok = ok && fwrite(page.data(), PAGE_SIZE, 1, file) == 1;
+      ++num_pages;
+    } while (!it.AtEnd());
+
+    while (level.size() > 1) {
+      // Spread the entries evenly over as few pages as possible.
+      std::vector<std::pair<Key, uint64_t>> parents;
+      size_t num_nodes = (level.size() + INTERNAL_ORDER - 1) / INTERNAL_ORDER;
+      size_t begin = 0;
+      for (size_t i = 0; i < num_nodes; ++i) {
+        size_t end = begin + level.size() / num_nodes + (i < level.size() % num_nodes);
+        memset(page.data(), 0, PAGE_SIZE);
+        InternalPage* node = reinterpret_cast<InternalPage*>(page.data());
+        for (size_t j = begin; j < end; ++j) {
+          node->keys[node->num_values] = level[j].first;
+          node->children[node->num_values] = level[j].second;
+          ++node->num_values;
+        }
+        parents.push_back(std::make_pair(level[end - 1].first, num_pages));
+        ok = ok && fwrite(page.data(), PAGE_SIZE, 1, file) == 1;
+        ++num_pages;
+        begin = end;
+      }
+      level.swap(parents);
+    }
+
+    FileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, Magic(), sizeof(header.magic));
+    header.version = FORMAT_VERSION;
+    header.page_size = PAGE_SIZE;
+    header.key_size = sizeof(Key);
+    header.value_size = sizeof(Value);
+    header.num_pages = num_pages;
+    header.root = num_pages - 1;
+    header.size = size;
+    ok = ok && fseek(file, 0, SEEK_SET) == 0;
+    ok = ok && fwrite(&header, sizeof(header), 1, file) == 1;
+    ok = fclose(file) == 0 && ok;
+    return ok;
+  }
+
+  // Maps the file at path, written by Save() with the same key, value and page sizes.
+  // Returns NULL if the file cannot be mapped or does not match.
+  static MappedBTree* OpenMapped(const std::string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(PAGE_SIZE)) {
+      close(fd);
+      return NULL;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    // The mapping stays valid after the file is closed.
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+    const FileHeader* header = static_cast<const FileHeader*>(base);
+    if (memcmp(header->magic, Magic(), sizeof(header->magic)) != 0 ||
+        header->version != FORMAT_VERSION || header->page_size != PAGE_SIZE ||
+        header->key_size != sizeof(Key) || header->value_size != sizeof(Value) ||
+        header->num_pages * PAGE_SIZE != static_cast<uint64_t>(st.st_size) ||
+        header->root == 0 || header->root >= header->num_pages) {
+      munmap(base, st.st_size);
+      return NULL;
+    }
+    return new MappedBTree(base, st.st_size);
+  }
+
+  ~MappedBTree() {
+    munmap(const_cast<char*>(base_), length_);
+  }
+
+  Iterator Find(const Key& key) const {
+    const LeafPage* leaf = FindLeaf(key);
+    if (leaf == NULL) return End();
+    int idx = Search::LowerBound(leaf->keys, leaf->num_values, key, comp_);
+    if (idx == leaf->num_values || comp_(key, leaf->keys[idx])) return End();
+    return Iterator(this, leaf, idx);
+  }
+
+  // Returns an iterator to the first key that is >= key.
+  Iterator LowerBound(const Key& key) const {
+    const LeafPage* leaf = FindLeaf(key);
+    if (leaf == NULL) return End();
+    int idx = Search::LowerBound(leaf->keys, leaf->num_values, key, comp_);
+    if (idx == leaf->num_values) return End();
+    return Iterator(this, leaf, idx);
+  }
+
+  // Returns an iterator to the smallest key.
+  Iterator Begin() const {
+    // The leaves start right after the header.
+    const LeafPage* leaf = Leaf(1);
+    if (leaf->num_values == 0) return End();
+    return Iterator(this, leaf, 0);
+  }
+
+  Iterator End() const { return Iterator(); }
+
+  int64_t size() const { return Header()->size; }
+
+  // Size of the file.
+  size_t bytes_mapped() const { return length_; }
+
+ private:
+  MappedBTree(const void* base, size_t length)
+    : base_(static_cast<const char*>(base)), length_(length) {}
+  MappedBTree(const MappedBTree&) = delete;
+  MappedBTree& operator=(const MappedBTree&) = delete;
+
+  const FileHeader* Header() const {
+    return reinterpret_cast<const FileHeader*>(base_);
+  }
+
+  const PageHeader* Page(uint64_t page) const {
+    assert(page > 0 && page < Header()->num_pages);
+    return reinterpret_cast<const PageHeader*>(base_ + page * PAGE_SIZE);
+  }
+
+  const LeafPage* Leaf(uint64_t page) const {
+    const PageHeader* header = Page(page);
+    assert(header->is_leaf);
+    return static_cast<const LeafPage*>(header);
+  }
+
+  // Returns the leaf that can contain key, or NULL if key is larger than every key.
+  const LeafPage* FindLeaf(const Key& key) const {
+    const PageHeader* page = Page(Header()->root);
+    while (!page->is_leaf) {
+      const InternalPage* node = static_cast<const InternalPage*>(page);
+      int i = Search::LowerBound(node->keys, node->num_values, key, comp_);
+      if (i == node->num_values) return NULL;
+      page = Page(node->children[i]);
+    }
+    return static_cast<const LeafPage*>(page);
+  }
+
+  const char* base_;
+  size_t length_;
+  Compare comp_;
+};
+
+#endif
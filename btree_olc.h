@@ -0,0 +1,694 @@
+#ifndef BTREE_OLC_H
+#define BTREE_OLC_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "epoch.h"
+#include "key_search.h"
+
+// Concurrent B+ tree using optimistic lock coupling (Leis et al., "The ART of
+// Practical Synchronization"). Every node has a version latch:
+//  - Readers never write shared memory. They remember the version of each node before
+//    reading it and check it again afterwards, restarting the operation from the root
+//    if it changed. A reader holds at most two versions (parent and child) at a time.
+//  - Readers load num_keys, keys, values and children with plain reads while a writer
+//    may be moving them (MoveEntries(), the splits). These data races are deliberate:
+//    a torn read is only used if the version check after it passes, and is thrown
+//    away otherwise. num_keys is never stored outside [0, LEAF_ORDER] or
+//    [0, INTERNAL_ORDER], so a stale count never indexes past the arrays.
+//    ThreadSanitizer reports these reads as races.
+//  - Writers descend the same way and only lock the nodes they modify, by upgrading
+//    the version they read. A failed upgrade restarts the operation.
+//  - Full nodes are split on the way down, so a split only ever locks a node and its
+//    parent. Removes merge (or rebalance) an underfull child with its sibling on the
+//    way down in the same way.
+//  - Unlinked nodes are freed through the EpochManager since readers may still be
+//    looking at them.
+//
+// Differences from BTree:
+//  - Internal nodes use the classic layout: n separator keys and n + 1 children, with
+//    every key in children[i] <= keys[i] < every key in children[i + 1]. The largest
+//    key never has to be propagated up, which would need locks on the whole path.
+//  - There are no parent pointers and no sibling links. There is no ordered iteration;
+//    Find/Insert/Upsert return a copy of the value, not a position in the tree.
+//  - Values are stored inline and must be trivially copyable, since readers copy them
+//    while a writer may be changing them.
+//
+// All operations other than CollectAllKeys() and DebugPrint() are thread safe.
+template<typename Key = int64_t, typename Value = void*,
+    typename Compare = std::less<Key>, size_t NODE_BYTES = 256>
+class BTreeOLC {
+ private:
+  typedef KeySearch<Key, Compare> Search;
+
+  struct Node {
+    // Bit 0 is set once the node has been unlinked from the tree, bit 1 while it is
+    // write locked. Unlocking adds 2, so every modification changes the version.
+    std::atomic<uint64_t> version;
+    int32_t num_keys;
+    bool is_leaf_;
+
+    bool is_leaf() const { return is_leaf_; }
+    bool is_internal() const { return !is_leaf_; }
+    explicit Node(bool is_leaf) : version(0), num_keys(0), is_leaf_(is_leaf) {}
+  };
+
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Value>::value,
+      "Values must be trivially copyable");
+
+ public:
+  // Maximum number of keys in a leaf and in an internal node.
+  enum {
+    LEAF_ORDER = (NODE_BYTES - sizeof(Node)) / (sizeof(Key) + sizeof(Value)),
+    INTERNAL_ORDER = (NODE_BYTES - sizeof(Node) - sizeof(Node*)) /
+        (sizeof(Key) + sizeof(Node*)),
+  };
+  static_assert(LEAF_ORDER >= 4 && INTERNAL_ORDER >= 4, "NODE_BYTES is too small");
+
+  explicit BTreeOLC(const Compare& comp = Compare())
+    : epoch_(EpochManager::Global()), comp_(comp) {
+    root_.store(NewNode<LeafNode>());
+    for (int i = 0; i < NUM_SIZE_STRIPES; ++i) sizes_[i].value.store(0);
+  }
+
+  // Not thread safe: no other operation may be running.
+  ~BTreeOLC() {
+    Delete(root_.load());
+  }
+
+  // Result of a lookup. Holds a copy of the value since the tree may change as soon
+  // as the operation returns.
+  class Iterator {
+   public:
+    bool AtEnd() const { return at_end_; }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return value_;
+    }
+
+   private:
+    friend class BTreeOLC;
+    Iterator() : at_end_(true), value_() {}
+    explicit Iterator(const Value& value) : at_end_(false), value_(value) {}
+
+    bool at_end_;
+    Value value_;
+  };
+
+  Iterator Find(const Key& key) const {
+    EpochManager::Guard guard(epoch_);
+    Iterator result;
+    while (!TryFind(key, &result)) {}
+    return result;
+  }
+
+  bool Update(const Key& key, const Value& value) {
+    EpochManager::Guard guard(epoch_);
+    bool updated;
+    while (!TryUpdate(key, value, &updated)) {}
+    return updated;
+  }
+
+  Iterator Insert(const Key& key, const Value& value) {
+    EpochManager::Guard guard(epoch_);
+    Iterator result;
+    while (!TryInsert(key, value, false, &result)) {}
+    return result;
+  }
+
+  Iterator Upsert(const Key& key, const Value& value) {
+    EpochManager::Guard guard(epoch_);
+    Iterator result;
+    while (!TryInsert(key, value, true, &result)) {}
+    return result;
+  }
+
+  bool Remove(const Key& key) {
+    EpochManager::Guard guard(epoch_);
+    bool removed;
+    while (!TryRemove(key, &removed)) {}
+    return removed;
+  }
+
+  // Number of values in the tree. Exact only when no modification is running.
+  int64_t size() const {
+    int64_t size = 0;
+    for (int i = 0; i < NUM_SIZE_STRIPES; ++i) {
+      size += sizes_[i].value.load(std::memory_order_relaxed);
+    }
+    return size;
+  }
+
+  Iterator End() const { return Iterator(); }
+
+  void DebugPrint() const {
+    printf("Printing Tree:\n");
+    PrintNode(root_.load(), 0);
+  }
+
+  void CollectAllKeys(std::vector<Key>* keys, bool backwards = false) const {
+    keys->clear();
+    CollectKeys(root_.load(), keys);
+    if (backwards) std::reverse(keys->begin(), keys->end());
+  }
+
+ private:
+  // Key arrays are padded so the search kernels can read whole blocks.
+  enum {
+    PADDED_LEAF_ORDER = (LEAF_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+    PADDED_INTERNAL_ORDER = (INTERNAL_ORDER + Search::PAD - 1) / Search::PAD * Search::PAD,
+  };
+
+  // Nodes with fewer keys than this are merged with or refilled from a sibling the
+  // next time a remove passes through their parent.
+  enum {
+    MIN_LEAF_KEYS = LEAF_ORDER / 2,
+    MIN_INTERNAL_KEYS = INTERNAL_ORDER / 2,
+  };
+
+  struct LeafNode : public Node {
+    enum { CAPACITY = LEAF_ORDER };
+
+    Key keys[PADDED_LEAF_ORDER];
+    Value values[LEAF_ORDER];
+
+    LeafNode() : Node(true) {}
+  };
+
+  struct InternalNode : public Node {
+    enum { CAPACITY = INTERNAL_ORDER };
+
+    Key keys[PADDED_INTERNAL_ORDER];
+    Node* children[INTERNAL_ORDER + 1];
+
+    InternalNode() : Node(false) {}
+  };
+
+  static LeafNode* AsLeaf(Node* node) {
+    assert(node == NULL || node->is_leaf());
+    return static_cast<LeafNode*>(node);
+  }
+
+  static const LeafNode* AsLeaf(const Node* node) {
+    assert(node == NULL || node->is_leaf());
+    return static_cast<const LeafNode*>(node);
+  }
+
+  static InternalNode* AsInternal(Node* node) {
+    assert(node == NULL || node->is_internal());
+    return static_cast<InternalNode*>(node);
+  }
+
+  static const InternalNode* AsInternal(const Node* node) {
+    assert(node == NULL || node->is_internal());
+    return static_cast<const InternalNode*>(node);
+  }
+
+  static void CpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    std::this_thread::yield();
+#endif
+  }
+
+  // Waits until node is not write locked and stores its version. Returns false if the
+  // node is obsolete.
+  static bool ReadLock(const Node* node, uint64_t* version) {
+    uint64_t v = node->version.load(std::memory_order_acquire);
+    while ((v & 2) != 0) {
+      CpuRelax();
+      v = node->version.load(std::memory_order_acquire);
+    }
+    if ((v & 1) != 0) return false;
+    *version = v;
+    return true;
+  }
+
+  // Returns true if node has not changed since ReadLock() returned version. Everything
+  // read from the node before a successful Validate() is consistent.
+  static bool Validate(const Node* node, uint64_t version) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return node->version.load(std::memory_order_relaxed) == version;
+  }
+
+  // Write locks node if it has not changed since ReadLock() returned version.
+  static bool Upgrade(Node* node, uint64_t version) {
+    return node->version.compare_exchange_strong(version, version + 2,
+        std::memory_order_acquire);
+  }
+
+  // Write locks node, waiting for other writers. Returns false if the node is obsolete.
+  static bool WriteLock(Node* node) {
+    while (true) {
+      uint64_t version;
+      if (!ReadLock(node, &version)) return false;
+      if (Upgrade(node, version)) return true;
+    }
+  }
+
+  static void WriteUnlock(Node* node) {
+    node->version.fetch_add(2, std::memory_order_release);
+  }
+
+  // Unlocks node and marks it obsolete. Readers that still reach it will restart.
+  static void WriteUnlockObsolete(Node* node) {
+    node->version.fetch_add(3, std::memory_order_release);
+  }
+
+  // Returns the index of the first key in node that is >= key. For an internal node
+  // this is also the index of the child that covers key.
+  template<typename NodeType>
+  int SearchNode(const NodeType* node, const Key& key) const {
+    return Search::LowerBound(node->keys, node->num_keys, key, comp_);
+  }
+
+  // Read locks the root. Fails if the root changed while doing so.
+  bool ReadLockRoot(Node** node, uint64_t* version) const {
+    *node = root_.load();
+    if (!ReadLock(*node, version)) return false;
+    return *node == root_.load();
+  }
+
+  // Steps from parent, read locked with version *version, to the child that covers
+  // key. On success *node is the child and *version its version.
+  bool ReadLockChild(const Key& key, Node** node, uint64_t* version) const {
+    const InternalNode* parent = AsInternal(*node);
+    Node* child = parent->children[SearchNode(parent, key)];
+    // The child pointer may be garbage unless the parent is still unchanged.
+    if (!Validate(parent, *version)) return false;
+    uint64_t child_version;
+    if (!ReadLock(child, &child_version)) return false;
+    // The child may have been split or rebalanced before it was locked.
+    if (!Validate(parent, *version)) return false;
+    *node = child;
+    *version = child_version;
+    return true;
+  }
+
+  bool TryFind(const Key& key, Iterator* result) const {
+    Node* node;
+    uint64_t version;
+    if (!ReadLockRoot(&node, &version)) return false;
+    while (node->is_internal()) {
+      if (!ReadLockChild(key, &node, &version)) return false;
+    }
+    const LeafNode* leaf = AsLeaf(node);
+    int idx = SearchNode(leaf, key);
+    bool found = idx < leaf->num_keys && !comp_(key, leaf->keys[idx]);
+    Value value = found ? leaf->values[idx] : Value();
+    if (!Validate(leaf, version)) return false;
+    *result = found ? Iterator(value) : End();
+    return true;
+  }
+
+  bool TryUpdate(const Key& key, const Value& value, bool* updated) {
+    Node* node;
+    uint64_t version;
+    if (!ReadLockRoot(&node, &version)) return false;
+    while (node->is_internal()) {
+      if (!ReadLockChild(key, &node, &version)) return false;
+    }
+    LeafNode* leaf = AsLeaf(node);
+    int idx = SearchNode(leaf, key);
+    if (idx == leaf->num_keys || comp_(key, leaf->keys[idx])) {
+      if (!Validate(leaf, version)) return false;
+      *updated = false;
+      return true;
+    }
+    if (!Upgrade(leaf, version)) return false;
+    leaf->values[idx] = value;
+    WriteUnlock(leaf);
+    *updated = true;
+    return true;
+  }
+
+  bool TryInsert(const Key& key, const Value& value, bool upsert, Iterator* result) {
+    Node* node;
+    uint64_t version;
+    if (!ReadLockRoot(&node, &version)) return false;
+    InternalNode* parent = NULL;
+    uint64_t parent_version = 0;
+    while (node->is_internal()) {
+      if (node->num_keys == INTERNAL_ORDER) {
+        SplitChild(parent, parent_version, node, version);
+        return false;
+      }
+      parent = AsInternal(node);
+      parent_version = version;
+      if (!ReadLockChild(key, &node, &version)) return false;
+    }
+
+    LeafNode* leaf = AsLeaf(node);
+    int idx = SearchNode(leaf, key);
+    bool exists = idx < leaf->num_keys && !comp_(key, leaf->keys[idx]);
+    if (exists && !upsert) {
+      if (!Validate(leaf, version)) return false;
+      *result = End();
+      return true;
+    }
+    if (!exists && leaf->num_keys == LEAF_ORDER) {
+      SplitChild(parent, parent_version, leaf, version);
+      return false;
+    }
+    if (!Upgrade(leaf, version)) return false;
+    if (exists) {
+      leaf->values[idx] = value;
+    } else {
+      MoveEntries(leaf, idx + 1, idx, leaf->num_keys - idx);
+      leaf->keys[idx] = key;
+      leaf->values[idx] = value;
+      ++leaf->num_keys;
+    }
+    WriteUnlock(leaf);
+    if (!exists) AddToSize(1);
+    *result = Iterator(value);
+    return true;
+  }
+
+  bool TryRemove(const Key& key, bool* removed) {
+    Node* node;
+    uint64_t version;
+    if (!ReadLockRoot(&node, &version)) return false;
+    while (node->is_internal()) {
+      InternalNode* parent = AsInternal(node);
+      uint64_t parent_version = version;
+      if (!ReadLockChild(key, &node, &version)) return false;
+      if (IsUnderfull(node) && parent->num_keys > 0) {
+        RebalanceChild(parent, parent_version, node, version, key);
+        return false;
+      }
+    }
+
+    LeafNode* leaf = AsLeaf(node);
+    int idx = SearchNode(leaf, key);
+    if (idx == leaf->num_keys || comp_(key, leaf->keys[idx])) {
+      if (!Validate(leaf, version)) return false;
+      *removed = false;
+      return true;
+    }
+    if (!Upgrade(leaf, version)) return false;
+    MoveEntries(leaf, idx, idx + 1, leaf->num_keys - idx - 1);
+    --leaf->num_keys;
+    WriteUnlock(leaf);
+    AddToSize(-1);
+    *removed = true;
+    return true;
+  }
+
+  bool IsUnderfull(const Node* node) const {
+    if (node->is_leaf()) return node->num_keys < MIN_LEAF_KEYS;
+    return node->num_keys < MIN_INTERNAL_KEYS;
+  }
+
+  // Splits the full node, whose parent is parent (NULL for the root). Both must be
+  // unchanged since they were read locked. Gives up silently if they were not; the
+  // caller restarts either way.
+  void SplitChild(InternalNode* parent, uint64_t parent_version, Node* node,
+      uint64_t version) {
+    if (parent != NULL && !Upgrade(parent, parent_version)) return;
+    if (!Upgrade(node, version)) {
+      if (parent != NULL) WriteUnlock(parent);
+      return;
+    }
+    if (parent == NULL && node != root_.load()) {
+      // Another thread grew the tree after node was read as the root.
+      WriteUnlock(node);
+      return;
+    }
+    Key separator;
+    Node* sibling;
+    if (node->is_leaf()) {
+      sibling = SplitNode(AsLeaf(node), &separator);
+    } else {
+      sibling = SplitNode(AsInternal(node), &separator);
+    }
+    if (parent != NULL) {
+      int idx = SearchNode(parent, separator);
+      MoveEntries(parent, idx + 1, idx, parent->num_keys - idx);
+      parent->keys[idx] = separator;
+      parent->children[idx + 1] = sibling;
+      ++parent->num_keys;
+    } else {
+      InternalNode* root = NewNode<InternalNode>();
+      root->keys[0] = separator;
+      root->children[0] = node;
+      root->children[1] = sibling;
+      root->num_keys = 1;
+      root_.store(root);
+    }
+    WriteUnlock(node);
+    if (parent != NULL) WriteUnlock(parent);
+  }
+
+  // Moves the upper half of node into a new sibling. The sibling is not reachable
+  // until the caller links it into the parent.
+  LeafNode* SplitNode(LeafNode* node, Key* separator) {
+    LeafNode* sibling = NewNode<LeafNode>();
+    int num_left = node->num_keys / 2;
+    int num_right = node->num_keys - num_left;
+    memcpy(sibling->keys, &node->keys[num_left], num_right * sizeof(Key));
+    memcpy(sibling->values, &node->values[num_left], num_right * sizeof(Value));
+    sibling->num_keys = num_right;
+    node->num_keys = num_left;
+    *separator = node->keys[num_left - 1];
+    return sibling;
+  }
+
+  // The middle key moves up to the parent.
+  InternalNode* SplitNode(InternalNode* node, Key* separator) {
+    InternalNode* sibling = NewNode<InternalNode>();
+    int mid = node->num_keys / 2;
+    int num_right = node->num_keys - mid - 1;
+    memcpy(sibling->keys, &node->keys[mid + 1], num_right * sizeof(Key));
+    memcpy(sibling->children, &node->children[mid + 1], (num_right + 1) * sizeof(Node*));
+    sibling->num_keys = num_right;
+    node->num_keys = mid;
+    *separator = node->keys[mid];
+    return sibling;
+  }
+
+  // Merges the underfull node with a sibling, or moves entries over from the sibling
+  // if they do not fit in one node. Gives up silently if parent or node changed; the
+  // caller restarts either way.
+  void RebalanceChild(InternalNode* parent, uint64_t parent_version, Node* node,
+      uint64_t version, const Key& key) {
+    if (!Upgrade(parent, parent_version)) return;
+    if (!Upgrade(node, version)) {
+      WriteUnlock(parent);
+      return;
+    }
+    int idx = SearchNode(parent, key);
+    assert(parent->children[idx] == node);
+    // Rebalance children[left_idx] and children[left_idx + 1].
+    int left_idx = idx > 0 ? idx - 1 : idx;
+    Node* sibling = parent->children[left_idx == idx ? idx + 1 : left_idx];
+    // Only writers that already got past parent can hold the sibling, and they do not
+    // need parent again.
+    bool locked = WriteLock(sibling);
+    assert(locked);
+    (void)locked;
+
+    Node* left = parent->children[left_idx];
+    Node* right = parent->children[left_idx + 1];
+    bool merged;
+    if (node->is_leaf()) {
+      merged = RebalanceNodes(parent, left_idx, AsLeaf(left), AsLeaf(right));
+    } else {
+      merged = RebalanceNodes(parent, left_idx, AsInternal(left), AsInternal(right));
+    }
+    WriteUnlock(left);
+    if (merged) {
+      WriteUnlockObsolete(right);
+      epoch_->Retire(right);
+    } else {
+      WriteUnlock(right);
+    }
+
+    if (parent->num_keys == 0 && parent == root_.load()) {
+      // The root has a single child left. Shrink the tree.
+      root_.store(left);
+      WriteUnlockObsolete(parent);
+      epoch_->Retire(parent);
+    } else {
+      WriteUnlock(parent);
+    }
+  }
+
+  // Rebalances the leaves parent->children[idx] and parent->children[idx + 1]. All
+  // three nodes are locked. Returns true if right was merged into left and removed from
+  // parent.
+  bool RebalanceNodes(InternalNode* parent, int idx, LeafNode* left, LeafNode* right) {
+    int total = left->num_keys + right->num_keys;
+    if (total <= LEAF_ORDER) {
+      memcpy(&left->keys[left->num_keys], right->keys, right->num_keys * sizeof(Key));
+      memcpy(&left->values[left->num_keys], right->values,
+          right->num_keys * sizeof(Value));
+      left->num_keys = total;
+      RemoveChild(parent, idx);
+      return true;
+    }
+    int num_left = total / 2;
+    if (left->num_keys < num_left) {
+      int n = num_left - left->num_keys;
+      memcpy(&left->keys[left->num_keys], right->keys, n * sizeof(Key));
+      memcpy(&left->values[left->num_keys], right->values, n * sizeof(Value));
+      MoveEntries(right, 0, n, right->num_keys - n);
+    } else {
+      int n = left->num_keys - num_left;
+      MoveEntries(right, n, 0, right->num_keys);
+      memcpy(right->keys, &left->keys[num_left], n * sizeof(Key));
+      memcpy(right->values, &left->values[num_left], n * sizeof(Value));
+    }
+    right->num_keys = total - num_left;
+    left->num_keys = num_left;
+    parent->keys[idx] = left->keys[num_left - 1];
+    return false;
+  }
+
+  // Same for internal nodes. The separator in parent moves down into the merged node,
+  // or rotates through parent when moving entries.
+  bool RebalanceNodes(InternalNode* parent, int idx, InternalNode* left,
+      InternalNode* right) {
+    int total = left->num_keys + right->num_keys;
+    if (total + 1 <= INTERNAL_ORDER) {
+      left->keys[left->num_keys] = parent->keys[idx];
+      memcpy(&left->keys[left->num_keys + 1], right->keys, right->num_keys * sizeof(Key));
+      memcpy(&left->children[left->num_keys + 1], right->children,
+          (right->num_keys + 1) * sizeof(Node*));
+      left->num_keys = total + 1;
+      RemoveChild(parent, idx);
+      return true;
+    }
+    int num_left = total / 2;
+    while (left->num_keys < num_left) {
+      left->keys[left->num_keys] = parent->keys[idx];
+      left->children[left->num_keys + 1] = right->children[0];
+      ++left->num_keys;
+      parent->keys[idx] = right->keys[0];
+      memmove(right->keys, &right->keys[1], (right->num_keys - 1) * sizeof(Key));
+      memmove(right->children, &right->children[1], right->num_keys * sizeof(Node*));
+      --right->num_keys;
+    }
+    while (left->num_keys > num_left) {
+      memmove(&right->keys[1], right->keys, right->num_keys * sizeof(Key));
+      memmove(&right->children[1], right->children, (right->num_keys + 1) * sizeof(Node*));
+      right->keys[0] = parent->keys[idx];
+      right->children[0] = left->children[left->num_keys];
+      ++right->num_keys;
+      parent->keys[idx] = left->keys[left->num_keys - 1];
+      --left->num_keys;
+    }
+    return false;
+  }
+
+  // Removes keys[idx] and children[idx + 1] from node.
+  void RemoveChild(InternalNode* node, int idx) {
+    MoveEntries(node, idx, idx + 1, node->num_keys - idx - 1);
+    --node->num_keys;
+  }
+
+  // Moves n entries of a leaf from src_idx to dst_idx.
+  void MoveEntries(LeafNode* node, int dst_idx, int src_idx, int n) const {
+    if (n <= 0) return;
+    memmove(&node->keys[dst_idx], &node->keys[src_idx], n * sizeof(Key));
+    memmove(&node->values[dst_idx], &node->values[src_idx], n * sizeof(Value));
+  }
+
+  // Moves n keys of an internal node from src_idx to dst_idx, together with the child
+  // to the right of each key.
+  void MoveEntries(InternalNode* node, int dst_idx, int src_idx, int n) const {
+    if (n <= 0) return;
+    memmove(&node->keys[dst_idx], &node->keys[src_idx], n * sizeof(Key));
+    memmove(&node->children[dst_idx + 1], &node->children[src_idx + 1],
+        n * sizeof(Node*));
+  }
+
+  template<typename NodeType>
+  NodeType* NewNode() {
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, 64, sizeof(NodeType)) != 0) {
+      printf("Out of memory allocating %zu bytes.\n", sizeof(NodeType));
+      abort();
+    }
+    return new (ptr) NodeType();
+  }
+
+  void Delete(Node* node) {
+    if (node->is_internal()) {
+      InternalNode* internal = AsInternal(node);
+      for (int i = 0; i <= internal->num_keys; ++i) {
+        Delete(internal->children[i]);
+      }
+    }
+    free(node);
+  }
+
+  void CollectKeys(const Node* node, std::vector<Key>* keys) const {
+    if (node->is_leaf()) {
+      const LeafNode* leaf = AsLeaf(node);
+      keys->insert(keys->end(), leaf->keys, leaf->keys + leaf->num_keys);
+      return;
+    }
+    const InternalNode* internal = AsInternal(node);
+    for (int i = 0; i <= internal->num_keys; ++i) {
+      CollectKeys(internal->children[i], keys);
+    }
+  }
+
+  void PrintNode(const Node* node, int level) const {
+    std::stringstream ss;
+    ss << level << ": " << (node->is_leaf() ? "<" : "[");
+    for (int i = 0; i < node->num_keys; ++i) {
+      if (i != 0) ss << " ";
+      if (node->is_leaf()) {
+        ss << AsLeaf(node)->keys[i];
+      } else {
+        ss << AsInternal(node)->keys[i];
+      }
+    }
+    ss << (node->is_leaf() ? ">" : "]");
+    printf("%s\n", ss.str().c_str());
+    if (node->is_internal()) {
+      for (int i = 0; i <= node->num_keys; ++i) {
+        PrintNode(AsInternal(node)->children[i], level + 1);
+      }
+    }
+  }
+
+  void AddToSize(int64_t delta) {
+    int stripe = epoch_->ThreadIndex() % NUM_SIZE_STRIPES;
+    sizes_[stripe].value.fetch_add(delta, std::memory_order_relaxed);
+  }
+
+  // The size is split over cache line sized counters, indexed by thread, so writers
+  // on different threads do not contend on it.
+  enum { NUM_SIZE_STRIPES = 16 };
+  struct alignas(64) SizeStripe {
+    std::atomic<int64_t> value;
+  };
+  SizeStripe sizes_[NUM_SIZE_STRIPES];
+
+  // Root of the tree. Never NULL. Changes when the root is split or shrinks.
+  std::atomic<Node*> root_;
+
+  EpochManager* epoch_;
+
+  Compare comp_;
+};
+
+#endif
@@ -0,0 +1,878 @@
+#ifndef BTREE_STRING_H
+#define BTREE_STRING_H
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "btree.h"
+#include "node_allocator.h"
+
+// B+ tree for std::string keys, ordered bytewise like std::string::compare().
+//
+// Nodes are slotted pages. Fixed size entries grow from the front of a node and the
+// key bytes from the back, with the free space in between. Keys are stored without
+// the node prefix, the bytes that every key the node can hold starts with, which is
+// kept once per node. An entry holds the first 4 bytes after the prefix as a big
+// endian integer (the head), the length, where the rest of the key is and the value
+// or child. Searches compare the heads and only read the rest of a key when they are
+// equal. Keys too long for a node are kept outside it and the node stores a pointer.
+//
+// As in BTree, entry i of an internal node holds child i and a separator that is >=
+// every key under the child and < every key under child i + 1. The last entry has an
+// empty separator that is never compared. Separators are the shortest strings that
+// split the keys of two leaves, often only a few bytes, so internal nodes fan out
+// further. The separators around a node (its fences) bound its keys, so their common
+// prefix is the node prefix. Fences only change when nodes split or merge, which is
+// when the prefix is set.
+//
+// Removed keys leave garbage in their node, which is compacted away when the node
+// needs the space. A node that drops below a quarter full is merged with a neighbor
+// when both fit in one node.
+template<typename Value = void*, size_t NODE_BYTES = 512>
+class StringBTree {
+ private:
+  typedef ValueStorage<Value> Storage;
+  typedef typename Storage::Slot ValueSlot;
+
+  struct Node {
+    uint16_t num_values;
+    // Offset in data of the key bytes, which run up to the prefix.
+    uint16_t heap_start;
+    // Bytes of the key bytes that no entry uses.
+    uint16_t garbage;
+    // The prefix is kept at the end of data.
+    uint16_t prefix_length : 15;
+    uint16_t is_leaf : 1;
+    // Next leaf in key order. Unused in internal nodes.
+    Node* next;
+    // Entries, free space, key bytes, prefix.
+    uint8_t data[NODE_BYTES - 16];
+  };
+
+  template<typename T>
+  struct Entry {
+    // First HEAD_BYTES bytes of the key after the prefix, big endian and zero padded.
+    uint32_t head;
+    // Key length without the prefix.
+    uint16_t length;
+    // Offset in data of the key bytes after the head, or of a pointer to them if the
+    // key is stored outside the node.
+    uint16_t offset;
+    T value;
+  };
+
+  typedef Entry<ValueSlot> LeafEntry;
+  typedef Entry<Node*> InternalEntry;
+
+  enum {
+    DATA_BYTES = NODE_BYTES - 16,
+    HEAD_BYTES = 4,
+    MAX_ENTRY_SIZE = sizeof(LeafEntry) > sizeof(InternalEntry) ? sizeof(LeafEntry) :
+        sizeof(InternalEntry),
+  };
+
+ public:
+  // Keys of up to MAX_INLINE_KEY bytes are stored in the nodes and node prefixes are
+  // at most MAX_PREFIX bytes. An entry then takes at most a fifth of a node, so the
+  // halves of a split node have room for one more even with longer prefixes.
+  enum {
+    MAX_INLINE_KEY = DATA_BYTES / 5 - MAX_ENTRY_SIZE + HEAD_BYTES,
+    MAX_PREFIX = DATA_BYTES / 10,
+  };
+  // Longest key a tree takes. Insert() and Upsert() reject longer keys.
+  enum { MAX_KEY = 0xFFFF };
+  static_assert(sizeof(Node) == NODE_BYTES, "Unexpected node layout");
+  static_assert(NODE_BYTES <= 0x8000, "Offsets in nodes are 15 bits");
+  static_assert(MAX_INLINE_KEY >= HEAD_BYTES + static_cast<int>(sizeof(char*)) &&
+      MAX_INLINE_KEY >= MAX_PREFIX, "NODE_BYTES is too small");
+  // A key stored outside the nodes then has bytes after its head with any prefix.
+  static_assert(MAX_INLINE_KEY - MAX_PREFIX >= HEAD_BYTES, "NODE_BYTES is too small");
+
+  StringBTree() : size_(0), root_(NewNode(true)) {}
+
+  ~StringBTree() {
+    // The nodes came from the pool, so only values and keys outside nodes need freeing.
+    DestroyNode(root_);
+  }
+
+  // Cursor over the values in key order. Any modification to the tree invalidates all
+  // iterators.
+  class Iterator {
+   public:
+    // An iterator at the end.
+    Iterator() : node_(NULL), idx_(0) {}
+
+    bool AtEnd() const { return node_ == NULL; }
+
+    std::string key() const {
+      assert(!AtEnd());
+      return KeyString(node_, Entries<LeafEntry>(node_)[idx_]);
+    }
+
+    const Value& value() const {
+      assert(!AtEnd());
+      return Storage::Get(Entries<LeafEntry>(node_)[idx_].value);
+    }
+
+    // Moves to the next larger key. The iterator is at the end after the largest key.
+    void Next() {
+      assert(!AtEnd());
+      ++idx_;
+      SkipForward();
+    }
+
+   private:
+    friend class StringBTree;
+    Iterator(const Node* node, int idx) : node_(node), idx_(idx) { SkipForward(); }
+
+    // If idx_ is past the values of the leaf, moves to the first value of the next
+    // non-empty leaf.
+    void SkipForward() {
+      while (node_ != NULL && idx_ >= node_->num_values) {
+        node_ = node_->next;
+        idx_ = 0;
+      }
+    }
+
+    const Node* node_;
+    int idx_;
+  };
+
+  Iterator Find(const std::string& key) const {
+    const Node* leaf = FindLeaf(key, NULL);
+    KeyRef ref = Strip(key, leaf);
+    int idx = LowerBound<LeafEntry>(leaf, leaf->num_values, ref);
+    if (!IsKeyAt(leaf, idx, ref)) return End();
+    return Iterator(leaf, idx);
+  }
+
+  // Returns an iterator to the first key that is >= key.
+  Iterator LowerBound(const std::string& key) const {
+    const Node* leaf = FindLeaf(key, NULL);
+    return Iterator(leaf, LowerBound<LeafEntry>(leaf, leaf->num_values, Strip(key, leaf)));
+  }
+
+  // Returns an iterator to the smallest key.
+  Iterator Begin() const {
+    const Node* node = root_;
+    while (!node->is_leaf) node = Entries<InternalEntry>(node)[0].value;
+    return Iterator(node, 0);
+  }
+
+  Iterator End() const { return Iterator(); }
+
+  bool Update(const std::string& key, const Value& value) {
+    Node* leaf = FindLeaf(key, NULL);
+    KeyRef ref = Strip(key, leaf);
+    int idx = LowerBound<LeafEntry>(leaf, leaf->num_values, ref);
+    if (!IsKeyAt(leaf, idx, ref)) return false;
+    Storage::Get(Entries<LeafEntry>(leaf)[idx].value) = value;
+    return true;
+  }
+
+  // Inserts key with value if the key is not in the tree. Returns an iterator to the
+  // new value, or End() if the key already exists or is longer than MAX_KEY bytes.
+  Iterator Insert(const std::string& key, const Value& value) {
+    return InsertOrUpsert(key, value, false);
+  }
+
+  // Inserts key with value, or replaces the value if the key exists. Returns an
+  // iterator to the value, or End() if the key is longer than MAX_KEY bytes.
+  Iterator Upsert(const std::string& key, const Value& value) {
+    return InsertOrUpsert(key, value, true);
+  }
+
+  bool Remove(const std::string& key) {
+    Path path;
+    path.depth = 0;
+    Node* leaf = FindLeaf(key, &path);
+    KeyRef ref = Strip(key, leaf);
+    int idx = LowerBound<LeafEntry>(leaf, leaf->num_values, ref);
+    if (!IsKeyAt(leaf, idx, ref)) return false;
+    Storage::Destroy(&Entries<LeafEntry>(leaf)[idx].value);
+    EraseEntry<LeafEntry>(leaf, idx);
+    --size_;
+    Rebalance(&path, leaf);
+    return true;
+  }
+
+  int64_t size() const { return size_; }
+
+  // Total bytes allocated from the system for nodes. Keys stored outside the nodes are
+  // not included.
+  int64_t bytes_reserved() const { return pool_.bytes_reserved(); }
+
+  // Checks the structure of the tree:
+  //  - keys increase within every leaf and from each leaf to the next
+  //  - every key is <= the separator after it and > the one before it
+  //  - every node prefix is the common prefix of the separators around the node
+  //  - the entries and key bytes of every node fit it without overlapping
+  //  - all leaves are at the same depth and linked in key order, and internal nodes
+  //    are not empty
+  //  - size() is the number of values in the leaves
+  // Returns false at the first problem and describes it in error if that is not NULL.
+  bool Validate(std::string* error = NULL) const {
+    ValidateState state = { -1, NULL, std::string(), 0 };
+    if (!ValidateNode(root_, 0, NULL, NULL, &state, error)) return false;
+    if (state.last_leaf->next != NULL) {
+      return ValidateError(error, "the last leaf has a next leaf");
+    }
+    if (state.num_values != size_) {
+      return ValidateError(error, "size() is " + std::to_string(size_) +
+          " but the leaves hold " + std::to_string(state.num_values) + " values");
+    }
+    return true;
+  }
+
+  void DebugPrint() const {
+    printf("Printing Tree:\n");
+    PrintNode(root_, 0);
+  }
+
+  void CollectAllKeys(std::vector<std::string>* keys) const {
+    keys->clear();
+    for (Iterator it = Begin(); !it.AtEnd(); it.Next()) {
+      keys->push_back(it.key());
+    }
+  }
+
+ private:
+  enum { MAX_HEIGHT = 32 };
+
+  // A key to search a node for, without the node prefix.
+  struct KeyRef {
+    uint32_t head;
+    const char* data;
+    size_t length;
+  };
+
+  // Internal nodes on the way from the root to a node, and the entry taken in each.
+  struct Path {
+    Node* nodes[MAX_HEIGHT];
+    int idx[MAX_HEIGHT];
+    int depth;
+
+    void Push(Node* node, int i) {
+      assert(depth < MAX_HEIGHT);
+      nodes[depth] = node;
+      idx[depth] = i;
+      ++depth;
+    }
+  };
+
+  // The separators before and after a node, where there are any.
+  struct Fences {
+    bool has_lower;
+    bool has_upper;
+    std::string lower;
+    std::string upper;
+
+    const std::string* Lower() const { return has_lower ? &lower : NULL; }
+    const std::string* Upper() const { return has_upper ? &upper : NULL; }
+  };
+
+  struct ValidateState {
+    int leaf_depth;
+    const Node* last_leaf;
+    std::string last_key;
+    int64_t num_values;
+  };
+
+  template<typename E>
+  static E* Entries(Node* node) { return reinterpret_cast<E*>(node->data); }
+
+  template<typename E>
+  static const E* Entries(const Node* node) {
+    return reinterpret_cast<const E*>(node->data);
+  }
+
+  static const char* Prefix(const Node* node) {
+    return reinterpret_cast<const char*>(node->data + DATA_BYTES - node->prefix_length);
+  }
+
+  static uint32_t MakeHead(const char* data, size_t length) {
+    uint32_t head = 0;
+    for (size_t i = 0; i < HEAD_BYTES; ++i) {
+      head = head << 8 | (i < length ? static_cast<uint8_t>(data[i]) : 0);
+    }
+    return head;
+  }
+
+  // Returns key without the prefix of node, which it must start with.
+  static KeyRef Strip(const std::string& key, const Node* node) {
+    assert(key.compare(0, node->prefix_length, Prefix(node), node->prefix_length) == 0);
+    const char* data = key.data() + node->prefix_length;
+    size_t length = key.size() - node->prefix_length;
+    KeyRef ref = { MakeHead(data, length), data, length };
+    return ref;
+  }
+
+  // Whether a key is stored outside the nodes depends on its full length, so that a
+  // longer prefix never makes a key take more bytes.
+  static bool IsOutside(size_t full_length) { return full_length > MAX_INLINE_KEY; }
+
+  template<typename E>
+  static bool IsOutside(const Node* node, const E& e) {
+    return IsOutside(node->prefix_length + e.length);
+  }
+
+  // Bytes a key of full_length bytes takes in the key bytes of a node with a prefix of
+  // prefix_length bytes.
+  static int KeyBytes(size_t full_length, size_t prefix_length) {
+    if (IsOutside(full_length)) return sizeof(char*);
+    return std::max(static_cast<int>(full_length - prefix_length) - HEAD_BYTES, 0);
+  }
+
+  // Returns the bytes of the key of e after the head.
+  template<typename E>
+  static const char* Suffix(const Node* node, const E& e) {
+    const uint8_t* bytes = node->data + e.offset;
+    if (!IsOutside(node, e)) return reinterpret_cast<const char*>(bytes);
+    const char* outside;
+    memcpy(&outside, bytes, sizeof(outside));
+    return outside;
+  }
+
+  template<typename E>
+  static std::string KeyString(const Node* node, const E& e) {
+    std::string key(Prefix(node), node->prefix_length);
+    for (int i = 0; i < HEAD_BYTES && i < e.length; ++i) {
+      key += static_cast<char>(e.head >> (8 * (HEAD_BYTES - 1 - i)));
+    }
+    if (e.length > HEAD_BYTES) key.append(Suffix(node, e), e.length - HEAD_BYTES);
+    return key;
+  }
+
+  // Compares key with the key of e like memcmp(), both without the prefix of node.
+  template<typename E>
+  static int Compare(const KeyRef& key, const Node* node, const E& e) {
+    if (key.head != e.head) return key.head < e.head ? -1 : 1;
+    // Equal heads mean the first min(length, HEAD_BYTES) bytes are equal.
+    size_t n = std::min<size_t>(key.length, e.length);
+    if (n > HEAD_BYTES) {
+      int c = memcmp(key.data + HEAD_BYTES, Suffix(node, e), n - HEAD_BYTES);
+      if (c != 0) return c;
+    }
+    return key.length < e.length ? -1 : key.length > e.length;
+  }
+
+  // Returns the index of the first of the first n entries of node whose key is >= key,
+  // or n if there is none.
+  template<typename E>
+  static int LowerBound(const Node* node, int n, const KeyRef& key) {
+    const E* entries = Entries<E>(node);
+    int lo = 0;
+    int hi = n;
+    while (lo < hi) {
+      int mid = (lo + hi) / 2;
+      if (Compare(key, node, entries[mid]) > 0) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+  static bool IsKeyAt(const Node* leaf, int idx, const KeyRef& key) {
+    return idx < leaf->num_values &&
+        Compare(key, leaf, Entries<LeafEntry>(leaf)[idx]) == 0;
+  }
+
+  // Returns the leaf that can contain key, recording the way there in path if it is
+  // not NULL.
+  Node* FindLeaf(const std::string& key, Path* path) const {
+    Node* node = root_;
+    while (!node->is_leaf) {
+      int i = LowerBound<InternalEntry>(node, node->num_values - 1, Strip(key, node));
+      if (path != NULL) path->Push(node, i);
+      node = Entries<InternalEntry>(node)[i].value;
+    }
+    return node;
+  }
+
+  // Returns the fences of the node under the first 'level' nodes of path.
+  static Fences GetFences(const Path& path, int level) {
+    Fences fences = { false, false, std::string(), std::string() };
+    for (int j = level - 1; j >= 0 && !(fences.has_lower && fences.has_upper); --j) {
+      const Node* node = path.nodes[j];
+      int i = path.idx[j];
+      const InternalEntry* entries = Entries<InternalEntry>(node);
+      if (!fences.has_lower && i > 0) {
+        fences.lower = KeyString(node, entries[i - 1]);
+        fences.has_lower = true;
+      }
+      if (!fences.has_upper && i < node->num_values - 1) {
+        fences.upper = KeyString(node, entries[i]);
+        fences.has_upper = true;
+      }
+    }
+    return fences;
+  }
+
+  // Returns the prefix of a node between lower and upper: their common prefix, up to
+  // MAX_PREFIX bytes, or nothing if either is missing.
+  static std::string CommonPrefix(const std::string* lower, const std::string* upper) {
+    if (lower == NULL || upper == NULL) return std::string();
+    size_t n = 0;
+    size_t max = std::min<size_t>(std::min(lower->size(), upper->size()), MAX_PREFIX);
+    while (n < max && (*lower)[n] == (*upper)[n]) ++n;
+    return lower->substr(0, n);
+  }
+
+  // Returns the shortest string s with left <= s < right, for keys left < right.
+  static std::string ShortestSeparator(const std::string& left, const std::string& right) {
+    size_t n = 0;
+    while (n < left.size() && left[n] == right[n]) ++n;
+    // right[0, n] is > left, and < right unless it is all of right.
+    if (n == left.size() || n + 1 == right.size()) return left;
+    return right.substr(0, n + 1);
+  }
+
+  static int EntrySize(const Node* node) {
+    return node->is_leaf ? sizeof(LeafEntry) : sizeof(InternalEntry);
+  }
+
+  // Bytes between the entries and the key bytes.
+  static int FreeBytes(const Node* node) {
+    return node->heap_start - node->num_values * EntrySize(node);
+  }
+
+  // Bytes the entries, keys and prefix of node take.
+  static int UsedBytes(const Node* node) {
+    return DATA_BYTES - FreeBytes(node) - node->garbage;
+  }
+
+  // Bytes the entries and keys of node would take with a prefix of prefix_length.
+  template<typename E>
+  static int BytesWithPrefix(const Node* node, size_t prefix_length) {
+    const E* entries = Entries<E>(node);
+    int bytes = 0;
+    for (int i = 0; i < node->num_values; ++i) {
+      bytes += sizeof(E);
+      if (node->is_leaf || i < node->num_values - 1) {
+        bytes += KeyBytes(node->prefix_length + entries[i].length, prefix_length);
+      }
+    }
+    return bytes;
+  }
+
+  // Returns true if an entry for a key of full_length bytes fits in node, after
+  // compacting it if needed.
+  static bool HasRoom(const Node* node, size_t full_length) {
+    return FreeBytes(node) + node->garbage >=
+        EntrySize(node) + KeyBytes(full_length, node->prefix_length);
+  }
+
+  // Empties node and gives it prefix.
+  static void ResetNode(Node* node, const std::string& prefix) {
+    node->num_values = 0;
+    node->garbage = 0;
+    node->prefix_length = prefix.size();
+    node->heap_start = DATA_BYTES - prefix.size();
+    memcpy(node->data + node->heap_start, prefix.data(), prefix.size());
+  }
+
+  // Rewrites the key bytes of node without the garbage.
+  template<typename E>
+  static void Compact(Node* node) {
+    Node copy;
+    memcpy(&copy, node, sizeof(Node));
+    node->heap_start = DATA_BYTES - node->prefix_length;
+    node->garbage = 0;
+    E* entries = Entries<E>(node);
+    for (int i = 0; i < node->num_values; ++i) {
+      int bytes = KeyBytes(node->prefix_length + entries[i].length, node->prefix_length);
+      node->heap_start -= bytes;
+      memcpy(node->data + node->heap_start, copy.data + entries[i].offset, bytes);
+      entries[i].offset = node->heap_start;
+    }
+  }
+
+  // Makes room for bytes more entry and key bytes in node.
+  template<typename E>
+  static void Reserve(Node* node, int bytes) {
+    if (FreeBytes(node) < bytes) Compact<E>(node);
+    assert(FreeBytes(node) >= bytes);
+  }
+
+  // Inserts an entry at idx with key, which is length bytes without the prefix of
+  // node, and returns it for the caller to set its value. The node must have room, see
+  // HasRoom().
+  template<typename E>
+  static E* InsertEntry(Node* node, int idx, const char* key, size_t length) {
+    size_t full_length = node->prefix_length + length;
+    int bytes = KeyBytes(full_length, node->prefix_length);
+    Reserve<E>(node, sizeof(E) + bytes);
+    E* entries = Entries<E>(node);
+    memmove(&entries[idx + 1], &entries[idx], (node->num_values - idx) * sizeof(E));
+    ++node->num_values;
+    E* e = &entries[idx];
+    assert(length <= MAX_KEY);
+    e->head = MakeHead(key, length);
+    e->length = length;
+    node->heap_start -= bytes;
+    e->offset = node->heap_start;
+    if (IsOutside(full_length)) {
+      char* outside = new char[length - HEAD_BYTES];
+      memcpy(outside, key + HEAD_BYTES, length - HEAD_BYTES);
+      memcpy(node->data + e->offset, &outside, sizeof(outside));
+    } else {
+      memcpy(node->data + e->offset, key + HEAD_BYTES, bytes);
+    }
+    return e;
+  }
+
+  // Frees the key of e, an entry of node, if it is stored outside the nodes.
+  template<typename E>
+  static void FreeKey(const Node* node, const E& e) {
+    if (IsOutside(node, e)) delete[] Suffix(node, e);
+  }
+
+  // Appends e, an entry of src, to node, which is the prefix of all keys of src. The
+  // key moves to node: src must not free it. With clear_key, e is the last entry of an
+  // internal node and is appended with an empty key.
+  template<typename E>
+  static void AppendEntry(Node* node, const Node* src, const E& e, bool clear_key = false) {
+    if (clear_key) {
+      FreeKey(src, e);
+      InsertEntry<E>(node, node->num_values, "", 0)->value = e.value;
+    } else if (node->prefix_length == src->prefix_length) {
+      // Same prefix, so the key bytes can be copied.
+      int bytes = KeyBytes(src->prefix_length + e.length, src->prefix_length);
+      Reserve<E>(node, sizeof(E) + bytes);
+      E* copy = &Entries<E>(node)[node->num_values++];
+      *copy = e;
+      node->heap_start -= bytes;
+      copy->offset = node->heap_start;
+      memcpy(node->data + copy->offset, src->data + e.offset, bytes);
+    } else {
+      std::string key = KeyString(src, e);
+      FreeKey(src, e);
+      InsertEntry<E>(node, node->num_values, key.data() + node->prefix_length,
+          key.size() - node->prefix_length)->value = e.value;
+    }
+  }
+
+  // Removes the entry at idx, freeing its key but not its value.
+  template<typename E>
+  static void EraseEntry(Node* node, int idx) {
+    E* entries = Entries<E>(node);
+    FreeKey(node, entries[idx]);
+    node->garbage += KeyBytes(node->prefix_length + entries[idx].length,
+        node->prefix_length);
+    memmove(&entries[idx], &entries[idx + 1], (node->num_values - idx - 1) * sizeof(E));
+    --node->num_values;
+  }
+
+  // Splits node, whose fences are 'fences', in the middle by bytes: moves the second
+  // half to a new node after it, which it returns, and sets separator to a string that
+  // is >= the keys of the first half and < those of the second. Both halves get the
+  // prefix of their new fences.
+  template<typename E>
+  Node* SplitNode(Node* node, const Fences& fences, std::string* separator) {
+    int n = node->num_values;
+    assert(n >= 2);
+    const E* entries = Entries<E>(node);
+    int half = (UsedBytes(node) - node->prefix_length) / 2;
+    int m = 0;
+    for (int bytes = 0; m < n - 1 && (m == 0 || bytes < half); ++m) {
+      bytes += sizeof(E) +
+          KeyBytes(node->prefix_length + entries[m].length, node->prefix_length);
+    }
+    if (node->is_leaf) {
+      *separator = ShortestSeparator(KeyString(node, entries[m - 1]),
+          KeyString(node, entries[m]));
+    } else {
+      // The last separator of the first half moves up.
+      *separator = KeyString(node, entries[m - 1]);
+    }
+
+    Node copy;
+    memcpy(&copy, node, sizeof(Node));
+    Node* right = NewNode(node->is_leaf);
+    ResetNode(node, CommonPrefix(fences.Lower(), separator));
+    ResetNode(right, CommonPrefix(separator, fences.Upper()));
+    const E* copy_entries = Entries<E>(&copy);
+    for (int i = 0; i < n; ++i) {
+      bool last = !node->is_leaf && (i == m - 1 || i == n - 1);
+      AppendEntry(i < m ? node : right, &copy, copy_entries[i], last);
+    }
+    if (node->is_leaf) {
+      right->next = node->next;
+      node->next = right;
+    }
+    return right;
+  }
+
+  // Inserts right, split from left, after left in the parent of left, which is at
+  // level in path. The keys under left are <= separator and those under right are
+  // greater.
+  void InsertChild(Path* path, int level, Node* left, Node* right,
+      const std::string& separator) {
+    if (level == 0) {
+      root_ = NewNode(false);
+      InsertEntry<InternalEntry>(root_, 0, separator.data(), separator.size())->value =
+          left;
+      InsertEntry<InternalEntry>(root_, 1, "", 0)->value = right;
+      return;
+    }
+    Node* parent = path->nodes[level - 1];
+    int i = path->idx[level - 1];
+    if (!HasRoom(parent, separator.size())) {
+      std::string parent_separator;
+      Node* parent_right = SplitNode<InternalEntry>(parent, GetFences(*path, level - 1),
+          &parent_separator);
+      InsertChild(path, level - 1, parent, parent_right, parent_separator);
+      if (i >= parent->num_values) {
+        i -= parent->num_values;
+        parent = parent_right;
+      }
+    }
+    // The entry for left moves to i + 1 and keeps its separator, which now bounds
+    // right.
+    KeyRef ref = Strip(separator, parent);
+    InsertEntry<InternalEntry>(parent, i, ref.data, ref.length)->value = left;
+    Entries<InternalEntry>(parent)[i + 1].value = right;
+  }
+
+  Iterator InsertOrUpsert(const std::string& key, const Value& value, bool upsert) {
+    // The entries only have 16 bits for the length.
+    if (key.size() > MAX_KEY) return End();
+    Path path;
+    path.depth = 0;
+    Node* leaf = FindLeaf(key, &path);
+    KeyRef ref = Strip(key, leaf);
+    int idx = LowerBound<LeafEntry>(leaf, leaf->num_values, ref);
+    if (IsKeyAt(leaf, idx, ref)) {
+      if (!upsert) return End();
+      Storage::Get(Entries<LeafEntry>(leaf)[idx].value) = value;
+      return Iterator(leaf, idx);
+    }
+    ++size_;
+
+    if (!HasRoom(leaf, key.size())) {
+      std::string separator;
+      Node* right = SplitNode<LeafEntry>(leaf, GetFences(path, path.depth), &separator);
+      InsertChild(&path, path.depth, leaf, right, separator);
+      if (key > separator) leaf = right;
+      ref = Strip(key, leaf);
+      idx = LowerBound<LeafEntry>(leaf, leaf->num_values, ref);
+    }
+    InsertEntry<LeafEntry>(leaf, idx, ref.data, ref.length)->value = Storage::Make(value);
+    return Iterator(leaf, idx);
+  }
+
+  // Merges the children of parent at i and i + 1 into the one at i if they fit in one
+  // node with the prefix of their combined fences. parent_fences are the fences of
+  // parent. Returns true if they did.
+  template<typename E>
+  bool MergeChildren(Node* parent, int i, const Fences& parent_fences) {
+    InternalEntry* parent_entries = Entries<InternalEntry>(parent);
+    Node* left = parent_entries[i].value;
+    Node* right = parent_entries[i + 1].value;
+    Fences fences = parent_fences;
+    if (i > 0) {
+      fences.lower = KeyString(parent, parent_entries[i - 1]);
+      fences.has_lower = true;
+    }
+    if (i + 1 < parent->num_values - 1) {
+      fences.upper = KeyString(parent, parent_entries[i + 1]);
+      fences.has_upper = true;
+    }
+    std::string prefix = CommonPrefix(fences.Lower(), fences.Upper());
+    // The separator between them bounds the last child of an internal node.
+    std::string separator = KeyString(parent, parent_entries[i]);
+    int bytes = prefix.size() + BytesWithPrefix<E>(left, prefix.size()) +
+        BytesWithPrefix<E>(right, prefix.size());
+    if (!left->is_leaf) bytes += KeyBytes(separator.size(), prefix.size());
+    if (bytes > DATA_BYTES) return false;
+
+    Node copy;
+    memcpy(&copy, left, sizeof(Node));
+    ResetNode(left, prefix);
+    const E* copy_entries = Entries<E>(&copy);
+    for (int j = 0; j < copy.num_values; ++j) {
+      if (!left->is_leaf && j == copy.num_values - 1) {
+        InsertEntry<E>(left, j, separator.data() + prefix.size(),
+            separator.size() - prefix.size())->value = copy_entries[j].value;
+      } else {
+        AppendEntry(left, &copy, copy_entries[j]);
+      }
+    }
+    const E* right_entries = Entries<E>(right);
+    for (int j = 0; j < right->num_values; ++j) {
+      AppendEntry(left, right, right_entries[j],
+          !left->is_leaf && j == right->num_values - 1);
+    }
+    left->next = right->next;
+    // The keys moved to left, so freeing right must not free them.
+    right->num_values = 0;
+    FreeNode(right);
+
+    // The entry of right keeps the separator that now bounds left.
+    parent_entries[i + 1].value = left;
+    EraseEntry<InternalEntry>(parent, i);
+    return true;
+  }
+
+  // Called after removing from node, at the end of path. Merges nodes under a quarter
+  // full with a neighbor on the way up while they fit, then removes roots with one
+  // child.
+  void Rebalance(Path* path, Node* node) {
+    while (path->depth > 0 && UsedBytes(node) < DATA_BYTES / 4) {
+      --path->depth;
+      Node* parent = path->nodes[path->depth];
+      int i = path->idx[path->depth];
+      if (parent->num_values > 1) {
+        if (i == parent->num_values - 1) --i;
+        Fences fences = GetFences(*path, path->depth);
+        bool merged = node->is_leaf ? MergeChildren<LeafEntry>(parent, i, fences) :
+            MergeChildren<InternalEntry>(parent, i, fences);
+        if (!merged) break;
+      }
+      node = parent;
+    }
+    while (!root_->is_leaf && root_->num_values == 1) {
+      Node* child = Entries<InternalEntry>(root_)[0].value;
+      // A root is left with one child by a merge under it, which gave the child the
+      // root's lack of fences and so no prefix.
+      assert(child->prefix_length == 0);
+      FreeNode(root_);
+      root_ = child;
+    }
+  }
+
+  Node* NewNode(bool is_leaf) {
+    Node* node = reinterpret_cast<Node*>(pool_.Allocate(sizeof(Node)));
+    ResetNode(node, std::string());
+    node->is_leaf = is_leaf;
+    node->next = NULL;
+    return node;
+  }
+
+  // Frees node and the keys it stores outside the nodes, but not its children or
+  // values.
+  void FreeNode(Node* node) {
+    for (int i = 0; i < node->num_values; ++i) {
+      if (node->is_leaf) {
+        FreeKey(node, Entries<LeafEntry>(node)[i]);
+      } else {
+        FreeKey(node, Entries<InternalEntry>(node)[i]);
+      }
+    }
+    pool_.Free(node, sizeof(Node));
+  }
+
+  // Frees node, its subtree and their values.
+  void DestroyNode(Node* node) {
+    for (int i = 0; i < node->num_values; ++i) {
+      if (node->is_leaf) {
+        Storage::Destroy(&Entries<LeafEntry>(node)[i].value);
+      } else {
+        DestroyNode(Entries<InternalEntry>(node)[i].value);
+      }
+    }
+    FreeNode(node);
+  }
+
+  static bool ValidateError(std::string* error, const std::string& message) {
+    if (error != NULL) *error = message;
+    return false;
+  }
+
+  // Validates node, at depth, and the subtree under it. Its fences are lower and
+  // upper where those are not NULL. Leaves are visited in key order, which is where
+  // the leaf links and the keys across leaves are checked.
+  bool ValidateNode(const Node* node, int depth, const std::string* lower,
+      const std::string* upper, ValidateState* state, std::string* error) const {
+    std::string name = (node->is_leaf ? "leaf" : "internal node") +
+        std::string(" at depth ") + std::to_string(depth);
+    if (std::string(Prefix(node), node->prefix_length) != CommonPrefix(lower, upper)) {
+      return ValidateError(error, name + " has a prefix other than that of its fences");
+    }
+    int bytes = node->prefix_length + node->garbage;
+    for (int i = 0; i < node->num_values; ++i) {
+      int length = node->is_leaf ? Entries<LeafEntry>(node)[i].length :
+          Entries<InternalEntry>(node)[i].length;
+      bytes += KeyBytes(node->prefix_length + length, node->prefix_length);
+    }
+    if (FreeBytes(node) < 0 || bytes != DATA_BYTES - node->heap_start) {
+      return ValidateError(error, name + " has overlapping or lost key bytes");
+    }
+
+    if (node->is_leaf) {
+      if (state->leaf_depth == -1) state->leaf_depth = depth;
+      if (depth != state->leaf_depth) {
+        return ValidateError(error, name + " is not at the depth of the first leaf");
+      }
+      if (state->last_leaf != NULL && state->last_leaf->next != node) {
+        return ValidateError(error, name + " is not linked from the leaf before it");
+      }
+      state->last_leaf = node;
+      for (int i = 0; i < node->num_values; ++i) {
+        std::string key = KeyString(node, Entries<LeafEntry>(node)[i]);
+        if (state->num_values > 0 && key <= state->last_key) {
+          return ValidateError(error, name + " has keys out of order");
+        }
+        if ((lower != NULL && key <= *lower) || (upper != NULL && key > *upper)) {
+          return ValidateError(error, name + " has a key outside its fences");
+        }
+        state->last_key = key;
+        ++state->num_values;
+      }
+      return true;
+    }
+
+    if (node->num_values == 0) return ValidateError(error, name + " is empty");
+    std::string previous;
+    for (int i = 0; i < node->num_values; ++i) {
+      const InternalEntry& e = Entries<InternalEntry>(node)[i];
+      std::string separator = KeyString(node, e);
+      bool last = i == node->num_values - 1;
+      if (last && e.length != 0) {
+        return ValidateError(error, name + " has a last separator");
+      }
+      if (!last && ((i > 0 && separator <= previous) ||
+          (lower != NULL && separator <= *lower) ||
+          (upper != NULL && separator > *upper))) {
+        return ValidateError(error, name + " has separators out of order");
+      }
+      if (!ValidateNode(e.value, depth + 1, i == 0 ? lower : &previous,
+          last ? upper : &separator, state, error)) {
+        return false;
+      }
+      previous = separator;
+    }
+    return true;
+  }
+
+  void PrintNode(const Node* node, int depth) const {
+    printf("%*s%s (%d of %d bytes used), prefix \"%s\":", depth * 2, "",
+        node->is_leaf ? "leaf" : "internal", UsedBytes(node),
+        static_cast<int>(DATA_BYTES), std::string(Prefix(node), node->prefix_length).c_str());
+    for (int i = 0; i < node->num_values; ++i) {
+      std::string key = node->is_leaf ? KeyString(node, Entries<LeafEntry>(node)[i]) :
+          KeyString(node, Entries<InternalEntry>(node)[i]);
+      printf(" \"%s\"", key.c_str());
+    }
+    printf("\n");
+    if (node->is_leaf) return;
+    for (int i = 0; i < node->num_values; ++i) {
+      PrintNode(Entries<InternalEntry>(node)[i].value, depth + 1);
+    }
+  }
+
+  // Number of values in tree.
+  int64_t size_;
+
+  NodePool pool_;
+  Node* root_;
+};
+
+#endif
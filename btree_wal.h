@@ -0,0 +1,427 @@
+#ifndef BTREE_WAL_H
+#define BTREE_WAL_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+#include "btree_mapped.h"
+
+struct WalOptions {
+  WalOptions() : commit_interval_us(1000), commit_bytes(1 << 20) {}
+
+  // Group commit window. A record is written and synced at most this long after it is
+  // appended, in one fdatasync with every record appended in the meantime.
+  int64_t commit_interval_us;
+  // The log is synced early once this many bytes are waiting.
+  size_t commit_bytes;
+};
+
+// Append-only log of tree mutations with group commit.
+//
+// Records are appended to a buffer in memory and return right away with their log
+// sequence number (LSN). A background thread writes the buffer and syncs it with a
+// single fdatasync once per commit window, or sooner when the buffer is large or
+// someone waits. WaitDurable() and Sync() block until records are on disk, so callers
+// choose when to pay for durability, and concurrent waiters share one sync.
+//
+// Records are blind writes: Put sets a key to a value and Remove deletes it, whatever
+// the key held before. Replaying a log on a state that already has some prefix of it
+// applied gives the same result as replaying it on the state before that prefix, so a
+// log can be replayed on a newer image. Every record has a checksum and replay stops
+// at the first record that is incomplete or does not match, which is where a crash cut
+// the log. Keys and values are stored as bytes and must be trivially copyable.
+template<typename Key = int64_t, typename Value = void*>
+class WriteAheadLog {
+ public:
+  enum Op {
+    PUT = 1,
+    REMOVE = 2,
+  };
+
+  // Called for each record on replay. value is unspecified for REMOVE.
+  typedef std::function<void(Op, const Key&, const Value&)> ReplayFn;
+
+ private:
+  static_assert(std::is_trivially_copyable<Key>::value, "Keys must be trivially copyable");
+  static_assert(std::is_trivially_copyable<Value>::value,
+      "Values must be trivially copyable");
+
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t key_size;
+    uint32_t value_size;
+    uint32_t record_size;
+  };
+
+  struct Record {
+    // Checksum of the bytes after it.
+    uint32_t checksum;
+    uint32_t op;
+    Key key;
+    Value value;
+  };
+
+  enum { FORMAT_VERSION = 1 };
+
+  static const char* Magic() { return "BTREEWAL"; }
+
+ public:
+  // Opens the log at path, creating it if it does not exist, and calls replay for
+  // every complete record in it in order. A torn tail is cut off before new records
+  // are appended. Returns NULL if the file cannot be read or written or was not
+  // written for this key and value size.
+  static WriteAheadLog* Open(const std::string& path, const WalOptions& options,
+      const ReplayFn& replay) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return NULL;
+    off_t valid_end = Replay(fd, replay);
+    if (valid_end < 0 || ftruncate(fd, valid_end) != 0 || fdatasync(fd) != 0) {
+      close(fd);
+      return NULL;
+    }
+    return new WriteAheadLog(fd, options);
+  }
+
+  // Writes and syncs every record appended so far.
+  ~WriteAheadLog() {
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      stop_ = true;
+    }
+    flush_cv_.notify_one();
+    flusher_.join();
+    close(fd_);
+  }
+
+  // Appends a record. Returns its LSN. The record is durable once WaitDurable() for
+  // the LSN returns.
+  uint64_t Put(const Key& key, const Value& value) { return Append(PUT, key, value); }
+  uint64_t Remove(const Key& key) { return Append(REMOVE, key, Value()); }
+
+  // Blocks until the record with lsn and every record before it are durable. Returns
+  // false if writing the log failed.
+  bool WaitDurable(uint64_t lsn) {
+    std::unique_lock<std::mutex> l(mutex_);
+    if (durable_lsn_ < lsn) {
+      ++num_waiters_;
+      flush_cv_.notify_one();
+      durable_cv_.wait(l, [this, lsn]() { return durable_lsn_ >= lsn || failed_; });
+      --num_waiters_;
+    }
+    return !failed_;
+  }
+
+  // Blocks until every record appended so far is durable.
+  bool Sync() {
+    uint64_t lsn;
+    {
+      std::lock_guard<std::mutex> l(mutex_);
+      lsn = next_lsn_ - 1;
+    }
+    return WaitDurable(lsn);
+  }
+
+  // Drops every record. Used once the records are part of a durable image. No records
+  // may be appended concurrently.
+  bool Reset() {
+    if (!Sync()) return false;
+    std::lock_guard<std::mutex> l(mutex_);
+    return ftruncate(fd_, sizeof(FileHeader)) == 0 && fdatasync(fd_) == 0;
+  }
+
+  // LSN of the last record appended, 0 if none.
+  uint64_t last_lsn() {
+    std::lock_guard<std::mutex> l(mutex_);
+    return next_lsn_ - 1;
+  }
+
+ private:
+  WriteAheadLog(int fd, const WalOptions& options)
+    : fd_(fd), options_(options), next_lsn_(1), durable_lsn_(0), num_waiters_(0),
+      stop_(false), failed_(false) {
+    flusher_ = std::thread([this]() { FlushLoop(); });
+  }
+  WriteAheadLog(const WriteAheadLog&) = delete;
+  WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+  // FNV-1a.
+  static uint32_t Checksum(const Record& record) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&record);
+    uint32_t hash = 2166136261U;
+    for (size_t i = sizeof(record.checksum); i < sizeof(Record); ++i) {
+      hash = (hash ^ bytes[i]) * 16777619U;
+    }
+    return hash;
+  }
+
+  static bool ReadFully(int fd, void* buf, size_t n) {
+    char* ptr = static_cast<char*>(buf);
+    while (n > 0) {
+      ssize_t r = read(fd, ptr, n);
+      if (r <= 0) return false;
+      ptr += r;
+      n -= r;
+    }
+    return true;
+  }
+
+  static bool WriteFully(int fd, const void* buf, size_t n) {
+    const char* ptr = static_cast<const char*>(buf);
+    while (n > 0) {
+      ssize_t r = write(fd, ptr, n);
+      if (r <= 0) return false;
+      ptr += r;
+      n -= r;
+    }
+    return true;
+  }
+
+  // Replays the records in fd, writing the file header first if the file is empty.
+  // Returns the offset after the last complete record, or -1 on an error.
+  static off_t Replay(int fd, const ReplayFn& replay) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    FileHeader expected;
+    memset(&expected, 0, sizeof(expected));
+    memcpy(expected.magic, Magic(), sizeof(expected.magic));
+    expected.version = FORMAT_VERSION;
+    expected.key_size = sizeof(Key);
+    expected.value_size = sizeof(Value);
+    expected.record_size = sizeof(Record);
+    if (st.st_size < static_cast<off_t>(sizeof(FileHeader))) {
+      // New log, or a crash while the header was written.
+      if (ftruncate(fd, 0) != 0 || !WriteFully(fd, &expected, sizeof(expected))) return -1;
+      return sizeof(FileHeader);
+    }
+
+    FileHeader header;
+    if (lseek(fd, 0, SEEK_SET) != 0 || !ReadFully(fd, &header, sizeof(header)) ||
+        memcmp(&header, &expected, sizeof(header)) != 0) {
+      return -1;
+    }
+    off_t end = sizeof(FileHeader);
+    std::vector<Record> records(4096);
+    while (end + static_cast<off_t>(sizeof(Record)) <= st.st_size) {
+      size_t n = (st.st_size - end) / sizeof(Record);
+      if (n > records.size()) n = records.size();
+      if (!ReadFully(fd, records.data(), n * sizeof(Record))) return -1;
+      for (size_t i = 0; i < n; ++i) {
+        const Record& record = records[i];
+        if (record.checksum != Checksum(record) ||
+            (record.op != PUT && record.op != REMOVE)) {
+          return end;
+        }
+        replay(static_cast<Op>(record.op), record.key, record.value);
+        end += sizeof(Record);
+      }
+    }
+    return end;
+  }
+
+  uint64_t Append(Op op, const Key& key, const Value& value) {
+    Record record;
+    // Zero the padding so the checksum is deterministic.
+    memset(&record, 0, sizeof(record));
+    record.op = op;
+    record.key = key;
+    record.value = value;
+    record.checksum = Checksum(record);
+    const char* bytes = reinterpret_cast<const char*>(&record);
+
+    std::lock_guard<std::mutex> l(mutex_);
+    bool was_empty = buffer_.empty();
+    buffer_.insert(buffer_.end(), bytes, bytes + sizeof(record));
+    if (was_empty || buffer_.size() >= options_.commit_bytes) flush_cv_.notify_one();
+    return next_lsn_++;
+  }
+
+  // Body of the flusher thread. Once there is a record, waits for the commit window
+  // to gather more, or less if the buffer is large or a thread waits. Then takes the
+  // buffered records and writes and syncs them without holding the lock, so appends
+  // continue during the sync.
+  void FlushLoop() {
+    std::vector<char> writing;
+    std::unique_lock<std::mutex> l(mutex_);
+    while (true) {
+      flush_cv_.wait(l, [this]() { return stop_ || !buffer_.empty(); });
+      flush_cv_.wait_for(l, std::chrono::microseconds(options_.commit_interval_us),
+          [this]() {
+            return stop_ || num_waiters_ > 0 || buffer_.size() >= options_.commit_bytes;
+          });
+      if (!buffer_.empty()) {
+        writing.swap(buffer_);
+        uint64_t lsn = next_lsn_ - 1;
+        l.unlock();
+        bool ok = WriteFully(fd_, writing.data(), writing.size()) && fdatasync(fd_) == 0;
+        writing.clear();
+        l.lock();
+        if (ok) {
+          durable_lsn_ = lsn;
+        } else {
+          failed_ = true;
+        }
+        durable_cv_.notify_all();
+      }
+      if (stop_ && buffer_.empty()) break;
+    }
+  }
+
+  const int fd_;
+  const WalOptions options_;
+  std::thread flusher_;
+
+  // Protects everything below.
+  std::mutex mutex_;
+  // Signals the flusher and the threads in WaitDurable().
+  std::condition_variable flush_cv_;
+  std::condition_variable durable_cv_;
+  // Records appended and not yet handed to the flusher.
+  std::vector<char> buffer_;
+  uint64_t next_lsn_;
+  // Every record up to this LSN is on disk.
+  uint64_t durable_lsn_;
+  int num_waiters_;
+  bool stop_;
+  bool failed_;
+};
+
+// BTree whose mutations are logged to a WriteAheadLog. The state on disk is an image
+// of the tree in the format of MappedBTree, written by Checkpoint(), and the log of the
+// mutations since. Open() recovers the tree from both.
+//
+// Mutations return before their record is durable. The log syncs them within the
+// commit window, and Sync() or log()->WaitDurable() wait for them. Only mutations that
+// change the tree are logged. Values written through FindOrInsert() cannot be seen by
+// the log, so it is not offered. Like BTree, this is not thread safe.
+template<typename Key = int64_t, typename Value = void*,
+    typename Compare = std::less<Key>, size_t NODE_BYTES = 256>
+class LoggedBTree {
+ public:
+  typedef BTree<Key, Value, Compare, NODE_BYTES> Tree;
+  typedef WriteAheadLog<Key, Value> Log;
+  typedef typename Tree::Iterator Iterator;
+
+  // Recovers the tree from the image at image_path, if there is one, and the log at
+  // log_path, and continues the log. Returns NULL if either cannot be read or the log
+  // cannot be written.
+  static LoggedBTree* Open(const std::string& image_path, const std::string& log_path,
+      const WalOptions& options = WalOptions()) {
+    LoggedBTree* logged = new LoggedBTree(image_path);
+    if (access(image_path.c_str(), F_OK) == 0) {
+      MappedBTree<Key, Value, Compare>* image =
+          MappedBTree<Key, Value, Compare>::OpenMapped(image_path);
+      if (image == NULL) {
+        delete logged;
+        return NULL;
+      }
+      std::vector<std::pair<Key, Value>> pairs;
+      pairs.reserve(image->size());
+      for (auto it = image->Begin(); !it.AtEnd(); it.Next()) {
+        pairs.push_back(std::make_pair(it.key(), it.value()));
+      }
+      delete image;
+      logged->tree_.BulkLoad(pairs.begin(), pairs.end());
+    }
+    Tree* tree = &logged->tree_;
+    logged->log_ = Log::Open(log_path, options,
+        [tree](typename Log::Op op, const Key& key, const Value& value) {
+          if (op == Log::PUT) {
+            tree->Upsert(key, value);
+          } else {
+            tree->Remove(key);
+          }
+        });
+    if (logged->log_ == NULL) {
+      delete logged;
+      return NULL;
+    }
+    return logged;
+  }
+
+  // Syncs the log.
+  ~LoggedBTree() { delete log_; }
+
+  Iterator Find(const Key& key) const { return tree_.Find(key); }
+  Iterator LowerBound(const Key& key) const { return tree_.LowerBound(key); }
+  Iterator Begin() const { return tree_.Begin(); }
+  Iterator End() const { return tree_.End(); }
+  int64_t size() const { return tree_.size(); }
+
+  Iterator Insert(const Key& key, const Value& value) {
+    Iterator it = tree_.Insert(key, value);
+    if (!it.AtEnd()) log_->Put(key, value);
+    return it;
+  }
+
+  Iterator Upsert(const Key& key, const Value& value) {
+    log_->Put(key, value);
+    return tree_.Upsert(key, value);
+  }
+
+  bool Update(const Key& key, const Value& value) {
+    if (!tree_.Update(key, value)) return false;
+    log_->Put(key, value);
+    return true;
+  }
+
+  bool Remove(const Key& key) {
+    if (!tree_.Remove(key)) return false;
+    log_->Remove(key);
+    return true;
+  }
+
+  // Blocks until every mutation so far is durable. Returns false if writing the log
+  // failed.
+  bool Sync() { return log_->Sync(); }
+
+  // Writes the tree as the new image and empties the log. The image is written to a
+  // temporary file that replaces the old one once it is synced, and only then is the
+  // log emptied. A crash in between replays the whole log on the new image, which the
+  // blind writes in the log make harmless.
+  bool Checkpoint() {
+    std::string tmp_path = image_path_ + ".tmp";
+    if (!tree_.Save(tmp_path)) return false;
+    int fd = open(tmp_path.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    if (!ok || rename(tmp_path.c_str(), image_path_.c_str()) != 0) return false;
+    // Make the rename durable.
+    std::string dir = image_path_.substr(0, image_path_.find_last_of('/') + 1);
+    fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    ok = fsync(fd) == 0;
+    close(fd);
+    return ok && log_->Reset();
+  }
+
+  const Tree& tree() const { return tree_; }
+  Log* log() { return log_; }
+
+ private:
+  explicit LoggedBTree(const std::string& image_path)
+    : image_path_(image_path), log_(NULL) {}
+  LoggedBTree(const LoggedBTree&) = delete;
+  LoggedBTree& operator=(const LoggedBTree&) = delete;
+
+  std::string image_path_;
+  Tree tree_;
+  Log* log_;
+};
+
+#endif
@@ -0,0 +1,176 @@
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <stdlib.h>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// Epoch based memory reclamation for the concurrent trees.
+//
+// Readers in those trees never take locks, so a node that a writer unlinks may still
+// be read by other threads for a while. Instead of freeing it, the writer retires it.
+// Each thread publishes the global epoch when it starts an operation (see Guard) and
+// clears it when it is done. A node retired in epoch E is freed once every thread
+// that is inside an operation has published an epoch > E: those threads started after
+// the node was unlinked and cannot reach it.
+//
+// There is one manager for the process. Retired pointers are kept per thread and
+// reclaimed in batches, so retiring does not take a lock.
+class EpochManager {
+ private:
+  struct ThreadState;
+
+ public:
+  static EpochManager* Global() {
+    static EpochManager manager;
+    return &manager;
+  }
+
+  // Marks the calling thread as inside an operation for the lifetime of the guard.
+  class Guard {
+   public:
+    explicit Guard(EpochManager* manager) : state_(manager->Enter()) {}
+    ~Guard() { state_->epoch.store(INACTIVE, std::memory_order_release); }
+
+   private:
+    ThreadState* state_;
+  };
+
+  ~EpochManager() {
+    ThreadState* state = threads_.load();
+    while (state != NULL) {
+      ThreadState* next = state->next;
+      FreeAll(&state->retired);
+      delete state;
+      state = next;
+    }
+    FreeAll(&orphans_);
+  }
+
+  // Frees ptr with free() once no thread can still be reading it. Must be called by a
+  // thread holding a Guard, after ptr is no longer reachable.
+  void Retire(void* ptr) {
+    ThreadState* state = LocalState();
+    state->retired.push_back(std::make_pair(global_epoch_.load(), ptr));
+    if (state->retired.size() >= RECLAIM_BATCH) Reclaim(state);
+  }
+
+  // Small index for the calling thread, unique among the running threads. Indexes of
+  // threads that exited are reused.
+  int ThreadIndex() { return LocalState()->index; }
+
+ private:
+  static const uint64_t INACTIVE = ~0ULL;
+  static const size_t RECLAIM_BATCH = 64;
+
+  typedef std::vector<std::pair<uint64_t, void*>> RetiredList;
+
+  struct ThreadState {
+    // Epoch the thread is in or INACTIVE.
+    std::atomic<uint64_t> epoch;
+    std::atomic<bool> in_use;
+    ThreadState* next;
+    int index;
+    RetiredList retired;
+  };
+
+  // Releases the thread's state when the thread exits.
+  struct ThreadHandle {
+    ThreadHandle() : manager(NULL), state(NULL) {}
+    ~ThreadHandle() {
+      if (state != NULL) manager->Release(state);
+    }
+
+    EpochManager* manager;
+    ThreadState* state;
+  };
+
+  EpochManager() : global_epoch_(0), threads_(NULL), num_threads_(0) {}
+
+  ThreadState* Enter() {
+    ThreadState* state = LocalState();
+    // Sequentially consistent so the store is visible before any node is read.
+    state->epoch.store(global_epoch_.load());
+    return state;
+  }
+
+  ThreadState* LocalState() {
+    static thread_local ThreadHandle handle;
+    if (handle.state == NULL) {
+      handle.manager = this;
+      handle.state = Acquire();
+    }
+    return handle.state;
+  }
+
+  // Returns a free ThreadState, reusing one of an exited thread if possible.
+  ThreadState* Acquire() {
+    for (ThreadState* state = threads_.load(); state != NULL; state = state->next) {
+      bool in_use = false;
+      if (state->in_use.compare_exchange_strong(in_use, true)) return state;
+    }
+    ThreadState* state = new ThreadState();
+    state->epoch.store(INACTIVE);
+    state->in_use.store(true);
+    state->index = num_threads_.fetch_add(1);
+    state->next = threads_.load();
+    while (!threads_.compare_exchange_weak(state->next, state)) {}
+    return state;
+  }
+
+  void Release(ThreadState* state) {
+    {
+      std::lock_guard<std::mutex> l(orphans_lock_);
+      orphans_.insert(orphans_.end(), state->retired.begin(), state->retired.end());
+    }
+    state->retired.clear();
+    state->in_use.store(false);
+  }
+
+  // Advances the epoch and frees everything retired before the oldest epoch any
+  // thread is still in.
+  void Reclaim(ThreadState* state) {
+    global_epoch_.fetch_add(1);
+    uint64_t min_epoch = INACTIVE;
+    for (ThreadState* s = threads_.load(); s != NULL; s = s->next) {
+      uint64_t epoch = s->epoch.load();
+      if (epoch < min_epoch) min_epoch = epoch;
+    }
+    FreeBefore(&state->retired, min_epoch);
+    std::unique_lock<std::mutex> l(orphans_lock_, std::try_to_lock);
+    if (l.owns_lock()) FreeBefore(&orphans_, min_epoch);
+  }
+
+  static void FreeBefore(RetiredList* list, uint64_t min_epoch) {
+    size_t kept = 0;
+    for (size_t i = 0; i < list->size(); ++i) {
+      if ((*list)[i].first < min_epoch) {
+        free((*list)[i].second);
+      } else {
+        (*list)[kept++] = (*list)[i];
+      }
+    }
+    list->resize(kept);
+  }
+
+  static void FreeAll(RetiredList* list) {
+    for (size_t i = 0; i < list->size(); ++i) {
+      free((*list)[i].second);
+    }
+    list->clear();
+  }
+
+  std::atomic<uint64_t> global_epoch_;
+  // Every thread that ever used the manager. Only grows.
+  std::atomic<ThreadState*> threads_;
+  std::atomic<int> num_threads_;
+
+  // Retired pointers of threads that exited.
+  std::mutex orphans_lock_;
+  RetiredList orphans_;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef HASH_INDEX_H
+#define HASH_INDEX_H
+
+#include <assert.h>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Hash table from keys to non-NULL pointers, which a BTree keeps in front of its leaves
+// to find the leaf of a key without descending the tree. See the HASH_INDEX argument
+// of BTree.
+//
+// Open addressing with linear probing: a key is in the first slot from its home slot
+// that holds it, and an empty slot ends the search. The table doubles before it is
+// half full, so a probe seldom leaves the cache line of the home slot. Erase() shifts
+// the rest of the run back into the hole instead of leaving a tombstone, so lookups do
+// not slow down as keys churn. The table only shrinks on Clear().
+//
+// Keys are hashed with std::hash and compared with ==, which must agree with the
+// ordering of the tree. Keys must be trivially copyable.
+template<typename Key, typename Target, bool ENABLED = true>
+class HashIndex {
+ public:
+  HashIndex() : size_(0), mask_(0), shift_(64) {}
+
+  // Returns the target of key, or NULL if it is not in the table.
+  Target Find(const Key& key) const {
+    if (size_ == 0) return NULL;
+    for (size_t i = Home(key); ; i = (i + 1) & mask_) {
+      const Slot& slot = slots_[i];
+      if (slot.target == NULL) return NULL;
+      if (slot.key == key) return slot.target;
+    }
+  }
+
+  // Sets the target of key, adding key if it is not in the table.
+  void Set(const Key& key, Target target) {
+    assert(target != NULL);
+    if (2 * (size_ + 1) > slots_.size()) Resize(slots_.empty() ? 16 : 2 * slots_.size());
+    size_t i = Home(key);
+    for (; slots_[i].target != NULL; i = (i + 1) & mask_) {
+      if (slots_[i].key == key) {
+        slots_[i].target = target;
+        return;
+      }
+    }
+    slots_[i].key = key;
+    slots_[i].target = target;
+    ++size_;
+  }
+
+  // Removes key if it is in the table.
+  void Erase(const Key& key) {
+    if (size_ == 0) return;
+    size_t i = Home(key);
+    for (; slots_[i].target != NULL; i = (i + 1) & mask_) {
+      if (slots_[i].key == key) break;
+    }
+    if (slots_[i].target == NULL) return;
+    // Slot i is a hole. A later key in the run moves into it unless its home is after
+    // the hole, in which case the hole would hide it from Find().
+    for (size_t j = (i + 1) & mask_; slots_[j].target != NULL; j = (j + 1) & mask_) {
+      size_t distance = (j - Home(slots_[j].key)) & mask_;
+      if (distance >= ((j - i) & mask_)) {
+        slots_[i] = slots_[j];
+        i = j;
+      }
+    }
+    slots_[i].target = NULL;
+    --size_;
+  }
+
+  // Makes room for n keys without growing the table again.
+  void Reserve(size_t n) {
+    size_t capacity = 16;
+    while (capacity < 2 * n) capacity *= 2;
+    if (capacity > slots_.size()) Resize(capacity);
+  }
+
+  // Removes every key and releases the table.
+  void Clear() {
+    std::vector<Slot>().swap(slots_);
+    size_ = 0;
+    mask_ = 0;
+    shift_ = 64;
+  }
+
+  size_t size() const { return size_; }
+
+  // Bytes allocated for the table.
+  size_t bytes() const { return slots_.capacity() * sizeof(Slot); }
+
+ private:
+  struct Slot {
+    Key key;
+    // NULL if the slot is empty.
+    Target target;
+  };
+
+  // Fibonacci hashing: the multiply mixes every bit of the hash into the top bits,
+  // which pick the slot. std::hash of an integer is the integer itself.
+  size_t Home(const Key& key) const {
+    uint64_t hash = std::hash<Key>()(key);
+    return (hash * 0x9E3779B97F4A7C15ULL) >> shift_;
+  }
+
+  // Rehashes every key into a table of capacity slots, a power of two.
+  void Resize(size_t capacity) {
+    std::vector<Slot> old;
+    old.swap(slots_);
+    slots_.resize(capacity);
+    for (size_t i = 0; i < capacity; ++i) slots_[i].target = NULL;
+    mask_ = capacity - 1;
+    shift_ = 64;
+    for (size_t c = capacity; c > 1; c /= 2) --shift_;
+    size_ = 0;
+    for (size_t i = 0; i < old.size(); ++i) {
+      if (old[i].target != NULL) Set(old[i].key, old[i].target);
+    }
+  }
+
+  std::vector<Slot> slots_;
+  size_t size_;
+  size_t mask_;
+  // 64 - log2 of the capacity.
+  int shift_;
+};
+
+// Without the index there is nothing to keep: every key is missing.
+template<typename Key, typename Target>
+class HashIndex<Key, Target, false> {
+ public:
+  Target Find(const Key& key) const { return NULL; }
+  void Set(const Key& key, Target target) {}
+  void Erase(const Key& key) {}
+  void Reserve(size_t n) {}
+  void Clear() {}
+  size_t size() const { return 0; }
+  size_t bytes() const { return 0; }
+};
+
+#endif
@@ -0,0 +1,261 @@
+#ifndef KEY_SEARCH_H
+#define KEY_SEARCH_H
+
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+#include <immintrin.h>
+#endif
+
+// Search kernels over a sorted array of keys inside a single node.
+//
+// The vector versions compare the search key against a whole block of keys and turn
+// the result into a bitmask, so there is one (well predicted) branch per block instead
+// of one per key. Callers must size the key array to a multiple of KeySearch::PAD:
+// the last block is loaded in full and the lanes past n are masked off. The 8 and 16
+// bit kernels are only used directly; their callers must keep the array readable up to
+// the next multiple of 32 bytes.
+
+// Returns the index of the first key in keys[0, n) that is >= key, or n if every key
+// is smaller.
+template<typename Key>
+inline int KeyLowerBoundScalar(const Key* keys, int n, Key key) {
+  int i = 0;
+  while (i < n && keys[i] < key) ++i;
+  return i;
+}
+
+#if defined(__AVX2__)
+
+inline int KeyLowerBound(const int64_t* keys, int n, int64_t key) {
+  const __m256i needle = _mm256_set1_epi64x(key);
+  for (int i = 0; i < n; i += 4) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+    // Bit j is set if keys[i + j] < key.
+    __m256i lt = _mm256_cmpgt_epi64(needle, block);
+    int less = _mm256_movemask_pd(_mm256_castsi256_pd(lt));
+    // Lanes at or past n always stop the scan.
+    int valid = n - i >= 4 ? 0xF : (1 << (n - i)) - 1;
+    int stop = (~less | ~valid) & 0xF;
+    if (stop != 0) return i + __builtin_ctz(stop);
+  }
+  return n;
+}
+
+inline int KeyLowerBound(const int32_t* keys, int n, int32_t key) {
+  const __m256i needle = _mm256_set1_epi32(key);
+  for (int i = 0; i < n; i += 8) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+    __m256i lt = _mm256_cmpgt_epi32(needle, block);
+    int less = _mm256_movemask_ps(_mm256_castsi256_ps(lt));
+    int valid = n - i >= 8 ? 0xFF : (1 << (n - i)) - 1;
+    int stop = (~less | ~valid) & 0xFF;
+    if (stop != 0) return i + __builtin_ctz(stop);
+  }
+  return n;
+}
+
+inline int KeyLowerBound(const int16_t* keys, int n, int16_t key) {
+  const __m256i needle = _mm256_set1_epi16(key);
+  for (int i = 0; i < n; i += 16) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+    // Two mask bits per key.
+    uint32_t less = _mm256_movemask_epi8(_mm256_cmpgt_epi16(needle, block));
+    uint32_t valid = n - i >= 16 ? 0xFFFFFFFF : (1u << (2 * (n - i))) - 1;
+    uint32_t stop = ~less | ~valid;
+    if (stop != 0) return i + __builtin_ctz(stop) / 2;
+  }
+  return n;
+}
+
+inline int KeyLowerBound(const int8_t* keys, int n, int8_t key) {
+  const __m256i needle = _mm256_set1_epi8(key);
+  for (int i = 0; i < n; i += 32) {
+    __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(keys + i));
+    uint32_t less = _mm256_movemask_epi8(_mm256_cmpgt_epi8(needle, block));
+    uint32_t valid = n - i >= 32 ? 0xFFFFFFFF : (1u << (n - i)) - 1;
+    uint32_t stop = ~less | ~valid;
+    if (stop != 0) return i + __builtin_ctz(stop);
+  }
+  return n;
+}
+
+#elif defined(__SSE4_2__)
+
+inline int KeyLowerBound(const int64_t* keys, int n, int64_t key) {
+  const __m128i needle = _mm_set1_epi64x(key);
+  for (int i = 0; i < n; i += 2) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+    int less = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(needle, block)));
+    int valid = n - i >= 2 ? 0x3 : 0x1;
+    int stop = (~less | ~valid) & 0x3;
+    if (stop != 0) return i + __builtin_ctz(stop);
+  }
+  return n;
+}
+
+inline int KeyLowerBound(const int32_t* keys, int n, int32_t key) {
+  const __m128i needle = _mm_set1_epi32(key);
+  for (int i = 0; i < n; i += 4) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+    int less = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(needle, block)));
+    int valid = n - i >= 4 ? 0xF : (1 << (n - i)) - 1;
+    int stop = (~less | ~valid) & 0xF;
+    if (stop != 0) return i + __builtin_ctz(stop);
+  }
+  return n;
+}
+
+inline int KeyLowerBound(const int16_t* keys, int n, int16_t key) {
+  const __m128i needle = _mm_set1_epi16(key);
+  for (int i = 0; i < n; i += 8) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+    int less = _mm_movemask_epi8(_mm_cmpgt_epi16(needle, block));
+    int valid = n - i >= 8 ? 0xFFFF : (1 << (2 * (n - i))) - 1;
+    int stop = (~less | ~valid) & 0xFFFF;
+    if (stop != 0) return i + __builtin_ctz(stop) / 2;
+  }
+  return n;
+}
+
+inline int KeyLowerBound(const int8_t* keys, int n, int8_t key) {
+  const __m128i needle = _mm_set1_epi8(key);
+  for (int i = 0; i < n; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + i));
+    int less = _mm_movemask_epi8(_mm_cmpgt_epi8(needle, block));
+    int valid = n - i >= 16 ? 0xFFFF : (1 << (n - i)) - 1;
+    int stop = (~less | ~valid) & 0xFFFF;
+    if (stop != 0) return i + __builtin_ctz(stop);
+  }
+  return n;
+}
+
+#else
+
+inline int KeyLowerBound(const int64_t* keys, int n, int64_t key) {
+  return KeyLowerBoundScalar(keys, n, key);
+}
+
+inline int KeyLowerBound(const int32_t* keys, int n, int32_t key) {
+  return KeyLowerBoundScalar(keys, n, key);
+}
+
+inline int KeyLowerBound(const int16_t* keys, int n, int16_t key) {
+  return KeyLowerBoundScalar(keys, n, key);
+}
+
+inline int KeyLowerBound(const int8_t* keys, int n, int8_t key) {
+  return KeyLowerBoundScalar(keys, n, key);
+}
+
+#endif
+
+// Search policies. Each finds the first key in a node that is not smaller than the
+// search key and says how far key arrays must be padded. BTree takes the policy as a
+// template argument, so the search can be picked to suit the node size and the keys.
+
+// Compares the keys one by one. Best for small nodes and keys that are expensive to
+// compare.
+template<typename Key, typename Compare>
+struct LinearKeySearch {
+  // Key arrays must be padded to a multiple of this many keys.
+  enum { PAD = 1 };
+
+  static int LowerBound(const Key* keys, int n, const Key& key, const Compare& comp) {
+    int i = 0;
+    while (i < n && comp(keys[i], key)) ++i;
+    return i;
+  }
+};
+
+// Binary search without branches on the comparisons: each step moves base with a
+// conditional move, so the loop runs log2(n) times whatever the keys are and never
+// mispredicts. Scales to large nodes.
+template<typename Key, typename Compare>
+struct BinaryKeySearch {
+  enum { PAD = 1 };
+
+  static int LowerBound(const Key* keys, int n, const Key& key, const Compare& comp) {
+    if (n == 0) return 0;
+    const Key* base = keys;
+    while (n > 1) {
+      int half = n / 2;
+      // The result is in [base, base + n]. Keep the upper half if its first key,
+      // base[half], is still too small.
+      base = comp(base[half], key) ? base + half : base;
+      n -= half;
+    }
+    return (base - keys) + comp(*base, key);
+  }
+};
+
+// Guesses the position of the key from the smallest and the largest key of the node
+// and scans from there. This takes a few comparisons when the keys are spread
+// evenly, and degrades to a linear scan when they are not. Only for integer keys in
+// increasing order.
+template<typename Key, typename Compare>
+struct InterpolationKeySearch {
+  static_assert(std::is_integral<Key>::value &&
+      std::is_same<Compare, std::less<Key> >::value,
+      "Interpolation search needs integer keys in increasing order");
+  enum { PAD = 1 };
+
+  static int LowerBound(const Key* keys, int n, const Key& key, const Compare&) {
+    if (n == 0 || key <= keys[0]) return 0;
+    if (key > keys[n - 1]) return n;
+    // keys[0] < key <= keys[n - 1], so the range is not empty. The guess is made in
+    // floating point, which cannot overflow.
+    double fraction = (static_cast<double>(key) - keys[0]) /
+        (static_cast<double>(keys[n - 1]) - keys[0]);
+    int i = static_cast<int>(fraction * (n - 1));
+    if (i < 1) i = 1;
+    if (i > n - 1) i = n - 1;
+    while (keys[i - 1] >= key) --i;
+    while (keys[i] < key) ++i;
+    return i;
+  }
+};
+
+// Linear search with the vector kernels above, which compare a block of keys at once.
+// Only for the key types with a kernel, signed integers in increasing order.
+template<typename Key, typename Compare>
+struct SimdKeySearch {
+  static_assert(sizeof(Key) == 0, "No vector search kernel for this key type");
+};
+
+template<>
+struct SimdKeySearch<int64_t, std::less<int64_t> > {
+  enum { PAD = 4 };
+
+  static int LowerBound(const int64_t* keys, int n, int64_t key,
+      const std::less<int64_t>&) {
+    return KeyLowerBound(keys, n, key);
+  }
+};
+
+template<>
+struct SimdKeySearch<int32_t, std::less<int32_t> > {
+  enum { PAD = 8 };
+
+  static int LowerBound(const int32_t* keys, int n, int32_t key,
+      const std::less<int32_t>&) {
+    return KeyLowerBound(keys, n, key);
+  }
+};
+
+// The default policy. Signed integer keys in increasing order use the vector kernels
+// and everything else a linear scan using the comparator.
+template<typename Key, typename Compare>
+struct KeySearch : public LinearKeySearch<Key, Compare> {};
+
+template<>
+struct KeySearch<int64_t, std::less<int64_t> >
+  : public SimdKeySearch<int64_t, std::less<int64_t> > {};
+
+template<>
+struct KeySearch<int32_t, std::less<int32_t> >
+  : public SimdKeySearch<int32_t, std::less<int32_t> > {};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef NODE_ALLOCATOR_H
+#define NODE_ALLOCATOR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cstdint>
+#include <vector>
+
+// Interface the trees use to get memory for their nodes. Returned memory is aligned to
+// a cache line. Free is always called with the size that was passed to Allocate.
+class NodeAllocator {
+ public:
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  virtual ~NodeAllocator() {}
+
+  virtual void* Allocate(size_t size) = 0;
+  virtual void Free(void* ptr, size_t size) = 0;
+
+ protected:
+  static void* AllocateAligned(size_t size) {
+    void* ptr = NULL;
+    if (posix_memalign(&ptr, CACHE_LINE_SIZE, size) != 0) {
+      printf("Out of memory allocating %zu bytes.\n", size);
+      abort();
+    }
+    return ptr;
+  }
+};
+
+// Allocates every node individually from the system allocator.
+class MallocNodeAllocator : public NodeAllocator {
+ public:
+  virtual void* Allocate(size_t size) { return AllocateAligned(size); }
+  virtual void Free(void* ptr, size_t size) { free(ptr); }
+};
+
+// Slab allocator for nodes. Nodes are carved out of large chunks and rounded up to a
+// whole number of cache lines. Freed nodes go on a free list per size and are handed
+// out again before any new memory is carved. Chunks are only returned to the system
+// when the pool is destroyed, which releases everything at once without having to
+// visit individual nodes.
+// Not thread safe.
+class NodePool : public NodeAllocator {
+ public:
+  explicit NodePool(size_t chunk_size = 1 << 20)
+    : chunk_size_(chunk_size), chunk_ptr_(NULL), chunk_end_(NULL), bytes_reserved_(0) {
+  }
+
+  virtual ~NodePool() {
+    for (size_t i = 0; i < chunks_.size(); ++i) {
+      free(chunks_[i]);
+    }
+  }
+
+  virtual void* Allocate(size_t size) {
+    FreeList* list = GetFreeList(size);
+    if (list->head != NULL) {
+      FreeBlock* block = list->head;
+      list->head = block->next;
+      return block;
+    }
+    size = list->size;
+    if (chunk_ptr_ + size > chunk_end_) NewChunk(size);
+    void* result = chunk_ptr_;
+    chunk_ptr_ += size;
+    return result;
+  }
+
+  virtual void Free(void* ptr, size_t size) {
+    FreeList* list = GetFreeList(size);
+    FreeBlock* block = reinterpret_cast<FreeBlock*>(ptr);
+    block->next = list->head;
+    list->head = block;
+  }
+
+  // Number of chunks allocated from the system.
+  int64_t num_chunks() const { return chunks_.size(); }
+
+  // Total bytes allocated from the system.
+  int64_t bytes_reserved() const { return bytes_reserved_; }
+
+ private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct FreeList {
+    // Block size, rounded up to a cache line.
+    size_t size;
+    FreeBlock* head;
+  };
+
+  // Returns the free list for blocks of 'size' bytes, creating it if needed. Trees use
+  // one or two node sizes, and a CsbBTree one per size of node group, which is at most
+  // its internal order, so this is a short linear search.
+  FreeList* GetFreeList(size_t size) {
+    size = (size + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    for (size_t i = 0; i < free_lists_.size(); ++i) {
+      if (free_lists_[i].size == size) return &free_lists_[i];
+    }
+    FreeList list = { size, NULL };
+    free_lists_.push_back(list);
+    return &free_lists_.back();
+  }
+
+  // Starts a new chunk that can hold at least one block of 'size' bytes. The unused
+  // tail of the current chunk is abandoned.
+  void NewChunk(size_t size) {
+    size_t chunk_size = chunk_size_ < size ? size : chunk_size_;
+    chunk_ptr_ = reinterpret_cast<uint8_t*>(AllocateAligned(chunk_size));
+    chunk_end_ = chunk_ptr_ + chunk_size;
+    chunks_.push_back(chunk_ptr_);
+    bytes_reserved_ += chunk_size;
+  }
+
+  const size_t chunk_size_;
+
+  // Unused part of the current chunk.
+  uint8_t* chunk_ptr_;
+  uint8_t* chunk_end_;
+
+  std::vector<void*> chunks_;
+  std::vector<FreeList> free_lists_;
+  int64_t bytes_reserved_;
+};
+
+#endif
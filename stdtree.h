@@ -66,6 +66,8 @@ class StdTree {
     for (auto& v: map_) {
       keys->push_back(v.first);
     }
+    // unordered_map iterates in hash order.
+    std::sort(keys->begin(), keys->end());
     if (backwards) std::reverse(keys->begin(), keys->end());
   }
 
@@ -5,16 +5,35 @@
 #include <assert.h>
 #include <vector>
 #include <algorithm>
+#include <string>
 
 // Must be 3+
 #define ORDER 7
 
+// Node size for BTree in the tests. Small nodes make splits and merges frequent.
+#define TEST_NODE_BYTES 144
+
 #include "btree.h"
+#include "btree_compressed.h"
+#include "btree_csb.h"
+#include "btree_olc.h"
+#include "btree_string.h"
 #include "btree_v1.h"
+#include "btree_wal.h"
 #include "stdtree.h"
 
 using namespace std;
 
+typedef BTree<int64_t, void*, std::less<int64_t>, TEST_NODE_BYTES> TestBTree;
+// Validates itself after every change, for tests on small trees.
+typedef BTree<int64_t, void*, std::less<int64_t>, TEST_NODE_BYTES, KeySearch, 1>
+    TestCheckedBTree;
+typedef BTree<int64_t, void*, std::less<int64_t>, TEST_NODE_BYTES, KeySearch,
+    BTREE_VALIDATE_EVERY, true> TestCountedBTree;
+typedef BTree<int64_t, void*, std::less<int64_t>, TEST_NODE_BYTES, KeySearch,
+    BTREE_VALIDATE_EVERY, false, true> TestHashedBTree;
+typedef BTreeOLC<int64_t, void*, std::less<int64_t>, TEST_NODE_BYTES> TestBTreeOLC;
+
 template<typename T>
 bool Insert(T* tree, int64_t key) {
   return !tree->Insert(key, NULL).AtEnd();
@@ -48,6 +67,19 @@ void PrintAllKeys(const T* tree, bool backwards = false) {
   printf("\n");
 }
 
+// Checks that tree, or a snapshot of one, holds exactly the pairs in reference, a
+// std::map with the same ordering, in order.
+template<typename Tree, typename Map>
+void VerifyContents(const Tree& tree, const Map& reference) {
+  assert(tree.size() == static_cast<int64_t>(reference.size()));
+  typename Map::const_iterator e = reference.begin();
+  for (typename Tree::Iterator it = tree.Begin(); !it.AtEnd(); it.Next(), ++e) {
+    assert(it.key() == e->first);
+    assert(it.value() == e->second);
+  }
+  assert(e == reference.end());
+}
+
 enum Op {
   FIND,
   INSERT,
@@ -57,5 +89,83 @@ enum Op {
   MAX_OP
 };
 
+// Checks that LowerBound(key) finds the same key in tree and in reference.
+template<typename Tree, typename Map>
+void VerifyLowerBound(const Tree& tree, const Map& reference,
+    const typename Map::key_type& key) {
+  typename Tree::Iterator lower = tree.LowerBound(key);
+  typename Map::const_iterator expected = reference.lower_bound(key);
+  assert(lower.AtEnd() == (expected == reference.end()));
+  if (!lower.AtEnd()) assert(lower.key() == expected->first);
+}
+
+// Prints the problem Validate() finds in tree, if any, and the tree, and fails.
+template<typename Tree>
+void VerifyValid(const Tree& tree) {
+  std::string error;
+  if (!tree.Validate(&error)) {
+    printf("Invalid tree: %s\n", error.c_str());
+    tree.DebugPrint();
+    assert(false);
+  }
+}
+
+// Runs num_ops random finds, updates, inserts, upserts and removes on tree and on
+// reference, a std::map with the same ordering, and checks that they agree. Keys come
+// from make_key() and values from make_value(rand()). After each op, step(key, i) runs
+// the checks of a particular kind of tree. At the end the tree must iterate over the
+// pairs of reference in order.
+template<typename Tree, typename Map, typename MakeKey, typename Step>
+void RunRandomOps(Tree* tree, Map* reference, int64_t num_ops, const MakeKey& make_key,
+    typename Map::mapped_type (*make_value)(int64_t), const Step& step) {
+  typedef typename Map::key_type Key;
+  typedef typename Map::mapped_type Value;
+  for (int64_t i = 0; i < num_ops; ++i) {
+    Key key = make_key();
+    Value value = make_value(rand());
+    switch ((Op)(rand() % MAX_OP)) {
+      case FIND: {
+        typename Tree::Iterator it = tree->Find(key);
+        typename Map::const_iterator expected = reference->find(key);
+        assert(it.AtEnd() == (expected == reference->end()));
+        if (!it.AtEnd()) {
+          assert(it.key() == key);
+          assert(it.value() == expected->second);
+        }
+        break;
+      }
+      case UPDATE: {
+        bool exists = reference->count(key) == 1;
+        if (exists) (*reference)[key] = value;
+        assert(tree->Update(key, value) == exists);
+        break;
+      }
+      case INSERT:
+        assert(tree->Insert(key, value).AtEnd() ==
+            !reference->insert(std::make_pair(key, value)).second);
+        break;
+      case UPSERT:
+        (*reference)[key] = value;
+        assert(tree->Upsert(key, value).value() == value);
+        break;
+      case REMOVE:
+        assert(tree->Remove(key) == (reference->erase(key) == 1));
+        break;
+      default:
+        assert(false);
+    }
+    assert(tree->size() == static_cast<int64_t>(reference->size()));
+    step(key, i);
+  }
+  VerifyContents(*tree, *reference);
+}
+
+template<typename Tree, typename Map, typename MakeKey>
+void RunRandomOps(Tree* tree, Map* reference, int64_t num_ops, const MakeKey& make_key,
+    typename Map::mapped_type (*make_value)(int64_t)) {
+  RunRandomOps(tree, reference, num_ops, make_key, make_value,
+      [](const typename Map::key_type& key, int64_t i) {});
+}
+
 #endif
 
@@ -1,3 +1,11 @@
+#include <unistd.h>
+
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <set>
+#include <thread>
+
 #include "test-common.h"
 
 template<typename T>
@@ -106,6 +114,1330 @@ void TestAgainstStl(int64_t num_ops, int64_t max_key) {
   }
 }
 
+// Builds a tree with the even keys in [0, 2 * num_keys) and checks every seek and
+// step of the iterator against the sorted key list.
+template<typename Tree>
+void TestIterator(int64_t num_keys) {
+  printf("Testing iterator with %ld keys.\n", num_keys);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    keys.push_back(i * 2);
+  }
+  random_shuffle(keys.begin(), keys.end());
+  Tree tree;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    assert(Insert(&tree, keys[i]));
+  }
+  sort(keys.begin(), keys.end());
+
+  // Full scans in both directions.
+  int64_t n = 0;
+  for (auto it = tree.Begin(); !it.AtEnd(); it.Next()) {
+    assert(it.key() == keys[n++]);
+  }
+  assert(n == num_keys);
+  for (auto it = tree.Last(); !it.AtEnd(); it.Prev()) {
+    assert(it.key() == keys[--n]);
+  }
+  assert(n == 0);
+
+  // Seeks to every present and missing key, and one step from there.
+  for (int64_t key = -1; key <= num_keys * 2; ++key) {
+    auto expected = lower_bound(keys.begin(), keys.end(), key);
+    auto it = tree.LowerBound(key);
+    if (expected == keys.end()) {
+      assert(it.AtEnd());
+    } else {
+      assert(it.key() == *expected);
+      it.Prev();
+      if (expected == keys.begin()) {
+        assert(it.AtEnd());
+      } else {
+        assert(it.key() == *(expected - 1));
+      }
+    }
+
+    expected = upper_bound(keys.begin(), keys.end(), key);
+    it = tree.UpperBound(key);
+    if (expected == keys.end()) {
+      assert(it.AtEnd());
+    } else {
+      assert(it.key() == *expected);
+      it.Next();
+      if (expected + 1 == keys.end()) {
+        assert(it.AtEnd());
+      } else {
+        assert(it.key() == *(expected + 1));
+      }
+    }
+  }
+}
+
+// Bulk loads the even keys in [0, 2 * num_keys), checks the result and then keeps
+// modifying the tree against a reference.
+void TestBulkLoad(int64_t num_keys, double fill_factor) {
+  printf("Testing bulk load with %ld keys and fill factor %0.2f.\n",
+      num_keys, fill_factor);
+  vector<pair<int64_t, void*>> values;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    values.push_back(make_pair(i * 2, reinterpret_cast<void*>(i)));
+  }
+  TestBTree tree(values.begin(), values.end(), fill_factor);
+  assert(tree.size() == num_keys);
+
+  int64_t n = 0;
+  for (auto it = tree.Begin(); !it.AtEnd(); it.Next()) {
+    assert(it.key() == values[n].first);
+    assert(it.value() == values[n].second);
+    ++n;
+  }
+  assert(n == num_keys);
+  for (int64_t i = 0; i < num_keys; ++i) {
+    assert(Find(&tree, i * 2));
+    assert(!Find(&tree, i * 2 + 1));
+  }
+
+  StdMap reference;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    assert(Insert(&reference, i * 2));
+  }
+  for (int64_t i = 0; i < num_keys * 4; ++i) {
+    int64_t key = rand() % (num_keys * 2 + 10);
+    if (rand() % 2 == 0) {
+      assert(Insert(&tree, key) == Insert(&reference, key));
+    } else {
+      assert(tree.Remove(key) == reference.Remove(key));
+    }
+    assert(tree.size() == reference.size());
+  }
+
+  // Loading again replaces the contents.
+  tree.BulkLoad(values.begin(), values.begin() + num_keys / 2);
+  assert(tree.size() == num_keys / 2);
+  for (int64_t i = 0; i < num_keys; ++i) {
+    assert(Find(&tree, i * 2) == (i < num_keys / 2));
+  }
+}
+
+// 16 byte payload. Small enough to be stored inline in the leaves.
+struct Payload {
+  int64_t a;
+  int64_t b;
+  bool operator==(const Payload& other) const { return a == other.a && b == other.b; }
+};
+
+Payload MakePayload(int64_t i) { return Payload{i, -i}; }
+string MakeString(int64_t i) { return to_string(i); }
+int64_t MakeInt(int64_t i) { return i * 3; }
+void* MakePointer(int64_t i) { return reinterpret_cast<void*>(i); }
+
+// Runs random operations on a BTree instantiation and on a std::map with the same key,
+// value and comparator and checks they agree, including the iteration order. Some
+// values are also changed in place through FindOrInsert().
+template<typename Tree, typename Key, typename Value, typename Compare>
+void TestTypedTree(const char* name, int64_t num_ops, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing %s (leaf order %d, internal order %d) for %ld ops.\n",
+      name, Tree::LEAF_ORDER, Tree::INTERNAL_ORDER, num_ops);
+  Tree tree;
+  map<Key, Value, Compare> reference;
+  RunRandomOps(&tree, &reference, num_ops,
+      [max_key]() { return static_cast<Key>(rand() % max_key); }, make_value,
+      [&](const Key& key, int64_t i) {
+        if (rand() % 10 != 0) return;
+        Value value = make_value(rand());
+        bool inserted;
+        Value* slot = tree.FindOrInsert(key, value, &inserted);
+        assert(inserted == (reference.count(key) == 0));
+        if (!inserted) {
+          assert(*slot == reference[key]);
+          *slot = value;
+        }
+        reference[key] = value;
+        assert(tree.Find(key).value() == value);
+      });
+}
+
+int32_t MakeInt32(int64_t i) { return static_cast<int32_t>(i); }
+
+// Key distributions for the compressed leaves: offsets of 1, 2, 4 and 8 bytes.
+int64_t DenseKey() { return rand() % 2000; }
+int64_t ClusteredKey() { return (static_cast<int64_t>(rand() % 64) << 40) + rand() % 1000; }
+// 5000 keys spread over the whole int64_t range.
+int64_t SparseKey() {
+  return static_cast<int64_t>((rand() % 5000) * 0x9E3779B97F4A7C15ULL);
+}
+int64_t ExtremeKey() {
+  int64_t offset = rand() % 100;
+  return rand() % 2 ? numeric_limits<int64_t>::min() + offset :
+      numeric_limits<int64_t>::max() - offset;
+}
+
+// Runs random operations on a CompressedBTree and a std::map and checks they agree,
+// including the iteration order. Then checks leaves that are re-encoded with wider and
+// narrower offsets, and keys as far apart as int64_t allows.
+template<typename Tree, typename Value>
+void TestCompressedTree(const char* name, int64_t num_ops, int64_t (*make_key)(),
+    Value (*make_value)(int64_t)) {
+  printf("Testing compressed %s (leaf order %d-%d) for %ld ops.\n",
+      name, Tree::LEAF_ORDER_64, Tree::LEAF_ORDER_8, num_ops);
+  Tree tree;
+  map<int64_t, Value> reference;
+  RunRandomOps(&tree, &reference, num_ops, make_key, make_value,
+      [&](int64_t key, int64_t i) {
+        if (i % 1000 == 0) VerifyLowerBound(tree, reference, key);
+      });
+
+  // Consecutive keys fill leaves with 1-byte offsets. Keys 2^40 past them land in the
+  // last leaf, which is rewritten with 8-byte offsets and split. Removing them again
+  // lets the leaves merge and narrow.
+  Tree packed;
+  map<int64_t, Value> packed_reference;
+  for (int64_t k = 0; k < 4 * Tree::LEAF_ORDER_8; ++k) {
+    packed.Insert(k, make_value(k));
+    packed_reference[k] = make_value(k);
+  }
+  const int64_t far = static_cast<int64_t>(1) << 40;
+  for (int64_t k = far; k < far + Tree::LEAF_ORDER_8; k += 3) {
+    packed.Insert(k, make_value(k));
+    packed_reference[k] = make_value(k);
+  }
+  VerifyContents(packed, packed_reference);
+  for (int64_t k = far; k < far + Tree::LEAF_ORDER_8; k += 3) {
+    assert(packed.Remove(k));
+    packed_reference.erase(k);
+  }
+  for (int64_t k = 0; k < 4 * Tree::LEAF_ORDER_8; k += 2) {
+    assert(packed.Remove(k));
+    packed_reference.erase(k);
+  }
+  VerifyContents(packed, packed_reference);
+
+  // The smallest and largest keys differ by more than an int64_t holds.
+  const int64_t extremes[] = { numeric_limits<int64_t>::min(), -1, 0,
+      numeric_limits<int64_t>::max() };
+  for (int64_t k : extremes) {
+    packed.Upsert(k, make_value(k));
+    packed_reference[k] = make_value(k);
+  }
+  VerifyContents(packed, packed_reference);
+  for (int64_t k : extremes) assert(packed.Find(k).value() == packed_reference[k]);
+}
+
+// Key distributions for StringBTree: short keys over a few bytes, including 0 and
+// 255 so that keys differ in the zero padding of the prefixes; URLs that share long
+// prefixes; and keys too long to be stored in the nodes.
+string ShortStringKey() {
+  const char bytes[] = { '\0', 'a', 'b', '\xff' };
+  string key;
+  for (int n = rand() % 7; n > 0; --n) key += bytes[rand() % 4];
+  return key;
+}
+string UrlKey() {
+  return "https://example.com/tenant/" + to_string(rand() % 20) + "/object/" +
+      to_string(rand() % 500);
+}
+string LongStringKey() {
+  return string(40 + rand() % 80, 'x') + to_string(rand() % 2000);
+}
+
+// Runs random operations on a StringBTree and a std::map and checks they agree,
+// including the iteration order, and validates the tree along the way.
+template<typename Tree, typename Value>
+void TestStringTree(const char* name, int64_t num_ops, string (*make_key)(),
+    Value (*make_value)(int64_t)) {
+  printf("Testing string keys (%s) for %ld ops.\n", name, num_ops);
+  Tree tree;
+  map<string, Value> reference;
+  RunRandomOps(&tree, &reference, num_ops, make_key, make_value,
+      [&](const string& key, int64_t i) {
+        // Removes are as common as all the inserts so that nodes merge.
+        if (rand() % MAX_OP == 0) {
+          string other = make_key();
+          assert(tree.Remove(other) == (reference.erase(other) == 1));
+        }
+        if (i % 100 == 0) VerifyLowerBound(tree, reference, key);
+        if (i % 1000 == 0) VerifyValid(tree);
+      });
+
+  vector<string> keys;
+  tree.CollectAllKeys(&keys);
+  assert(keys.size() == reference.size());
+
+  // Keys too long for the 16-bit entry lengths are rejected rather than truncated.
+  string too_long(Tree::MAX_KEY + 1, 'x');
+  assert(tree.Insert(too_long, make_value(0)).AtEnd());
+  assert(tree.Upsert(too_long, make_value(0)).AtEnd());
+  assert(tree.Find(too_long).AtEnd() && !tree.Remove(too_long));
+  assert(tree.size() == static_cast<int64_t>(reference.size()));
+
+  // Keys that share more bytes than a node prefix holds.
+  string shared(2 * Tree::MAX_PREFIX, 'p');
+  for (int64_t i = 0; i < 2000; ++i) {
+    string key = shared + to_string(rand() % 1000);
+    tree.Upsert(key, make_value(i));
+    reference[key] = make_value(i);
+  }
+  VerifyContents(tree, reference);
+  VerifyValid(tree);
+
+  // Emptying the tree merges every node back into the root.
+  for (auto& pair : reference) assert(tree.Remove(pair.first));
+  assert(tree.size() == 0 && tree.Begin().AtEnd() && tree.Validate());
+}
+
+// Runs random operations on a CsbBTree and a std::map and checks they agree,
+// including the iteration order, and validates the tree along the way. Then empties the
+// tree, so node groups merge at every level.
+template<typename Tree, typename Key, typename Value, typename Compare>
+void TestCsbTree(const char* name, int64_t num_ops, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing csb+ %s (leaf order %d, internal order %d) for %ld ops.\n", name,
+      Tree::LEAF_ORDER, Tree::INTERNAL_ORDER, num_ops);
+  Tree tree;
+  map<Key, Value, Compare> reference;
+  RunRandomOps(&tree, &reference, num_ops,
+      [max_key]() { return static_cast<Key>(rand() % max_key); }, make_value,
+      [&](const Key& key, int64_t i) {
+        if (i % 100 == 0) VerifyLowerBound(tree, reference, key);
+        if (i % 1000 == 0) VerifyValid(tree);
+      });
+
+  // Emptying the tree in random order merges every group back into the root.
+  vector<Key> keys;
+  for (auto& pair : reference) keys.push_back(pair.first);
+  random_shuffle(keys.begin(), keys.end());
+  for (size_t i = 0; i < keys.size(); ++i) {
+    assert(tree.Remove(keys[i]));
+    if (i % 1000 == 0) assert(tree.Validate());
+  }
+  assert(tree.size() == 0 && tree.height() == 1 && tree.Begin().AtEnd() &&
+      tree.Validate());
+}
+
+// Allocator that tracks how many nodes are live.
+class CountingAllocator : public MallocNodeAllocator {
+ public:
+  CountingAllocator() : num_live_(0) {}
+
+  virtual void* Allocate(size_t size) {
+    ++num_live_;
+    return MallocNodeAllocator::Allocate(size);
+  }
+
+  virtual void Free(void* ptr, size_t size) {
+    --num_live_;
+    MallocNodeAllocator::Free(ptr, size);
+  }
+
+  int64_t num_live() const { return num_live_; }
+
+ private:
+  int64_t num_live_;
+};
+
+void TestAllocator(int64_t num_ops, int64_t max_key) {
+  printf("Testing allocators for %ld ops.\n", num_ops);
+  vector<int64_t> keys;
+  vector<Op> ops;
+  GenerateOps(&keys, &ops, num_ops, max_key);
+
+  // Every node a tree allocates from a caller's allocator is given back.
+  CountingAllocator counting;
+  {
+    TestBTree tree(&counting);
+    for (int64_t i = 0; i < num_ops; ++i) {
+      if (ops[i] == REMOVE) {
+        tree.Remove(keys[i]);
+      } else {
+        Insert(&tree, keys[i]);
+      }
+    }
+    assert(counting.num_live() > 0);
+  }
+  assert(counting.num_live() == 0);
+
+  // Nodes freed by merges are reused, so insert/remove churn over a fixed key range
+  // does not keep growing the pool.
+  NodePool pool(4096);
+  TestBTree tree(&pool);
+  for (int64_t i = 0; i < max_key; ++i) {
+    assert(Insert(&tree, i));
+  }
+  int64_t num_chunks = pool.num_chunks();
+  for (int round = 0; round < 10; ++round) {
+    for (int64_t i = 0; i < max_key; ++i) {
+      assert(tree.Remove(i));
+    }
+    for (int64_t i = 0; i < max_key; ++i) {
+      assert(Insert(&tree, i));
+    }
+  }
+  assert(pool.num_chunks() <= num_chunks + 1);
+}
+
+// Runs random batches of finds, inserts and upserts against a std::map. Batches are up
+// to 300 keys, with duplicates, so a batch often splits several leaves.
+template<typename Tree>
+void TestBatch(int64_t num_batches, int64_t max_key) {
+  printf("Testing batches for %ld batches.\n", num_batches);
+  Tree tree;
+  map<int64_t, void*> reference;
+  vector<int64_t> keys;
+  vector<void*> values;
+  for (int64_t b = 0; b < num_batches; ++b) {
+    size_t n = rand() % 300;
+    keys.clear();
+    values.clear();
+    for (size_t i = 0; i < n; ++i) {
+      keys.push_back(rand() % max_key);
+      values.push_back(reinterpret_cast<void*>(rand()));
+    }
+    switch (rand() % 4) {
+      case 0: {
+        vector<typename Tree::Iterator> found(n);
+        tree.FindBatch(keys.data(), n, found.data());
+        for (size_t i = 0; i < n; ++i) {
+          map<int64_t, void*>::iterator it = reference.find(keys[i]);
+          assert(found[i].AtEnd() == (it == reference.end()));
+          if (!found[i].AtEnd()) {
+            assert(found[i].key() == keys[i]);
+            assert(found[i].value() == it->second);
+          }
+        }
+        break;
+      }
+      case 1: {
+        bool inserted[300];
+        size_t num_inserted = tree.InsertBatch(keys.data(), values.data(), n, inserted);
+        size_t expected = 0;
+        for (size_t i = 0; i < n; ++i) {
+          assert(inserted[i] == reference.insert(make_pair(keys[i], values[i])).second);
+          expected += inserted[i];
+        }
+        assert(num_inserted == expected);
+        break;
+      }
+      case 2: {
+        size_t num_inserted = tree.UpsertBatch(keys.data(), values.data(), n);
+        size_t expected = 0;
+        for (size_t i = 0; i < n; ++i) {
+          expected += reference.count(keys[i]) == 0;
+          reference[keys[i]] = values[i];
+        }
+        assert(num_inserted == expected);
+        break;
+      }
+      case 3:
+        for (size_t i = 0; i < n; ++i) {
+          assert(tree.Remove(keys[i]) == (reference.erase(keys[i]) == 1));
+        }
+        break;
+    }
+    assert(tree.size() == static_cast<int64_t>(reference.size()));
+  }
+}
+
+// Runs num_threads threads against one tree. Thread t owns the keys that are t modulo
+// num_threads: it inserts, updates and removes them while checking what it sees of its
+// own keys, and looks up everyone else's keys to race with their splits and merges.
+// The value of a key is key * 2 + (number of updates), so stale reads are caught.
+template<typename Tree>
+void TestConcurrent(int num_threads, int64_t num_keys, int rounds) {
+  printf("Testing %d threads with %ld keys.\n", num_threads, num_keys);
+  Tree tree;
+  vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.push_back(std::thread([&tree, t, num_threads, num_keys, rounds]() {
+      vector<int64_t> keys;
+      for (int64_t k = t; k < num_keys; k += num_threads) keys.push_back(k);
+      unsigned int seed = t;
+      for (int round = 0; round < rounds; ++round) {
+        random_shuffle(keys.begin(), keys.end(),
+            [&seed](int64_t n) { return rand_r(&seed) % n; });
+        for (size_t i = 0; i < keys.size(); ++i) {
+          void* value = reinterpret_cast<void*>(keys[i] * 2);
+          assert(!tree.Insert(keys[i], value).AtEnd());
+          assert(tree.Insert(keys[i], value).AtEnd());
+          int64_t other = rand_r(&seed) % num_keys;
+          tree.Find(other);
+        }
+        for (size_t i = 0; i < keys.size(); i += 2) {
+          assert(tree.Update(keys[i], reinterpret_cast<void*>(keys[i] * 2 + 1)));
+        }
+        for (size_t i = 0; i < keys.size(); ++i) {
+          typename Tree::Iterator it = tree.Find(keys[i]);
+          assert(!it.AtEnd());
+          assert(it.value() == reinterpret_cast<void*>(keys[i] * 2 + (i % 2 == 0)));
+        }
+        // Keep the last round's odd positions so the final tree is not empty.
+        for (size_t i = 0; i < keys.size(); ++i) {
+          if (round == rounds - 1 && i % 2 == 1) continue;
+          assert(tree.Remove(keys[i]));
+          assert(!tree.Remove(keys[i]));
+          assert(tree.Find(keys[i]).AtEnd());
+          tree.Find(rand_r(&seed) % num_keys);
+        }
+      }
+      for (size_t i = 1; i < keys.size(); i += 2) {
+        assert(tree.Find(keys[i]).value() == reinterpret_cast<void*>(keys[i] * 2));
+      }
+    }));
+  }
+  for (int t = 0; t < num_threads; ++t) {
+    threads[t].join();
+  }
+
+  vector<int64_t> collected_keys;
+  tree.CollectAllKeys(&collected_keys);
+  assert(static_cast<int64_t>(collected_keys.size()) == tree.size());
+  for (size_t i = 1; i < collected_keys.size(); ++i) {
+    assert(collected_keys[i - 1] < collected_keys[i]);
+  }
+  int64_t expected = 0;
+  for (int t = 0; t < num_threads; ++t) {
+    int64_t owned = (num_keys - t + num_threads - 1) / num_threads;
+    expected += owned / 2;
+  }
+  assert(tree.size() == expected);
+}
+
+// Runs random operations on a tree and a std::map while keeping up to four snapshots,
+// each with a copy of the map from when it was taken. The snapshots are checked after
+// every checkpoint: a full scan, range scans from random keys and lookups.
+template<typename Tree, typename Value>
+void TestSnapshots(const char* name, int64_t num_ops, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing snapshots of %s for %ld ops.\n", name, num_ops);
+  typedef typename Tree::SnapshotView Snapshot;
+  Tree tree;
+  map<int64_t, Value> reference;
+  vector<unique_ptr<Snapshot>> snapshots;
+  vector<map<int64_t, Value>> expected;
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % max_key;
+    Value value = make_value(rand());
+    switch (rand() % 8) {
+      case 0:
+      case 1:
+        assert(tree.Insert(key, value).AtEnd() ==
+            !reference.insert(make_pair(key, value)).second);
+        break;
+      case 2:
+        assert(tree.Upsert(key, value).value() == value);
+        reference[key] = value;
+        break;
+      case 3: {
+        bool exists = reference.count(key) == 1;
+        if (exists) reference[key] = value;
+        assert(tree.Update(key, value) == exists);
+        break;
+      }
+      case 4: {
+        bool inserted;
+        Value* slot = tree.FindOrInsert(key, value, &inserted);
+        if (!inserted) *slot = value;
+        reference[key] = value;
+        break;
+      }
+      case 5: {
+        int64_t keys[20];
+        Value values[20];
+        for (int j = 0; j < 20; ++j) {
+          keys[j] = (key + j * 7) % max_key;
+          values[j] = make_value(rand());
+          reference[keys[j]] = values[j];
+        }
+        tree.UpsertBatch(keys, values, 20);
+        break;
+      }
+      default:
+        assert(tree.Remove(key) == (reference.erase(key) == 1));
+    }
+    assert(tree.size() == static_cast<int64_t>(reference.size()));
+
+    if (i % 1000 != 999) continue;
+    if (rand() % 50 == 0) {
+      // Rebuilding the tree drops every node the snapshots share at once.
+      vector<pair<int64_t, Value>> pairs(reference.begin(), reference.end());
+      tree.BulkLoad(pairs.begin(), pairs.end(), 0.7);
+    }
+    for (size_t s = 0; s < snapshots.size(); ++s) {
+      const Snapshot& snapshot = *snapshots[s];
+      const map<int64_t, Value>& ref = expected[s];
+      VerifyContents(snapshot, ref);
+      for (int j = 0; j < 20; ++j) {
+        int64_t lo = rand() % max_key;
+        typename Snapshot::Iterator it = snapshot.LowerBound(lo);
+        typename map<int64_t, Value>::const_iterator e = ref.lower_bound(lo);
+        for (int n = 0; n < 50 && e != ref.end(); ++n, ++e, it.Next()) {
+          assert(!it.AtEnd());
+          assert(it.key() == e->first);
+        }
+        if (e == ref.end()) assert(it.AtEnd());
+        assert(snapshot.Find(lo).AtEnd() == (ref.count(lo) == 0));
+      }
+    }
+    if (!snapshots.empty() && rand() % 3 == 0) {
+      size_t victim = rand() % snapshots.size();
+      snapshots.erase(snapshots.begin() + victim);
+      expected.erase(expected.begin() + victim);
+    }
+    if (snapshots.size() < 4) {
+      snapshots.push_back(unique_ptr<Snapshot>(new Snapshot(tree.Snapshot())));
+      expected.push_back(reference);
+    }
+  }
+}
+
+// Scans a snapshot from another thread while this thread keeps changing the tree.
+// Reading the snapshot needs no lock, so the scans must see the keys as they were.
+void TestSnapshotReader(int64_t num_keys, int64_t num_ops) {
+  printf("Testing a snapshot reader with %ld keys.\n", num_keys);
+  TestBTree tree;
+  for (int64_t k = 0; k < num_keys; ++k) {
+    tree.Insert(k, reinterpret_cast<void*>(k));
+  }
+  TestBTree::SnapshotView snapshot = tree.Snapshot();
+  std::atomic<bool> done(false);
+  std::thread reader([&snapshot, &done, num_keys]() {
+    int scans = 0;
+    while (!done.load() || scans == 0) {
+      int64_t expected = 0;
+      for (TestBTree::SnapshotView::Iterator it = snapshot.Begin(); !it.AtEnd();
+          it.Next(), ++expected) {
+        assert(it.key() == expected);
+        assert(it.value() == reinterpret_cast<void*>(expected));
+      }
+      assert(expected == num_keys);
+      ++scans;
+    }
+  });
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % (num_keys * 2);
+    if (rand() % 2 == 0) {
+      tree.Remove(key);
+    } else {
+      tree.Upsert(key, reinterpret_cast<void*>(rand()));
+    }
+  }
+  done.store(true);
+  reader.join();
+}
+
+// Checks a MappedBTree against the std::map it was saved from: a full scan, a lookup
+// of every key up to max_key and scans from random keys.
+template<typename Mapped, typename Key, typename Value>
+void VerifyMapped(const Mapped& mapped, const map<Key, Value>& reference,
+    int64_t max_key) {
+  assert(mapped.size() == static_cast<int64_t>(reference.size()));
+  auto expected = reference.begin();
+  for (auto it = mapped.Begin(); !it.AtEnd(); it.Next(), ++expected) {
+    assert(it.key() == expected->first);
+    assert(it.value() == expected->second);
+  }
+  assert(expected == reference.end());
+  for (int64_t k = -1; k <= max_key; ++k) {
+    auto it = mapped.Find(k);
+    expected = reference.find(k);
+    assert(it.AtEnd() == (expected == reference.end()));
+    if (!it.AtEnd()) assert(it.value() == expected->second);
+  }
+  for (int i = 0; i < 1000; ++i) {
+    Key lo = rand() % (max_key + 1);
+    auto it = mapped.LowerBound(lo);
+    expected = reference.lower_bound(lo);
+    for (int n = 0; n < 20 && expected != reference.end(); ++n, ++expected, it.Next()) {
+      assert(!it.AtEnd());
+      assert(it.key() == expected->first);
+    }
+    if (expected == reference.end()) assert(it.AtEnd());
+  }
+}
+
+// Saves trees of random keys and checks the files through MappedBTree, with the page
+// size BTree::Save() uses and with small pages for deeper trees.
+template<typename Tree, typename Key, typename Value, size_t PAGE_SIZE>
+void TestMapped(const char* name, int64_t num_keys, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing mapped %s with %ld keys.\n", name, num_keys);
+  typedef MappedBTree<Key, Value, less<Key>, PAGE_SIZE> Mapped;
+  string path = "/tmp/test-correctness-" + to_string(getpid()) + ".btree";
+  map<Key, Value> reference;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    reference[rand() % max_key] = make_value(rand());
+  }
+  Tree tree(reference.begin(), reference.end());
+  assert(Mapped::Save(path, tree.Begin()));
+  Mapped* mapped = Mapped::OpenMapped(path);
+  assert(mapped != NULL);
+  VerifyMapped(*mapped, reference, max_key);
+  delete mapped;
+
+  if (PAGE_SIZE == 4096) {
+    assert(tree.Save(path));
+    mapped = Mapped::OpenMapped(path);
+    assert(mapped != NULL);
+    VerifyMapped(*mapped, reference, max_key);
+    delete mapped;
+  }
+
+  // Files that were not written for this instantiation are rejected.
+  assert((MappedBTree<Key, char>::OpenMapped(path) == NULL));
+  assert(truncate(path.c_str(), PAGE_SIZE / 2) == 0);
+  assert(Mapped::OpenMapped(path) == NULL);
+  unlink(path.c_str());
+  assert(Mapped::OpenMapped(path) == NULL);
+}
+
+string ReadFile(const string& path) {
+  FILE* file = fopen(path.c_str(), "rb");
+  assert(file != NULL);
+  string contents;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), file)) > 0) contents.append(buf, n);
+  fclose(file);
+  return contents;
+}
+
+void WriteFile(const string& path, const string& contents) {
+  FILE* file = fopen(path.c_str(), "wb");
+  assert(file != NULL);
+  assert(fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+  fclose(file);
+}
+
+// Runs random mutations on a LoggedBTree and a std::map. Every 500 ops the tree is
+// checkpointed or closed and recovered, sometimes after damaging the files the way a
+// crash could: a torn record at the end of the log, or a checkpoint whose log was not
+// emptied yet.
+void TestWal(int64_t num_ops, int64_t max_key) {
+  printf("Testing write-ahead log for %ld ops.\n", num_ops);
+  typedef LoggedBTree<int64_t, void*, less<int64_t>, TEST_NODE_BYTES> Logged;
+  string prefix = "/tmp/test-correctness-" + to_string(getpid());
+  string image_path = prefix + ".image";
+  string log_path = prefix + ".wal";
+  unlink(image_path.c_str());
+  unlink(log_path.c_str());
+
+  Logged* tree = Logged::Open(image_path, log_path);
+  assert(tree != NULL);
+  map<int64_t, void*> reference;
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % max_key;
+    void* value = reinterpret_cast<void*>(rand());
+    switch (rand() % 4) {
+      case 0:
+        assert(tree->Insert(key, value).AtEnd() ==
+            !reference.insert(make_pair(key, value)).second);
+        break;
+      case 1:
+        tree->Upsert(key, value);
+        reference[key] = value;
+        break;
+      case 2: {
+        bool exists = reference.count(key) == 1;
+        if (exists) reference[key] = value;
+        assert(tree->Update(key, value) == exists);
+        break;
+      }
+      default:
+        assert(tree->Remove(key) == (reference.erase(key) == 1));
+    }
+
+    if (i % 500 != 499) continue;
+    // Closing syncs the log.
+    switch (rand() % 4) {
+      case 0:
+        assert(tree->Checkpoint());
+        delete tree;
+        break;
+      case 1:
+        delete tree;
+        break;
+      case 2:
+        delete tree;
+        WriteFile(log_path,
+            ReadFile(log_path) + "a torn record that is longer than one record");
+        break;
+      case 3: {
+        assert(tree->Sync());
+        string log = ReadFile(log_path);
+        assert(tree->Checkpoint());
+        delete tree;
+        WriteFile(log_path, log);
+        break;
+      }
+    }
+    if (i % 2000 == 1999) {
+      // Recovering twice must give the same tree.
+      delete Logged::Open(image_path, log_path);
+    }
+    tree = Logged::Open(image_path, log_path);
+    assert(tree != NULL);
+    assert(tree->size() == static_cast<int64_t>(reference.size()));
+    auto expected = reference.begin();
+    for (auto it = tree->Begin(); !it.AtEnd(); it.Next(), ++expected) {
+      assert(it.key() == expected->first);
+      assert(it.value() == expected->second);
+    }
+    assert(expected == reference.end());
+  }
+  delete tree;
+  unlink(image_path.c_str());
+  unlink(log_path.c_str());
+}
+
+// Appends from several threads that each wait for their records to be durable, so
+// the waits share syncs. Every record must be in the log afterwards.
+void TestWalGroupCommit(int num_threads, int64_t records_per_thread) {
+  printf("Testing group commit with %d threads.\n", num_threads);
+  typedef WriteAheadLog<int64_t, int64_t> Log;
+  string path = "/tmp/test-correctness-" + to_string(getpid()) + ".wal";
+  unlink(path.c_str());
+  Log::ReplayFn ignore = [](Log::Op, const int64_t&, const int64_t&) {};
+  Log* log = Log::Open(path, WalOptions(), ignore);
+  assert(log != NULL);
+  vector<std::thread> threads;
+  for (int t = 0; t < num_threads; ++t) {
+    threads.push_back(std::thread([log, t, records_per_thread]() {
+      for (int64_t i = 0; i < records_per_thread; ++i) {
+        uint64_t lsn = log->Put(t, i);
+        if (i % 100 == 99) assert(log->WaitDurable(lsn));
+      }
+      assert(log->Sync());
+    }));
+  }
+  for (int t = 0; t < num_threads; ++t) {
+    threads[t].join();
+  }
+  assert(log->last_lsn() == static_cast<uint64_t>(num_threads * records_per_thread));
+  delete log;
+
+  // Records of each thread are in the order it appended them.
+  vector<int64_t> next(num_threads, 0);
+  log = Log::Open(path, WalOptions(), [&next](Log::Op op, const int64_t& t, const int64_t& i) {
+    assert(op == Log::PUT);
+    assert(next[t]++ == i);
+  });
+  assert(log != NULL);
+  for (int t = 0; t < num_threads; ++t) {
+    assert(next[t] == records_per_thread);
+  }
+  delete log;
+  unlink(path.c_str());
+}
+
+// Churns a tree whose nodes can underflow down to min_fill against a reference. The
+// tree alternates between growing and shrinking and is compacted now and then,
+// sometimes while a snapshot shares its nodes.
+template<typename Tree, typename Value>
+void TestMinFill(const char* name, double min_fill, int64_t num_ops, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing %s with min fill %0.2f for %ld ops.\n", name, min_fill, num_ops);
+  typedef typename Tree::SnapshotView Snapshot;
+  Tree tree;
+  tree.SetMinFill(min_fill);
+  map<int64_t, Value> reference;
+  unique_ptr<Snapshot> snapshot;
+  map<int64_t, Value> expected;
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % max_key;
+    bool growing = (i / 5000) % 2 == 0;
+    if (rand() % 3 < (growing ? 2 : 1)) {
+      Value value = make_value(rand());
+      assert(tree.Insert(key, value).AtEnd() ==
+          !reference.insert(make_pair(key, value)).second);
+    } else {
+      assert(tree.Remove(key) == (reference.erase(key) == 1));
+    }
+    assert(tree.size() == static_cast<int64_t>(reference.size()));
+
+    if (i % 5000 != 4999) continue;
+    if (snapshot) {
+      VerifyContents(*snapshot, expected);
+      snapshot.reset();
+    }
+    if (rand() % 2 == 0) {
+      snapshot.reset(new Snapshot(tree.Snapshot()));
+      expected = reference;
+    }
+    tree.Compact(rand() % 2 == 0 ? 1.0 : 0.7);
+    VerifyContents(tree, reference);
+  }
+
+  // Raising the bound repacks the tree to meet it.
+  snapshot.reset();
+  tree.SetMinFill(0.5);
+  VerifyContents(tree, reference);
+  for (int64_t i = 0; i < max_key; ++i) {
+    assert(tree.Remove(i) == (reference.erase(i) == 1));
+  }
+  VerifyContents(tree, reference);
+}
+
+// Checks that the levels in stats describe a well formed tree of stats.size values.
+void VerifyStats(const BTreeStats& stats, int leaf_order) {
+  assert(stats.height == static_cast<int>(stats.levels.size()));
+  assert(stats.levels[0].num_nodes == 1);
+  int64_t num_nodes = 0;
+  for (int i = 0; i < stats.height; ++i) {
+    const BTreeStats::Level& level = stats.levels[i];
+    // Every value of an internal node is a node on the next level.
+    int64_t num_values = i + 1 < stats.height ? stats.levels[i + 1].num_nodes : stats.size;
+    assert(level.num_values == num_values);
+    assert(level.fill >= 0 && level.fill <= 1);
+    int64_t histogram_nodes = 0;
+    for (int j = 0; j < BTreeStats::FILL_BUCKETS; ++j) {
+      histogram_nodes += level.fill_histogram[j];
+    }
+    assert(histogram_nodes == level.num_nodes);
+    num_nodes += level.num_nodes;
+  }
+  assert(stats.levels.back().num_nodes == stats.num_leaves);
+  assert(num_nodes == stats.num_leaves + stats.num_internal_nodes);
+  assert(stats.bytes_used > 0);
+  assert(stats.size == 0 || stats.levels.back().fill ==
+      static_cast<double>(stats.size) / (stats.num_leaves * leaf_order));
+}
+
+// Checks Stats() and the counters through inserts and removes of num_keys keys.
+void TestStats(int64_t num_keys) {
+  printf("Testing stats with %ld keys.\n", num_keys);
+  TestBTree tree;
+  BTreeStats stats = tree.Stats();
+  VerifyStats(stats, TestBTree::LEAF_ORDER);
+  assert(stats.height == 1 && stats.num_leaves == 1 && stats.num_internal_nodes == 0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(i);
+  random_shuffle(keys.begin(), keys.end());
+
+  for (int64_t i = 0; i < num_keys; ++i) {
+    Insert(&tree, keys[i]);
+  }
+  stats = tree.Stats();
+  VerifyStats(stats, TestBTree::LEAF_ORDER);
+  const BTreeCounters& counters = tree.counters();
+  // Every node but the first leaf comes from a split, and a root split makes two.
+  assert(counters.splits + stats.height - 1 ==
+      stats.num_leaves + stats.num_internal_nodes - 1);
+  assert(counters.merges == 0 && counters.borrows == 0);
+  assert(counters.descents == num_keys);
+  assert(counters.node_searches >= num_keys);
+  assert(counters.key_comparisons >= counters.node_searches);
+  // Random inserts leave the leaves between half and completely full.
+  assert(num_keys < 1000 ||
+      (stats.levels.back().fill > 0.5 && stats.levels.back().fill < 1));
+
+  tree.ResetCounters();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    assert(Find(&tree, keys[i]));
+  }
+  assert(counters.descents == num_keys);
+  assert(counters.node_searches == num_keys * stats.height);
+  assert(counters.splits == 0);
+
+  for (int64_t i = 0; i < num_keys / 2; ++i) {
+    tree.Remove(keys[i]);
+  }
+  VerifyStats(tree.Stats(), TestBTree::LEAF_ORDER);
+  assert(num_keys < 1000 || (counters.merges > 0 && counters.borrows > 0 &&
+      counters.separator_updates > 0));
+}
+
+// Orders keys in increasing order, or in decreasing order once flipped, which lets a
+// test break the order of a tree from the outside.
+struct FlippableLess {
+  static bool flipped;
+  bool operator()(int64_t a, int64_t b) const { return flipped ? b < a : a < b; }
+};
+bool FlippableLess::flipped = false;
+
+// Checks that Validate() accepts trees built in different ways and reports a tree
+// whose keys are out of order. Trees that validate a sample of their changes run
+// the mixed workload at sizes full validation would make too slow.
+void TestValidate(int64_t num_keys) {
+  printf("Testing validation with %ld keys.\n", num_keys);
+  typedef BTree<int64_t, void*, less<int64_t>, TEST_NODE_BYTES, KeySearch, 0>
+      Unchecked;
+  Unchecked tree;
+  string error;
+  assert(tree.Validate(&error) && error.empty());
+  for (int64_t i = 0; i < num_keys; ++i) {
+    Insert(&tree, rand() % (num_keys * 2));
+    if (i % 1000 == 0) assert(tree.Validate());
+  }
+  {
+    Unchecked::SnapshotView snapshot = tree.Snapshot();
+    for (int64_t i = 0; i < num_keys; ++i) tree.Remove(rand() % (num_keys * 2));
+    assert(tree.Validate(&error));
+  }
+  tree.SetMinFill(0);
+  for (int64_t i = 0; i < num_keys; ++i) tree.Remove(rand() % (num_keys * 2));
+  assert(tree.Validate(&error));
+  tree.Compact(0.7);
+  assert(tree.Validate(&error));
+
+  typedef BTree<int64_t, void*, FlippableLess, TEST_NODE_BYTES, KeySearch, 0>
+      Flippable;
+  Flippable flippable;
+  for (int64_t i = 0; i < num_keys; ++i) flippable.Insert(i, NULL);
+  assert(flippable.Validate(&error));
+  FlippableLess::flipped = true;
+  assert(num_keys < 2 || !flippable.Validate(&error));
+  assert(num_keys < 2 || !error.empty());
+  FlippableLess::flipped = false;
+  assert(flippable.Validate());
+
+  typedef BTree<int64_t, void*, less<int64_t>, TEST_NODE_BYTES, KeySearch, 1000>
+      Sampled;
+  TestAgainstStl<Sampled>(num_keys * 10, num_keys);
+}
+
+// Checks Search::LowerBound() against std::lower_bound on sorted arrays of every size
+// up to max_size, with keys spread evenly, clustered and at the extremes of Key.
+template<typename Key, typename Compare, typename Search>
+void TestSearchPolicy(const char* name, int max_size) {
+  printf("Testing %s search.\n", name);
+  Compare comp;
+  for (int n = 0; n <= max_size; ++n) {
+    for (int spread = 0; spread < 3; ++spread) {
+      // Padded for the vector kernels.
+      vector<Key> keys(n + Search::PAD);
+      set<Key, Compare> unique;
+      while (static_cast<int>(unique.size()) < n) {
+        int64_t r = rand();
+        if (spread == 0) {
+          // Even.
+          r %= n * 4 + 1;
+        } else if (spread == 1) {
+          // Clustered with a few outliers.
+          if (r % 16 != 0) r %= n + 1;
+        } else if (r % 8 == 0) {
+          // Some at the extremes.
+          r = r % 2 == 0 ? numeric_limits<Key>::max() :
+              numeric_limits<Key>::min() + r % 100;
+        }
+        unique.insert(static_cast<Key>(r));
+      }
+      copy(unique.begin(), unique.end(), keys.begin());
+      for (int i = 0; i < 50; ++i) {
+        Key key = i < n ? keys[i] : static_cast<Key>(rand() % (n * 4 + 2) - 1);
+        if (i == 49) key = numeric_limits<Key>::max();
+        if (i == 48) key = numeric_limits<Key>::min();
+        int expected = lower_bound(keys.begin(), keys.begin() + n, key, comp) - keys.begin();
+        assert(Search::LowerBound(keys.data(), n, key, comp) == expected);
+      }
+    }
+  }
+}
+
+// Runs TestAgainstStl() on BTree with SearchPolicy, in small and in large nodes.
+template<template<typename, typename> class SearchPolicy>
+void TestTreeSearchPolicy() {
+  TestAgainstStl<BTree<int64_t, void*, less<int64_t>, TEST_NODE_BYTES, SearchPolicy>>(
+      100000, 10000);
+  TestAgainstStl<BTree<int64_t, void*, less<int64_t>, 2048, SearchPolicy>>(100000, 10000);
+}
+
+// Runs inserts, removes and range removes on a tree and a std::map, checking
+// CountRange() along the way. Ranges run from a few keys to most of the tree, sometimes
+// while a snapshot shares the nodes.
+template<typename Tree, typename Value>
+void TestRanges(const char* name, double min_fill, int64_t num_ops, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing ranges on %s with min fill %0.2f for %ld ops.\n", name, min_fill,
+      num_ops);
+  typedef typename Tree::SnapshotView Snapshot;
+  typedef typename map<int64_t, Value>::iterator MapIterator;
+  Tree tree;
+  tree.SetMinFill(min_fill);
+  map<int64_t, Value> reference;
+  unique_ptr<Snapshot> snapshot;
+  map<int64_t, Value> expected;
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % max_key;
+    int op = rand() % 100;
+    if (op < 70) {
+      Value value = make_value(rand());
+      assert(tree.Insert(key, value).AtEnd() ==
+          !reference.insert(make_pair(key, value)).second);
+    } else if (op < 90) {
+      assert(tree.Remove(key) == (reference.erase(key) == 1));
+    } else {
+      // Narrow ranges are as common as wide ones.
+      int64_t width = rand() % 2 == 0 ? 10 : max_key;
+      int64_t hi = key + rand() % width;
+      MapIterator begin = reference.lower_bound(key);
+      MapIterator end = reference.lower_bound(hi);
+      int64_t n = distance(begin, end);
+      assert(tree.CountRange(key, hi) == n);
+      assert(tree.CountRange(hi, key) == 0);
+      if (op < 95) {
+        assert(tree.RemoveRange(key, hi) == n);
+        reference.erase(begin, end);
+        assert(tree.CountRange(key, hi) == 0);
+      }
+    }
+    assert(tree.size() == static_cast<int64_t>(reference.size()));
+
+    if (i % 1000 != 999) continue;
+    if (snapshot) {
+      VerifyContents(*snapshot, expected);
+      snapshot.reset();
+    }
+    if (rand() % 2 == 0) {
+      snapshot.reset(new Snapshot(tree.Snapshot()));
+      expected = reference;
+    }
+    VerifyContents(tree, reference);
+  }
+
+  snapshot.reset();
+  int64_t n = reference.size();
+  assert(tree.CountRange(numeric_limits<int64_t>::min(), max_key) == n);
+  assert(tree.RemoveRange(max_key / 2, max_key) ==
+      distance(reference.lower_bound(max_key / 2), reference.end()));
+  reference.erase(reference.lower_bound(max_key / 2), reference.end());
+  VerifyContents(tree, reference);
+  assert(tree.RemoveRange(numeric_limits<int64_t>::min(), max_key) ==
+      static_cast<int64_t>(reference.size()));
+  reference.clear();
+  VerifyContents(tree, reference);
+  assert(!tree.Insert(1, make_value(1)).AtEnd() && tree.CountRange(0, 2) == 1);
+}
+
+// Checks Rank() and Select() against a sorted copy of the keys, for every key in the
+// tree and for keys around and outside it.
+template<typename Tree>
+void VerifyRankSelect(const Tree& tree, const set<int64_t>& reference, int64_t max_key) {
+  vector<int64_t> keys(reference.begin(), reference.end());
+  int64_t n = keys.size();
+  for (int64_t k = 0; k < n; ++k) {
+    assert(tree.Select(k).key() == keys[k]);
+    assert(tree.Rank(keys[k]) == k);
+  }
+  assert(tree.Select(n).AtEnd() && tree.Select(-1).AtEnd());
+  for (int i = 0; i < 100; ++i) {
+    int64_t key = rand() % (max_key + 2) - 1;
+    assert(tree.Rank(key) == lower_bound(keys.begin(), keys.end(), key) - keys.begin());
+  }
+  assert(tree.Rank(numeric_limits<int64_t>::max()) == n);
+}
+
+// Runs inserts, removes and range removes on a tree, checking Rank() and Select()
+// along the way, then again after a bulk load.
+template<typename Tree>
+void TestRankSelect(const char* name, int64_t num_ops, int64_t max_key) {
+  printf("Testing rank and select on %s for %ld ops.\n", name, num_ops);
+  Tree tree;
+  set<int64_t> reference;
+  VerifyRankSelect(tree, reference, max_key);
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % max_key;
+    int op = rand() % 100;
+    if (op < 70) {
+      assert(tree.Insert(key, MakePointer(key)).AtEnd() == !reference.insert(key).second);
+    } else if (op < 98) {
+      assert(tree.Remove(key) == (reference.erase(key) == 1));
+    } else {
+      int64_t hi = key + rand() % 50;
+      assert(tree.RemoveRange(key, hi) == distance(reference.lower_bound(key),
+          reference.lower_bound(hi)));
+      reference.erase(reference.lower_bound(key), reference.lower_bound(hi));
+    }
+    if (i % 500 == 499) VerifyRankSelect(tree, reference, max_key);
+  }
+
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t key = 0; key < max_key; key += 3) {
+    pairs.push_back(make_pair(key, MakePointer(key)));
+  }
+  tree.BulkLoad(pairs.begin(), pairs.end(), 0.7);
+  reference.clear();
+  for (const auto& pair : pairs) reference.insert(pair.first);
+  VerifyRankSelect(tree, reference, max_key);
+}
+
+// Checks every query of a FrozenBTree against the map it was built from, for every
+// key in [-1, max_key] and a sample of ranges.
+template<typename Frozen, typename Key, typename Value, typename Compare>
+void VerifyFrozen(const Frozen& frozen, const map<Key, Value, Compare>& reference,
+    int64_t max_key) {
+  string error;
+  if (!frozen.Validate(&error)) {
+    printf("Invalid frozen tree: %s\n", error.c_str());
+    assert(false);
+  }
+  assert(frozen.size() == static_cast<int64_t>(reference.size()));
+  auto expected = reference.begin();
+  for (auto it = frozen.Begin(); !it.AtEnd(); it.Next(), ++expected) {
+    assert(it.key() == expected->first);
+    assert(it.value() == expected->second);
+  }
+  assert(expected == reference.end());
+
+  vector<Key> keys;
+  for (const auto& pair : reference) keys.push_back(pair.first);
+  for (int64_t i = -1; i <= max_key; ++i) {
+    Key key = static_cast<Key>(i);
+    auto it = frozen.Find(key);
+    auto found = reference.find(key);
+    assert(it.AtEnd() == (found == reference.end()));
+    if (!it.AtEnd()) assert(it.key() == key && it.value() == found->second);
+    auto lower = frozen.LowerBound(key);
+    auto expected_lower = reference.lower_bound(key);
+    assert(lower.AtEnd() == (expected_lower == reference.end()));
+    if (!lower.AtEnd()) assert(lower.key() == expected_lower->first);
+    auto upper = frozen.UpperBound(key);
+    auto expected_upper = reference.upper_bound(key);
+    assert(upper.AtEnd() == (expected_upper == reference.end()));
+    if (!upper.AtEnd()) assert(upper.key() == expected_upper->first);
+    int64_t rank = lower_bound(keys.begin(), keys.end(), key, Compare()) - keys.begin();
+    assert(frozen.Rank(key) == rank);
+    if (found != reference.end()) assert(frozen.Select(rank).key() == key);
+  }
+  assert(frozen.Select(frozen.size()).AtEnd() && frozen.Select(-1).AtEnd());
+  for (int i = 0; i < 100; ++i) {
+    Key lo = static_cast<Key>(rand() % (max_key + 2) - 1);
+    Key hi = static_cast<Key>(rand() % (max_key + 2) - 1);
+    int64_t count = !Compare()(lo, hi) ? 0 :
+        lower_bound(keys.begin(), keys.end(), hi, Compare()) -
+        lower_bound(keys.begin(), keys.end(), lo, Compare());
+    assert(frozen.CountRange(lo, hi) == count);
+  }
+}
+
+// Freezes trees of num_keys random keys below max_key, built from sorted pairs.
+template<typename Frozen, typename Key, typename Value, typename Compare>
+void TestFrozen(const char* name, int64_t num_keys, int64_t max_key,
+    Value (*make_value)(int64_t)) {
+  printf("Testing frozen %s (%d keys per block) with %ld keys.\n", name,
+      Frozen::BLOCK_KEYS, num_keys);
+  map<Key, Value, Compare> reference;
+  while (static_cast<int64_t>(reference.size()) < num_keys) {
+    int64_t key = rand() % max_key;
+    reference[static_cast<Key>(key)] = make_value(key);
+  }
+  Frozen frozen(reference.begin(), reference.end());
+  VerifyFrozen(frozen, reference, max_key);
+
+  // Moving hands over the arrays and leaves the source empty.
+  Frozen moved(std::move(frozen));
+  assert(frozen.size() == 0 && frozen.Begin().AtEnd() && frozen.Find(0).AtEnd());
+  VerifyFrozen(moved, reference, max_key);
+  frozen = std::move(moved);
+  VerifyFrozen(frozen, reference, max_key);
+}
+
+// Freezes a BTree after random inserts and removes, checking that the frozen copy is
+// unaffected by later changes to the tree.
+void TestFreeze(int64_t num_ops, int64_t max_key) {
+  printf("Testing Freeze() for %ld ops.\n", num_ops);
+  TestBTree tree;
+  map<int64_t, void*> reference;
+  VerifyFrozen(tree.Freeze(), reference, max_key);
+  for (int64_t i = 0; i < num_ops; ++i) {
+    int64_t key = rand() % max_key;
+    if (rand() % 3 != 0) {
+      tree.Upsert(key, MakePointer(i));
+      reference[key] = MakePointer(i);
+    } else {
+      assert(tree.Remove(key) == (reference.erase(key) == 1));
+    }
+  }
+  auto frozen = tree.Freeze();
+  for (int64_t key = 0; key < max_key; key += 2) tree.Remove(key);
+  VerifyFrozen(frozen, reference, max_key);
+  set<int64_t> keys;
+  for (const auto& pair : reference) keys.insert(pair.first);
+  VerifyRankSelect(frozen, keys, max_key);
+}
+
+// Loads num_pairs random pairs, with repeated keys, with ParallelBulkLoad() on
+// num_threads threads and checks that the last pair of each key won.
+template<typename Tree, typename Value>
+void TestParallelBulkLoad(const char* name, int64_t num_pairs, int64_t max_key,
+    int num_threads, Value (*make_value)(int64_t)) {
+  printf("Testing parallel bulk load of %s with %ld pairs on %d threads.\n", name,
+      num_pairs, num_threads);
+  Tree tree;
+  tree.Upsert(max_key, make_value(0));
+  vector<pair<int64_t, Value>> pairs;
+  map<int64_t, Value> reference;
+  for (int64_t i = 0; i < num_pairs; ++i) {
+    int64_t key = rand() % max_key;
+    pairs.push_back(make_pair(key, make_value(i)));
+    reference[key] = make_value(i);
+  }
+  tree.ParallelBulkLoad(&pairs, num_threads, rand() % 2 == 0 ? 1.0 : 0.7);
+  assert(pairs.size() == reference.size());
+  VerifyContents(tree, reference);
+  for (int64_t key = 0; key <= max_key; ++key) {
+    assert(tree.Find(key).AtEnd() == (reference.count(key) == 0));
+  }
+
+  // Sorted input skips the sort.
+  tree.ParallelBulkLoad(&pairs, num_threads);
+  VerifyContents(tree, reference);
+  for (int64_t i = 0; i < 100; ++i) {
+    int64_t key = rand() % (2 * max_key);
+    tree.Upsert(key, make_value(i));
+    reference[key] = make_value(i);
+  }
+  VerifyContents(tree, reference);
+}
+
+// Merges trees whose keys are drawn from [lo, lo + span) and [other_lo,
+// other_lo + other_span), which may overlap, and checks that the values of the second
+// tree won. Sometimes a snapshot of the first tree is held across the merge.
+template<typename Tree, typename Value>
+void TestMerge(const char* name, int64_t size, int64_t lo, int64_t span,
+    int64_t other_size, int64_t other_lo, int64_t other_span, int num_threads,
+    Value (*make_value)(int64_t)) {
+  printf("Testing merge of %s, %ld keys in [%ld, %ld) and %ld keys in [%ld, %ld), on "
+      "%d threads.\n", name, size, lo, lo + span, other_size, other_lo,
+      other_lo + other_span, num_threads);
+  Tree tree, other;
+  map<int64_t, Value> reference, other_reference;
+  for (int64_t i = 0; i < size; ++i) reference[lo + rand() % span] = make_value(i);
+  for (int64_t i = 0; i < other_size; ++i) {
+    other_reference[other_lo + rand() % other_span] = make_value(-i);
+  }
+  tree.BulkLoad(reference.begin(), reference.end(), rand() % 2 == 0 ? 1.0 : 0.7);
+  other.BulkLoad(other_reference.begin(), other_reference.end());
+  unique_ptr<typename Tree::SnapshotView> snapshot;
+  map<int64_t, Value> expected = reference;
+  if (rand() % 2 == 0) snapshot.reset(new typename Tree::SnapshotView(tree.Snapshot()));
+
+  tree.Merge(std::move(other), num_threads);
+  for (const auto& pair : other_reference) reference[pair.first] = pair.second;
+  VerifyContents(tree, reference);
+  assert(other.size() == 0 && other.Begin().AtEnd());
+  if (snapshot) VerifyContents(*snapshot, expected);
+
+  // Both trees stay usable.
+  other_reference.clear();
+  for (int64_t i = 0; i < 100; ++i) {
+    int64_t key = lo + rand() % span;
+    if (rand() % 2 == 0) {
+      tree.Upsert(key, make_value(i));
+      reference[key] = make_value(i);
+    } else {
+      assert(tree.Remove(key) == (reference.erase(key) == 1));
+    }
+    other.Upsert(key, make_value(-i));
+    other_reference[key] = make_value(-i);
+  }
+  VerifyContents(tree, reference);
+  snapshot.reset();
+  tree.Merge(std::move(other), num_threads);
+  for (const auto& pair : other_reference) reference[pair.first] = pair.second;
+  VerifyContents(tree, reference);
+  assert(other.size() == 0);
+}
+
 int main(int argc, char** argv) {
   srand(0);
   string mode = argc == 1 ? "" : argv[1];
@@ -114,14 +1446,256 @@ int main(int argc, char** argv) {
     TestBasicCorrectness<StdUnorderedMap>("std unordered map", 1000);
     for (int i = 0; i <= 1000; i += 10) {
       //TestBasicCorrectness<BTreeV1>("btree_v1", i);
-      TestBasicCorrectness<BTree>("btree", i);
+      TestBasicCorrectness<TestCheckedBTree>("btree", i);
     }
   } else if (mode == "stl") {
     for (int i = 0; i < 10; ++i) {
       TestAgainstStl<BTreeV1>(100000, 100000);
+      TestAgainstStl<TestBTree>(100000, 100000);
+    }
+  } else if (mode == "iter") {
+    for (int i = 0; i <= 1000; i += 10) {
+      TestIterator<TestCheckedBTree>(i);
+    }
+  } else if (mode == "alloc") {
+    TestAllocator(100000, 10000);
+  } else if (mode == "bulk") {
+    for (int i = 0; i <= 1000; i += 10) {
+      TestBulkLoad(i, 1.0);
+      TestBulkLoad(i, 0.7);
+      TestBulkLoad(i, 0.5);
+    }
+  } else if (mode == "types") {
+    TestTypedTree<BTree<int32_t, Payload, less<int32_t>, 128>, int32_t, Payload,
+        less<int32_t>>("int32 -> payload", 100000, 10000, MakePayload);
+    TestTypedTree<BTree<int64_t, string, less<int64_t>, 128>, int64_t, string,
+        less<int64_t>>("int64 -> string", 100000, 10000, MakeString);
+    TestTypedTree<BTree<int64_t, int64_t, greater<int64_t>, 128>, int64_t, int64_t,
+        greater<int64_t>>("descending int64 -> int64", 100000, 10000, MakeInt);
+    TestTypedTree<BTree<int32_t, Payload, less<int32_t>, 4096>, int32_t, Payload,
+        less<int32_t>>("int32 -> payload, 4KB nodes", 1000000, 100000, MakePayload);
+  } else if (mode == "compressed") {
+    for (int i = 0; i <= 1000; i += 10) {
+      TestBasicCorrectness<CompressedBTree<>>("compressed btree", i);
+    }
+    for (int i = 0; i < 5; ++i) {
+      TestAgainstStl<CompressedBTree<>>(100000, 100000);
+    }
+    typedef CompressedBTree<int64_t> Int64Tree;
+    TestCompressedTree<Int64Tree, int64_t>("dense", 100000, DenseKey, MakeInt);
+    TestCompressedTree<Int64Tree, int64_t>("clustered", 100000, ClusteredKey, MakeInt);
+    TestCompressedTree<Int64Tree, int64_t>("sparse", 100000, SparseKey, MakeInt);
+    TestCompressedTree<Int64Tree, int64_t>("extreme", 100000, ExtremeKey, MakeInt);
+    TestCompressedTree<CompressedBTree<int32_t, 128>, int32_t>(
+        "int32 values, 128 byte leaves", 100000, ClusteredKey, MakeInt32);
+    TestCompressedTree<CompressedBTree<string>, string>(
+        "string values", 100000, ClusteredKey, MakeString);
+  } else if (mode == "batch") {
+    TestBatch<TestBTree>(1000, 100);
+    TestBatch<TestBTree>(2000, 10000);
+    TestBatch<TestBTree>(1000, 1000000);
+  } else if (mode == "olc") {
+    for (int i = 0; i <= 1000; i += 10) {
+      TestBasicCorrectness<TestBTreeOLC>("btree olc", i);
+    }
+    for (int i = 0; i < 10; ++i) {
+      TestAgainstStl<TestBTreeOLC>(100000, 100000);
+    }
+    TestConcurrent<TestBTreeOLC>(1, 10000, 3);
+    TestConcurrent<TestBTreeOLC>(4, 100000, 5);
+    TestConcurrent<TestBTreeOLC>(16, 100000, 5);
+    TestConcurrent<BTreeOLC<>>(8, 1000000, 2);
+  } else if (mode == "snapshot") {
+    TestSnapshots<TestBTree, void*>("btree", 100000, 1000, MakePointer);
+    TestSnapshots<TestBTree, void*>("btree", 30000, 20000, MakePointer);
+    TestSnapshots<BTree<int64_t, string, less<int64_t>, 128>, string>(
+        "string values", 50000, 2000, MakeString);
+    TestSnapshotReader(10000, 20000);
+  } else if (mode == "mapped") {
+    int64_t sizes[] = { 0, 1, 100, 10000, 300000 };
+    for (int64_t n : sizes) {
+      TestMapped<TestBTree, int64_t, void*, 4096>("btree", n, n * 2 + 1, MakePointer);
+      TestMapped<TestBTree, int64_t, void*, 256>("btree", n, n * 2 + 1, MakePointer);
+    }
+    TestMapped<BTree<int32_t, Payload, less<int32_t>, 128>, int32_t, Payload, 4096>(
+        "payload values", 100000, 1000000, MakePayload);
+    TestMapped<BTree<int32_t, Payload, less<int32_t>, 128>, int32_t, Payload, 512>(
+        "payload values", 100000, 1000000, MakePayload);
+  } else if (mode == "wal") {
+    TestWal(20000, 2000);
+    TestWalGroupCommit(4, 10000);
+  } else if (mode == "minfill") {
+    double min_fills[] = { 0, 0.1, 0.25, 0.5 };
+    for (double min_fill : min_fills) {
+      TestMinFill<TestBTree, void*>("btree", min_fill, 50000, 3000, MakePointer);
+      TestMinFill<BTree<int64_t, string, less<int64_t>, 128>, string>(
+          "string values", min_fill, 30000, 2000, MakeString);
+    }
+  } else if (mode == "stats") {
+    TestStats(0);
+    TestStats(100);
+    TestStats(10000);
+  } else if (mode == "validate") {
+    TestValidate(0);
+    TestValidate(1);
+    TestValidate(1000);
+    TestValidate(100000);
+  } else if (mode == "search") {
+    TestSearchPolicy<int64_t, less<int64_t>, LinearKeySearch<int64_t, less<int64_t>>>(
+        "linear", 300);
+    TestSearchPolicy<int64_t, less<int64_t>, BinaryKeySearch<int64_t, less<int64_t>>>(
+        "binary", 300);
+    TestSearchPolicy<int64_t, greater<int64_t>,
+        BinaryKeySearch<int64_t, greater<int64_t>>>("descending binary", 300);
+    TestSearchPolicy<int64_t, less<int64_t>,
+        InterpolationKeySearch<int64_t, less<int64_t>>>("interpolation", 300);
+    TestSearchPolicy<int32_t, less<int32_t>,
+        InterpolationKeySearch<int32_t, less<int32_t>>>("int32 interpolation", 300);
+    TestSearchPolicy<int64_t, less<int64_t>, SimdKeySearch<int64_t, less<int64_t>>>(
+        "simd", 300);
+    TestSearchPolicy<int32_t, less<int32_t>, SimdKeySearch<int32_t, less<int32_t>>>(
+        "int32 simd", 300);
+    TestTreeSearchPolicy<LinearKeySearch>();
+    TestTreeSearchPolicy<BinaryKeySearch>();
+    TestTreeSearchPolicy<InterpolationKeySearch>();
+    TestTreeSearchPolicy<SimdKeySearch>();
+  } else if (mode == "range") {
+    typedef BTree<int64_t, string, less<int64_t>, 128, KeySearch, BTREE_VALIDATE_EVERY,
+        true> CountedStringBTree;
+    double min_fills[] = { 0, 0.25, 0.5 };
+    for (double min_fill : min_fills) {
+      TestRanges<TestBTree, void*>("btree", min_fill, 20000, 3000, MakePointer);
+      TestRanges<TestCountedBTree, void*>("counted btree", min_fill, 20000, 3000,
+          MakePointer);
+      TestRanges<CountedStringBTree, string>("counted string values", min_fill, 10000,
+          2000, MakeString);
+    }
+    // The counts are kept through every other change too.
+    for (int i = 0; i < 3; ++i) {
+      TestAgainstStl<TestCountedBTree>(100000, 10000);
+    }
+    TestMinFill<TestCountedBTree, void*>("counted btree", 0.1, 50000, 3000, MakePointer);
+    TestSnapshots<TestCountedBTree, void*>("counted btree", 30000, 3000, MakePointer);
+  } else if (mode == "string") {
+    TestStringTree<StringBTree<>, void*>("short", 100000, ShortStringKey, MakePointer);
+    TestStringTree<StringBTree<>, void*>("urls", 100000, UrlKey, MakePointer);
+    TestStringTree<StringBTree<>, void*>("long", 100000, LongStringKey, MakePointer);
+    TestStringTree<StringBTree<void*, 256>, void*>("short, 256 byte nodes", 100000,
+        ShortStringKey, MakePointer);
+    TestStringTree<StringBTree<void*, 256>, void*>("urls, 256 byte nodes", 100000,
+        UrlKey, MakePointer);
+    TestStringTree<StringBTree<string>, string>("urls, string values", 50000, UrlKey,
+        MakeString);
+    TestStringTree<StringBTree<string, 1024>, string>("long, 1024 byte nodes", 50000,
+        LongStringKey, MakeString);
+    TestStringTree<StringBTree<int32_t, 192>, int32_t>("long, 192 byte nodes", 50000,
+        LongStringKey, MakeInt32);
+  } else if (mode == "rank") {
+    TestRankSelect<TestBTree>("btree", 20000, 5000);
+    TestRankSelect<TestCountedBTree>("counted btree", 50000, 5000);
+    TestRankSelect<TestCountedBTree>("counted btree with few keys", 5000, 50);
+  } else if (mode == "hash") {
+    // Validate() checks the hash index after every change in debug builds.
+    typedef BTree<int32_t, string, less<int32_t>, 128, KeySearch, BTREE_VALIDATE_EVERY,
+        false, true> HashedStringBTree;
+    for (int i = 0; i <= 1000; i += 10) {
+      TestBasicCorrectness<TestHashedBTree>("hashed btree", i);
+    }
+    for (int i = 0; i < 3; ++i) {
+      TestAgainstStl<TestHashedBTree>(100000, 10000);
+    }
+    TestBatch<TestHashedBTree>(2000, 10000);
+    TestSnapshots<TestHashedBTree, void*>("hashed btree", 30000, 3000, MakePointer);
+    TestTypedTree<HashedStringBTree, int32_t, string, less<int32_t>>(
+        "hashed int32 -> string", 100000, 10000, MakeString);
+    double min_fills[] = { 0, 0.25, 0.5 };
+    for (double min_fill : min_fills) {
+      TestMinFill<TestHashedBTree, void*>("hashed btree", min_fill, 30000, 3000,
+          MakePointer);
+      TestRanges<TestHashedBTree, void*>("hashed btree", min_fill, 20000, 3000,
+          MakePointer);
+    }
+  } else if (mode == "csb") {
+    typedef CsbBTree<int64_t, void*, less<int64_t>, 128> SmallCsbBTree;
+    typedef CsbBTree<int64_t, void*, less<int64_t>, 128, EytzingerLayout>
+        SmallEytzingerBTree;
+    for (int i = 0; i <= 1000; i += 10) {
+      TestBasicCorrectness<SmallCsbBTree>("csb+ btree", i);
+      TestBasicCorrectness<SmallEytzingerBTree>("csb+ btree (eytzinger)", i);
+    }
+    for (int i = 0; i < 3; ++i) {
+      TestAgainstStl<SmallCsbBTree>(100000, 10000);
+      TestAgainstStl<SmallEytzingerBTree>(100000, 10000);
+    }
+    TestCsbTree<SmallCsbBTree, int64_t, void*, less<int64_t>>("sorted", 200000, 50000,
+        MakePointer);
+    TestCsbTree<SmallEytzingerBTree, int64_t, void*, less<int64_t>>("eytzinger", 200000,
+        50000, MakePointer);
+    TestCsbTree<CsbBTree<>, int64_t, void*, less<int64_t>>("256 byte nodes", 300000,
+        200000, MakePointer);
+    TestCsbTree<CsbBTree<int64_t, void*, greater<int64_t>, 192, EytzingerLayout>,
+        int64_t, void*, greater<int64_t>>("descending eytzinger, 192 byte nodes", 200000,
+        50000, MakePointer);
+    TestCsbTree<CsbBTree<int32_t, int32_t, less<int32_t>, 128>, int32_t, int32_t,
+        less<int32_t>>("int32 values", 200000, 50000, MakeInt32);
+    TestCsbTree<CsbBTree<int32_t, string, less<int32_t>, 256, EytzingerLayout>, int32_t,
+        string, less<int32_t>>("eytzinger string values", 100000, 30000, MakeString);
+  } else if (mode == "frozen") {
+    int64_t sizes[] = { 0, 1, 2, 31, 32, 33, 1056, 1057, 20000 };
+    for (int64_t n : sizes) {
+      TestFrozen<FrozenBTree<>, int64_t, void*, less<int64_t>>("btree", n, 3 * n + 10,
+          MakePointer);
+    }
+    TestFrozen<FrozenBTree<int64_t, void*, less<int64_t>, 64>, int64_t, void*,
+        less<int64_t>>("64 byte blocks", 30000, 100000, MakePointer);
+    TestFrozen<FrozenBTree<int64_t, void*, less<int64_t>, 64, BinaryKeySearch>, int64_t,
+        void*, less<int64_t>>("binary search", 30000, 100000, MakePointer);
+    TestFrozen<FrozenBTree<int64_t, void*, greater<int64_t>, 128>, int64_t, void*,
+        greater<int64_t>>("descending", 30000, 100000, MakePointer);
+    TestFrozen<FrozenBTree<int32_t, string, less<int32_t>, 64>, int32_t, string,
+        less<int32_t>>("int32 -> string", 20000, 50000, MakeString);
+    TestFreeze(100000, 30000);
+  } else if (mode == "parallel") {
+    typedef BTree<int64_t, string, less<int64_t>, 128> StringValueBTree;
+    int thread_counts[] = { 1, 2, 3, 8 };
+    for (int num_threads : thread_counts) {
+      int64_t sizes[] = { 0, 1, 7, 100, 5000, 100000 };
+      for (int64_t n : sizes) {
+        TestParallelBulkLoad<TestBTree, void*>("btree", n, n / 2 + 1, num_threads,
+            MakePointer);
+      }
+      TestParallelBulkLoad<TestCountedBTree, void*>("counted btree", 50000, 30000,
+          num_threads, MakePointer);
+      TestParallelBulkLoad<TestHashedBTree, void*>("hashed btree", 50000, 30000,
+          num_threads, MakePointer);
+      TestParallelBulkLoad<StringValueBTree, string>("string values", 30000, 20000,
+          num_threads, MakeString);
+
+      TestMerge<TestBTree, void*>("disjoint trees", 20000, 0, 50000, 20000, 100000,
+          50000, num_threads, MakePointer);
+      TestMerge<TestBTree, void*>("disjoint trees", 20000, 100000, 50000, 20000, 0,
+          50000, num_threads, MakePointer);
+      TestMerge<TestBTree, void*>("interleaved trees", 50000, 0, 100000, 30000, 0,
+          100000, num_threads, MakePointer);
+      TestMerge<TestBTree, void*>("a small tree", 50000, 0, 100000, 10, 40000, 20000,
+          num_threads, MakePointer);
+      TestMerge<TestBTree, void*>("into a small tree", 10, 40000, 20000, 50000, 0,
+          100000, num_threads, MakePointer);
+      TestMerge<TestBTree, void*>("into an empty tree", 0, 0, 1, 5000, 0, 10000,
+          num_threads, MakePointer);
+      TestMerge<TestBTree, void*>("an empty tree", 5000, 0, 10000, 0, 0, 1, num_threads,
+          MakePointer);
+      TestMerge<TestCountedBTree, void*>("counted trees", 30000, 0, 60000, 30000, 20000,
+          60000, num_threads, MakePointer);
+      TestMerge<TestHashedBTree, void*>("hashed trees", 30000, 0, 60000, 30000, 20000,
+          60000, num_threads, MakePointer);
+      TestMerge<StringValueBTree, string>("string values", 20000, 0, 40000, 20000, 10000,
+          40000, num_threads, MakeString);
     }
   } else {
-    printf("Usage: test-correctness [basic|stl]\n");
+    printf("Usage: test-correctness [basic|stl|iter|alloc|bulk|types|batch|compressed|"
+        "olc|snapshot|mapped|wal|minfill|stats|validate|search|range|rank|string|"
+        "hash|csb|frozen|parallel]\n");
     return -1;
   }
   printf("Done.\n");
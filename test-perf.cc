@@ -1,6 +1,18 @@
 #include "test-common.h"
 
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
 #include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <string>
+#include <thread>
 
 void GenerateOps(vector<int64_t>* keys, vector<Op>* ops, int64_t num_ops, int64_t max_key) {
   for (int64_t i = 0; i < num_ops; ++i) {
@@ -52,6 +64,16 @@ int64_t TestPerf(const char* name, const vector<TestOp>& ops, int num_iters) {
   return num_finds;
 }
 
+// BTree whose leaves are only merged away once they are empty.
+class LazyBTree : public BTree<> {
+ public:
+  LazyBTree() { SetMinFill(0); }
+};
+
+// BTree with a hash index in front of its leaves.
+typedef BTree<int64_t, void*, less<int64_t>, 256, KeySearch, BTREE_VALIDATE_EVERY, false,
+    true> HashedBTree;
+
 vector<TestOp> GenerateOps(int64_t num_ops, int64_t max_key,
     int percentFind, int percentInsert) {
   if (percentFind + percentInsert > 100) {
@@ -74,6 +96,1134 @@ vector<TestOp> GenerateOps(int64_t num_ops, int64_t max_key,
   return ops;
 }
 
+// Latency histogram. Values below 16 have their own bucket, larger values are split
+// into 16 buckets per power of two, so percentiles are accurate to about 6%.
+class LatencyHistogram {
+ public:
+  LatencyHistogram() : counts_(NUM_BUCKETS, 0), total_(0) {}
+
+  void Add(int64_t ns) {
+    ++counts_[Bucket(ns)];
+    ++total_;
+  }
+
+  void Merge(const LatencyHistogram& other) {
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+  }
+
+  // Returns an upper bound for the p-th percentile (0 < p <= 1).
+  int64_t Percentile(double p) const {
+    int64_t target = static_cast<int64_t>(ceil(p * total_));
+    int64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; ++i) {
+      seen += counts_[i];
+      if (seen >= target) return BucketLimit(i);
+    }
+    return BucketLimit(NUM_BUCKETS - 1);
+  }
+
+  int64_t count() const { return total_; }
+
+ private:
+  static const int SUB_BUCKETS = 16;
+  static const int NUM_BUCKETS = SUB_BUCKETS + 60 * SUB_BUCKETS;
+
+  static int Bucket(int64_t value) {
+    uint64_t v = value < 0 ? 0 : value;
+    if (v < SUB_BUCKETS) return v;
+    int log = 63 - __builtin_clzll(v);
+    int sub = (v >> (log - 4)) - SUB_BUCKETS;
+    return SUB_BUCKETS + (log - 4) * SUB_BUCKETS + sub;
+  }
+
+  // Largest value in bucket b.
+  static int64_t BucketLimit(int b) {
+    if (b < SUB_BUCKETS) return b;
+    int log = (b - SUB_BUCKETS) / SUB_BUCKETS + 4;
+    int sub = (b - SUB_BUCKETS) % SUB_BUCKETS;
+    return ((static_cast<int64_t>(SUB_BUCKETS + sub + 1)) << (log - 4)) - 1;
+  }
+
+  vector<int64_t> counts_;
+  int64_t total_;
+};
+
+// Key distributions for the multithreaded benchmark.
+enum Distribution {
+  UNIFORM,
+  // Zipfian with theta 0.99 over [0, max_key), rank i is key i, so hot keys share leaves.
+  ZIPF,
+  // Each thread walks the key space in order, interleaved with the other threads.
+  SEQUENTIAL,
+  // 90% of the ops go to the first 10% of the key space.
+  HOTSPOT,
+};
+
+// Zipfian generator from Gray et al., "Quickly Generating Billion-Record Synthetic
+// Databases", as used by YCSB.
+class ZipfGenerator {
+ public:
+  ZipfGenerator(int64_t n, double theta) : n_(n), theta_(theta) {
+    zetan_ = Zeta(n, theta);
+    double zeta2 = Zeta(2, theta);
+    alpha_ = 1.0 / (1.0 - theta);
+    eta_ = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan_);
+  }
+
+  int64_t Next(mt19937_64* rng) const {
+    double u = uniform_real_distribution<double>(0, 1)(*rng);
+    double uz = u * zetan_;
+    if (uz < 1.0) return 0;
+    if (uz < 1.0 + pow(0.5, theta_)) return 1;
+    int64_t v = static_cast<int64_t>(n_ * pow(eta_ * u - eta_ + 1, alpha_));
+    return v < n_ ? v : n_ - 1;
+  }
+
+ private:
+  static double Zeta(int64_t n, double theta) {
+    double sum = 0;
+    for (int64_t i = 1; i <= n; ++i) {
+      sum += 1.0 / pow(static_cast<double>(i), theta);
+    }
+    return sum;
+  }
+
+  int64_t n_;
+  double theta_;
+  double zetan_;
+  double alpha_;
+  double eta_;
+};
+
+struct MtConfig {
+  // Threads running the op mix and threads running only finds.
+  int threads;
+  int readers;
+  int64_t ops_per_thread;
+  int64_t max_key;
+  // Percentage of the key space inserted before the clock starts.
+  int prefill;
+  Distribution dist;
+  // Op mix for the mixed threads. Removes make up the rest.
+  int percent_find;
+  int percent_insert;
+  int percent_update;
+  int percent_upsert;
+  // Pin thread i to cpu i % num_cpus.
+  bool pin;
+};
+
+// Generates the ops for thread 'thread_idx'.
+vector<TestOp> GenerateMtOps(const MtConfig& config, const ZipfGenerator* zipf,
+    int thread_idx, bool reader) {
+  mt19937_64 rng(thread_idx + 1);
+  int num_threads = config.threads + config.readers;
+  vector<TestOp> ops;
+  ops.reserve(config.ops_per_thread);
+  for (int64_t i = 0; i < config.ops_per_thread; ++i) {
+    int64_t key = 0;
+    switch (config.dist) {
+      case UNIFORM:
+        key = rng() % config.max_key;
+        break;
+      case ZIPF:
+        key = zipf->Next(&rng);
+        break;
+      case SEQUENTIAL:
+        key = (i * num_threads + thread_idx) % config.max_key;
+        break;
+      case HOTSPOT: {
+        int64_t hot_keys = config.max_key / 10 > 0 ? config.max_key / 10 : 1;
+        key = rng() % 100 < 90 ? rng() % hot_keys : rng() % config.max_key;
+        break;
+      }
+      default:
+        assert(false);
+    }
+
+    int rand_op = rng() % 100;
+    Op op = REMOVE;
+    if (reader || rand_op < config.percent_find) {
+      op = FIND;
+    } else if ((rand_op -= config.percent_find) < config.percent_insert) {
+      op = INSERT;
+    } else if ((rand_op -= config.percent_insert) < config.percent_update) {
+      op = UPDATE;
+    } else if ((rand_op -= config.percent_update) < config.percent_upsert) {
+      op = UPSERT;
+    }
+    ops.push_back(TestOp{op, key});
+  }
+  return ops;
+}
+
+// Locking for SharedTree. The trees other than BTreeOLC are not thread safe and
+// are shared behind one of these.
+class MutexLock {
+ public:
+  void ReadLock() { mutex_.lock(); }
+  void ReadUnlock() { mutex_.unlock(); }
+  void WriteLock() { mutex_.lock(); }
+  void WriteUnlock() { mutex_.unlock(); }
+
+ private:
+  std::mutex mutex_;
+};
+
+class RwLock {
+ public:
+  RwLock() { pthread_rwlock_init(&lock_, NULL); }
+  ~RwLock() { pthread_rwlock_destroy(&lock_); }
+  void ReadLock() { pthread_rwlock_rdlock(&lock_); }
+  void ReadUnlock() { pthread_rwlock_unlock(&lock_); }
+  void WriteLock() { pthread_rwlock_wrlock(&lock_); }
+  void WriteUnlock() { pthread_rwlock_unlock(&lock_); }
+
+ private:
+  pthread_rwlock_t lock_;
+};
+
+// For trees that synchronize internally.
+class NoLock {
+ public:
+  void ReadLock() {}
+  void ReadUnlock() {}
+  void WriteLock() {}
+  void WriteUnlock() {}
+};
+
+// Tree shared by all the benchmark threads. Every op holds 'Lock' for its duration.
+template<typename Tree, typename Lock>
+class SharedTree {
+ public:
+  bool Find(int64_t key) {
+    lock_.ReadLock();
+    bool found = !tree_.Find(key).AtEnd();
+    lock_.ReadUnlock();
+    return found;
+  }
+
+  bool Insert(int64_t key) {
+    lock_.WriteLock();
+    bool inserted = !tree_.Insert(key, NULL).AtEnd();
+    lock_.WriteUnlock();
+    return inserted;
+  }
+
+  bool Update(int64_t key) {
+    lock_.WriteLock();
+    bool updated = tree_.Update(key, NULL);
+    lock_.WriteUnlock();
+    return updated;
+  }
+
+  bool Upsert(int64_t key) {
+    lock_.WriteLock();
+    bool upserted = !tree_.Upsert(key, NULL).AtEnd();
+    lock_.WriteUnlock();
+    return upserted;
+  }
+
+  bool Remove(int64_t key) {
+    lock_.WriteLock();
+    bool removed = tree_.Remove(key);
+    lock_.WriteUnlock();
+    return removed;
+  }
+
+ private:
+  Tree tree_;
+  Lock lock_;
+};
+
+void PinThread(int thread_idx) {
+  int num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(thread_idx % num_cpus, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+// Returns the number of ops that succeeded (found, inserted, ...). Using the results
+// also keeps the compiler from dropping lookups whose result is otherwise unused.
+template<typename Tree>
+int64_t RunMtOps(Tree* tree, const vector<TestOp>& ops, LatencyHistogram* latencies) {
+  typedef chrono::steady_clock Clock;
+  int64_t num_succeeded = 0;
+  for (size_t i = 0; i < ops.size(); ++i) {
+    Clock::time_point start = Clock::now();
+    switch (ops[i].op) {
+      case FIND:
+        num_succeeded += tree->Find(ops[i].key);
+        break;
+      case UPDATE:
+        num_succeeded += tree->Update(ops[i].key);
+        break;
+      case INSERT:
+        num_succeeded += tree->Insert(ops[i].key);
+        break;
+      case UPSERT:
+        num_succeeded += tree->Upsert(ops[i].key);
+        break;
+      case REMOVE:
+        num_succeeded += tree->Remove(ops[i].key);
+        break;
+      default:
+        printf("Unknown op\n");
+        exit(1);
+    }
+    Clock::time_point end = Clock::now();
+    latencies[ops[i].op].Add(chrono::duration_cast<chrono::nanoseconds>(end - start).count());
+  }
+  return num_succeeded;
+}
+
+// Runs the ops for every thread against one shared tree and prints the throughput
+// and the latency percentiles for each type of op.
+template<typename Tree>
+void TestMtPerf(const char* name, const MtConfig& config,
+    const vector<vector<TestOp>>& thread_ops) {
+  printf("Testing %s", name);
+  fflush(stdout);
+  Tree tree;
+  // Exactly prefill percent of the keys, picked and inserted in random order.
+  vector<int64_t> keys(config.max_key);
+  iota(keys.begin(), keys.end(), 0);
+  shuffle(keys.begin(), keys.end(), mt19937_64(0));
+  keys.resize(config.max_key * config.prefill / 100);
+  for (int64_t key : keys) tree.Insert(key);
+
+  int num_threads = thread_ops.size();
+  vector<vector<LatencyHistogram>> latencies(
+      num_threads, vector<LatencyHistogram>(MAX_OP));
+  vector<int64_t> succeeded(num_threads);
+  vector<thread> threads;
+  auto start = chrono::high_resolution_clock::now();
+  for (int i = 0; i < num_threads; ++i) {
+    threads.push_back(thread([&, i]() {
+      if (config.pin) PinThread(i);
+      succeeded[i] = RunMtOps(&tree, thread_ops[i], &latencies[i][0]);
+    }));
+  }
+  for (int i = 0; i < num_threads; ++i) {
+    threads[i].join();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+
+  int64_t transactions = 0;
+  int64_t num_succeeded = 0;
+  for (int i = 0; i < num_threads; ++i) {
+    transactions += thread_ops[i].size();
+    num_succeeded += succeeded[i];
+  }
+  printf(": %0.3f kTPS (%ld ops succeeded)\n", transactions / seconds.count() / 1000.,
+      num_succeeded);
+
+  const char* op_names[] = { "find", "insert", "update", "upsert", "remove" };
+  for (int op = 0; op < MAX_OP; ++op) {
+    LatencyHistogram merged;
+    for (int i = 0; i < num_threads; ++i) {
+      merged.Merge(latencies[i][op]);
+    }
+    if (merged.count() == 0) continue;
+    printf("    %-6s  p50: %6ld ns   p99: %6ld ns   p999: %6ld ns\n", op_names[op],
+        merged.Percentile(0.5), merged.Percentile(0.99), merged.Percentile(0.999));
+  }
+}
+
+// Compares Find() with FindBatch() at several batch sizes on a tree with num_keys
+// keys. The lookups are uniformly random so every level below the top few misses the
+// cache once the tree is larger than the LLC.
+void TestBatchPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running batch lookup benchmark with %ld keys.\n", num_keys);
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    pairs.push_back(make_pair(i * 2, reinterpret_cast<void*>(i)));
+  }
+  BTree<> tree(pairs.begin(), pairs.end(), 0.7);
+  pairs.clear();
+
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_lookups; ++i) {
+    keys.push_back(rng() % (num_keys * 2));
+  }
+
+  printf("Testing find");
+  fflush(stdout);
+  int64_t expected = 0;
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_lookups; ++i) {
+    expected += !tree.Find(keys[i]).AtEnd();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf(": %0.3f kTPS\n", num_lookups / seconds.count() / 1000.);
+
+  const int batch_sizes[] = { 8, 32, 64, 128, 256 };
+  for (int batch_size : batch_sizes) {
+    printf("Testing find batch of %d", batch_size);
+    fflush(stdout);
+    vector<BTree<>::Iterator> results(batch_size);
+    int64_t found = 0;
+    start = chrono::high_resolution_clock::now();
+    for (int64_t i = 0; i < num_lookups; i += batch_size) {
+      int n = num_lookups - i < batch_size ? num_lookups - i : batch_size;
+      tree.FindBatch(&keys[i], n, results.data());
+      for (int j = 0; j < n; ++j) found += !results[j].AtEnd();
+    }
+    end = chrono::high_resolution_clock::now();
+    seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+    printf(": %0.3f kTPS\n", num_lookups / seconds.count() / 1000.);
+    if (found != expected) {
+      printf("Incorrect results: %ld != %ld\n", found, expected);
+      exit(1);
+    }
+  }
+}
+
+// Inserts keys in order into Tree and reports the memory used per key and the lookup
+// throughput. bytes_reserved returns the bytes the tree allocated.
+template<typename Tree>
+void TestMemory(const char* name, Tree* tree, const vector<int64_t>& keys,
+    const function<int64_t()>& bytes_reserved) {
+  printf("Testing %s", name);
+  fflush(stdout);
+  for (size_t i = 0; i < keys.size(); ++i) {
+    tree->Insert(keys[i], NULL);
+  }
+  vector<int64_t> lookups(keys);
+  shuffle(lookups.begin(), lookups.end(), mt19937_64(1));
+  int64_t found = 0;
+  auto start = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    found += !tree->Find(lookups[i]).AtEnd();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf(": %0.1f bytes/key, find %0.3f kTPS\n",
+      static_cast<double>(bytes_reserved()) / keys.size(),
+      lookups.size() / seconds.count() / 1000.);
+  if (found != static_cast<int64_t>(keys.size())) {
+    printf("Incorrect results: %ld != %zu\n", found, keys.size());
+    exit(1);
+  }
+}
+
+// Memory footprint of BTree and CompressedBTree on num_keys dense ids (every key in
+// [0, 1.25 * num_keys) with probability 0.8), inserted in random order.
+void TestMemoryPerf(int64_t num_keys) {
+  printf("Running memory benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; static_cast<int64_t>(keys.size()) < num_keys; ++i) {
+    if (rng() % 5 != 0) keys.push_back(i);
+  }
+  shuffle(keys.begin(), keys.end(), rng);
+
+  NodePool pool;
+  BTree<> btree(&pool);
+  TestMemory("btree", &btree, keys, [&pool]() { return pool.bytes_reserved(); });
+  CompressedBTree<> compressed;
+  TestMemory("compressed btree", &compressed, keys,
+      [&compressed]() { return compressed.bytes_reserved(); });
+}
+
+// Throughput of random upserts into a tree with num_keys keys while a snapshot is
+// replaced every 'interval' upserts. The first write to a node after a snapshot copies
+// it, so frequent snapshots copy more of the tree.
+void TestSnapshotPerf(int64_t num_keys, int64_t num_ops) {
+  printf("Running snapshot benchmark with %ld keys.\n", num_keys);
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    pairs.push_back(make_pair(i, reinterpret_cast<void*>(i)));
+  }
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_ops; ++i) keys.push_back(rng() % num_keys);
+
+  const int64_t intervals[] = { 0, 1000000, 100000, 10000, 1000 };
+  for (int64_t interval : intervals) {
+    BTree<> tree(pairs.begin(), pairs.end(), 0.7);
+    if (interval == 0) {
+      printf("Testing upsert without snapshots");
+    } else {
+      printf("Testing upsert with a snapshot every %ld", interval);
+    }
+    fflush(stdout);
+    unique_ptr<BTree<>::SnapshotView> snapshot;
+    auto start = chrono::high_resolution_clock::now();
+    for (int64_t i = 0; i < num_ops; ++i) {
+      if (interval != 0 && i % interval == 0) {
+        snapshot.reset(new BTree<>::SnapshotView(tree.Snapshot()));
+      }
+      tree.Upsert(keys[i], NULL);
+    }
+    snapshot.reset();
+    auto end = chrono::high_resolution_clock::now();
+    auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+    printf(": %0.3f kTPS\n", num_ops / seconds.count() / 1000.);
+  }
+}
+
+// Cold start of a tree with num_keys keys: rebuilding it by inserting every key
+// against opening a file written by Save(), and lookups from the heap against lookups
+// from the mapping.
+void TestMappedPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running mapped benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(i * 2);
+  shuffle(keys.begin(), keys.end(), rng);
+  vector<int64_t> lookups;
+  for (int64_t i = 0; i < num_lookups; ++i) lookups.push_back(rng() % (num_keys * 2));
+  string path = "/tmp/test-perf-" + to_string(getpid()) + ".btree";
+
+  BTree<> tree;
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_keys; ++i) {
+    tree.Insert(keys[i], reinterpret_cast<void*>(keys[i]));
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Testing insert all keys: %0.3f s\n", seconds.count());
+
+  start = chrono::high_resolution_clock::now();
+  if (!tree.Save(path)) {
+    printf("Could not write %s\n", path.c_str());
+    exit(1);
+  }
+  end = chrono::high_resolution_clock::now();
+  seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Testing save: %0.3f s\n", seconds.count());
+
+  start = chrono::high_resolution_clock::now();
+  MappedBTree<>* mapped = MappedBTree<>::OpenMapped(path);
+  end = chrono::high_resolution_clock::now();
+  auto micros = chrono::duration_cast<chrono::microseconds>(end - start);
+  if (mapped == NULL) {
+    printf("Could not map %s\n", path.c_str());
+    exit(1);
+  }
+  printf("Testing open mapped: %ld us, %0.1f bytes/key\n", micros.count(),
+      static_cast<double>(mapped->bytes_mapped()) / num_keys);
+
+  int64_t expected = 0;
+  start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_lookups; ++i) {
+    expected += !tree.Find(lookups[i]).AtEnd();
+  }
+  end = chrono::high_resolution_clock::now();
+  seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Testing find in btree: %0.3f kTPS\n", num_lookups / seconds.count() / 1000.);
+
+  int64_t found = 0;
+  start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_lookups; ++i) {
+    found += !mapped->Find(lookups[i]).AtEnd();
+  }
+  end = chrono::high_resolution_clock::now();
+  seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Testing find in mapped btree: %0.3f kTPS\n",
+      num_lookups / seconds.count() / 1000.);
+  delete mapped;
+  unlink(path.c_str());
+  if (found != expected) {
+    printf("Incorrect results: %ld != %ld\n", found, expected);
+    exit(1);
+  }
+}
+
+// Throughput of random upserts without a log, with a log that commits in groups and
+// with a log synced after every upsert.
+void TestWalPerf(int64_t num_ops, int64_t num_synced_ops) {
+  printf("Running write-ahead log benchmark.\n");
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_ops; ++i) keys.push_back(rng() % (num_ops * 2));
+  string prefix = "/tmp/test-perf-" + to_string(getpid());
+  string image_path = prefix + ".image";
+  string log_path = prefix + ".wal";
+
+  printf("Testing upsert without log");
+  fflush(stdout);
+  BTree<> tree;
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_ops; ++i) {
+    tree.Upsert(keys[i], reinterpret_cast<void*>(i));
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf(": %0.3f kTPS\n", num_ops / seconds.count() / 1000.);
+
+  for (int sync_every_op = 0; sync_every_op < 2; ++sync_every_op) {
+    int64_t n = sync_every_op ? num_synced_ops : num_ops;
+    printf(sync_every_op ? "Testing upsert with sync per op" :
+        "Testing upsert with group commit");
+    fflush(stdout);
+    unlink(log_path.c_str());
+    LoggedBTree<>* logged = LoggedBTree<>::Open(image_path, log_path);
+    if (logged == NULL) {
+      printf("Could not open %s\n", log_path.c_str());
+      exit(1);
+    }
+    start = chrono::high_resolution_clock::now();
+    for (int64_t i = 0; i < n; ++i) {
+      logged->Upsert(keys[i], reinterpret_cast<void*>(i));
+      if (sync_every_op) logged->Sync();
+    }
+    logged->Sync();
+    end = chrono::high_resolution_clock::now();
+    seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+    printf(": %0.3f kTPS\n", n / seconds.count() / 1000.);
+    delete logged;
+  }
+  unlink(log_path.c_str());
+}
+
+// Prints the shape of a tree of num_keys random keys, after removing half of them and
+// after bulk loading them. Build with -DBTREE_COUNTERS=1 to see the counters as well.
+void TestStatsPerf(int64_t num_keys) {
+  printf("Running stats benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(i);
+  shuffle(keys.begin(), keys.end(), rng);
+
+  BTree<> tree;
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_keys; ++i) tree.Insert(keys[i], NULL);
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Random inserts: %0.3f kTPS\n%s", num_keys / seconds.count() / 1000.,
+      tree.Stats().ToString().c_str());
+
+  tree.ResetCounters();
+  for (int64_t i = 0; i < num_keys / 2; ++i) tree.Remove(keys[i]);
+  printf("After removing half:\n%s", tree.Stats().ToString().c_str());
+
+  sort(keys.begin(), keys.end());
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t key : keys) pairs.push_back(make_pair(key, static_cast<void*>(NULL)));
+  BTree<> loaded(pairs.begin(), pairs.end(), 0.7);
+  start = chrono::high_resolution_clock::now();
+  BTreeStats stats = loaded.Stats();
+  end = chrono::high_resolution_clock::now();
+  seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Bulk loaded at 0.7, Stats() took %0.3f ms:\n%s", seconds.count() * 1000.,
+      stats.ToString().c_str());
+}
+
+// Throughput of num_keys random inserts into a tree that validates itself after every
+// VALIDATE_EVERY-th insert.
+template<int VALIDATE_EVERY>
+void TestValidateEvery(const vector<int64_t>& keys) {
+  if (VALIDATE_EVERY == 0) {
+    printf("Testing insert without validation");
+  } else {
+    printf("Testing insert with validation every %d", VALIDATE_EVERY);
+  }
+  fflush(stdout);
+  BTree<int64_t, void*, less<int64_t>, 256, KeySearch, VALIDATE_EVERY> tree;
+  auto start = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < keys.size(); ++i) tree.Insert(keys[i], NULL);
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf(": %0.3f kTPS\n", keys.size() / seconds.count() / 1000.);
+}
+
+// Cost of Validate() on a tree of num_keys keys and of sampling it during inserts.
+void TestValidatePerf(int64_t num_keys) {
+  printf("Running validation benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(i);
+  shuffle(keys.begin(), keys.end(), rng);
+
+  BTree<> tree;
+  for (int64_t i = 0; i < num_keys; ++i) tree.Insert(keys[i], NULL);
+  auto start = chrono::high_resolution_clock::now();
+  bool valid = tree.Validate();
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Validate(): %0.3f ms, %0.2f ns/key\n", seconds.count() * 1000.,
+      seconds.count() * 1e9 / num_keys);
+  if (!valid) {
+    printf("Invalid tree\n");
+    exit(1);
+  }
+
+  TestValidateEvery<0>(keys);
+  TestValidateEvery<1000000>(keys);
+  TestValidateEvery<100000>(keys);
+  TestValidateEvery<10000>(keys);
+}
+
+// Random lookups of keys in a tree bulk loaded with 'pairs', with NODE_BYTES nodes
+// searched by SearchPolicy.
+template<size_t NODE_BYTES, template<typename, typename> class SearchPolicy>
+void TestSearch(const char* name, const vector<pair<int64_t, void*>>& pairs,
+    const vector<int64_t>& lookups) {
+  typedef BTree<int64_t, void*, less<int64_t>, NODE_BYTES, SearchPolicy> Tree;
+  Tree tree(pairs.begin(), pairs.end(), 0.7);
+  int64_t found = 0;
+  auto start = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    found += !tree.Find(lookups[i]).AtEnd();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("  %s: %0.3f kTPS", name, lookups.size() / seconds.count() / 1000.);
+  if (found != static_cast<int64_t>(lookups.size())) {
+    printf("\nIncorrect results: %ld != %zu\n", found, lookups.size());
+    exit(1);
+  }
+}
+
+// Compares the search policies in NODE_BYTES nodes.
+template<size_t NODE_BYTES>
+void TestSearchPolicies(const vector<pair<int64_t, void*>>& pairs,
+    const vector<int64_t>& lookups) {
+  typedef BTree<int64_t, void*, less<int64_t>, NODE_BYTES> Tree;
+  printf("%zu byte nodes (leaf order %d, internal order %d):\n", NODE_BYTES,
+      Tree::LEAF_ORDER, Tree::INTERNAL_ORDER);
+  TestSearch<NODE_BYTES, LinearKeySearch>("linear", pairs, lookups);
+  TestSearch<NODE_BYTES, BinaryKeySearch>("binary", pairs, lookups);
+  TestSearch<NODE_BYTES, InterpolationKeySearch>("interpolation", pairs, lookups);
+  TestSearch<NODE_BYTES, SimdKeySearch>("simd", pairs, lookups);
+  printf("\n");
+}
+
+// Lookup throughput of every search policy for node sizes from 128 bytes to 4KB, on
+// num_keys uniformly distributed random keys.
+void TestSearchPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running search policy benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(rng() >> 2);
+  sort(keys.begin(), keys.end());
+  keys.erase(unique(keys.begin(), keys.end()), keys.end());
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t key : keys) pairs.push_back(make_pair(key, static_cast<void*>(NULL)));
+  vector<int64_t> lookups;
+  for (int64_t i = 0; i < num_lookups; ++i) lookups.push_back(keys[rng() % keys.size()]);
+
+  TestSearchPolicies<128>(pairs, lookups);
+  TestSearchPolicies<256>(pairs, lookups);
+  TestSearchPolicies<512>(pairs, lookups);
+  TestSearchPolicies<1024>(pairs, lookups);
+  TestSearchPolicies<2048>(pairs, lookups);
+  TestSearchPolicies<4096>(pairs, lookups);
+}
+
+// BTree<> with subtree counts.
+typedef BTree<int64_t, void*, less<int64_t>, 256, KeySearch, BTREE_VALIDATE_EVERY, true>
+    CountedBTree;
+
+// Expires the keys of a tree bulk loaded with 'pairs' oldest first, range_size keys at
+// a time, like TTL expiry of increasing IDs. Either removes the keys one by one or
+// with RemoveRange().
+template<typename Tree>
+void TestExpire(const char* name, const vector<pair<int64_t, void*>>& pairs,
+    int64_t range_size, bool by_range) {
+  printf("Testing %s", name);
+  fflush(stdout);
+  Tree tree(pairs.begin(), pairs.end(), 0.7);
+  int64_t num_keys = pairs.size();
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t lo = 0; lo < num_keys; lo += range_size) {
+    if (by_range) {
+      tree.RemoveRange(lo, lo + range_size);
+    } else {
+      for (int64_t key = lo; key < lo + range_size && key < num_keys; ++key) {
+        tree.Remove(key);
+      }
+    }
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf(": %0.3f ms, %0.2f ns/key\n", seconds.count() * 1000.,
+      seconds.count() * 1e9 / num_keys);
+  if (tree.size() != 0) {
+    printf("Incorrect results: %ld keys left\n", tree.size());
+    exit(1);
+  }
+}
+
+// Counts the keys in num_ranges random ranges of up to max_width keys.
+template<typename Tree>
+void TestCountRange(const char* name, const vector<pair<int64_t, void*>>& pairs,
+    int64_t num_ranges, int64_t max_width) {
+  Tree tree(pairs.begin(), pairs.end(), 0.7);
+  mt19937_64 rng(0);
+  int64_t num_keys = pairs.size();
+  int64_t total = 0;
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_ranges; ++i) {
+    int64_t lo = rng() % num_keys;
+    total += tree.CountRange(lo, lo + rng() % max_width);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Testing %s, ranges up to %ld keys: %0.3f kTPS (%ld keys)\n", name, max_width,
+      num_ranges / seconds.count() / 1000., total);
+}
+
+// Range removal against removing each key, and range counts with and without subtree
+// counts, on num_keys consecutive keys.
+void TestRangePerf(int64_t num_keys) {
+  printf("Running range benchmark with %ld keys.\n", num_keys);
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    pairs.push_back(make_pair(i, static_cast<void*>(NULL)));
+  }
+  int64_t range_sizes[] = { 100, 10000, 1000000 };
+  for (int64_t range_size : range_sizes) {
+    printf("Expiring %ld keys at a time:\n", range_size);
+    TestExpire<BTree<>>("Remove()", pairs, range_size, false);
+    TestExpire<BTree<>>("RemoveRange()", pairs, range_size, true);
+    TestExpire<CountedBTree>("RemoveRange() with subtree counts", pairs, range_size,
+        true);
+  }
+  int64_t widths[] = { 100, 10000, 1000000 };
+  for (int64_t width : widths) {
+    TestCountRange<BTree<>>("CountRange()", pairs, 100000000 / width, width);
+    TestCountRange<CountedBTree>("CountRange() with subtree counts", pairs,
+        100000000 / width, width);
+  }
+}
+
+// Runs num_ops random Rank() or Select() queries on a tree bulk loaded with 'pairs'.
+template<typename Tree>
+void TestRankSelectQueries(const char* name, const vector<pair<int64_t, void*>>& pairs,
+    int64_t num_ops, bool select) {
+  Tree tree(pairs.begin(), pairs.end(), 0.7);
+  mt19937_64 rng(0);
+  int64_t num_keys = pairs.size();
+  int64_t total = 0;
+  auto start = chrono::high_resolution_clock::now();
+  for (int64_t i = 0; i < num_ops; ++i) {
+    if (select) {
+      total += tree.Select(rng() % num_keys).key();
+    } else {
+      total += tree.Rank(rng() % (num_keys * 2));
+    }
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto seconds = chrono::duration_cast<chrono::duration<float>>(end - start);
+  printf("Testing %s %s: %0.3f kTPS (checksum %ld)\n", name,
+      select ? "Select()" : "Rank()", num_ops / seconds.count() / 1000., total);
+}
+
+// Rank and select queries with and without subtree counts on num_keys even keys.
+// Without counts both walk the leaves, so they run far fewer queries.
+void TestRankPerf(int64_t num_keys) {
+  printf("Running rank benchmark with %ld keys.\n", num_keys);
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    pairs.push_back(make_pair(i * 2, static_cast<void*>(NULL)));
+  }
+  TestRankSelectQueries<BTree<>>("btree", pairs, 200, false);
+  TestRankSelectQueries<BTree<>>("btree", pairs, 200, true);
+  TestRankSelectQueries<CountedBTree>("btree with subtree counts", pairs, 5000000, false);
+  TestRankSelectQueries<CountedBTree>("btree with subtree counts", pairs, 5000000, true);
+}
+
+// The calls of the string key benchmark, for the trees and std::map.
+template<typename Tree, typename Key>
+void InsertKey(Tree* tree, const Key& key) { tree->Insert(key, NULL); }
+void InsertKey(map<string, void*>* tree, const string& key) {
+  tree->insert(make_pair(key, static_cast<void*>(NULL)));
+}
+template<typename Tree, typename Key>
+bool FindKey(const Tree& tree, const Key& key) { return !tree.Find(key).AtEnd(); }
+bool FindKey(const map<string, void*>& tree, const string& key) {
+  return tree.count(key) == 1;
+}
+
+// Inserts keys in order into an empty tree, then looks up every key in 'lookups'.
+template<typename Tree, typename Key>
+void TestKeyedTree(const char* name, const vector<Key>& keys, const vector<Key>& lookups) {
+  printf("Testing %s", name);
+  fflush(stdout);
+  Tree tree;
+  auto start = chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < keys.size(); ++i) {
+    InsertKey(&tree, keys[i]);
+  }
+  auto middle = chrono::high_resolution_clock::now();
+  int64_t found = 0;
+  for (size_t i = 0; i < lookups.size(); ++i) {
+    found += FindKey(tree, lookups[i]);
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto insert_seconds = chrono::duration_cast<chrono::duration<float>>(middle - start);
+  auto find_seconds = chrono::duration_cast<chrono::duration<float>>(end - middle);
+  printf(": insert %0.3f kTPS, find %0.3f kTPS\n",
+      keys.size() / insert_seconds.count() / 1000.,
+      lookups.size() / find_seconds.count() / 1000.);
+  if (found != static_cast<int64_t>(lookups.size())) {
+    printf("Incorrect results: %ld != %zu\n", found, lookups.size());
+    exit(1);
+  }
+}
+
+// StringBTree against std::map on num_keys string keys in random order, with BTree
+// on int64_t keys for reference. Keys are URLs and composite tenant/object keys,
+// which share long prefixes.
+void TestStringPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running string key benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> int_keys;
+  for (int64_t i = 0; i < num_keys; ++i) int_keys.push_back(rng() >> 2);
+  vector<int64_t> int_lookups;
+  for (int64_t i = 0; i < num_lookups; ++i) {
+    int_lookups.push_back(int_keys[rng() % num_keys]);
+  }
+  TestKeyedTree<BTree<>>("btree with int64_t keys", int_keys, int_lookups);
+
+  const char* formats[] = { "https://www.example.com/tenant/%ld/object/%ld.html",
+      "tenant%06ld/object%010ld" };
+  for (const char* format : formats) {
+    vector<string> keys;
+    for (int64_t i = 0; i < num_keys; ++i) {
+      char key[128];
+      snprintf(key, sizeof(key), format, rng() % 1000, rng() % 1000000000);
+      keys.push_back(key);
+    }
+    vector<string> lookups;
+    for (int64_t i = 0; i < num_lookups; ++i) lookups.push_back(keys[rng() % num_keys]);
+    printf("Keys like %s:\n", keys[0].c_str());
+    TestKeyedTree<map<string, void*>>("std map", keys, lookups);
+    TestKeyedTree<StringBTree<void*, 256>>("string btree, 256 byte nodes", keys, lookups);
+    TestKeyedTree<StringBTree<void*, 512>>("string btree, 512 byte nodes", keys, lookups);
+    TestKeyedTree<StringBTree<void*, 1024>>("string btree, 1024 byte nodes", keys,
+        lookups);
+  }
+}
+
+// Point lookups in BTree with and without the hash index, against std::map and
+// std::unordered_map, on num_keys random keys inserted in random order.
+void TestHashPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running hash index benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(rng() >> 2);
+  vector<int64_t> lookups;
+  for (int64_t i = 0; i < num_lookups; ++i) lookups.push_back(keys[rng() % num_keys]);
+  TestKeyedTree<BTree<>>("btree", keys, lookups);
+  TestKeyedTree<HashedBTree>("btree (hash index)", keys, lookups);
+  TestKeyedTree<StdMap>("std map", keys, lookups);
+  TestKeyedTree<StdUnorderedMap>("std unordered map", keys, lookups);
+}
+
+// Point lookups in BTree against CsbBTree with both separator layouts, on num_keys
+// random keys inserted in random order, at two node sizes.
+void TestCsbPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running csb+ benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(rng() >> 2);
+  vector<int64_t> lookups;
+  for (int64_t i = 0; i < num_lookups; ++i) lookups.push_back(keys[rng() % num_keys]);
+  TestKeyedTree<BTree<>>("btree", keys, lookups);
+  TestKeyedTree<CsbBTree<>>("csb+ btree", keys, lookups);
+  TestKeyedTree<CsbBTree<int64_t, void*, less<int64_t>, 256, EytzingerLayout>>(
+      "csb+ btree (eytzinger)", keys, lookups);
+  TestKeyedTree<BTree<int64_t, void*, less<int64_t>, 512>>("btree, 512 byte nodes", keys,
+      lookups);
+  TestKeyedTree<CsbBTree<int64_t, void*, less<int64_t>, 512>>(
+      "csb+ btree, 512 byte nodes", keys, lookups);
+  TestKeyedTree<CsbBTree<int64_t, void*, less<int64_t>, 512, EytzingerLayout>>(
+      "csb+ btree (eytzinger), 512 byte nodes", keys, lookups);
+}
+
+// Times num_lookups random Find() calls and short scans of 100 keys from
+// LowerBound() on tree.
+template<typename Tree>
+void TestFrozenQueries(const char* name, const Tree& tree, const vector<int64_t>& lookups) {
+  printf("Testing %s", name);
+  fflush(stdout);
+  auto start = chrono::high_resolution_clock::now();
+  int64_t found = 0;
+  for (size_t i = 0; i < lookups.size(); ++i) found += !tree.Find(lookups[i]).AtEnd();
+  auto middle = chrono::high_resolution_clock::now();
+  int64_t total = 0;
+  size_t num_scans = lookups.size() / 10;
+  for (size_t i = 0; i < num_scans; ++i) {
+    auto it = tree.LowerBound(lookups[i]);
+    for (int j = 0; j < 100 && !it.AtEnd(); ++j, it.Next()) total += it.key();
+  }
+  auto end = chrono::high_resolution_clock::now();
+  auto find_seconds = chrono::duration_cast<chrono::duration<float>>(middle - start);
+  auto scan_seconds = chrono::duration_cast<chrono::duration<float>>(end - middle);
+  printf(": find %0.3f kTPS, scan 100 %0.3f kTPS (checksum %ld)\n",
+      lookups.size() / find_seconds.count() / 1000.,
+      num_scans / scan_seconds.count() / 1000., total);
+  if (found != static_cast<int64_t>(lookups.size())) {
+    printf("Incorrect results: %ld != %zu\n", found, lookups.size());
+    exit(1);
+  }
+}
+
+// Lookups and scans in a BTree against FrozenBTree copies of it with several block
+// sizes, on num_keys random keys.
+void TestFrozenPerf(int64_t num_keys, int64_t num_lookups) {
+  printf("Running frozen benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<int64_t> keys;
+  for (int64_t i = 0; i < num_keys; ++i) keys.push_back(rng() >> 2);
+  vector<int64_t> lookups;
+  for (int64_t i = 0; i < num_lookups; ++i) lookups.push_back(keys[rng() % num_keys]);
+  BTree<> tree;
+  for (int64_t key : keys) tree.Insert(key, NULL);
+  TestFrozenQueries("btree", tree, lookups);
+
+  auto start = chrono::high_resolution_clock::now();
+  FrozenBTree<> frozen = tree.Freeze();
+  auto end = chrono::high_resolution_clock::now();
+  printf("Freeze() took %0.3f s, %ld bytes instead of %ld\n",
+      chrono::duration_cast<chrono::duration<float>>(end - start).count(), frozen.bytes(),
+      tree.Stats().bytes_used);
+  TestFrozenQueries("frozen btree, 256 byte blocks", frozen, lookups);
+  TestFrozenQueries("frozen btree, 128 byte blocks",
+      FrozenBTree<int64_t, void*, less<int64_t>, 128>(tree.Begin(), tree.size()),
+      lookups);
+  TestFrozenQueries("frozen btree, 64 byte blocks",
+      FrozenBTree<int64_t, void*, less<int64_t>, 64>(tree.Begin(), tree.size()),
+      lookups);
+  TestFrozenQueries("frozen btree, 64 byte blocks, binary search",
+      FrozenBTree<int64_t, void*, less<int64_t>, 64, BinaryKeySearch>(tree.Begin(),
+      tree.size()), lookups);
+}
+
+// Times building a BTree from num_keys unsorted random pairs, by sorting and calling
+// BulkLoad() against ParallelBulkLoad(), and merging two trees of num_keys / 2 random
+// keys, by upserting every key of one into the other against Merge(). The parallel
+// calls run on 1, 4 and one thread per core.
+void TestParallelPerf(int64_t num_keys) {
+  printf("Running parallel build benchmark with %ld keys.\n", num_keys);
+  mt19937_64 rng(0);
+  vector<pair<int64_t, void*>> pairs;
+  for (int64_t i = 0; i < num_keys; ++i) {
+    pairs.push_back(make_pair(static_cast<int64_t>(rng() >> 2), static_cast<void*>(NULL)));
+  }
+  int num_cores = max(1u, thread::hardware_concurrency());
+  int thread_counts[] = { 1, 4, num_cores };
+  auto print_time = [num_keys](const char* name, int num_threads,
+      chrono::high_resolution_clock::time_point start) {
+    auto seconds = chrono::duration_cast<chrono::duration<float>>(
+        chrono::high_resolution_clock::now() - start);
+    if (num_threads == 0) {
+      printf("Testing %s: %0.3f s, %0.3f kTPS\n", name, seconds.count(),
+          num_keys / seconds.count() / 1000.);
+    } else {
+      printf("Testing %s on %d threads: %0.3f s, %0.3f kTPS\n", name, num_threads,
+          seconds.count(), num_keys / seconds.count() / 1000.);
+    }
+  };
+
+  {
+    vector<pair<int64_t, void*>> input = pairs;
+    auto start = chrono::high_resolution_clock::now();
+    sort(input.begin(), input.end());
+    input.erase(unique(input.begin(), input.end()), input.end());
+    BTree<> tree;
+    tree.BulkLoad(input.begin(), input.end());
+    print_time("sort and bulk load", 0, start);
+  }
+  for (int num_threads : thread_counts) {
+    vector<pair<int64_t, void*>> input = pairs;
+    auto start = chrono::high_resolution_clock::now();
+    BTree<> tree;
+    tree.ParallelBulkLoad(&input, num_threads);
+    print_time("parallel bulk load", num_threads, start);
+  }
+
+  vector<pair<int64_t, void*>> first(pairs.begin(), pairs.begin() + num_keys / 2);
+  vector<pair<int64_t, void*>> second(pairs.begin() + num_keys / 2, pairs.end());
+  for (vector<pair<int64_t, void*>>* half : { &first, &second }) {
+    sort(half->begin(), half->end());
+    half->erase(unique(half->begin(), half->end()), half->end());
+  }
+  BTree<> other;
+  other.BulkLoad(second.begin(), second.end());
+  {
+    BTree<> merged;
+    merged.BulkLoad(first.begin(), first.end());
+    auto start = chrono::high_resolution_clock::now();
+    for (auto it = other.Begin(); !it.AtEnd(); it.Next()) merged.Upsert(it.key(), NULL);
+    print_time("upsert all keys", 0, start);
+  }
+  for (int num_threads : thread_counts) {
+    BTree<> merged, source;
+    merged.BulkLoad(first.begin(), first.end());
+    source.BulkLoad(second.begin(), second.end());
+    auto start = chrono::high_resolution_clock::now();
+    merged.Merge(std::move(source), num_threads);
+    print_time("merge", num_threads, start);
+  }
+}
+
+// Parses name=value arguments for the mt mode into config.
+bool ParseMtArgs(int argc, char** argv, MtConfig* config) {
+  for (int i = 2; i < argc; ++i) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    if (eq == string::npos) return false;
+    string name = arg.substr(0, eq);
+    string value = arg.substr(eq + 1);
+    if (name == "dist") {
+      if (value == "uniform") {
+        config->dist = UNIFORM;
+      } else if (value == "zipf") {
+        config->dist = ZIPF;
+      } else if (value == "seq") {
+        config->dist = SEQUENTIAL;
+      } else if (value == "hotspot") {
+        config->dist = HOTSPOT;
+      } else {
+        return false;
+      }
+      continue;
+    }
+    int64_t v = atol(value.c_str());
+    bool is_percent = name == "prefill" || name == "find" || name == "insert" ||
+        name == "update" || name == "upsert";
+    if (is_percent && (v < 0 || v > 100)) return false;
+    if (name == "threads") {
+      config->threads = v;
+    } else if (name == "readers") {
+      config->readers = v;
+    } else if (name == "ops") {
+      config->ops_per_thread = v;
+    } else if (name == "keys") {
+      config->max_key = v;
+    } else if (name == "prefill") {
+      config->prefill = v;
+    } else if (name == "find") {
+      config->percent_find = v;
+    } else if (name == "insert") {
+      config->percent_insert = v;
+    } else if (name == "update") {
+      config->percent_update = v;
+    } else if (name == "upsert") {
+      config->percent_upsert = v;
+    } else if (name == "pin") {
+      config->pin = v != 0;
+    } else {
+      return false;
+    }
+  }
+  return config->threads + config->readers > 0 && config->max_key > 0 &&
+      config->percent_find + config->percent_insert + config->percent_update +
+      config->percent_upsert <= 100;
+}
+
 // Running single threaded benchmark.
 //   Find: 70%   Insert: 20%   Remove: 10%
 // Testing btree: 9810.000 kTPS
@@ -88,13 +1238,15 @@ int main(int argc, char** argv) {
   const int percent_insert = 20;
 
   string mode = "st";
-  if (argc == 2) mode = argv[1];
+  if (argc >= 2) mode = argv[1];
   if (mode == "st") {
     printf("Running single threaded benchmark.\n");
     vector<TestOp> ops = GenerateOps(5000000L, 50000, percent_find, percent_insert);
     printf("  Find: %d%%   Insert: %d%%   Remove: %d%%\n",
         percent_find, percent_insert, 100 - percent_find - percent_insert);
-    int64_t btree_finds = TestPerf<BTree>("btree", ops, num_iters);
+    int64_t btree_finds = TestPerf<BTree<>>("btree", ops, num_iters);
+    TestPerf<LazyBTree>("btree (min fill 0)", ops, num_iters);
+    TestPerf<HashedBTree>("btree (hash index)", ops, num_iters);
     TestPerf<BTreeV1>("btree_v1", ops, num_iters);
     int64_t map_finds = TestPerf<StdMap>("std map", ops, num_iters);
     TestPerf<StdUnorderedMap>("std unordered map", ops, num_iters);
@@ -102,6 +1254,90 @@ int main(int argc, char** argv) {
       printf("Incorrect results: %ld != %ld\n", btree_finds, map_finds);
       exit(1);
     }
+  } else if (mode == "mt") {
+    MtConfig config;
+    config.threads = thread::hardware_concurrency();
+    config.readers = 0;
+    config.ops_per_thread = 1000000;
+    config.max_key = 1000000;
+    config.prefill = 50;
+    config.dist = UNIFORM;
+    config.percent_find = percent_find;
+    config.percent_insert = percent_insert;
+    config.percent_update = 0;
+    config.percent_upsert = 0;
+    config.pin = false;
+    if (!ParseMtArgs(argc, argv, &config)) {
+      printf("Usage: test-perf mt [threads=N] [readers=N] [ops=N] [keys=N] "
+          "[prefill=PCT] [dist=uniform|zipf|seq|hotspot] [find=PCT] [insert=PCT] "
+          "[update=PCT] [upsert=PCT] [pin=0|1]\n");
+      exit(1);
+    }
+
+    const char* dist_names[] = { "uniform", "zipf", "sequential", "hotspot" };
+    printf("Running multithreaded benchmark.\n");
+    printf("  Threads: %d mixed, %d find only   Keys: %ld (%s)   Ops/thread: %ld\n",
+        config.threads, config.readers, config.max_key, dist_names[config.dist],
+        config.ops_per_thread);
+    printf("  Find: %d%%   Insert: %d%%   Update: %d%%   Upsert: %d%%   Remove: %d%%\n",
+        config.percent_find, config.percent_insert, config.percent_update,
+        config.percent_upsert, 100 - config.percent_find - config.percent_insert -
+        config.percent_update - config.percent_upsert);
+
+    ZipfGenerator* zipf = NULL;
+    if (config.dist == ZIPF) zipf = new ZipfGenerator(config.max_key, 0.99);
+    vector<vector<TestOp>> thread_ops;
+    for (int i = 0; i < config.threads + config.readers; ++i) {
+      thread_ops.push_back(GenerateMtOps(config, zipf, i, i >= config.threads));
+    }
+    delete zipf;
+
+    TestMtPerf<SharedTree<BTreeOLC<>, NoLock>>("btree olc", config, thread_ops);
+    TestMtPerf<SharedTree<BTree<>, MutexLock>>("btree (mutex)", config, thread_ops);
+    TestMtPerf<SharedTree<BTree<>, RwLock>>("btree (rwlock)", config, thread_ops);
+    TestMtPerf<SharedTree<BTreeV1, MutexLock>>("btree_v1 (mutex)", config, thread_ops);
+    TestMtPerf<SharedTree<StdMap, MutexLock>>("std map (mutex)", config, thread_ops);
+    TestMtPerf<SharedTree<StdUnorderedMap, MutexLock>>(
+        "std unordered map (mutex)", config, thread_ops);
+  } else if (mode == "memory") {
+    int64_t num_keys = argc >= 3 ? atol(argv[2]) : 10000000L;
+    TestMemoryPerf(num_keys);
+  } else if (mode == "batch") {
+    int64_t num_keys = argc >= 3 ? atol(argv[2]) : 10000000L;
+    TestBatchPerf(num_keys, 10000000L);
+  } else if (mode == "snapshot") {
+    int64_t num_keys = argc >= 3 ? atol(argv[2]) : 1000000L;
+    TestSnapshotPerf(num_keys, 5000000L);
+  } else if (mode == "mapped") {
+    int64_t num_keys = argc >= 3 ? atol(argv[2]) : 10000000L;
+    TestMappedPerf(num_keys, 10000000L);
+  } else if (mode == "wal") {
+    TestWalPerf(5000000L, 10000L);
+  } else if (mode == "stats") {
+    TestStatsPerf(1000000L);
+  } else if (mode == "validate") {
+    TestValidatePerf(1000000L);
+  } else if (mode == "search") {
+    TestSearchPerf(1000000L, 5000000L);
+    TestSearchPerf(20000000L, 5000000L);
+  } else if (mode == "range") {
+    TestRangePerf(10000000L);
+  } else if (mode == "rank") {
+    TestRankPerf(10000000L);
+  } else if (mode == "string") {
+    TestStringPerf(1000000L, 5000000L);
+  } else if (mode == "hash") {
+    TestHashPerf(1000000L, 10000000L);
+    TestHashPerf(10000000L, 10000000L);
+  } else if (mode == "csb") {
+    TestCsbPerf(1000000L, 10000000L);
+    TestCsbPerf(10000000L, 10000000L);
+  } else if (mode == "frozen") {
+    TestFrozenPerf(1000000L, 10000000L);
+    TestFrozenPerf(10000000L, 10000000L);
+  } else if (mode == "parallel") {
+    TestParallelPerf(1000000L);
+    TestParallelPerf(10000000L);
   } else {
     printf("Unknown mode.\n");
     exit(1);